@@ -0,0 +1,71 @@
+# bench.py
+# This runs the benchmarks in bench/ against one or more lily executables, and
+# reports the best wall time of several runs for each.
+
+# Usage: python bench.py [-r runs] [lily executable...]
+# If no executables are given, ./lily is used. Giving two executables (say, one
+# built normally and one built with -DNO_COMPUTED_GOTO=1) is the easiest way to
+# compare the impact of a change.
+
+# The results are also written to bench_output.txt.
+
+import os, subprocess, sys, time
+
+def time_run(lily, path):
+    start = time.time()
+    subp = subprocess.Popen([lily, path], stdout=subprocess.PIPE,
+            stderr=subprocess.PIPE)
+    (subp_stdout, subp_stderr) = subp.communicate()
+    end = time.time()
+
+    if subp.returncode != 0 or len(subp_stderr) != 0:
+        return None
+
+    return end - start
+
+def main():
+    args = sys.argv[1:]
+    runs = 3
+
+    if len(args) >= 2 and args[0] == '-r':
+        runs = int(args[1])
+        args = args[2:]
+
+    lilies = args or ['.' + os.sep + 'lily']
+    bench_dir = 'bench'
+    names = sorted([f for f in os.listdir(bench_dir) if f.endswith('.lly')])
+
+    header = '%-28s' % 'benchmark'
+    for lily in lilies:
+        header += ' %16s' % lily[-16:]
+
+    lines = [header]
+    print(header)
+
+    for name in names:
+        path = bench_dir + os.sep + name
+        line = '%-28s' % name
+
+        for lily in lilies:
+            best = None
+            for i in range(runs):
+                t = time_run(lily, path)
+                if t is None:
+                    best = None
+                    break
+                elif best is None or t < best:
+                    best = t
+
+            if best is None:
+                line += ' %16s' % 'FAILED'
+            else:
+                line += ' %15.3fs' % best
+
+        lines.append(line)
+        print(line)
+
+    f = open('bench_output.txt', 'w')
+    f.write('\n'.join(lines) + '\n')
+    f.close()
+
+main()
@@ -0,0 +1,137 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "lily_api_embed.h"
+#include "lily_api_options.h"
+
+/*  setup.c
+    This measures the cost of giving each request its own state. A request loads
+    a prelude file (imports, classes, globals) and then renders a template.
+
+    fresh: Each request makes a new state, runs the prelude, and renders.
+    clone: The prelude is run and the template compiled once. Each request
+           clones a snapshot of that state and renders.
+
+    Build with -DWITH_BENCH=on, then run from the root of the repo:
+    ./lily_setup_bench bench/setup/prelude.lly bench/setup/page.lly [requests] */
+
+static void usage()
+{
+    fputs("Usage: lily_setup_bench <prelude> <template> [requests]\n", stderr);
+    exit(EXIT_FAILURE);
+}
+
+static double now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+/* Rendered output is counted, so that both ways can be checked against each
+   other without writing anything out. */
+static void count_sink(const char *text, size_t size, void *data)
+{
+    *(size_t *)data += size;
+}
+
+static void fail(lily_state *s)
+{
+    fputs(lily_get_error(s), stderr);
+    exit(EXIT_FAILURE);
+}
+
+static lily_state *load(const char *prelude, size_t *output)
+{
+    lily_options *options = lily_new_options();
+    lily_op_render_sink(options, count_sink);
+    lily_op_data(options, output);
+
+    lily_state *s = lily_new_state(options);
+
+    if (lily_parse_file(s, prelude) == 0)
+        fail(s);
+
+    return s;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc != 3 && argc != 4)
+        usage();
+
+    const char *prelude = argv[1];
+    const char *template = argv[2];
+    int requests = 1000;
+    int i;
+
+    if (argc == 4)
+        requests = atoi(argv[3]);
+
+    if (requests <= 0)
+        usage();
+
+    size_t fresh_output = 0, clone_output = 0;
+    double fresh_setup = 0, fresh_render = 0, start, mid;
+
+    for (i = 0;i < requests;i++) {
+        start = now_ms();
+        lily_state *s = load(prelude, &fresh_output);
+        struct lily_function_val_ *f = lily_compile_template_file(s, template);
+        if (f == NULL)
+            fail(s);
+
+        mid = now_ms();
+        if (lily_render_template(s, f) == 0)
+            fail(s);
+
+        lily_free_state(s);
+        fresh_setup += mid - start;
+        fresh_render += now_ms() - mid;
+    }
+
+    double clone_setup = 0, clone_render = 0, snapshot_time;
+
+    start = now_ms();
+    lily_state *base = load(prelude, &clone_output);
+    struct lily_function_val_ *f = lily_compile_template_file(base, template);
+    if (f == NULL)
+        fail(base);
+
+    lily_snapshot *snapshot = lily_state_snapshot(base);
+    snapshot_time = now_ms() - start;
+
+    for (i = 0;i < requests;i++) {
+        start = now_ms();
+        lily_state *s = lily_state_clone(snapshot, &clone_output);
+
+        mid = now_ms();
+        if (lily_render_template(s, f) == 0)
+            fail(s);
+
+        lily_free_state(s);
+        clone_setup += mid - start;
+        clone_render += now_ms() - mid;
+    }
+
+    lily_free_snapshot(snapshot);
+
+    if (fresh_output != clone_output) {
+        fprintf(stderr, "Output differs: %lu bytes fresh, %lu bytes cloned.\n",
+                (unsigned long)fresh_output, (unsigned long)clone_output);
+        exit(EXIT_FAILURE);
+    }
+
+    printf("%d requests, %lu bytes rendered each\n", requests,
+            (unsigned long)(fresh_output / requests));
+    printf("%-8s %14s %14s\n", "", "setup (ms)", "render (ms)");
+    printf("%-8s %14.4f %14.4f\n", "fresh", fresh_setup / requests,
+            fresh_render / requests);
+    printf("%-8s %14.4f %14.4f\n", "clone", clone_setup / requests,
+            clone_render / requests);
+    printf("(snapshot made once in %.4f ms)\n", snapshot_time);
+
+    exit(EXIT_SUCCESS);
+}
@@ -368,7 +368,7 @@ def run_dyna_entry(e, accum):
     if suffix:
         suffix = "\\0" + suffix
 
-    accum.append('    ,"%s\\%d%s%s"' % (letter, dyna_len, name, suffix))
+    accum.append('    ,"%s\\%o%s%s"' % (letter, dyna_len, name, suffix))
 
     try:
         for inner in e.inner_entries:
@@ -422,7 +422,7 @@ Generate dynaload information based on comment blocks in a given filename.
 
     header = """\
 const char *lily%s_dynaload_table[] = {
-    "\\%d%s\\0"\
+    "\\%o%s\\0"\
 """ % (name, len(used), "\\0".join(used))
 
     result = [header] + result
@@ -97,9 +97,70 @@ def process_test_dir(basepath):
         for filepath in filepath_list:
             run_test(options, dirpath, filepath)
 
+def process_cached_dir(basepath):
+    # Run tests again, but from a cache written by 'lily -c'. Tests that can't
+    # be cached (those that import, or fail to parse) are skipped.
+    for (dirpath, dirpath_list, filepath_list) in os.walk(basepath):
+        if dirpath.endswith('tag_mode'):
+            continue
+
+        options = get_options_for(dirpath)
+        dirpath += os.sep
+        for filepath in filepath_list:
+            fullpath = dirpath + filepath
+            subp = subprocess.Popen(["./lily", "-c", fullpath],
+                    stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+            subp.communicate()
+
+            if subp.returncode == 0:
+                run_test(options, dirpath, filepath)
+                damage_cache(fullpath + "c")
+                run_test(options, dirpath, filepath)
+                os.remove(fullpath + "c")
+
+# Each embed test is a program (built with the interpreter) that checks the
+# embed api. Those that haven't been built are skipped.
+def process_embed_tests(basepath):
+    for filepath in sorted(os.listdir(basepath)):
+        if filepath.endswith('.c'):
+            run_embed_test('.' + os.sep + 'lily_embed_' + filepath[:-2])
+
+def run_embed_test(path):
+    global pass_count, error_count, crash_count, test_count
+
+    if not os.path.exists(path):
+        return
+
+    test_count += 1
+    subp = subprocess.Popen([path], stdout=subprocess.PIPE,
+            stderr=subprocess.PIPE)
+    (subp_stdout, subp_stderr) = subp.communicate()
+
+    if subp.returncode == -signal.SIGSEGV:
+        print("Test %s crashed." % path)
+        crash_count += 1
+    elif subp.returncode != 0:
+        print("Test %s failed.\n%s" % (path, subp_stderr))
+        error_count += 1
+    else:
+        pass_count += 1
+
+def damage_cache(cachepath):
+    # Flip a bit in the middle of the cache. The interpreter should notice, and
+    # parse the source instead of running broken code.
+    f = open(cachepath, "r+b")
+    data = bytearray(f.read())
+    data[len(data) // 2] ^= 0x10
+    f.seek(0)
+    f.write(data)
+    f.close()
+
 process_test_dir('test' + os.sep + 'fail')
 process_test_dir('test' + os.sep + 'pass')
 process_test_dir('try')
+process_cached_dir('test' + os.sep + 'fail')
+process_cached_dir('test' + os.sep + 'pass')
+process_embed_tests('test' + os.sep + 'embed')
 
 print ('Final stats: %d tests passed, %d errors, %d crashed.' \
         % (pass_count, error_count, crash_count))
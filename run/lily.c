@@ -18,16 +18,31 @@ static void usage()
           "                 Everything else is printed to stdout.\n"
           "                 By default, everything is treated as code.\n"
           "-s string      : The program is a string (end of options).\n"
+          "-c             : Write a cache of the file (x.lly to x.llyc) instead\n"
+          "                 of running it. Later runs use the cache while the\n"
+          "                 file is unchanged.\n"
           "-gstart N      : Initial # of objects allowed before a gc sweep.\n"
           "-gmul N        : (# allowed * N) when sweep can't free anything.\n"
+          "-hseed N       : Use N to seed hashing instead of a random seed.\n"
+          "-gstats        : Print gc statistics to stderr before exiting.\n"
+          "-noopt         : Don't optimize code after it's emitted.\n"
+          "-depth N       : Allow function calls to go N deep.\n"
+          "-reentry N     : Allow foreign functions (like List.map) to call\n"
+          "                 back into the interpreter N deep.\n"
           "file           : The program is the given filename.\n", stderr);
     exit(EXIT_FAILURE);
 }
 
 int is_file;
 int do_tags = 0;
+int do_cache = 0;
 int gc_start = -1;
 int gc_multiplier = -1;
+unsigned long long hash_seed = 0;
+int gc_stats = 0;
+int no_optimize = 0;
+int call_depth = -1;
+int max_reentry = -1;
 char *to_process = NULL;
 
 static void process_args(int argc, char **argv, int *argc_offset)
@@ -39,6 +54,12 @@ static void process_args(int argc, char **argv, int *argc_offset)
             usage();
         else if (strcmp("-t", arg) == 0)
             do_tags = 1;
+        else if (strcmp("-c", arg) == 0)
+            do_cache = 1;
+        else if (strcmp("-gstats", arg) == 0)
+            gc_stats = 1;
+        else if (strcmp("-noopt", arg) == 0)
+            no_optimize = 1;
         else if (strcmp("-gstart", arg) == 0) {
             i++;
             if (i + 1 == argc)
@@ -53,6 +74,27 @@ static void process_args(int argc, char **argv, int *argc_offset)
 
             gc_multiplier = atoi(argv[i]);
         }
+        else if (strcmp("-depth", arg) == 0) {
+            i++;
+            if (i + 1 == argc)
+                usage();
+
+            call_depth = atoi(argv[i]);
+        }
+        else if (strcmp("-reentry", arg) == 0) {
+            i++;
+            if (i + 1 == argc)
+                usage();
+
+            max_reentry = atoi(argv[i]);
+        }
+        else if (strcmp("-hseed", arg) == 0) {
+            i++;
+            if (i + 1 == argc)
+                usage();
+
+            hash_seed = strtoull(argv[i], NULL, 10);
+        }
         else if (strcmp("-s", arg) == 0) {
             i++;
             if (i == argc)
@@ -71,6 +113,24 @@ static void process_args(int argc, char **argv, int *argc_offset)
     *argc_offset = i;
 }
 
+static void print_gc_stats(lily_state *state)
+{
+    lily_gc_stats stats;
+    lily_gc_get_stats(state, &stats);
+
+    fprintf(stderr,
+            "gc passes       : %u minor, %u major\n"
+            "gc entries      : %u young, %u old, %u spare\n"
+            "gc thresholds   : %u minor, %u major (multiplier %u)\n"
+            "gc values freed : %llu total, %u by the last pass\n"
+            "gc pause time   : %.3f ms total, %.3f ms max\n",
+            stats.minor_passes, stats.major_passes,
+            stats.young_entries, stats.old_entries, stats.spare_entries,
+            stats.threshold, stats.major_threshold, stats.multiplier,
+            (unsigned long long)stats.total_freed, stats.last_freed,
+            stats.total_pause_ns / 1000000.0, stats.max_pause_ns / 1000000.0);
+}
+
 int main(int argc, char **argv)
 {
     int argc_offset;
@@ -83,6 +143,14 @@ int main(int argc, char **argv)
         lily_op_gc_start(options, gc_start);
     if (gc_multiplier != -1)
         lily_op_gc_multiplier(options, gc_multiplier);
+    if (hash_seed != 0)
+        lily_op_hash_seed(options, (uint64_t)hash_seed);
+    if (no_optimize)
+        lily_op_optimize(options, 0);
+    if (call_depth > 0)
+        lily_op_max_call_depth(options, (uint32_t)call_depth);
+    if (max_reentry > 0)
+        lily_op_max_reentry(options, (uint32_t)max_reentry);
 
     lily_op_argv(options, argc - argc_offset, argv + argc_offset);
 
@@ -90,7 +158,13 @@ int main(int argc, char **argv)
 
     int result;
 
-    if (do_tags) {
+    if (do_cache) {
+        if (is_file == 0 || do_tags)
+            usage();
+
+        result = lily_cache_file(state, to_process);
+    }
+    else if (do_tags) {
         if (is_file == 1)
             result = lily_render_file(state, to_process);
         else
@@ -103,6 +177,9 @@ int main(int argc, char **argv)
             result = lily_parse_string(state, "[cli]", to_process);
     }
 
+    if (gc_stats)
+        print_gc_stats(state);
+
     if (result == 0) {
         fputs(lily_get_error(state), stderr);
         exit(EXIT_FAILURE);
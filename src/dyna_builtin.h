@@ -47,7 +47,7 @@ const char *lily_builtin_dynaload_table[] = {
     ,"m\0write\0[A](File,A)"
     ,"C\1Function"
     ,"m\0doc\0(Function(1)):String"
-    ,"C\11Hash"
+    ,"C\13Hash"
     ,"m\0clear\0[A,B](Hash[A,B])"
     ,"m\0delete\0[A,B](Hash[A,B],A)"
     ,"m\0each_pair\0[A,B](Hash[A,B],Function(A,B))"
@@ -70,7 +70,7 @@ const char *lily_builtin_dynaload_table[] = {
     ,"m\0<new>\0(String):IOError"
     ,"N\1KeyError\0< Exception"
     ,"m\0<new>\0(String):KeyError"
-    ,"C\18List"
+    ,"C\22List"
     ,"m\0clear\0[A](List[A])"
     ,"m\0count\0[A](List[A],Function(A=>Boolean)):Integer"
     ,"m\0delete_at\0[A](List[A],Integer)"
@@ -89,7 +89,7 @@ const char *lily_builtin_dynaload_table[] = {
     ,"m\0shift\0[A](List[A]):A"
     ,"m\0slice\0[A](List[A],*Integer,*Integer):List[A]"
     ,"m\0unshift\0[A](List[A],A)"
-    ,"E\10Option\0[A]"
+    ,"E\12Option\0[A]"
     ,"m\0and\0[A,B](Option[A],Option[B]):Option[B]"
     ,"m\0and_then\0[A,B](Option[A],Function(A=>Option[B])):Option[B]"
     ,"m\0is_none\0[A](Option[A]):Boolean"
@@ -104,7 +104,7 @@ const char *lily_builtin_dynaload_table[] = {
     ,"V\0None\0"
     ,"N\1RuntimeError\0< Exception"
     ,"m\0<new>\0(String):RuntimeError"
-    ,"C\20String"
+    ,"C\24String"
     ,"m\0format\0(String,1...):String"
     ,"m\0ends_with\0(String,String):Boolean"
     ,"m\0find\0(String,String,*Integer):Option[Integer]"
@@ -125,6 +125,16 @@ const char *lily_builtin_dynaload_table[] = {
     ,"m\0to_bytestring\0(String):ByteString"
     ,"m\0trim\0(String):String"
     ,"m\0upper\0(String):String"
+    ,"C\11StringBuilder"
+    ,"m\0<new>\0(*Integer):StringBuilder"
+    ,"m\0append\0(StringBuilder,String)"
+    ,"m\0append_byte\0(StringBuilder,Byte)"
+    ,"m\0append_bytes\0(StringBuilder,ByteString)"
+    ,"m\0clear\0(StringBuilder)"
+    ,"m\0reserve\0(StringBuilder,Integer)"
+    ,"m\0size\0(StringBuilder):Integer"
+    ,"m\0to_bytestring\0(StringBuilder):ByteString"
+    ,"m\0to_s\0(StringBuilder):String"
     ,"C\2Tuple"
     ,"m\0merge\0(Tuple[1],Tuple[2]):Tuple[1,2]"
     ,"m\0push\0[A](Tuple[1],A):Tuple[1,A]"
@@ -232,9 +242,18 @@ void *lily_builtin_loader(lily_options *o, uint16_t *c, int id)
         case 120: return lily_builtin_String_to_bytestring;
         case 121: return lily_builtin_String_trim;
         case 122: return lily_builtin_String_upper;
-        case 124: return lily_builtin_Tuple_merge;
-        case 125: return lily_builtin_Tuple_push;
-        case 127: return lily_builtin_ValueError_new;
+        case 124: return lily_builtin_StringBuilder_new;
+        case 125: return lily_builtin_StringBuilder_append;
+        case 126: return lily_builtin_StringBuilder_append_byte;
+        case 127: return lily_builtin_StringBuilder_append_bytes;
+        case 128: return lily_builtin_StringBuilder_clear;
+        case 129: return lily_builtin_StringBuilder_reserve;
+        case 130: return lily_builtin_StringBuilder_size;
+        case 131: return lily_builtin_StringBuilder_to_bytestring;
+        case 132: return lily_builtin_StringBuilder_to_s;
+        case 134: return lily_builtin_Tuple_merge;
+        case 135: return lily_builtin_Tuple_push;
+        case 137: return lily_builtin_ValueError_new;
         default: return NULL;
     }
 }
@@ -21,5 +21,6 @@
 #define OPTION_OFFSET              88
 #define RUNTIMEERROR_OFFSET        101
 #define STRING_OFFSET              103
-#define TUPLE_OFFSET               124
-#define VALUEERROR_OFFSET          127
+#define STRINGBUILDER_OFFSET       124
+#define TUPLE_OFFSET               134
+#define VALUEERROR_OFFSET          137
@@ -26,6 +26,7 @@ struct lily_function_val_;
 
 void lily_ci_init(lily_code_iter *, uint16_t *, uint16_t, uint16_t);
 int lily_ci_next(lily_code_iter *);
+int lily_ci_falls_through(uint16_t);
 
 void lily_ci_from_native(lily_code_iter *, struct lily_function_val_ *);
 
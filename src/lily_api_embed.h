@@ -19,9 +19,94 @@ int lily_parse_string(lily_state *, const char *, char *);
 int lily_parse_file(lily_state *, const char *);
 int lily_parse_expr(lily_state *, const char *, char *, const char **);
 
+/* Templates are compiled into a single function, with the text outside of the
+   tags stored as readonly ByteStrings. Compiling with the same name and source
+   again gives back the same function. A state holds one function for each
+   name: if the source of a name changes, the new function replaces the old
+   one, which is freed and must not be used after. A function is otherwise
+   valid until the state is freed. Returns NULL if the template could not be
+   compiled (the function from before, if any, is kept). */
+struct lily_function_val_ *lily_compile_template_string(lily_state *,
+        const char *, char *);
+struct lily_function_val_ *lily_compile_template_file(lily_state *,
+        const char *);
+
+/* Run a compiled template. This is the only way to run the function given by
+   the above, since a template runs as __main__. */
+int lily_render_template(lily_state *, struct lily_function_val_ *);
+
+/* These compile the template (if it hasn't been compiled yet), then run it. */
 int lily_render_string(lily_state *, const char *, char *);
 int lily_render_file(lily_state *, const char *);
 
+/* While a template runs, content and print output are buffered (see
+   lily_op_render_threshold). The buffer is sent to the render sink when it
+   fills, and when the template is done. This sends it right away instead. */
+void lily_render_flush(lily_state *);
+
+/* Parse a file without running it, and write a cache of it next to the file
+   (the cache of 'x.lly' is 'x.llyc'). When lily_parse_file is the first thing
+   a state does, it runs from that cache if the source has not changed. Only
+   files that do not import anything can be cached. */
+int lily_cache_file(lily_state *, const char *);
+
+/* A snapshot is made from a state that has finished loading (running files
+   and compiling templates). Clones of the snapshot are independent states that
+   start with a copy of its globals, and share everything else with it (classes,
+   function code, templates, and the readonly table).
+
+   A clone can run the templates that were compiled before the snapshot, and
+   call lily_get_func, but can't parse. Strings, Files, and foreign values are
+   shared between clones, instead of being copied. StringBuilder is copied,
+   since it changes in place. Other foreign values are shared by refcount, so
+   a package that makes a mutable foreign value must expect that a change made
+   through one clone is seen by every clone.
+
+   lily_state_snapshot takes over the state, which must not be used after.
+   Clones are freed with lily_free_state, and must be freed before their
+   snapshot. The snapshot and clones must be used from one thread. */
+typedef struct lily_snapshot_ lily_snapshot;
+
+lily_snapshot *lily_state_snapshot(lily_state *);
+/* The data given replaces the data from the options of the snapshot, unless it
+   is NULL. */
+lily_state *lily_state_clone(lily_snapshot *, void *);
+void lily_free_snapshot(lily_snapshot *);
+
+/* Statistics about the garbage collector of a state. Pause times are given in
+   nanoseconds. */
+typedef struct {
+    uint32_t minor_passes;
+    uint32_t major_passes;
+    /* Entries currently attached to a value, split by generation. */
+    uint32_t young_entries;
+    uint32_t old_entries;
+    /* Entries kept around to be reused. */
+    uint32_t spare_entries;
+    /* A minor collection runs once this many young entries exist. */
+    uint32_t threshold;
+    /* After a minor collection, a major one runs if there are at least this
+       many old entries. */
+    uint32_t major_threshold;
+    uint32_t multiplier;
+    /* Values destroyed by the most recent collection. */
+    uint32_t last_freed;
+    uint64_t total_freed;
+    uint64_t total_pause_ns;
+    uint64_t max_pause_ns;
+} lily_gc_stats;
+
+void lily_gc_get_stats(lily_state *, lily_gc_stats *);
+
+/* These adjust the gc of a running state. They take effect the next time that
+   a value is tagged. */
+void lily_gc_set_threshold(lily_state *, uint32_t);
+void lily_gc_set_major_threshold(lily_state *, uint32_t);
+void lily_gc_set_multiplier(lily_state *, uint32_t);
+
+/* Run a full collection now. */
+void lily_gc_collect(lily_state *);
+
 /* This searches in the scope of the first file loaded, and attempts to find a
    global function based on the name given. Returns either a valid, callable
    function value or NULL. */
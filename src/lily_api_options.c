@@ -13,18 +13,35 @@ struct lily_options_ {
     /* Parser freezes the options it takes to keep other parts from modifying
        them during execution. */
     uint16_t frozen;
+    /* Should the emitter run the optimizer over the code of functions? */
+    uint16_t optimize;
     /* How many tagged values before the gc needs to sweep? */
     uint32_t gc_start;
+    /* How deep function calls can go before RuntimeError is raised. */
+    uint32_t max_call_depth;
+    /* How many times foreign functions can enter the vm again. */
+    uint32_t max_reentry;
+    /* Hash tables use this as their seed. If 0, each interpreter picks a
+       random seed for itself instead. */
+    uint64_t hash_seed;
 
     int argc;
     /* This is what `sys.argv` makes visible. */
     char **argv;
-    /* The html sender gets this as the second argument. */
+    /* Render sinks get this as their last argument. */
     void *data;
-    /* This is called by lexer when content is seen in template mode. */
+    /* Template output goes to the sink, or to render_func if the sink is
+       NULL. It's buffered until there's more than render_threshold bytes. */
+    lily_render_sink render_sink;
     lily_render_func render_func;
+    uint32_t render_threshold;
 };
 
+static void render_to_file(const char *text, size_t size, void *data)
+{
+    fwrite(text, 1, size, (FILE *)data);
+}
+
 /* This creates an option structure containing "good" default values. This
    struct is read from to initialize different parts of the interpreter. It can
    be adjusted before running the parser, but never during or after. */
@@ -34,11 +51,17 @@ lily_options *lily_new_options(void)
     /* The gc options are totally arbitrary. */
     options->gc_start = 100;
     options->gc_multiplier = 4;
+    options->hash_seed = 0;
     options->argc = 0;
     options->argv = NULL;
     options->frozen = 0;
+    options->optimize = 1;
+    options->max_call_depth = 10000;
+    options->max_reentry = 1000;
 
+    options->render_sink = render_to_file;
     options->render_func = (lily_render_func) fputs;
+    options->render_threshold = 8192;
     options->data = stdout;
     options->allow_sys = 1;
 
@@ -91,7 +114,56 @@ void lily_op_gc_start(lily_options *opt, int gc_start)
     if (opt->frozen)
         return;
 
-    opt->gc_start = (uint16_t)gc_start;
+    if (gc_start < 0)
+        gc_start = 0;
+
+    opt->gc_start = (uint32_t)gc_start;
+}
+
+void lily_op_hash_seed(lily_options *opt, uint64_t hash_seed)
+{
+    if (opt->frozen)
+        return;
+
+    opt->hash_seed = hash_seed;
+}
+
+/* Calls deeper than this raise RuntimeError. Each level of depth holds a call
+   frame and the registers of that call. Values under 16 are raised to 16. */
+void lily_op_max_call_depth(lily_options *opt, uint32_t depth)
+{
+    if (opt->frozen)
+        return;
+
+    if (depth < 16)
+        depth = 16;
+
+    opt->max_call_depth = depth;
+}
+
+/* Each time a foreign function enters the vm again (List.map calling a
+   function that calls List.map), native stack is used. This raises
+   RuntimeError past the given number of entries. Values under 16 are raised to
+   16. */
+void lily_op_max_reentry(lily_options *opt, uint32_t reentry)
+{
+    if (opt->frozen)
+        return;
+
+    if (reentry < 16)
+        reentry = 16;
+
+    opt->max_reentry = reentry;
+}
+
+/* The optimizer is on by default. Turning it off leaves code exactly as the
+   emitter wrote it, which is useful to compare against. */
+void lily_op_optimize(lily_options *opt, int optimize)
+{
+    if (opt->frozen)
+        return;
+
+    opt->optimize = !!optimize;
 }
 
 void lily_op_render_func(lily_options *opt, lily_render_func render_func)
@@ -100,6 +172,26 @@ void lily_op_render_func(lily_options *opt, lily_render_func render_func)
         return;
 
     opt->render_func = render_func;
+    /* The sink takes priority, so remove it. */
+    opt->render_sink = NULL;
+}
+
+void lily_op_render_sink(lily_options *opt, lily_render_sink render_sink)
+{
+    if (opt->frozen)
+        return;
+
+    opt->render_sink = render_sink;
+}
+
+/* Output is sent once there's more than this many bytes of it. 0 sends output
+   as soon as it's written. */
+void lily_op_render_threshold(lily_options *opt, uint32_t threshold)
+{
+    if (opt->frozen)
+        return;
+
+    opt->render_threshold = threshold;
 }
 
 int lily_op_get_allow_sys(lily_options *opt) { return opt->allow_sys; }
@@ -111,7 +203,13 @@ char **lily_op_get_argv(lily_options *opt, int *argc)
 void *lily_op_get_data(lily_options *opt) { return opt->data; }
 int lily_op_get_gc_multiplier(lily_options *opt) { return opt->gc_multiplier; }
 int lily_op_get_gc_start(lily_options *opt) { return opt->gc_start; }
+uint64_t lily_op_get_hash_seed(lily_options *opt) { return opt->hash_seed; }
+uint32_t lily_op_get_max_call_depth(lily_options *opt) { return opt->max_call_depth; }
+uint32_t lily_op_get_max_reentry(lily_options *opt) { return opt->max_reentry; }
+int lily_op_get_optimize(lily_options *opt) { return opt->optimize; }
 lily_render_func lily_op_get_render_func(lily_options *opt) { return opt->render_func; }
+lily_render_sink lily_op_get_render_sink(lily_options *opt) { return opt->render_sink; }
+uint32_t lily_op_get_render_threshold(lily_options *opt) { return opt->render_threshold; }
 
 void lily_free_options(lily_options *o)
 {
@@ -1,6 +1,13 @@
 #ifndef LILY_API_OPTIONS_H
 # define LILY_API_OPTIONS_H
 
+# include <stddef.h>
+# include <stdint.h>
+
+/* Template output is sent to a render sink, along with the data option. The
+   text given is not \0 terminated, and may have \0 within it. */
+typedef void (*lily_render_sink)(const char *, size_t, void *);
+/* This is the older form of a render sink. It's given \0 terminated text. */
 typedef void (*lily_render_func)(char *, void *);
 typedef struct lily_options_ lily_options;
 
@@ -13,13 +20,25 @@ void lily_op_data(lily_options *, void *);
 void lily_op_freeze(lily_options *);
 void lily_op_gc_start(lily_options *, int);
 void lily_op_gc_multiplier(lily_options *, int);
+void lily_op_hash_seed(lily_options *, uint64_t);
+void lily_op_max_call_depth(lily_options *, uint32_t);
+void lily_op_max_reentry(lily_options *, uint32_t);
+void lily_op_optimize(lily_options *, int);
 void lily_op_render_func(lily_options *, lily_render_func);
+void lily_op_render_sink(lily_options *, lily_render_sink);
+void lily_op_render_threshold(lily_options *, uint32_t);
 
 int lily_op_get_allow_sys(lily_options *);
 char **lily_op_get_argv(lily_options *, int *);
 void *lily_op_get_data(lily_options *);
 int lily_op_get_gc_start(lily_options *);
 int lily_op_get_gc_multiplier(lily_options *);
+uint64_t lily_op_get_hash_seed(lily_options *);
+uint32_t lily_op_get_max_call_depth(lily_options *);
+uint32_t lily_op_get_max_reentry(lily_options *);
+int lily_op_get_optimize(lily_options *);
 lily_render_func lily_op_get_render_func(lily_options *);
+lily_render_sink lily_op_get_render_sink(lily_options *);
+uint32_t lily_op_get_render_threshold(lily_options *);
 
 #endif
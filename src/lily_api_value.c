@@ -30,11 +30,11 @@ void lily_##name##_instance(__VA_ARGS__, uint16_t f, lily_instance_val * v) \
 void lily_##name##_integer(__VA_ARGS__, int64_t v) \
 { lily_move_integer(source->action, v); } \
 void lily_##name##_list(__VA_ARGS__, lily_list_val * v) \
-{ lily_move_list_f(MOVE_DEREF_SPECULATIVE, source->action, v); } \
+{ lily_move_list_f(lily_list_move_flags(v), source->action, v); } \
 void lily_##name##_string(__VA_ARGS__, lily_string_val * v) \
 { lily_move_string(source->action, v); } \
 void lily_##name##_tuple(__VA_ARGS__, lily_tuple_val * v) \
-{ lily_move_tuple_f(MOVE_DEREF_SPECULATIVE, source->action, v); } \
+{ lily_move_tuple_f(lily_tuple_move_flags(v), source->action, v); } \
 void lily_##name##_unit(__VA_ARGS__) \
 { lily_move_unit(source->action); } \
 void lily_##name##_value(__VA_ARGS__, lily_value * v) \
@@ -44,49 +44,49 @@ void lily_##name##_variant(__VA_ARGS__, uint16_t f, lily_variant_val * v) \
 
 #define DEFINE_GETTERS(name, action, ...) \
 int lily_##name##_boolean(__VA_ARGS__) \
-{ return source->action->value.integer; } \
+{ return (source->action)->value.integer; } \
 uint8_t lily_##name##_byte(__VA_ARGS__) \
-{ return source->action->value.integer; } \
+{ return (source->action)->value.integer; } \
 lily_bytestring_val *lily_##name##_bytestring(__VA_ARGS__) \
-{ return (lily_bytestring_val *)source->action->value.string; } \
+{ return (lily_bytestring_val *)(source->action)->value.string; } \
 double lily_##name##_double(__VA_ARGS__) \
-{ return source->action->value.doubleval; } \
+{ return (source->action)->value.doubleval; } \
 lily_file_val *lily_##name##_file(__VA_ARGS__) \
-{ return source->action->value.file; } \
+{ return (source->action)->value.file; } \
 FILE *lily_##name##_file_raw(__VA_ARGS__) \
-{ return source->action->value.file->inner_file; } \
+{ return (source->action)->value.file->inner_file; } \
 lily_function_val *lily_##name##_function(__VA_ARGS__) \
-{ return source->action->value.function; } \
+{ return (source->action)->value.function; } \
 lily_hash_val *lily_##name##_hash(__VA_ARGS__) \
-{ return source->action->value.hash; } \
+{ return (source->action)->value.hash; } \
 lily_generic_val *lily_##name##_generic(__VA_ARGS__) \
-{ return source->action->value.generic; } \
+{ return (source->action)->value.generic; } \
 lily_instance_val *lily_##name##_instance(__VA_ARGS__) \
-{ return source->action->value.instance; } \
+{ return (source->action)->value.instance; } \
 int64_t lily_##name##_integer(__VA_ARGS__) \
-{ return source->action->value.integer; } \
+{ return (source->action)->value.integer; } \
 lily_list_val *lily_##name##_list(__VA_ARGS__) \
-{ return source->action->value.list; } \
+{ return (source->action)->value.list; } \
 lily_string_val *lily_##name##_string(__VA_ARGS__) \
-{ return source->action->value.string; } \
+{ return (source->action)->value.string; } \
 char *lily_##name##_string_raw(__VA_ARGS__) \
-{ return source->action->value.string->string; } \
+{ return lily_string_raw((source->action)->value.string); } \
 lily_tuple_val *lily_##name##_tuple(__VA_ARGS__) \
-{ return (lily_tuple_val *)source->action->value.list; } \
+{ return (lily_tuple_val *)(source->action)->value.list; } \
 lily_value *lily_##name##_value(__VA_ARGS__) \
-{ return source->action; } \
+{ return (source->action); } \
 lily_variant_val *lily_##name##_variant(__VA_ARGS__) \
-{ return (lily_variant_val *)source->action->value.instance; } \
+{ return (lily_variant_val *)(source->action)->value.instance; } \
 
 #define DEFINE_BOTH(name, action, ...) \
 DEFINE_SETTERS(name##_set, action, __VA_ARGS__) \
 DEFINE_GETTERS(name, action, __VA_ARGS__)
 
-DEFINE_BOTH(instance, values[i], lily_instance_val *source, int i)
+DEFINE_BOTH(instance, values + i, lily_instance_val *source, int i)
 DEFINE_BOTH(dynamic, inner_value, lily_dynamic_val *source)
-DEFINE_BOTH(list, elems[i], lily_list_val *source, int i)
-DEFINE_BOTH(tuple, elems[i], lily_tuple_val *source, int i)
-DEFINE_BOTH(variant, values[i], lily_variant_val *source, int i)
+DEFINE_BOTH(list, elems + i, lily_list_val *source, int i)
+DEFINE_BOTH(tuple, elems + i, lily_tuple_val *source, int i)
+DEFINE_BOTH(variant, values + i, lily_variant_val *source, int i)
 
 DEFINE_SETTERS(return, call_chain->prev->return_target, lily_vm_state *source)
 
@@ -99,7 +99,7 @@ void lily_return_value_noref(lily_state *s, lily_value *v)
 
 void lily_result_return(lily_state *s)
 {
-    lily_value *r = s->regs_from_main[s->num_registers - 1];
+    lily_value *r = &s->regs_from_main[s->num_registers - 1];
     lily_value_assign_noref(s->call_chain->prev->return_target, r);
     r->flags = 0;
     s->num_registers--;
@@ -107,12 +107,12 @@ void lily_result_return(lily_state *s)
 
 /* Argument and result operations */
 
-DEFINE_GETTERS(arg, vm_regs[index], lily_vm_state *source, int index)
+DEFINE_GETTERS(arg, vm_regs + index, lily_vm_state *source, int index)
 DEFINE_GETTERS(result, call_chain->return_target, lily_vm_state *source)
 
 int lily_arg_class_id(lily_state *s, int index)
 {
-    return s->vm_regs[index]->class_id;
+    return s->vm_regs[index].class_id;
 }
 
 int lily_arg_count(lily_state *s)
@@ -122,14 +122,14 @@ int lily_arg_count(lily_state *s)
 
 int lily_arg_instance_for_id(lily_state *s, int index, lily_instance_val **iv)
 {
-    lily_value *v = s->vm_regs[index];
+    lily_value *v = &s->vm_regs[index];
     *iv = v->value.instance;
     return v->class_id;
 }
 
 int lily_arg_variant_for_id(lily_state *s, int index, lily_variant_val **iv)
 {
-    lily_value *v = s->vm_regs[index];
+    lily_value *v = &s->vm_regs[index];
     *iv = (lily_variant_val *)v->value.instance;
     return v->class_id;
 }
@@ -141,13 +141,13 @@ int lily_arg_variant_for_id(lily_state *s, int index, lily_variant_val **iv)
 lily_value *lily_result_pop(lily_state *s)
 {
     s->num_registers--;
-    return s->regs_from_main[s->num_registers];
+    return &s->regs_from_main[s->num_registers];
 }
 
 void lily_result_drop(lily_state *s)
 {
     s->num_registers--;
-    lily_value *z = s->regs_from_main[s->num_registers];
+    lily_value *z = &s->regs_from_main[s->num_registers];
     lily_deref(z);
     z->flags = 0;
 }
@@ -294,6 +294,8 @@ lily_file_val *lily_new_file(FILE *inner_file, const char *mode)
     filev->read_ok = (*mode == 'r' || plus);
     filev->write_ok = (*mode == 'w' || plus);
     filev->is_builtin = 0;
+    filev->line_buffer = NULL;
+    filev->line_capacity = 0;
 
     return filev;
 }
@@ -301,17 +303,14 @@ lily_file_val *lily_new_file(FILE *inner_file, const char *mode)
 lily_list_val *lily_new_list(int initial)
 {
     lily_list_val *lv = lily_malloc(sizeof(lily_list_val));
-    lv->elems = lily_malloc(initial * sizeof(lily_value *));
+    lv->elems = lily_malloc(initial * sizeof(lily_value));
     lv->refcount = 0;
     lv->num_values = initial;
     lv->extra_space = 0;
 
     int i;
-    for (i = 0;i < initial;i++) {
-        lily_value *elem = lily_malloc(sizeof(lily_value));
-        elem->flags = 0;
-        lv->elems[i] = elem;
-    }
+    for (i = 0;i < initial;i++)
+        lv->elems[i].flags = 0;
 
     return lv;
 }
@@ -320,28 +319,59 @@ lily_instance_val *lily_new_instance(int initial)
 {
     lily_instance_val *ival = lily_malloc(sizeof(lily_instance_val));
 
-    ival->values = lily_malloc(initial * sizeof(lily_value *));
+    ival->values = lily_malloc(initial * sizeof(lily_value));
     ival->refcount = 0;
     ival->gc_entry = NULL;
     ival->num_values = initial;
     ival->ctor_need = 0;
 
     int i;
-    for (i = 0;i < initial;i++) {
-        lily_value *v = lily_malloc(sizeof(lily_value));
-        v->flags = 0;
-        ival->values[i] = v;
-    }
+    for (i = 0;i < initial;i++)
+        ival->values[i].flags = 0;
 
     return ival;
 }
 
+/* Strings that are copies keep their bytes right after the header, so that a
+   string is one allocation. Strings that take a buffer point to it instead.
+   Views point into the buffer of their parent. In every case, 'string' is where
+   the bytes are. */
 static lily_string_val *new_sv(char *buffer, int size)
 {
     lily_string_val *sv = lily_malloc(sizeof(lily_string_val));
     sv->refcount = 0;
     sv->string = buffer;
     sv->size = size;
+    sv->hash = 0;
+    sv->parent = NULL;
+    sv->views = NULL;
+    return sv;
+}
+
+static void drop_view(lily_string_val *);
+
+static void free_sv(lily_string_val *sv)
+{
+    if (sv->parent)
+        drop_view(sv);
+    /* Only strings that took a buffer have a separate one to free. */
+    else if (sv->string != (char *)(sv + 1))
+        lily_free(sv->string);
+
+    lily_free(sv);
+}
+
+/* Create a new RAW lily_string_val with room for 'size' bytes and a \0 after
+   them. The caller is expected to fill in the bytes and the \0. */
+lily_string_val *lily_new_string_blank(int size)
+{
+    lily_string_val *sv = lily_malloc(sizeof(lily_string_val) + size + 1);
+    sv->refcount = 0;
+    sv->string = (char *)(sv + 1);
+    sv->size = size;
+    sv->hash = 0;
+    sv->parent = NULL;
+    sv->views = NULL;
     return sv;
 }
 
@@ -351,22 +381,18 @@ static lily_string_val *new_sv(char *buffer, int size)
    will */
 lily_string_val *lily_new_string_sized(const char *source, int len)
 {
-    char *buffer = lily_malloc(len + 1);
-    memcpy(buffer, source, len);
-    buffer[len] = '\0';
+    lily_string_val *sv = lily_new_string_blank(len);
+    memcpy(sv->string, source, len);
+    sv->string[len] = '\0';
 
-    return new_sv(buffer, len);
+    return sv;
 }
 
 /* Create a new RAW lily_string_val. The newly-made string shall contain a copy
    of what is inside 'source'. The source is expected to be \0 terminated. */
 lily_string_val *lily_new_string(const char *source)
 {
-    int len = strlen(source);
-    char *buffer = lily_malloc(len + 1);
-    strcpy(buffer, source);
-
-    return new_sv(buffer, len);
+    return lily_new_string_sized(source, strlen(source));
 }
 
 /* Create a new raw string that takes ownership of 'source'. */
@@ -375,6 +401,138 @@ lily_string_val *lily_new_string_take(char *source)
     return new_sv(source, strlen(source));
 }
 
+/* This takes ownership of 'source', which has 'len' bytes before a terminating
+   \0. */
+lily_string_val *lily_new_string_take_sized(char *source, int len)
+{
+    return new_sv(source, len);
+}
+
+/* Views smaller than this are copied instead. A copy that small costs about as
+   much as the view would, and doesn't need to be copied again for raw access. */
+#define VIEW_MIN_SIZE 64
+
+/* A string that views point into keeps a list of them, so that they can be
+   given their own bytes if keeping it alive isn't worth it anymore. The links
+   of a view are kept just past its header, where a copy keeps its bytes. */
+typedef struct lily_view_set_ {
+    lily_string_val *first;
+    /* How many views there are, and how many bytes they cover in total. */
+    uint32_t count;
+    uint32_t pad;
+    uint64_t bytes;
+} lily_view_set;
+
+typedef struct {
+    lily_string_val *prev;
+    lily_string_val *next;
+} view_links;
+
+#define VIEW_LINKS(sv) ((view_links *)((sv) + 1))
+
+/* Create a new RAW lily_string_val holding 'size' bytes of 'source' starting at
+   'start'. Unless the result is tiny, this makes a view that shares the bytes
+   of 'source' instead of copying them. Views can pin a source that is much
+   larger than them. That's fixed once views are the only thing holding the
+   source (see release_views). */
+lily_string_val *lily_new_string_view(lily_string_val *source, int start,
+        int size)
+{
+    if (size < VIEW_MIN_SIZE)
+        return lily_new_string_sized(source->string + start, size);
+
+    /* Views always point at the string that owns the bytes, so that a view of
+       a view doesn't keep the middle one alive. */
+    lily_string_val *parent = source->parent ? source->parent : source;
+    lily_string_val *sv = lily_malloc(sizeof(lily_string_val) +
+            sizeof(view_links));
+    lily_view_set *set = parent->views;
+
+    sv->refcount = 0;
+    sv->string = source->string + start;
+    sv->size = size;
+    sv->hash = 0;
+    sv->parent = parent;
+    sv->views = NULL;
+
+    if (set == NULL) {
+        set = lily_malloc(sizeof(lily_view_set));
+        set->first = NULL;
+        set->count = 0;
+        set->bytes = 0;
+        parent->views = set;
+    }
+
+    VIEW_LINKS(sv)->prev = NULL;
+    VIEW_LINKS(sv)->next = set->first;
+    if (set->first)
+        VIEW_LINKS(set->first)->prev = sv;
+
+    set->first = sv;
+    set->count++;
+    set->bytes += size;
+    parent->refcount++;
+    return sv;
+}
+
+/* Views of 'sv' are the only thing keeping it alive if each ref it has comes
+   from one of them. Once that's the case and they use less than half of it,
+   each view gets a copy of its bytes so that 'sv' can be freed. Views that are
+   kept never pin more than twice what they use (after what holds 'sv' lets go
+   of it). */
+static void release_views(lily_string_val *sv)
+{
+    lily_view_set *set = sv->views;
+
+    if (set == NULL ||
+        sv->refcount != set->count ||
+        set->bytes >= sv->size / 2)
+        return;
+
+    /* Giving a view its bytes drops it from the set, and the set is freed
+       after the last one. The extra ref keeps 'sv' alive until then, and stops
+       the drops from coming back here. */
+    sv->refcount++;
+
+    while (sv->views)
+        lily_string_raw(sv->views->first);
+
+    sv->refcount--;
+    if (sv->refcount == 0)
+        free_sv(sv);
+}
+
+/* 'sv' is a view that is being freed or given its own bytes. This takes it out
+   of the views of its parent, and drops the ref it held. */
+static void drop_view(lily_string_val *sv)
+{
+    lily_string_val *parent = sv->parent;
+    lily_view_set *set = parent->views;
+    view_links *links = VIEW_LINKS(sv);
+
+    if (links->prev)
+        VIEW_LINKS(links->prev)->next = links->next;
+    else
+        set->first = links->next;
+
+    if (links->next)
+        VIEW_LINKS(links->next)->prev = links->prev;
+
+    set->count--;
+    set->bytes -= sv->size;
+
+    if (set->count == 0) {
+        lily_free(set);
+        parent->views = NULL;
+    }
+
+    parent->refcount--;
+    if (parent->refcount == 0)
+        free_sv(parent);
+    else
+        release_views(parent);
+}
+
 lily_tuple_val *lily_new_tuple(int initial)
 {
     return (lily_tuple_val *)lily_new_list(initial);
@@ -384,17 +542,14 @@ lily_variant_val *lily_new_variant(int size)
 {
     lily_variant_val *ival = lily_malloc(sizeof(lily_variant_val));
 
-    ival->values = lily_malloc(size * sizeof(lily_value *));
+    ival->values = lily_malloc(size * sizeof(lily_value));
     ival->refcount = 0;
     ival->gc_entry = NULL;
     ival->num_values = size;
 
     int i;
-    for (i = 0;i < size;i++) {
-        lily_value *v = lily_malloc(sizeof(lily_value));
-        v->flags = 0;
-        ival->values[i] = v;
-    }
+    for (i = 0;i < size;i++)
+        ival->values[i].flags = 0;
 
     return ival;
 }
@@ -411,6 +566,13 @@ lily_bytestring_val *lily_new_bytestring_take(char *source)
     return (lily_bytestring_val *)lily_new_string_take(source);
 }
 
+/* This takes ownership of 'source', which has 'len' bytes before a terminating
+   \0. Use this when 'source' may contain \0 bytes inside of it. */
+lily_bytestring_val *lily_new_bytestring_take_sized(char *source, int len)
+{
+    return (lily_bytestring_val *)new_sv(source, len);
+}
+
 lily_bytestring_val *lily_new_bytestring(const char *source)
 {
     return (lily_bytestring_val *)lily_new_string(source);
@@ -459,8 +621,25 @@ int lily_function_is_native(lily_function_val *fv)
     return fv->code != NULL;
 }
 
+/* Views don't have a \0 terminator, so this replaces their bytes with a copy
+   that does. Pointers to the old bytes of 'sv' may not be valid after this. */
+static void materialize_view(lily_string_val *sv)
+{
+    char *buffer = lily_malloc(sv->size + 1);
+
+    memcpy(buffer, sv->string, sv->size);
+    buffer[sv->size] = '\0';
+    /* This may free the parent, so the bytes are copied first. */
+    drop_view(sv);
+    sv->string = buffer;
+    sv->parent = NULL;
+}
+
 char *lily_string_raw(lily_string_val *sv)
 {
+    if (sv->parent)
+        materialize_view(sv);
+
     return sv->string;
 }
 
@@ -469,6 +648,35 @@ int lily_string_length(lily_string_val *sv)
     return sv->size;
 }
 
+/* Check if two strings are equal. Strings of different sizes, or strings that
+   have both been hashed to different values, can't be equal. */
+int lily_string_eq(lily_string_val *left, lily_string_val *right)
+{
+    if (left == right)
+        return 1;
+
+    if (left->size != right->size ||
+        (left->hash && right->hash && left->hash != right->hash))
+        return 0;
+
+    return memcmp(left->string, right->string, left->size) == 0;
+}
+
+/* Compare two strings, returning -1, 0, or 1 like strcmp. If one string is a
+   prefix of the other, the shorter one comes first. */
+int lily_string_cmp(lily_string_val *left, lily_string_val *right)
+{
+    uint32_t size = left->size < right->size ? left->size : right->size;
+    int result = memcmp(left->string, right->string, size);
+
+    if (result == 0)
+        result = (left->size > right->size) - (left->size < right->size);
+    else
+        result = (result > 0) - (result < 0);
+
+    return result;
+}
+
 int lily_list_num_values(lily_list_val *lv)
 {
     return lv->num_values;
@@ -496,10 +704,8 @@ static void destroy_instance(lily_value *v)
     }
 
     int i;
-    for (i = 0;i < iv->num_values;i++) {
-        lily_deref(iv->values[i]);
-        lily_free(iv->values[i]);
-    }
+    for (i = 0;i < iv->num_values;i++)
+        lily_deref(&iv->values[i]);
 
     lily_free(iv->values);
 
@@ -513,10 +719,8 @@ static void destroy_list(lily_value *v)
     lily_list_val *lv = v->value.list;
 
     int i;
-    for (i = 0;i < lv->num_values;i++) {
-        lily_deref(lv->elems[i]);
-        lily_free(lv->elems[i]);
-    }
+    for (i = 0;i < lv->num_values;i++)
+        lily_deref(&lv->elems[i]);
 
     lily_free(lv->elems);
     lily_free(lv);
@@ -524,10 +728,7 @@ static void destroy_list(lily_value *v)
 
 static void destroy_string(lily_value *v)
 {
-    lily_string_val *sv = v->value.string;
-
-    lily_free(sv->string);
-    lily_free(sv);
+    free_sv(v->value.string);
 }
 
 static void destroy_function(lily_value *v)
@@ -605,6 +806,7 @@ static void destroy_file(lily_value *v)
     if (filev->inner_file && filev->is_builtin == 0)
         fclose(filev->inner_file);
 
+    free(filev->line_buffer);
     lily_free(filev);
 }
 
@@ -636,6 +838,11 @@ void lily_deref(lily_value *value)
         value->value.generic->refcount--;
         if (value->value.generic->refcount == 0)
             lily_value_destroy(value);
+        /* The last ref that isn't from a view may have been dropped. */
+        else if ((value->class_id == LILY_STRING_ID ||
+                  value->class_id == LILY_BYTESTRING_ID) &&
+                 value->value.string->views)
+            release_views(value->value.string);
     }
 }
 
@@ -695,8 +902,8 @@ static int subvalue_eq(lily_state *s, int *depth, lily_value *left,
         ok = 1;
         int i;
         for (i = 0;i < left_list->num_values;i++) {
-            lily_value *left_item = left_list->elems[i];
-            lily_value *right_item = right_list->elems[i];
+            lily_value *left_item = &left_list->elems[i];
+            lily_value *right_item = &right_list->elems[i];
             (*depth)++;
             if (lily_value_compare_raw(s, depth, left_item, right_item) == 0) {
                 (*depth)--;
@@ -729,8 +936,7 @@ int lily_value_compare_raw(lily_state *s, int *depth, lily_value *left,
     else if (left_tag == LILY_DOUBLE_ID)
         return left->value.doubleval == right->value.doubleval;
     else if (left_tag == LILY_STRING_ID)
-        return strcmp(left->value.string->string,
-                right->value.string->string) == 0;
+        return lily_string_eq(left->value.string, right->value.string);
     else if (left_tag == LILY_BYTESTRING_ID) {
         lily_string_val *left_sv = left->value.string;
         lily_string_val *right_sv = right->value.string;
@@ -753,19 +959,18 @@ int lily_value_compare_raw(lily_state *s, int *depth, lily_value *left,
 
         if (ok) {
             (*depth)++;
-            int i;
-            for (i = 0;i < left_hash->num_bins;i++) {
-                lily_hash_entry *left = left_hash->bins[i];
-                if (left) {
-                    lily_value *right = lily_hash_find_value(right_hash,
-                            left->boxed_key);
-
-                    if (right == NULL ||
-                        lily_value_compare_raw(s, depth, left->record,
-                                right) == 0) {
-                        ok = 0;
-                        break;
-                    }
+            lily_hash_entry *left;
+            int pos = 0;
+
+            while ((left = lily_hash_next_entry(left_hash, &pos)) != NULL) {
+                lily_value *right = lily_hash_find_value(right_hash,
+                        &left->boxed_key);
+
+                if (right == NULL ||
+                    lily_value_compare_raw(s, depth, &left->record,
+                            right) == 0) {
+                    ok = 0;
+                    break;
                 }
             }
             (*depth)--;
@@ -20,6 +20,7 @@ typedef struct lily_file_val_       lily_file_val;
 typedef struct lily_foreign_val_    lily_foreign_val;
 typedef struct lily_function_val_   lily_function_val;
 typedef struct lily_generic_val_    lily_generic_val;
+typedef struct lily_hash_entry_     lily_hash_entry;
 typedef struct lily_hash_val_       lily_hash_val;
 typedef struct lily_instance_val_   lily_instance_val;
 typedef struct lily_list_val_       lily_list_val;
@@ -76,6 +77,7 @@ lily_value *lily_new_value_of_string_raw(const char *);
 /* ByteString operations */
 lily_bytestring_val *lily_new_bytestring(const char *);
 lily_bytestring_val *lily_new_bytestring_take(char *);
+lily_bytestring_val *lily_new_bytestring_take_sized(char *, int);
 lily_bytestring_val *lily_new_bytestring_sized(const char *, int);
 char *lily_bytestring_raw(lily_bytestring_val *);
 int lily_bytestring_length(lily_bytestring_val *);
@@ -161,15 +163,17 @@ void lily_instance_set_value        (lily_instance_val *, int, lily_value *);
 void lily_instance_set_variant      (lily_instance_val *, int, uint16_t, lily_variant_val *);
 
 /* Hash operations */
-lily_hash_val *lily_new_hash_numtable(void);
-lily_hash_val *lily_new_hash_numtable_sized(int);
-lily_hash_val *lily_new_hash_strtable(void);
-lily_hash_val *lily_new_hash_strtable_sized(int);
+lily_hash_val *lily_new_hash_numtable(lily_state *);
+lily_hash_val *lily_new_hash_numtable_sized(lily_state *, int);
+lily_hash_val *lily_new_hash_strtable(lily_state *);
+lily_hash_val *lily_new_hash_strtable_sized(lily_state *, int);
 lily_hash_val *lily_new_hash_like_sized(lily_hash_val *, int);
 lily_value *lily_hash_find_value(lily_hash_val *, lily_value *);
 void lily_hash_insert_value(lily_hash_val *, lily_value *, lily_value *);
 void lily_hash_insert_str(lily_hash_val *, lily_string_val *, lily_value *);
-int lily_hash_delete(lily_hash_val *, lily_value **, lily_value **);
+int lily_hash_delete(lily_hash_val *, lily_value *, lily_value *, lily_value *);
+void lily_hash_clear(lily_hash_val *);
+lily_hash_entry *lily_hash_next_entry(lily_hash_val *, int *);
 
 /* List operations */
 lily_list_val *lily_new_list(int);
@@ -209,10 +213,15 @@ void lily_list_set_variant      (lily_list_val *, int, uint16_t, lily_variant_va
 
 /* String operations */
 lily_string_val *lily_new_string(const char *);
+lily_string_val *lily_new_string_blank(int);
 lily_string_val *lily_new_string_take(char *);
+lily_string_val *lily_new_string_take_sized(char *, int);
 lily_string_val *lily_new_string_sized(const char *, int);
+lily_string_val *lily_new_string_view(lily_string_val *, int, int);
 char *lily_string_raw(lily_string_val *);
 int lily_string_length(lily_string_val *);
+int lily_string_eq(lily_string_val *, lily_string_val *);
+int lily_string_cmp(lily_string_val *, lily_string_val *);
 
 /* Tuple operations */
 lily_tuple_val *lily_new_tuple(int);
@@ -0,0 +1,1739 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "lily_cache.h"
+#include "lily_int_opcode.h"
+#include "lily_api_code_iter.h"
+#include "lily_value_flags.h"
+
+#include "lily_api_alloc.h"
+#include "lily_api_value.h"
+
+/** Parsing is often the most expensive part of running a small script, such as
+    a page that is rendered again on every request. A cache holds what the
+    parser made from a file, so that later runs can skip the lexer, the parser,
+    and the emitter, and go straight to the vm.
+
+    The cache of 'page.lly' is 'page.llyc'. It holds the code of __main__, the
+    literals and functions in the order that symtab stored them, the classes
+    that the file declared, and the names of builtin items that were dynaloaded.
+    Builtin items are stored by name, and rebuilt through dynaloading. Because
+    of that, the readonly table ends up the same as it was when the file was
+    parsed, and the cached code can run as-is.
+
+    Only files that do not import anything can be cached, and a cache is only
+    used for the first parse of an interpreter. The cache records the size and a
+    hash of the source it was made from. If the source has changed, or anything
+    within the cache does not line up, then the cache is ignored and the source
+    is parsed instead. Modification times are not used, because copying or
+    checking out files does not reliably preserve them. **/
+
+#define CACHE_MAGIC "LLYC"
+
+/* __main__ is always the first literal. Instead of being stored with the rest,
+   it's rebuilt from the code that is cached for it. */
+#define LITERAL_BASE 1
+
+typedef struct {
+    const char *name;
+    uint32_t spot;
+    uint32_t pad;
+} cache_symbol;
+
+typedef struct lily_cache_ {
+    /* Class and function names point into this, so it's kept until the state
+       is torn down. */
+    unsigned char *buffer;
+    /* These are toplevel functions, so that lily_get_func can find them. */
+    cache_symbol *funcs;
+    uint32_t func_count;
+    uint32_t pad;
+} lily_cache;
+
+typedef struct {
+    /* 'c' for a class, 'e' for an enum, 'v' for a variant. */
+    char kind;
+    uint16_t flags;
+    uint16_t parent_id;
+    uint16_t prop_count;
+    uint16_t inherit_depth;
+    const char *name;
+} cache_class;
+
+typedef struct {
+    /* 'i', 'd', 's', and 'b' are literals. 'n' is a native function, and 'f' is
+       a builtin foreign function. */
+    char kind;
+    uint16_t reg_count;
+    uint32_t size;
+    uint32_t line_num;
+    union {
+        int64_t integer;
+        double doubleval;
+    };
+    const unsigned char *data;
+    const char *class_name;
+    const char *name;
+    const char *docstring;
+} cache_literal;
+
+typedef struct {
+    uint64_t source_size;
+    uint64_t source_hash;
+    uint32_t class_start;
+    uint32_t class_count;
+    cache_class *classes;
+    uint32_t builtin_count;
+    uint32_t literal_count;
+    const char **builtins;
+    cache_literal *literals;
+    uint32_t global_count;
+    uint32_t func_count;
+    cache_symbol *globals;
+    cache_symbol *funcs;
+    uint32_t main_reg_count;
+    uint32_t main_code_len;
+    const unsigned char *main_code;
+} cache_image;
+
+/***
+ *      ____
+ *     / ___|  ___  _   _ _ __ ___ ___
+ *     \___ \ / _ \| | | | '__/ __/ _ \
+ *      ___) | (_) | |_| | | | (_|  __/
+ *     |____/ \___/ \__,_|_|  \___\___|
+ *
+ */
+
+static char *cache_path_for(const char *filename)
+{
+    size_t len = strlen(filename);
+    char *result = lily_malloc(len + 2);
+
+    strcpy(result, filename);
+    result[len] = 'c';
+    result[len + 1] = '\0';
+
+    return result;
+}
+
+#define FNV_OFFSET_BASIS 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+/* Add 'size' bytes of 'data' to a (64-bit FNV-1a) hash. */
+static uint64_t fnv_add(uint64_t hash, const unsigned char *data, size_t size)
+{
+    size_t i;
+
+    for (i = 0;i < size;i++) {
+        hash ^= data[i];
+        hash *= FNV_PRIME;
+    }
+
+    return hash;
+}
+
+/* Find the size and a (64-bit FNV-1a) hash of the source at 'path'. */
+int lily_cache_identify_file(const char *path, uint64_t *size, uint64_t *hash)
+{
+    FILE *f = fopen(path, "rb");
+    if (f == NULL)
+        return 0;
+
+    unsigned char chunk[4096];
+    uint64_t result = FNV_OFFSET_BASIS;
+    uint64_t total = 0;
+    size_t count;
+
+    while ((count = fread(chunk, 1, sizeof(chunk), f)) != 0) {
+        result = fnv_add(result, chunk, count);
+        total += count;
+    }
+
+    fclose(f);
+    *size = total;
+    *hash = result;
+    return 1;
+}
+
+/* This is the same as the above, but for source that is a string. */
+void lily_cache_identify_string(const char *str, uint64_t *size,
+        uint64_t *hash)
+{
+    const unsigned char *ch = (const unsigned char *)str;
+    uint64_t result = FNV_OFFSET_BASIS;
+
+    while (*ch) {
+        result ^= *ch;
+        result *= FNV_PRIME;
+        ch++;
+    }
+
+    *size = (uint64_t)(ch - (const unsigned char *)str);
+    *hash = result;
+}
+
+/***
+ *     __        __    _ _
+ *     \ \      / / __(_) |_ ___
+ *      \ \ /\ / / '__| | __/ _ \
+ *       \ V  V /| |  | | ||  __/
+ *        \_/\_/ |_|  |_|\__\___|
+ *
+ */
+
+/** Numbers are written in little-endian order. Strings are written with their
+    size first, and are followed by a terminator so that the loader can use them
+    in place. Code is written as a count of u16 values, and then the values.
+    The last 8 bytes are a hash of everything before them. **/
+
+typedef struct {
+    unsigned char *data;
+    uint32_t pos;
+    uint32_t size;
+} cache_writer;
+
+static void write_n(cache_writer *w, uint64_t value, int n)
+{
+    if (w->pos + n > w->size) {
+        while (w->pos + n > w->size)
+            w->size *= 2;
+
+        w->data = lily_realloc(w->data, w->size);
+    }
+
+    int i;
+    for (i = 0;i < n;i++)
+        w->data[w->pos + i] = (unsigned char)(value >> (i * 8));
+
+    w->pos += n;
+}
+
+static void write_string(cache_writer *w, const char *s, uint32_t size)
+{
+    write_n(w, size, 4);
+
+    uint32_t i;
+    for (i = 0;i < size;i++)
+        write_n(w, (unsigned char)s[i], 1);
+
+    write_n(w, 0, 1);
+}
+
+static void write_optional_string(cache_writer *w, const char *s)
+{
+    if (s) {
+        write_n(w, 1, 1);
+        write_string(w, s, strlen(s));
+    }
+    else
+        write_n(w, 0, 1);
+}
+
+static void write_code(cache_writer *w, uint16_t *code, uint32_t size)
+{
+    write_n(w, size, 4);
+
+    uint32_t i;
+    for (i = 0;i < size;i++)
+        write_n(w, code[i], 2);
+}
+
+static char class_kind(lily_class *cls)
+{
+    if (cls->item_kind == ITEM_TYPE_VARIANT)
+        return 'v';
+    else if (cls->flags & CLS_IS_ENUM)
+        return 'e';
+    else
+        return 'c';
+}
+
+/* Collect the classes that the first file declared, ordered by id. The loader
+   recreates classes in this order so that they get the same ids. Returns NULL
+   if the ids aren't in one solid block, or if variants are out of place. */
+static lily_class **collect_classes(lily_parse_state *parser, uint32_t count)
+{
+    uint32_t start = START_CLASS_ID;
+    lily_class **result = lily_malloc((count + 1) * sizeof(*result));
+    lily_class *class_iter = parser->main_module->class_chain;
+    uint32_t i, found = 0;
+
+    memset(result, 0, (count + 1) * sizeof(*result));
+
+    for (;class_iter;class_iter = class_iter->next) {
+        int is_scoped = (class_iter->flags & CLS_ENUM_IS_SCOPED);
+        int j, variant_count = is_scoped ? class_iter->variant_size : 0;
+
+        /* Scoped variants aren't linked, so take them from the enum. */
+        for (j = -1;j < variant_count;j++) {
+            lily_class *cls = class_iter;
+            if (j != -1)
+                cls = (lily_class *)class_iter->variant_members[j];
+
+            /* A variant's id is in the same place as a class id. */
+            uint32_t id = cls->id;
+            if (id < start || id >= start + count || result[id - start]) {
+                lily_free(result);
+                return NULL;
+            }
+
+            result[id - start] = cls;
+            found++;
+        }
+    }
+
+    if (found != count) {
+        lily_free(result);
+        return NULL;
+    }
+
+    /* The loader finishes an enum once all of the variants after it are made,
+       so variants have to directly follow their enum. */
+    for (i = 0;i < count;i++) {
+        lily_class *cls = result[i];
+        if (cls->item_kind != ITEM_TYPE_VARIANT)
+            continue;
+
+        lily_class *prev = (i == 0) ? NULL : result[i - 1];
+        if (prev == NULL ||
+            (prev != cls->parent && (prev->item_kind != ITEM_TYPE_VARIANT ||
+                                     prev->parent != cls->parent))) {
+            lily_free(result);
+            return NULL;
+        }
+    }
+
+    return result;
+}
+
+static void write_classes(cache_writer *w, lily_class **classes, uint32_t count)
+{
+    uint32_t i;
+
+    write_n(w, START_CLASS_ID, 4);
+    write_n(w, count, 4);
+
+    for (i = 0;i < count;i++) {
+        lily_class *cls = classes[i];
+        char kind = class_kind(cls);
+        uint16_t parent_id = 0;
+
+        if (cls->parent)
+            parent_id = cls->parent->id;
+
+        write_n(w, kind, 1);
+        write_n(w, cls->flags, 2);
+        write_n(w, parent_id, 2);
+
+        if (kind == 'v') {
+            write_n(w, 0, 2);
+            write_n(w, 0, 2);
+        }
+        else {
+            write_n(w, cls->prop_count, 2);
+            write_n(w, cls->inherit_depth, 2);
+        }
+
+        write_string(w, cls->name, strlen(cls->name));
+    }
+}
+
+static void write_builtin_classes(cache_writer *w, lily_symtab *symtab)
+{
+    lily_class *class_iter = symtab->builtin_module->class_chain;
+    uint32_t count = 0;
+
+    for (;class_iter;class_iter = class_iter->next)
+        count++;
+
+    write_n(w, count, 4);
+
+    class_iter = symtab->builtin_module->class_chain;
+    for (;class_iter;class_iter = class_iter->next)
+        write_string(w, class_iter->name, strlen(class_iter->name));
+}
+
+/* Check that every literal is something that can be written. */
+static int literals_are_cacheable(lily_symtab *symtab)
+{
+    lily_value_stack *literals = symtab->literals;
+    uint32_t i;
+
+    if (lily_vs_nth(literals, 0)->value.function != symtab->main_function)
+        return 0;
+
+    for (i = LITERAL_BASE;i < lily_vs_pos(literals);i++) {
+        lily_value *v = lily_vs_nth(literals, i);
+        int id = v->class_id;
+
+        if (id == LILY_FUNCTION_ID) {
+            lily_function_val *f = v->value.function;
+
+            if (f->foreign_func == NULL && f->code == NULL)
+                return 0;
+            else if (f->foreign_func && f->module != symtab->builtin_module)
+                return 0;
+        }
+        else if (id != LILY_INTEGER_ID && id != LILY_DOUBLE_ID &&
+                 id != LILY_STRING_ID && id != LILY_BYTESTRING_ID)
+            return 0;
+    }
+
+    return 1;
+}
+
+static void write_literals(cache_writer *w, lily_symtab *symtab)
+{
+    lily_value_stack *literals = symtab->literals;
+    uint32_t i;
+
+    write_n(w, lily_vs_pos(literals) - LITERAL_BASE, 4);
+
+    for (i = LITERAL_BASE;i < lily_vs_pos(literals);i++) {
+        lily_value *v = lily_vs_nth(literals, i);
+        int id = v->class_id;
+
+        if (id == LILY_INTEGER_ID) {
+            write_n(w, 'i', 1);
+            write_n(w, (uint64_t)v->value.integer, 8);
+        }
+        else if (id == LILY_DOUBLE_ID) {
+            uint64_t bits;
+            memcpy(&bits, &v->value.doubleval, sizeof(bits));
+            write_n(w, 'd', 1);
+            write_n(w, bits, 8);
+        }
+        else if (id == LILY_STRING_ID) {
+            lily_string_val *sv = v->value.string;
+            write_n(w, 's', 1);
+            write_string(w, sv->string, sv->size);
+        }
+        else if (id == LILY_BYTESTRING_ID) {
+            lily_bytestring_val *bv = (lily_bytestring_val *)v->value.string;
+            write_n(w, 'b', 1);
+            write_string(w, bv->string, bv->size);
+        }
+        else {
+            lily_function_val *f = v->value.function;
+
+            if (f->foreign_func == NULL) {
+                write_n(w, 'n', 1);
+                write_n(w, f->line_num, 4);
+                write_n(w, f->reg_count, 2);
+                write_code(w, f->code, f->code_len);
+                write_optional_string(w, f->class_name);
+                write_string(w, f->trace_name, strlen(f->trace_name));
+                write_optional_string(w, f->docstring);
+            }
+            else {
+                write_n(w, 'f', 1);
+                write_optional_string(w, f->class_name);
+                write_string(w, f->trace_name, strlen(f->trace_name));
+            }
+        }
+    }
+}
+
+/* Vars in the builtin module are either functions (stored as literals), or
+   dynaloaded vars like stdout. The latter have values in __main__'s registers,
+   which the loader moves back to the same spot. */
+static void write_globals(cache_writer *w, lily_symtab *symtab)
+{
+    lily_var *var_iter = symtab->builtin_module->var_chain;
+    uint32_t count = 0;
+
+    for (;var_iter;var_iter = var_iter->next)
+        if (var_iter->flags & VAR_IS_GLOBAL)
+            count++;
+
+    write_n(w, count, 4);
+
+    var_iter = symtab->builtin_module->var_chain;
+    for (;var_iter;var_iter = var_iter->next) {
+        if (var_iter->flags & VAR_IS_GLOBAL) {
+            write_string(w, var_iter->name, strlen(var_iter->name));
+            write_n(w, var_iter->reg_spot, 2);
+        }
+    }
+}
+
+static int is_toplevel_func(lily_var *var)
+{
+    return (var->flags & VAR_IS_READONLY) &&
+           var->type->cls->id == LILY_FUNCTION_ID;
+}
+
+static void write_funcs(cache_writer *w, lily_module_entry *m)
+{
+    lily_var *var_iter = m->var_chain;
+    uint32_t count = 0;
+
+    for (;var_iter;var_iter = var_iter->next)
+        if (is_toplevel_func(var_iter))
+            count++;
+
+    write_n(w, count, 4);
+
+    var_iter = m->var_chain;
+    for (;var_iter;var_iter = var_iter->next) {
+        if (is_toplevel_func(var_iter)) {
+            write_string(w, var_iter->name, strlen(var_iter->name));
+            write_n(w, var_iter->reg_spot, 4);
+        }
+    }
+}
+
+/* This is called by parser instead of running the first file. A cache of that
+   file is written next to it.
+   Failure: An error is raised if the file can't be cached, or if the cache
+            can't be written. */
+void lily_write_cache(lily_parse_state *parser, const char *filename)
+{
+    lily_symtab *symtab = parser->symtab;
+    lily_raiser *raiser = parser->raiser;
+    uint64_t source_size, source_hash;
+
+    if (parser->main_module->module_chain != NULL)
+        lily_raise_err(raiser,
+                "Cannot cache '%s', because it imports other modules.",
+                filename);
+
+    if (literals_are_cacheable(symtab) == 0)
+        lily_raise_err(raiser,
+                "Cannot cache '%s', because it uses foreign functions from "
+                "outside the builtin module.",
+                filename);
+
+    if (lily_cache_identify_file(filename, &source_size, &source_hash) == 0)
+        lily_raise_err(raiser, "Cannot read '%s' to cache it.", filename);
+
+    uint32_t class_count = symtab->next_class_id - START_CLASS_ID;
+    lily_class **classes = collect_classes(parser, class_count);
+
+    if (classes == NULL)
+        lily_raise_err(raiser,
+                "Cannot cache '%s', because its class ids are not in order.",
+                filename);
+
+    cache_writer w;
+    w.size = 1024;
+    w.pos = 0;
+    w.data = lily_malloc(w.size);
+
+    write_n(&w, CACHE_MAGIC[0], 1);
+    write_n(&w, CACHE_MAGIC[1], 1);
+    write_n(&w, CACHE_MAGIC[2], 1);
+    write_n(&w, CACHE_MAGIC[3], 1);
+    write_n(&w, LILY_CACHE_VERSION, 4);
+    write_n(&w, o_return_from_vm + 1, 4);
+    write_n(&w, source_size, 8);
+    write_n(&w, source_hash, 8);
+
+    write_classes(&w, classes, class_count);
+    write_builtin_classes(&w, symtab);
+    write_literals(&w, symtab);
+    write_globals(&w, symtab);
+    write_funcs(&w, parser->main_module);
+
+    lily_buffer_u16 *code = parser->emit->code;
+    write_n(&w, parser->emit->main_block->next_reg_spot, 4);
+    write_code(&w, code->data, lily_u16_pos(code));
+    write_n(&w, fnv_add(FNV_OFFSET_BASIS, w.data, w.pos), 8);
+
+    lily_free(classes);
+
+    /* Write to a side file first, so that a reader never sees half of a cache.
+       The rename replaces any older cache at once. */
+    char *path = cache_path_for(filename);
+    char *temp_path = lily_malloc(strlen(path) + 5);
+    int ok = 0;
+
+    strcpy(temp_path, path);
+    strcat(temp_path, ".tmp");
+
+    FILE *f = fopen(temp_path, "wb");
+    if (f) {
+        ok = (fwrite(w.data, 1, w.pos, f) == w.pos);
+        ok = (fclose(f) == 0) && ok;
+
+        if (ok) {
+            /* Windows won't rename over an existing file. */
+            remove(path);
+            ok = (rename(temp_path, path) == 0);
+        }
+
+        if (ok == 0)
+            remove(temp_path);
+    }
+
+    lily_free(w.data);
+    lily_free(temp_path);
+
+    /* The file isn't run, so the vm never takes these. */
+    while (lily_vs_pos(parser->foreign_values)) {
+        lily_value *v = lily_vs_pop(parser->foreign_values);
+        lily_deref(v);
+        lily_free(v);
+    }
+
+    if (ok == 0) {
+        lily_mb_flush(parser->msgbuf);
+        lily_mb_add(parser->msgbuf, path);
+        lily_free(path);
+        lily_raise_err(raiser, "Cannot write cache to '%s'.",
+                lily_mb_get(parser->msgbuf));
+    }
+
+    lily_free(path);
+}
+
+/***
+ *      ____                _
+ *     |  _ \ ___  __ _  __| |
+ *     | |_) / _ \/ _` |/ _` |
+ *     |  _ <  __/ (_| | (_| |
+ *     |_| \_\___|\__,_|\__,_|
+ *
+ */
+
+/** The image is checked completely before the interpreter is changed. Any
+    problem with the layout makes the loader give up and parse the source.
+    The hash at the end catches damage to the file. Since a hash can't prove
+    that the code is sane, the code is also checked before it's used (see
+    below). **/
+
+typedef struct {
+    const unsigned char *pos;
+    const unsigned char *end;
+    int ok;
+    int pad;
+} cache_reader;
+
+static uint64_t read_n(cache_reader *r, int n)
+{
+    uint64_t result = 0;
+    int i;
+
+    if (r->ok == 0 || r->end - r->pos < n) {
+        r->ok = 0;
+        return 0;
+    }
+
+    for (i = 0;i < n;i++)
+        result |= (uint64_t)r->pos[i] << (i * 8);
+
+    r->pos += n;
+    return result;
+}
+
+static const unsigned char *read_bytes(cache_reader *r, uint64_t size)
+{
+    const unsigned char *result = r->pos;
+
+    if (r->ok == 0 || (uint64_t)(r->end - r->pos) < size) {
+        r->ok = 0;
+        return NULL;
+    }
+
+    r->pos += size;
+    return result;
+}
+
+static const char *read_string(cache_reader *r, uint32_t *size)
+{
+    uint32_t len = (uint32_t)read_n(r, 4);
+    const unsigned char *s = read_bytes(r, (uint64_t)len + 1);
+
+    if (s == NULL || s[len] != '\0') {
+        r->ok = 0;
+        return NULL;
+    }
+
+    if (size)
+        *size = len;
+
+    return (const char *)s;
+}
+
+static const char *read_optional_string(cache_reader *r)
+{
+    if (read_n(r, 1) == 0)
+        return NULL;
+
+    return read_string(r, NULL);
+}
+
+static const unsigned char *read_code(cache_reader *r, uint32_t *size)
+{
+    *size = (uint32_t)read_n(r, 4);
+    return read_bytes(r, (uint64_t)*size * 2);
+}
+
+/* Every entry takes at least a byte, so a count larger than what's left can't
+   be valid. This keeps a broken cache from asking for a huge block. */
+static void *read_array(cache_reader *r, uint32_t *count, size_t elem_size)
+{
+    *count = (uint32_t)read_n(r, 4);
+
+    if (r->ok == 0 || *count > (uint64_t)(r->end - r->pos)) {
+        r->ok = 0;
+        *count = 0;
+        return NULL;
+    }
+
+    return lily_malloc((*count + 1) * elem_size);
+}
+
+static int read_classes(cache_reader *r, cache_image *image)
+{
+    uint32_t start = (uint32_t)read_n(r, 4);
+    cache_class *classes = read_array(r, &image->class_count,
+            sizeof(*classes));
+    uint32_t i, count = image->class_count;
+
+    image->class_start = start;
+    image->classes = classes;
+
+    if ((uint64_t)start + count >= LILY_SELF_ID)
+        r->ok = 0;
+
+    for (i = 0;i < count && r->ok;i++) {
+        cache_class *c = &classes[i];
+
+        c->kind = (char)read_n(r, 1);
+        c->flags = (uint16_t)read_n(r, 2);
+        c->parent_id = (uint16_t)read_n(r, 2);
+        c->prop_count = (uint16_t)read_n(r, 2);
+        c->inherit_depth = (uint16_t)read_n(r, 2);
+        c->name = read_string(r, NULL);
+    }
+
+    if (r->ok == 0)
+        return 0;
+
+    for (i = 0;i < count;i++) {
+        cache_class *c = &classes[i];
+        uint32_t id = start + i;
+
+        uint16_t enum_flags = c->flags & (CLS_IS_ENUM | CLS_ENUM_IS_SCOPED);
+
+        if ((c->kind == 'e' && (enum_flags & CLS_IS_ENUM) == 0) ||
+            (c->kind != 'e' && enum_flags))
+            return 0;
+
+        if (c->kind == 'v') {
+            /* Variants must follow their enum or a sibling. */
+            if (i == 0 || c->parent_id < start || c->parent_id >= id ||
+                classes[c->parent_id - start].kind != 'e')
+                return 0;
+
+            cache_class *prev = &classes[i - 1];
+            if (c->parent_id != id - 1 &&
+                (prev->kind != 'v' || prev->parent_id != c->parent_id))
+                return 0;
+        }
+        else if (c->kind == 'e' || c->kind == 'c') {
+            if (c->parent_id >= id ||
+                (c->kind == 'e' && c->parent_id != 0) ||
+                (c->parent_id >= start &&
+                 classes[c->parent_id - start].kind != 'c'))
+                return 0;
+
+            /* An enum needs at least one variant. */
+            if (c->kind == 'e' &&
+                (i + 1 == count || classes[i + 1].kind != 'v'))
+                return 0;
+        }
+        else
+            return 0;
+    }
+
+    return 1;
+}
+
+static int read_literals(cache_reader *r, cache_image *image)
+{
+    cache_literal *literals = read_array(r, &image->literal_count,
+            sizeof(*literals));
+    uint32_t i, count = image->literal_count;
+
+    image->literals = literals;
+
+    for (i = 0;i < count && r->ok;i++) {
+        cache_literal *lit = &literals[i];
+        uint64_t bits;
+
+        lit->kind = (char)read_n(r, 1);
+        lit->class_name = NULL;
+        lit->name = NULL;
+
+        switch (lit->kind) {
+            case 'i':
+                lit->integer = (int64_t)read_n(r, 8);
+                break;
+            case 'd':
+                bits = read_n(r, 8);
+                memcpy(&lit->doubleval, &bits, sizeof(bits));
+                break;
+            case 's':
+            case 'b':
+                lit->data = (const unsigned char *)read_string(r, &lit->size);
+                break;
+            case 'n':
+                lit->line_num = (uint32_t)read_n(r, 4);
+                lit->reg_count = (uint16_t)read_n(r, 2);
+                lit->data = read_code(r, &lit->size);
+                lit->class_name = read_optional_string(r);
+                lit->name = read_string(r, NULL);
+                lit->docstring = read_optional_string(r);
+
+                if (lit->size == 0 || lit->size > UINT16_MAX)
+                    r->ok = 0;
+                break;
+            case 'f':
+                lit->class_name = read_optional_string(r);
+                lit->name = read_string(r, NULL);
+                break;
+            default:
+                r->ok = 0;
+                break;
+        }
+    }
+
+    return r->ok;
+}
+
+static cache_symbol *read_symbols(cache_reader *r, uint32_t *count,
+        int spot_size)
+{
+    cache_symbol *result = read_array(r, count, sizeof(*result));
+    uint32_t i;
+
+    for (i = 0;i < *count && r->ok;i++) {
+        result[i].name = read_string(r, NULL);
+        result[i].spot = (uint32_t)read_n(r, spot_size);
+    }
+
+    return result;
+}
+
+static int read_image(unsigned char *buffer, uint32_t size, cache_image *image)
+{
+    cache_reader r;
+    uint32_t i;
+
+    if (size < 8)
+        return 0;
+
+    size -= 8;
+
+    r.pos = buffer + size;
+    r.end = buffer + size + 8;
+    r.ok = 1;
+
+    if (read_n(&r, 8) != fnv_add(FNV_OFFSET_BASIS, buffer, size))
+        return 0;
+
+    r.pos = buffer;
+    r.end = buffer + size;
+
+    const unsigned char *magic = read_bytes(&r, 4);
+    if (magic == NULL || memcmp(magic, CACHE_MAGIC, 4) != 0 ||
+        read_n(&r, 4) != LILY_CACHE_VERSION ||
+        read_n(&r, 4) != o_return_from_vm + 1)
+        return 0;
+
+    image->source_size = read_n(&r, 8);
+    image->source_hash = read_n(&r, 8);
+
+    if (read_classes(&r, image) == 0)
+        return 0;
+
+    image->builtins = read_array(&r, &image->builtin_count,
+            sizeof(*image->builtins));
+    for (i = 0;i < image->builtin_count && r.ok;i++)
+        image->builtins[i] = read_string(&r, NULL);
+
+    if (r.ok == 0 || read_literals(&r, image) == 0)
+        return 0;
+
+    image->globals = read_symbols(&r, &image->global_count, 2);
+    image->funcs = read_symbols(&r, &image->func_count, 4);
+    image->main_reg_count = (uint32_t)read_n(&r, 4);
+    image->main_code = read_code(&r, &image->main_code_len);
+
+    if (r.ok == 0 || r.pos != r.end || image->main_reg_count > UINT16_MAX)
+        return 0;
+
+    for (i = 0;i < image->global_count;i++) {
+        if (image->globals[i].spot >= image->main_reg_count)
+            return 0;
+    }
+
+    /* Toplevel functions are looked up through the readonly table. */
+    for (i = 0;i < image->func_count;i++) {
+        uint32_t spot = image->funcs[i].spot;
+        if (spot < LITERAL_BASE ||
+            spot >= LITERAL_BASE + image->literal_count ||
+            image->literals[spot - LITERAL_BASE].kind != 'n')
+            return 0;
+    }
+
+    return 1;
+}
+
+static unsigned char *read_cache_file(const char *path, uint32_t *size)
+{
+    FILE *f = fopen(path, "rb");
+    if (f == NULL)
+        return NULL;
+
+    unsigned char *result = NULL;
+    long file_size;
+
+    if (fseek(f, 0, SEEK_END) == 0 &&
+        (file_size = ftell(f)) > 0 &&
+        file_size < INT32_MAX &&
+        fseek(f, 0, SEEK_SET) == 0) {
+        result = lily_malloc(file_size);
+
+        if (fread(result, 1, file_size, f) == (size_t)file_size)
+            *size = (uint32_t)file_size;
+        else {
+            lily_free(result);
+            result = NULL;
+        }
+    }
+
+    fclose(f);
+    return result;
+}
+
+static void free_image(cache_image *image)
+{
+    lily_free(image->classes);
+    lily_free(image->builtins);
+    lily_free(image->literals);
+    lily_free(image->globals);
+    lily_free(image->funcs);
+}
+
+/***
+ *     __     __        _  __
+ *     \ \   / /__ _ __(_)/ _|_   _
+ *      \ \ / / _ \ '__| | |_| | | |
+ *       \ V /  __/ |  | |  _| |_| |
+ *        \_/ \___|_|  |_|_|  \__, |
+ *                            |___/
+ */
+
+/** The vm trusts that code came from the emitter. It doesn't check registers,
+    table indexes, or jumps, so code from a cache has to be checked before it
+    runs. Every instruction is walked with lily_code_iter, which gives where it
+    starts and how long it is. The operands are then checked by what the vm does
+    with them. Jumps are checked last, once the start of every instruction is
+    known.
+    Classes declared before the cache's classes are builtin ones, so this runs
+    after the builtin items of the cache have been dynaloaded.
+    Some operands depend on what a register holds at runtime. Those are held to
+    the largest that the cache could need: a property index to the most
+    properties any class has, and an upvalue index to the largest closure that
+    any function makes.
+    None of this checks what type of value a register holds. This keeps a
+    damaged cache from running, but isn't a defense against one that was made
+    to do harm (anyone that can write the cache can write the source too). **/
+
+/* The iterator reads up to the count of a variable-size instruction before the
+   size is known. The code is copied into a buffer with this much room after it,
+   so a broken instruction at the end doesn't read past the buffer. */
+#define CODE_PAD 8
+
+typedef struct {
+    lily_parse_state *parser;
+    cache_image *image;
+    uint16_t *code;
+    /* 1 for each spot in the code where an instruction starts. */
+    unsigned char *starts;
+    uint32_t size;
+    uint32_t reg_count;
+    /* __main__ is given o_return_from_vm when it runs. It can fall off of the
+       end, and jumps can target the spot where that will be. */
+    uint32_t is_main;
+    uint32_t max_props;
+    /* The largest closure made, and the highest upvalue used plus one. */
+    uint32_t closure_size;
+    uint32_t upvalue_need;
+} code_check;
+
+static lily_class *find_builtin_class(lily_symtab *symtab, uint16_t id)
+{
+    lily_class *class_iter = symtab->builtin_module->class_chain;
+
+    for (;class_iter;class_iter = class_iter->next) {
+        if (class_iter->id == id)
+            return class_iter;
+
+        if (class_iter->flags & CLS_ENUM_IS_SCOPED) {
+            int i;
+            for (i = 0;i < class_iter->variant_size;i++) {
+                lily_class *v = (lily_class *)class_iter->variant_members[i];
+                if (v->id == id)
+                    return v;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/* Returns the kind of the class with the given id ('c', 'e', or 'v'), or 0 if
+   there is no class with that id. */
+static char class_kind_of(code_check *check, uint32_t id)
+{
+    cache_image *image = check->image;
+
+    if (id >= image->class_start) {
+        if (id - image->class_start >= image->class_count)
+            return 0;
+
+        return image->classes[id - image->class_start].kind;
+    }
+
+    lily_class *cls = find_builtin_class(check->parser->symtab, (uint16_t)id);
+    if (cls == NULL)
+        return 0;
+
+    return class_kind(cls);
+}
+
+static uint32_t variant_count_of(code_check *check, uint32_t enum_id)
+{
+    cache_image *image = check->image;
+    uint32_t count = 0;
+
+    if (enum_id >= image->class_start) {
+        uint32_t i;
+
+        for (i = enum_id - image->class_start + 1;i < image->class_count;i++) {
+            if (image->classes[i].kind != 'v')
+                break;
+
+            count++;
+        }
+    }
+    else {
+        lily_class *cls = find_builtin_class(check->parser->symtab,
+                (uint16_t)enum_id);
+        count = cls->variant_size;
+    }
+
+    return count;
+}
+
+/* Returns the kind of the readonly entry at 'index' (see cache_literal), or 0
+   if there isn't one. __main__ is the first entry. */
+static char readonly_kind_of(code_check *check, uint32_t index)
+{
+    if (index < LITERAL_BASE)
+        return 'n';
+
+    index -= LITERAL_BASE;
+    if (index >= check->image->literal_count)
+        return 0;
+
+    return check->image->literals[index].kind;
+}
+
+static void need_upvalues(code_check *check, uint16_t *c, int start,
+        int count)
+{
+    int i;
+
+    for (i = start;i < start + count;i++) {
+        if (c[i] >= check->upvalue_need)
+            check->upvalue_need = c[i] + 1u;
+    }
+}
+
+static int regs_ok(code_check *check, uint16_t *c, int start, int count)
+{
+    int i;
+
+    for (i = start;i < start + count;i++) {
+        if (c[i] >= check->reg_count)
+            return 0;
+    }
+
+    return 1;
+}
+
+/* Calls to a native function put the arguments into the registers of that
+   function, so it must have at least that many. */
+static int call_ok(code_check *check, uint16_t *c)
+{
+    uint16_t opcode = c[0];
+    char kind;
+
+    if (opcode == o_function_call || opcode == o_function_tail_call)
+        return regs_ok(check, c, 2, 1);
+
+    kind = readonly_kind_of(check, c[2]);
+
+    if (opcode == o_foreign_call)
+        return kind == 'f';
+
+    return kind == 'n' && c[2] >= LITERAL_BASE &&
+           check->image->literals[c[2] - LITERAL_BASE].reg_count >= c[3];
+}
+
+/* Check the operands of the instruction at 'c', which has 'left' words before
+   the code ends. Variable-size instructions check their count against 'left',
+   so that the size that the iterator found can be trusted after. */
+static int operands_ok(code_check *check, uint16_t *c, uint32_t left)
+{
+    cache_image *image = check->image;
+    uint32_t count;
+    char kind;
+
+    switch ((lily_opcode)c[0]) {
+        case o_fast_assign:
+        case o_assign:
+        case o_unary_not:
+        case o_unary_minus:
+            return regs_ok(check, c, 2, 2);
+        case o_integer_add_imm:
+            return regs_ok(check, c, 2, 1) && regs_ok(check, c, 4, 1);
+        case o_integer_add:
+        case o_integer_minus:
+        case o_modulo:
+        case o_integer_mul:
+        case o_integer_div:
+        case o_left_shift:
+        case o_right_shift:
+        case o_bitwise_and:
+        case o_bitwise_or:
+        case o_bitwise_xor:
+        case o_double_add:
+        case o_double_minus:
+        case o_double_mul:
+        case o_double_div:
+        case o_integer_eq:
+        case o_integer_not_eq:
+        case o_integer_less:
+        case o_integer_less_eq:
+        case o_double_eq:
+        case o_double_not_eq:
+        case o_double_less:
+        case o_double_less_eq:
+        case o_string_eq:
+        case o_string_not_eq:
+        case o_string_less:
+        case o_string_less_eq:
+        case o_generic_eq:
+        case o_generic_not_eq:
+        case o_get_item:
+        case o_set_item:
+            return regs_ok(check, c, 2, 3);
+        case o_integer_eq_jump:
+        case o_integer_less_jump:
+        case o_integer_less_eq_jump:
+        case o_double_eq_jump:
+        case o_double_less_jump:
+        case o_double_less_eq_jump:
+            return regs_ok(check, c, 2, 2);
+        case o_integer_eq_imm_jump:
+        case o_integer_less_imm_jump:
+        case o_integer_less_eq_imm_jump:
+        case o_jump_if:
+        case o_return_val:
+        case o_raise:
+            return regs_ok(check, c, 2, 1);
+        case o_jump:
+        case o_push_try:
+        case o_pop_try:
+        case o_return_unit:
+        case o_return_from_vm:
+            return 1;
+        case o_get_global:
+            return c[2] < image->main_reg_count && regs_ok(check, c, 3, 1);
+        case o_set_global:
+            return regs_ok(check, c, 2, 1) && c[3] < image->main_reg_count;
+        case o_get_readonly:
+            return readonly_kind_of(check, c[2]) && regs_ok(check, c, 3, 1);
+        case o_get_integer:
+        case o_get_boolean:
+        case o_get_byte:
+            return regs_ok(check, c, 3, 1);
+        case o_get_upvalue:
+        case o_set_upvalue:
+            need_upvalues(check, c, 2, 1);
+            return regs_ok(check, c, 3, 1);
+        case o_create_closure:
+            if (c[2] > check->closure_size)
+                check->closure_size = c[2];
+
+            return regs_ok(check, c, 3, 1);
+        case o_get_empty_variant:
+            return class_kind_of(check, c[2]) == 'v' &&
+                   regs_ok(check, c, 3, 1);
+        case o_new_instance_basic:
+        case o_new_instance_speculative:
+        case o_new_instance_tagged:
+            return class_kind_of(check, c[2]) == 'c' &&
+                   regs_ok(check, c, 3, 1);
+        case o_dynamic_cast:
+            kind = class_kind_of(check, c[2]);
+            return (kind == 'c' || kind == 'e') && regs_ok(check, c, 3, 2);
+        case o_get_property:
+        case o_set_property:
+        case o_load_class_closure:
+            return c[2] < check->max_props && regs_ok(check, c, 3, 2);
+        case o_create_function:
+            return regs_ok(check, c, 1, 1) &&
+                   readonly_kind_of(check, c[2]) == 'n' &&
+                   regs_ok(check, c, 3, 1);
+        case o_for_setup:
+        case o_integer_for:
+            return regs_ok(check, c, 2, 4);
+        case o_native_call:
+        case o_tail_call:
+        case o_foreign_call:
+        case o_function_call:
+        case o_function_tail_call:
+            count = c[3];
+            return count + 5 <= left && call_ok(check, c) &&
+                   regs_ok(check, c, 4, count + 1);
+        case o_build_enum:
+            if (class_kind_of(check, c[2]) != 'v')
+                return 0;
+        case o_build_list:
+        case o_build_tuple:
+        case o_build_hash:
+            count = c[3];
+            return count + 5 <= left && regs_ok(check, c, 4, count + 1);
+        case o_variant_decompose:
+            count = c[3];
+            return count + 4 <= left && regs_ok(check, c, 2, 1) &&
+                   regs_ok(check, c, 4, count);
+        case o_interpolation:
+            count = c[2];
+            return count + 4 <= left && regs_ok(check, c, 3, count + 1);
+        case o_load_closure:
+            count = c[2];
+            if (count + 4 > left)
+                return 0;
+
+            need_upvalues(check, c, 3, count);
+            return regs_ok(check, c, 3 + count, 1);
+        case o_match_dispatch:
+            /* The vm takes the jump at the variant's id minus [3]. */
+            count = c[4];
+            return count + 5 <= left && regs_ok(check, c, 2, 1) &&
+                   c[3] != 0 && class_kind_of(check, c[3] - 1u) == 'e' &&
+                   variant_count_of(check, c[3] - 1u) == count;
+        case o_optarg_dispatch:
+            /* This reads down from [1], one register for each jump but the
+               last. */
+            count = c[2];
+            return count + 3 <= left && count != 0 &&
+                   regs_ok(check, c, 1, 1) && count <= c[1] + 2u;
+        case o_except_catch:
+        case o_except_ignore:
+            return class_kind_of(check, c[2]) == 'c' &&
+                   regs_ok(check, c, 3, 1);
+        case o_render_content:
+            kind = readonly_kind_of(check, c[1]);
+            return kind == 's' || kind == 'b';
+    }
+
+    return 0;
+}
+
+static int is_except(uint16_t opcode)
+{
+    return opcode == o_except_catch || opcode == o_except_ignore;
+}
+
+static int jumps_ok(code_check *check, lily_code_iter *ci)
+{
+    uint16_t *code = check->code;
+    uint32_t end = check->size + check->is_main;
+    int i;
+
+    for (i = 0;i < ci->jumps_7;i++) {
+        int16_t distance = (int16_t)code[ci->offset + ci->round_total -
+                ci->jumps_7 + i];
+        int64_t target = (int64_t)ci->offset + distance;
+
+        /* The last handler of a try ends the chain with a 0. */
+        if (distance == 0 && is_except(ci->opcode))
+            continue;
+
+        if (target < 0 || target >= end || check->starts[target] == 0)
+            return 0;
+
+        /* When an exception is raised, the vm follows these to find the
+           handlers. */
+        if ((ci->opcode == o_push_try || is_except(ci->opcode)) &&
+            (target == check->size || is_except(code[target]) == 0))
+            return 0;
+    }
+
+    return 1;
+}
+
+static int code_ok(code_check *check, const unsigned char *data, uint32_t size)
+{
+    uint16_t *code = check->code;
+    lily_code_iter ci;
+    uint16_t last_op = o_return_unit;
+    uint32_t i;
+
+    if (size > UINT16_MAX || (size == 0 && check->is_main == 0))
+        return 0;
+
+    for (i = 0;i < size;i++)
+        code[i] = (uint16_t)(data[i * 2] | (data[i * 2 + 1] << 8));
+
+    memset(code + size, 0, CODE_PAD * sizeof(*code));
+    memset(check->starts, 0, size + 1);
+    check->size = size;
+
+    /* The spot after the end is only a valid target for __main__. */
+    check->starts[size] = 1;
+
+    lily_ci_init(&ci, code, 0, (uint16_t)size);
+
+    while (ci.offset + ci.round_total != size) {
+        uint32_t left = size - ci.offset - ci.round_total;
+
+        if (lily_ci_next(&ci) == 0 ||
+            operands_ok(check, code + ci.offset, left) == 0 ||
+            ci.round_total > left)
+            return 0;
+
+        check->starts[ci.offset] = 1;
+        last_op = ci.opcode;
+    }
+
+    if (check->is_main == 0 && lily_ci_falls_through(last_op))
+        return 0;
+
+    lily_ci_init(&ci, code, 0, (uint16_t)size);
+
+    while (lily_ci_next(&ci)) {
+        if (jumps_ok(check, &ci) == 0)
+            return 0;
+    }
+
+    return 1;
+}
+
+/* Check the code of __main__ and of each native function in the cache. */
+static int all_code_ok(lily_parse_state *parser, cache_image *image)
+{
+    uint32_t max_size = image->main_code_len;
+    uint32_t i;
+    int ok;
+
+    for (i = 0;i < image->literal_count;i++) {
+        cache_literal *lit = &image->literals[i];
+        if (lit->kind == 'n' && lit->size > max_size)
+            max_size = lit->size;
+    }
+
+    if (max_size > UINT16_MAX)
+        return 0;
+
+    code_check check;
+    lily_class *class_iter = parser->symtab->builtin_module->class_chain;
+
+    check.max_props = 0;
+
+    for (;class_iter;class_iter = class_iter->next) {
+        if (class_iter->item_kind != ITEM_TYPE_VARIANT &&
+            class_iter->prop_count > check.max_props)
+            check.max_props = class_iter->prop_count;
+    }
+
+    for (i = 0;i < image->class_count;i++) {
+        if (image->classes[i].prop_count > check.max_props)
+            check.max_props = image->classes[i].prop_count;
+    }
+
+    check.parser = parser;
+    check.image = image;
+    check.closure_size = 0;
+    check.upvalue_need = 0;
+    check.code = lily_malloc((max_size + CODE_PAD) * sizeof(*check.code));
+    check.starts = lily_malloc(max_size + 1);
+    check.reg_count = image->main_reg_count;
+    check.is_main = 1;
+
+    ok = code_ok(&check, image->main_code, image->main_code_len);
+    check.is_main = 0;
+
+    for (i = 0;i < image->literal_count && ok;i++) {
+        cache_literal *lit = &image->literals[i];
+        if (lit->kind != 'n')
+            continue;
+
+        check.reg_count = lit->reg_count;
+        ok = code_ok(&check, lit->data, lit->size);
+    }
+
+    ok = ok && check.upvalue_need <= check.closure_size;
+
+    lily_free(check.code);
+    lily_free(check.starts);
+    return ok;
+}
+
+/***
+ *      _                    _
+ *     | |    ___   __ _  __| |
+ *     | |   / _ \ / _` |/ _` |
+ *     | |__| (_) | (_| | (_| |
+ *     |_____\___/ \__,_|\__,_|
+ *
+ */
+
+static int is_class_item(lily_item *item)
+{
+    return item != NULL &&
+           item->item_kind != ITEM_TYPE_VAR &&
+           item->item_kind != ITEM_TYPE_VARIANT;
+}
+
+static lily_var *load_foreign_func(lily_parse_state *parser,
+        cache_literal *lit)
+{
+    lily_item *item;
+
+    if (lit->class_name) {
+        lily_item *cls = lily_find_or_dl_builtin(parser, lit->class_name);
+        if (is_class_item(cls) == 0)
+            return NULL;
+
+        item = lily_find_or_dl_member(parser, (lily_class *)cls, lit->name);
+    }
+    else
+        item = lily_find_or_dl_builtin(parser, lit->name);
+
+    if (item == NULL || item->item_kind != ITEM_TYPE_VAR ||
+        (((lily_var *)item)->flags & VAR_IS_FOREIGN_FUNC) == 0)
+        return NULL;
+
+    return (lily_var *)item;
+}
+
+static void load_native_func(lily_parse_state *parser, cache_literal *lit)
+{
+    lily_function_val *f = new_native_function_val((char *)lit->class_name,
+            (char *)lit->name);
+    uint16_t *code = lily_malloc(lit->size * sizeof(*code));
+    uint32_t i;
+
+    for (i = 0;i < lit->size;i++)
+        code[i] = (uint16_t)(lit->data[i * 2] | (lit->data[i * 2 + 1] << 8));
+
+    f->code = code;
+    f->code_len = (uint16_t)lit->size;
+    f->reg_count = lit->reg_count;
+    f->line_num = lit->line_num;
+    f->module = parser->main_module;
+
+    if (lit->docstring) {
+        f->docstring = lily_malloc(strlen(lit->docstring) + 1);
+        strcpy(f->docstring, lit->docstring);
+    }
+
+    /* This is what symtab does to store a function. */
+    lily_value *v = lily_malloc(sizeof(*v));
+    v->flags = LILY_FUNCTION_ID;
+    v->value.function = f;
+
+    lily_vs_push(parser->symtab->literals, v);
+}
+
+/* Rebuild the readonly table, one entry at a time. Builtin functions are
+   dynaloaded by name, which also loads whatever they need. Every step must land
+   in the spot that the cache says it does. */
+static int load_literals(lily_parse_state *parser, cache_image *image)
+{
+    lily_symtab *symtab = parser->symtab;
+    lily_value_stack *literals = symtab->literals;
+    uint32_t i;
+
+    for (i = 0;i < image->literal_count;i++) {
+        cache_literal *lit = &image->literals[i];
+        uint32_t spot = LITERAL_BASE + i;
+        uint32_t reg_spot = 0;
+        lily_literal *l;
+        lily_var *var;
+
+        switch (lit->kind) {
+            case 'i':
+                reg_spot = lily_get_integer_literal(symtab,
+                        lit->integer)->reg_spot;
+                break;
+            case 'd':
+                reg_spot = lily_get_double_literal(symtab,
+                        lit->doubleval)->reg_spot;
+                break;
+            case 's':
+                l = lily_get_string_literal(symtab, (const char *)lit->data);
+                if (l->value.string->size != lit->size)
+                    return 0;
+
+                reg_spot = l->reg_spot;
+                break;
+            case 'b':
+                reg_spot = lily_get_bytestring_literal(symtab,
+                        (const char *)lit->data, lit->size)->reg_spot;
+                break;
+            case 'n':
+                load_native_func(parser, lit);
+                reg_spot = spot;
+                break;
+            case 'f':
+                var = load_foreign_func(parser, lit);
+                if (var == NULL)
+                    return 0;
+
+                reg_spot = var->reg_spot;
+                break;
+        }
+
+        if (reg_spot != spot || lily_vs_pos(literals) != spot + 1)
+            return 0;
+    }
+
+    return 1;
+}
+
+/* Dynaload builtin vars (such as stdout), and check that each one pushed one
+   value for the vm. Spots are fixed later, once nothing can fail. */
+static int load_globals(lily_parse_state *parser, cache_image *image,
+        lily_var **vars, lily_literal **values)
+{
+    lily_value_stack *foreign_values = parser->foreign_values;
+    uint32_t i;
+
+    for (i = 0;i < image->global_count;i++) {
+        uint32_t pos = lily_vs_pos(foreign_values);
+        lily_item *item = lily_find_or_dl_builtin(parser,
+                image->globals[i].name);
+
+        if (item == NULL || item->item_kind != ITEM_TYPE_VAR ||
+            lily_vs_pos(foreign_values) != pos + 1)
+            return 0;
+
+        vars[i] = (lily_var *)item;
+        values[i] = (lily_literal *)lily_vs_nth(foreign_values, pos);
+    }
+
+    return 1;
+}
+
+static lily_class *find_builtin_by_id(lily_symtab *symtab, uint16_t id)
+{
+    lily_class *class_iter = symtab->builtin_module->class_chain;
+
+    for (;class_iter;class_iter = class_iter->next) {
+        if (class_iter->item_kind != ITEM_TYPE_VARIANT &&
+            class_iter->id == id)
+            break;
+    }
+
+    return class_iter;
+}
+
+static void load_classes(lily_parse_state *parser, cache_image *image,
+        lily_class **parents)
+{
+    lily_symtab *symtab = parser->symtab;
+    lily_module_entry *main_module = parser->main_module;
+    lily_class *class_start = main_module->class_chain;
+    uint32_t count = image->class_count;
+    uint32_t start = image->class_start;
+    lily_class **made = lily_malloc((count + 1) * sizeof(*made));
+    uint32_t i;
+
+    symtab->active_module = main_module;
+
+    for (i = 0;i < count;i++) {
+        cache_class *c = &image->classes[i];
+        lily_class *cls;
+
+        if (c->kind == 'v') {
+            lily_class *enum_cls = made[c->parent_id - start];
+            cls = (lily_class *)lily_new_variant_class(symtab, enum_cls,
+                    c->name);
+            cls->flags = c->flags;
+
+            if (i + 1 == count || image->classes[i + 1].kind != 'v' ||
+                image->classes[i + 1].parent_id != c->parent_id) {
+                uint16_t enum_flags = enum_cls->flags;
+                lily_finish_enum(symtab, enum_cls,
+                        enum_flags & CLS_ENUM_IS_SCOPED, NULL);
+                enum_cls->flags = enum_flags;
+            }
+        }
+        else {
+            if (c->kind == 'e')
+                cls = lily_new_enum_class(symtab, c->name);
+            else
+                cls = lily_new_class(symtab, c->name);
+
+            cls->flags = c->flags;
+            cls->prop_count = c->prop_count;
+            cls->inherit_depth = c->inherit_depth;
+
+            if (c->parent_id >= start)
+                cls->parent = made[c->parent_id - start];
+            else if (c->parent_id)
+                cls->parent = parents[i];
+        }
+
+        made[i] = cls;
+    }
+
+    lily_free(made);
+
+    /* The vm needs these classes, but the parser only has their names. Hide
+       them, so that later parses don't find classes without any members. */
+    lily_register_classes(symtab, parser->vm);
+    lily_rewind_symtab(symtab, main_module, class_start,
+            main_module->var_chain, 0);
+}
+
+/* This is called by parser for the first file that it loads. If there's a cache
+   for that file that matches it, then the cache is loaded into the interpreter
+   and 1 is returned. The parser then runs __main__ as usual.
+   If this returns 0, then the parser should parse the file. The interpreter may
+   have more literals or builtin items loaded, but those don't interfere with
+   parsing. */
+int lily_load_cache(lily_parse_state *parser, const char *filename)
+{
+    lily_symtab *symtab = parser->symtab;
+    lily_emit_state *emit = parser->emit;
+    uint64_t source_size, source_hash;
+    uint32_t buffer_size = 0;
+    char *path = cache_path_for(filename);
+    unsigned char *buffer = read_cache_file(path, &buffer_size);
+
+    lily_free(path);
+
+    if (buffer == NULL)
+        return 0;
+
+    cache_image image;
+    memset(&image, 0, sizeof(image));
+
+    if (read_image(buffer, buffer_size, &image) == 0 ||
+        lily_cache_identify_file(filename, &source_size, &source_hash) == 0 ||
+        image.source_size != source_size ||
+        image.source_hash != source_hash ||
+        image.class_start != symtab->next_class_id ||
+        lily_vs_pos(symtab->literals) != LITERAL_BASE ||
+        lily_u16_pos(emit->code) != 0 ||
+        parser->main_module->class_chain != NULL) {
+        free_image(&image);
+        lily_free(buffer);
+        return 0;
+    }
+
+    uint32_t count = image.global_count + image.class_count + 1;
+    lily_var **global_vars = lily_malloc(count * sizeof(*global_vars));
+    lily_literal **global_values = lily_malloc(count * sizeof(*global_values));
+    lily_class **parents = lily_malloc(count * sizeof(*parents));
+    uint32_t literal_end = LITERAL_BASE + image.literal_count;
+    uint32_t i;
+    int ok = load_literals(parser, &image);
+
+    for (i = 0;i < image.builtin_count && ok;i++) {
+        lily_item *item = lily_find_or_dl_builtin(parser, image.builtins[i]);
+        ok = (item != NULL && item->item_kind != ITEM_TYPE_VAR);
+    }
+
+    ok = ok && load_globals(parser, &image, global_vars, global_values);
+
+    for (i = 0;i < image.class_count && ok;i++) {
+        cache_class *c = &image.classes[i];
+        if (c->kind == 'c' && c->parent_id &&
+            c->parent_id < image.class_start) {
+            parents[i] = find_builtin_by_id(symtab, c->parent_id);
+            ok = (parents[i] != NULL);
+        }
+    }
+
+    /* Dynaloads after the literals must not have added any. */
+    ok = ok && lily_vs_pos(symtab->literals) == literal_end;
+    ok = ok && all_code_ok(parser, &image);
+
+    if (ok) {
+        for (i = 0;i < image.global_count;i++) {
+            uint16_t spot = (uint16_t)image.globals[i].spot;
+            global_vars[i]->reg_spot = spot;
+            global_values[i]->reg_spot = spot;
+        }
+
+        load_classes(parser, &image, parents);
+
+        lily_buffer_u16 *code = emit->code;
+        lily_u16_write_prep(code, image.main_code_len + 1);
+
+        for (i = 0;i < image.main_code_len;i++) {
+            const unsigned char *p = image.main_code + (i * 2);
+            lily_u16_write_1(code, (uint16_t)(p[0] | (p[1] << 8)));
+        }
+
+        emit->main_block->next_reg_spot = (uint16_t)image.main_reg_count;
+    }
+
+    lily_free(global_vars);
+    lily_free(global_values);
+    lily_free(parents);
+
+    /* Once anything has been loaded, there may be functions pointing into the
+       buffer. Keep it with the state, even if the cache was not used. */
+    lily_cache *cache = lily_malloc(sizeof(*cache));
+    cache->buffer = buffer;
+    cache->funcs = NULL;
+    cache->func_count = 0;
+
+    if (ok) {
+        cache->funcs = image.funcs;
+        cache->func_count = image.func_count;
+        image.funcs = NULL;
+    }
+
+    parser->cache = cache;
+    free_image(&image);
+    return ok;
+}
+
+lily_function_val *lily_cache_find_func(lily_cache *cache, lily_vm_state *vm,
+        const char *name)
+{
+    uint32_t i;
+
+    for (i = 0;i < cache->func_count;i++) {
+        if (strcmp(cache->funcs[i].name, name) == 0)
+            return vm->readonly_table[cache->funcs[i].spot]->value.function;
+    }
+
+    return NULL;
+}
+
+void lily_free_cache(lily_cache *cache)
+{
+    if (cache == NULL)
+        return;
+
+    lily_free(cache->funcs);
+    lily_free(cache->buffer);
+    lily_free(cache);
+}
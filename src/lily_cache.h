@@ -0,0 +1,17 @@
+#ifndef LILY_CACHE_H
+# define LILY_CACHE_H
+
+# include "lily_parser.h"
+
+struct lily_cache_;
+
+int lily_load_cache(lily_parse_state *, const char *);
+void lily_write_cache(lily_parse_state *, const char *);
+lily_function_val *lily_cache_find_func(struct lily_cache_ *, lily_vm_state *,
+        const char *);
+void lily_free_cache(struct lily_cache_ *);
+
+int lily_cache_identify_file(const char *, uint64_t *, uint64_t *);
+void lily_cache_identify_string(const char *, uint64_t *, uint64_t *);
+
+#endif
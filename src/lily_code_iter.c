@@ -25,6 +25,24 @@ void lily_ci_from_native(lily_code_iter *iter, lily_function_val *fv)
     iter->round_total = 0;
 }
 
+/* Returns 0 if an instruction with this opcode never goes on to the one after
+   it (jumps, returns, raise, and the dispatches). */
+int lily_ci_falls_through(uint16_t opcode)
+{
+    switch (opcode) {
+        case o_jump:
+        case o_return_val:
+        case o_return_unit:
+        case o_raise:
+        case o_match_dispatch:
+        case o_optarg_dispatch:
+        case o_return_from_vm:
+            return 0;
+        default:
+            return 1;
+    }
+}
+
 int lily_ci_next(lily_code_iter *iter)
 {
     iter->offset += iter->round_total;
@@ -63,16 +81,32 @@ int lily_ci_next(lily_code_iter *iter)
         case o_double_minus:
         case o_double_mul:
         case o_double_div:
-        case o_is_equal:
-        case o_not_eq:
-        case o_less:
-        case o_less_eq:
-        case o_greater:
-        case o_greater_eq:
+        case o_integer_eq:
+        case o_integer_not_eq:
+        case o_integer_less:
+        case o_integer_less_eq:
+        case o_double_eq:
+        case o_double_not_eq:
+        case o_double_less:
+        case o_double_less_eq:
+        case o_string_eq:
+        case o_string_not_eq:
+        case o_string_less:
+        case o_string_less_eq:
+        case o_generic_eq:
+        case o_generic_not_eq:
             iter->line = 1;
             iter->inputs_3 = 2;
             iter->outputs_5 = 1;
 
+            iter->round_total = 5;
+            break;
+        case o_integer_add_imm:
+            iter->line = 1;
+            iter->inputs_3 = 1;
+            iter->special_4 = 1;
+            iter->outputs_5 = 1;
+
             iter->round_total = 5;
             break;
         case o_jump:
@@ -87,9 +121,33 @@ int lily_ci_next(lily_code_iter *iter)
 
             iter->round_total = 4;
             break;
+        case o_integer_eq_jump:
+        case o_integer_less_jump:
+        case o_integer_less_eq_jump:
+        case o_double_eq_jump:
+        case o_double_less_jump:
+        case o_double_less_eq_jump:
+            iter->special_1 = 1;
+            iter->inputs_3 = 2;
+            iter->jumps_7 = 1;
+
+            iter->round_total = 5;
+            break;
+        case o_integer_eq_imm_jump:
+        case o_integer_less_imm_jump:
+        case o_integer_less_eq_imm_jump:
+            iter->special_1 = 1;
+            iter->inputs_3 = 1;
+            iter->special_4 = 1;
+            iter->jumps_7 = 1;
+
+            iter->round_total = 5;
+            break;
         case o_native_call:
+        case o_tail_call:
         case o_foreign_call:
         case o_function_call:
+        case o_function_tail_call:
             iter->line = 1;
             iter->special_1 = 1;
             iter->counter_2 = 1;
@@ -119,13 +177,6 @@ int lily_ci_next(lily_code_iter *iter)
             break;
         case o_build_list:
         case o_build_tuple:
-            iter->line = 1;
-            iter->counter_2 = 1;
-            iter->inputs_3 = buffer[2];
-            iter->outputs_5 = 1;
-
-            iter->round_total = buffer[2] + 4;
-            break;
         case o_build_hash:
             iter->line = 1;
             iter->special_1 = 1;
@@ -262,6 +313,11 @@ int lily_ci_next(lily_code_iter *iter)
 
             iter->round_total = 4;
             break;
+        case o_render_content:
+            iter->special_1 = 1;
+
+            iter->round_total = 2;
+            break;
         case o_optarg_dispatch:
             iter->special_1 = 1;
             iter->counter_2 = 1;
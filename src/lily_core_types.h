@@ -415,7 +415,8 @@ typedef struct lily_module_entry_ {
 #define LILY_ASSERTIONERROR_ID 26
 
 #define LILY_UNIT_ID       27
-#define START_CLASS_ID     28
+#define LILY_STRINGBUILDER_ID 28
+#define START_CLASS_ID     29
 
 /* Instances of these are never made, so these ids will never be seen by vm. */
 #define LILY_SELF_ID       65529
@@ -34,7 +34,6 @@ extern lily_type *lily_unit_type;
 
 static lily_storage_stack *new_storage_stack(int);
 static void free_storage_stack(lily_storage_stack *);
-lily_function_val *new_native_function_val(char *, char *);
 lily_function_val *new_foreign_function_val(lily_foreign_func, const char *,
         const char *);
 
@@ -49,6 +48,8 @@ lily_emit_state *lily_new_emit_state(lily_symtab *symtab, lily_raiser *raiser)
             symtab->question_class->self_type);
     emit->code = lily_new_buffer_u16(32);
     emit->closure_aux_code = NULL;
+    emit->optimizer = NULL;
+    emit->optimize = 1;
 
     emit->storages = new_storage_stack(4);
 
@@ -106,6 +107,8 @@ void lily_free_emit_state(lily_emit_state *emit)
     lily_free(emit->match_cases);
     if (emit->closure_aux_code)
         lily_free_buffer_u16(emit->closure_aux_code);
+    if (emit->optimizer)
+        lily_free_optimizer(emit->optimizer);
     lily_free_buffer_u16(emit->patches);
     lily_free_buffer_u16(emit->code);
     lily_free(emit);
@@ -543,10 +546,121 @@ void lily_emit_except(lily_emit_state *emit, lily_type *except_type,
     lily_u16_write_1(emit->patches, lily_u16_pos(emit->code) - 1);
 }
 
+/* If the last instruction written is 'o_get_integer' into 'sym', remove it and
+   give back the value that it loaded. The caller uses the value directly. */
+static int take_integer_load(lily_emit_state *emit, lily_sym *sym,
+        uint16_t *value)
+{
+    uint16_t pos = lily_u16_pos(emit->code);
+
+    if (pos < 4)
+        return 0;
+
+    uint16_t *code = emit->code->data + pos - 4;
+
+    if (code[0] != o_get_integer || code[3] != sym->reg_spot)
+        return 0;
+
+    *value = code[2];
+    lily_u16_set_pos(emit->code, pos - 4);
+    return 1;
+}
+
+/* Most conditions are a comparison of two Integer or Double values, written to
+   a Boolean just for o_jump_if to test. If that comparison is the last thing
+   written, this replaces it with an opcode that compares and jumps. If either
+   side is an Integer literal, the value goes into the code too. */
+static int emit_compare_jump(lily_emit_state *emit, lily_ast *ast, int jump_on)
+{
+    while (ast->tree_type == tree_parenth)
+        ast = ast->arg_start;
+
+    uint16_t pos = lily_u16_pos(emit->code);
+
+    if (ast->tree_type != tree_binary ||
+        ast->op < expr_eq_eq || ast->op > expr_not_eq ||
+        pos < 5)
+        return 0;
+
+    uint16_t *code = emit->code->data + pos - 5;
+    uint16_t lhs = code[2], rhs = code[3];
+    int opcode;
+
+    if (code[4] != ast->result->reg_spot)
+        return 0;
+
+    switch (code[0]) {
+        case o_integer_not_eq:
+            jump_on = !jump_on;
+        case o_integer_eq:
+            opcode = o_integer_eq_jump;
+            break;
+        case o_integer_less:
+            opcode = o_integer_less_jump;
+            break;
+        case o_integer_less_eq:
+            opcode = o_integer_less_eq_jump;
+            break;
+        case o_double_not_eq:
+            jump_on = !jump_on;
+        case o_double_eq:
+            opcode = o_double_eq_jump;
+            break;
+        case o_double_less:
+            opcode = o_double_less_jump;
+            break;
+        case o_double_less_eq:
+            opcode = o_double_less_eq_jump;
+            break;
+        default:
+            return 0;
+    }
+
+    lily_u16_set_pos(emit->code, pos - 5);
+
+    lily_sym *literal = NULL;
+    uint16_t value;
+
+    if (opcode <= o_integer_less_eq_jump && lhs != rhs) {
+        if (ast->right->tree_type == tree_integer &&
+            take_integer_load(emit, ast->right->result, &value))
+            literal = ast->right->result;
+        else if (ast->left->tree_type == tree_integer &&
+                 take_integer_load(emit, ast->left->result, &value))
+            literal = ast->left->result;
+    }
+
+    if (literal) {
+        if (literal->reg_spot == lhs) {
+            /* '5 < a' is 'a <= 5' failing, and '5 <= a' is 'a < 5' failing. */
+            if (opcode == o_integer_less_jump) {
+                opcode = o_integer_less_eq_jump;
+                jump_on = !jump_on;
+            }
+            else if (opcode == o_integer_less_eq_jump) {
+                opcode = o_integer_less_jump;
+                jump_on = !jump_on;
+            }
+
+            lhs = rhs;
+        }
+
+        opcode += o_integer_eq_imm_jump - o_integer_eq_jump;
+        rhs = value;
+    }
+
+    lily_u16_write_5(emit->code, opcode, jump_on, lhs, rhs, 4);
+    lily_u16_write_1(emit->patches, lily_u16_pos(emit->code) - 1);
+    return 1;
+}
+
 /* Write a conditional jump. 0 means jump if false, 1 means jump if true. The
    ast is the thing to test. */
 static void emit_jump_if(lily_emit_state *emit, lily_ast *ast, int jump_on)
 {
+    if (emit_compare_jump(emit, ast, jump_on))
+        return;
+
     lily_u16_write_4(emit->code, o_jump_if, jump_on, ast->result->reg_spot, 3);
 
     lily_u16_write_1(emit->patches, lily_u16_pos(emit->code) - 1);
@@ -1348,7 +1462,8 @@ static int count_transforms(lily_emit_state *emit, int start)
     int pos = ci.offset + 1 + ci.line;
     int count = 0;
 
-    if ((op == o_function_call || op == o_match_dispatch) &&
+    if ((op == o_function_call || op == o_function_tail_call ||
+         op == o_match_dispatch) &&
         transform_table[buffer[pos]] != (uint16_t)-1)
         count++;
 
@@ -1365,8 +1480,10 @@ static int count_transforms(lily_emit_state *emit, int start)
     pos += ci.inputs_3 + ci.special_4 + ci.outputs_5;
 
     if (op == o_native_call ||
+        op == o_tail_call ||
         op == o_foreign_call ||
-        op == o_function_call) {
+        op == o_function_call ||
+        op == o_function_tail_call) {
         int i;
         for (i = 0;i < ci.special_6;i++) {
             if (transform_table[buffer[pos + i]] != (uint16_t)-1)
@@ -1561,6 +1678,7 @@ static void perform_closure_transform(lily_emit_state *emit,
                     pos++;
                     break;
                 case o_function_call:
+                case o_function_tail_call:
                 case o_match_dispatch:
                     MAYBE_TRANSFORM_INPUT(pos, o_get_upvalue)
                 default:
@@ -1584,6 +1702,10 @@ static void perform_closure_transform(lily_emit_state *emit,
                 case o_create_function:
                 case o_load_class_closure:
                 case o_load_closure:
+                case o_integer_add_imm:
+                case o_integer_eq_imm_jump:
+                case o_integer_less_imm_jump:
+                case o_integer_less_eq_imm_jump:
                     pos += ci.special_4;
                     break;
                 default:
@@ -1601,8 +1723,10 @@ static void perform_closure_transform(lily_emit_state *emit,
             lily_opcode op = buffer[ci.offset];
             switch (op) {
                 case o_native_call:
+                case o_tail_call:
                 case o_foreign_call:
                 case o_function_call:
+                case o_function_tail_call:
                     for (i = 0;i < ci.special_6;i++) {
                         MAYBE_TRANSFORM_INPUT(pos + i, o_get_upvalue)
                     }
@@ -1703,6 +1827,30 @@ static void perform_closure_transform(lily_emit_state *emit,
     lily_u16_set_pos(emit->patches, patch_start);
 }
 
+/* This runs the optimizer over the code that a function block is about to
+   get. Only the storages of the function are marked as temporary, since the
+   optimizer will discard writes to them that aren't read. */
+static int optimize_code(lily_emit_state *emit, lily_block *function_block,
+        uint16_t *code, int code_size)
+{
+    lily_storage_stack *stack = emit->storages;
+    int i;
+
+    if (emit->optimizer == NULL)
+        emit->optimizer = lily_new_optimizer();
+
+    lily_opt_prepare(emit->optimizer, function_block->next_reg_spot);
+
+    for (i = function_block->storage_start;i < stack->scope_end;i++) {
+        lily_storage *s = stack->data[i];
+
+        if (s->type)
+            lily_opt_mark_temp(emit->optimizer, s->reg_spot);
+    }
+
+    return lily_opt_run(emit->optimizer, code, code_size);
+}
+
 /* This makes the function value that will be needed by the current code
    block. If the current function is a closure, then the appropriate transform
    is done to it. */
@@ -1733,6 +1881,9 @@ static lily_function_val *create_code_block_for(lily_emit_state *emit,
     code = lily_malloc((code_size + 1) * sizeof(uint16_t));
     memcpy(code, source + code_start, sizeof(uint16_t) * code_size);
 
+    if (emit->optimize)
+        code_size = optimize_code(emit, function_block, code, code_size);
+
     f->code_len = code_size;
     f->code = code;
     return f;
@@ -2067,6 +2218,29 @@ static lily_type *get_subscript_result(lily_emit_state *emit, lily_type *type,
 }
 
 
+/* This returns 1 if values of 'type' can never hold gc tagged data inside of
+   them, 0 otherwise. Containers built from such types don't have to be swept
+   through by the gc. */
+static int type_is_gc_free(lily_type *type)
+{
+    int id = type->cls->id;
+
+    if (id >= LILY_INTEGER_ID && id <= LILY_BOOLEAN_ID)
+        return 1;
+
+    if (id == LILY_LIST_ID || id == LILY_TUPLE_ID || id == LILY_HASH_ID) {
+        int i;
+        for (i = 0;i < type->subtype_count;i++) {
+            if (type_is_gc_free(type->subtypes[i]) == 0)
+                return 0;
+        }
+
+        return 1;
+    }
+
+    return 0;
+}
+
 /* Since o_build_list, o_build_tuple, and o_build_hash are fairly similar (and
    the first two are fairly common), this function writes all of them.
 
@@ -2086,6 +2260,9 @@ static void write_build_op(lily_emit_state *emit, int opcode,
     if (opcode == o_build_hash)
         /* The vm the key's id to decide what hashing functions to use. */
         lily_u16_write_1(emit->code, s->type->subtypes[0]->cls->id);
+    else
+        /* Lists and Tuples of primitives are built without gc speculation. */
+        lily_u16_write_1(emit->code, type_is_gc_free(s->type));
 
     lily_u16_write_1(emit->code, num_values);
 
@@ -2556,6 +2733,40 @@ static void eval_oo_assign(lily_emit_state *emit, lily_ast *ast)
 
 /* This handles simple binary ops (no assign, &&/||, |>, or compounds. This
    assumes that both sides have already been evaluated. */
+/* Each kind of value has opcodes to compare it, so that the vm doesn't need to
+   check. Byte and Boolean are held like Integer, so they use those. Greater
+   forms use a less form, and the caller swaps the sides. Other classes can
+   only be checked for equality. -1 is returned if 'op' can't be done. */
+static int compare_opcode(lily_class *cls, int op)
+{
+    int base;
+
+    if (cls->id == LILY_INTEGER_ID ||
+        cls->id == LILY_BYTE_ID ||
+        cls->id == LILY_BOOLEAN_ID)
+        base = o_integer_eq;
+    else if (cls->id == LILY_DOUBLE_ID)
+        base = o_double_eq;
+    else if (cls->id == LILY_STRING_ID)
+        base = o_string_eq;
+    else if (op == expr_eq_eq)
+        return o_generic_eq;
+    else if (op == expr_not_eq)
+        return o_generic_not_eq;
+    else
+        return -1;
+
+    /* Each group of opcodes has the same order. */
+    if (op == expr_eq_eq)
+        return base;
+    else if (op == expr_not_eq)
+        return base + 1;
+    else if (op == expr_lt || op == expr_gr)
+        return base + 2;
+    else
+        return base + 3;
+}
+
 static void emit_binary_op(lily_emit_state *emit, lily_ast *ast)
 {
     lily_sym *lhs_sym = ast->left->result;
@@ -2607,20 +2818,8 @@ static void emit_binary_op(lily_emit_state *emit, lily_ast *ast)
         else if (ast->op == expr_bitwise_xor &&
                  lhs_class->id == LILY_INTEGER_ID)
             opcode = o_bitwise_xor;
-        else if (ast->op == expr_eq_eq)
-            opcode = o_is_equal;
-        else if (ast->op == expr_lt_eq)
-            opcode = o_less_eq;
-        else if (ast->op == expr_lt)
-            opcode = o_less;
-        else if (ast->op == expr_gr_eq)
-            opcode = o_greater_eq;
-        else if (ast->op == expr_gr)
-            opcode = o_greater;
-        else if (ast->op == expr_eq_eq)
-            opcode = o_is_equal;
-        else if (ast->op == expr_not_eq)
-            opcode = o_not_eq;
+        else if (ast->op >= expr_eq_eq && ast->op <= expr_not_eq)
+            opcode = compare_opcode(lhs_class, ast->op);
     }
 
     if (opcode == -1)
@@ -2661,8 +2860,26 @@ static void emit_binary_op(lily_emit_state *emit, lily_ast *ast)
         s->flags |= SYM_NOT_ASSIGNABLE;
     }
 
-    lily_u16_write_5(emit->code, opcode, ast->line_num, lhs_sym->reg_spot,
-            rhs_sym->reg_spot, s->reg_spot);
+    uint16_t value;
+
+    /* A small literal on the right is given to the instruction directly. */
+    if ((opcode == o_integer_add || opcode == o_integer_minus) &&
+        ast->right->tree_type == tree_integer &&
+        lhs_sym != rhs_sym &&
+        (opcode == o_integer_add || ast->right->backing_value != INT16_MIN) &&
+        take_integer_load(emit, rhs_sym, &value)) {
+        if (opcode == o_integer_minus)
+            value = (uint16_t)-(int16_t)value;
+
+        lily_u16_write_5(emit->code, o_integer_add_imm, ast->line_num,
+                lhs_sym->reg_spot, value, s->reg_spot);
+    }
+    else if (ast->op == expr_gr || ast->op == expr_gr_eq)
+        lily_u16_write_5(emit->code, opcode, ast->line_num, rhs_sym->reg_spot,
+                lhs_sym->reg_spot, s->reg_spot);
+    else
+        lily_u16_write_5(emit->code, opcode, ast->line_num, lhs_sym->reg_spot,
+                rhs_sym->reg_spot, s->reg_spot);
 
     ast->result = (lily_sym *)s;
 }
@@ -3606,7 +3823,8 @@ static void write_varargs(lily_emit_state *emit, lily_emit_call_state *cs,
     lily_storage *s = get_storage(emit, type);
     int count = cs->arg_count - from;
 
-    lily_u16_write_3(emit->code, o_build_list, cs->ast->line_num, count);
+    lily_u16_write_4(emit->code, o_build_list, cs->ast->line_num,
+            type_is_gc_free(type), count);
     write_call_values(emit, cs, from);
     lily_u16_write_1(emit->code, s->reg_spot);
 
@@ -4335,6 +4553,32 @@ void lily_emit_eval_condition(lily_emit_state *emit, lily_expr_state *es)
     }
 }
 
+/* This is called before writing an o_return_val for 'ast'. If 'ast' is a call
+   that was just written, and the result goes right to the return, then the
+   call becomes a tail call. Anything written in between (such
+   as leaving a try block) stops this. The return is still written after, but
+   the vm will not reach it. */
+static void maybe_tail_call(lily_emit_state *emit, lily_ast *ast)
+{
+    if (ast->tree_type == tree_parenth)
+        ast = ast->arg_start;
+
+    if (ast->tree_type != tree_call || ast->maybe_result_pos < 4)
+        return;
+
+    uint16_t *code = emit->code->data;
+    uint16_t start = ast->maybe_result_pos - 4;
+
+    if (code[start + 4] != ast->result->reg_spot ||
+        start + 5 + code[start + 3] != lily_u16_pos(emit->code))
+        return;
+
+    if (code[start] == o_native_call)
+        code[start] = o_tail_call;
+    else if (code[start] == o_function_call)
+        code[start] = o_function_tail_call;
+}
+
 /* This is called from parser to evaluate the last expression that is within a
    lambda. This is rather tricky, because 'full_type' is supposed to describe
    the full type of the lambda, but may be NULL. If it isn't NULL, then use that
@@ -4358,6 +4602,7 @@ void lily_emit_eval_lambda_body(lily_emit_state *emit, lily_expr_state *es,
     if (return_wanted && root_result != NULL) {
         /* If the caller doesn't want a return, then don't give one...regardless
            of if there is one available. */
+        maybe_tail_call(emit, es->root);
         lily_u16_write_3(emit->code, o_return_val, es->root->line_num,
                 es->root->result->reg_spot);
     }
@@ -4386,6 +4631,7 @@ void lily_emit_eval_return(lily_emit_state *emit, lily_expr_state *es)
         }
 
         write_pop_try_blocks_up_to(emit, emit->function_block);
+        maybe_tail_call(emit, ast);
         lily_u16_write_3(emit->code, o_return_val, ast->line_num,
                 ast->result->reg_spot);
         emit->block->last_exit = lily_u16_pos(emit->code);
@@ -4457,8 +4703,14 @@ void lily_emit_raise(lily_emit_state *emit, lily_expr_state *es)
     emit->block->last_exit = lily_u16_pos(emit->code);
 }
 
-/* This resets __main__'s code position for the next pass. Only tagged mode
-   needs this. */
+/* The parser has the text between two template tags, and wants the emitter to
+   write code that renders it. The text is a ByteString literal at 'spot'. */
+void lily_emit_render_content(lily_emit_state *emit, uint16_t spot)
+{
+    lily_u16_write_2(emit->code, o_render_content, spot);
+}
+
+/* This resets __main__'s code position for the next pass. */
 void lily_reset_main(lily_emit_state *emit)
 {
     emit->code->pos = 0;
@@ -7,6 +7,7 @@
 # include "lily_type_maker.h"
 # include "lily_buffer_u16.h"
 # include "lily_string_pile.h"
+# include "lily_optimizer.h"
 
 typedef enum {
     block_if,
@@ -169,6 +170,9 @@ typedef struct {
     /* This is a buffer used when transforming code to build a closure. */
     lily_buffer_u16 *closure_aux_code;
 
+    /* This cleans up the code of functions, and is made when first needed. */
+    lily_optimizer *optimizer;
+
     lily_sym **closed_syms;
 
     uint16_t *transform_table;
@@ -211,7 +215,8 @@ typedef struct {
        implicitly entered before any user code. */
     lily_block *block;
 
-    uint16_t pad2;
+    /* Should finished functions go through the optimizer? */
+    uint16_t optimize;
 
     /* How deep the current functions are. */
     uint16_t function_depth;
@@ -271,6 +276,7 @@ void lily_emit_leave_block(lily_emit_state *);
 void lily_emit_try(lily_emit_state *, int);
 void lily_emit_except(lily_emit_state *, lily_type *, lily_var *, int);
 void lily_emit_raise(lily_emit_state *, lily_expr_state *);
+void lily_emit_render_content(lily_emit_state *, uint16_t);
 
 void lily_emit_setup_call(lily_emit_state *, lily_type *, lily_var *,
         lily_buffer_u16 *, int);
@@ -293,4 +299,7 @@ lily_var *lily_emit_new_dyna_var(lily_emit_state *, lily_module_entry *,
 void lily_free_emit_state(lily_emit_state *);
 void lily_emit_enter_main(lily_emit_state *);
 lily_emit_state *lily_new_emit_state(lily_symtab *, lily_raiser *);
+
+/* Cache loading uses this to rebuild native functions. */
+lily_function_val *new_native_function_val(char *, char *);
 #endif
@@ -7,6 +7,12 @@
    The int prefix of this file means that it is internal, and thus may change
    (whereas an api file tends to be more stable). */
 
+/* Caches (see lily_cache.c) hold code as it was emitted. Bump this whenever an
+   opcode is added, removed, or has the layout of its operands changed (or the
+   layout of the cache itself changes), so that older caches are ignored instead
+   of run. */
+#define LILY_CACHE_VERSION 6
+
 typedef enum {
     /* Perform an assignment, but do not alter refcount. */
     o_fast_assign,
@@ -25,6 +31,9 @@ typedef enum {
     o_bitwise_and,
     o_bitwise_or,
     o_bitwise_xor,
+    /* Add a 16-bit SIGNED value (given in the code) to an Integer. Subtracting
+       a small literal uses this too, with the value negated. */
+    o_integer_add_imm,
 
     /* Integer/Double ops, that aren't as fast as the above ops. */
     o_double_add,
@@ -32,14 +41,26 @@ typedef enum {
     o_double_mul,
     o_double_div,
 
-    /* Comparison operations are general purpose, and work for any two values of
-       the same underlying class. */
-    o_is_equal,
-    o_not_eq,
-    o_less,
-    o_less_eq,
-    o_greater,
-    o_greater_eq,
+    /* Comparisons have an opcode for each kind of value, so that the vm doesn't
+       need to check what it was given. Each group is in the same order. There
+       are no greater forms: The emitter swaps the sides of a less form.
+       The Integer group is also used for Byte and Boolean values. */
+    o_integer_eq,
+    o_integer_not_eq,
+    o_integer_less,
+    o_integer_less_eq,
+    o_double_eq,
+    o_double_not_eq,
+    o_double_less,
+    o_double_less_eq,
+    o_string_eq,
+    o_string_not_eq,
+    o_string_less,
+    o_string_less_eq,
+    /* Equality for any other kind of value. This goes through
+       lily_value_compare, which may raise an error. */
+    o_generic_eq,
+    o_generic_not_eq,
 
     /* Simple unary operations. */
     o_unary_not,
@@ -53,6 +74,22 @@ typedef enum {
        Like o_jump, this may be a negative jump. */
     o_jump_if,
 
+    /* These compare two values and jump if the result matches the check value,
+       like o_jump_if does. They replace a comparison into a Boolean that is
+       then only given to o_jump_if. There are no greater forms: The emitter
+       swaps the sides, or (for immediates) flips the check value. */
+    o_integer_eq_jump,
+    o_integer_less_jump,
+    o_integer_less_eq_jump,
+    /* These are like the above, except the right side is a 16-bit SIGNED value
+       in the code. */
+    o_integer_eq_imm_jump,
+    o_integer_less_imm_jump,
+    o_integer_less_eq_imm_jump,
+    o_double_eq_jump,
+    o_double_less_jump,
+    o_double_less_eq_jump,
+
     /* Perform a single step of a for loop. This may jump out of the loop, or it
        may only increment and continue on. */
     o_integer_for,
@@ -67,21 +104,29 @@ typedef enum {
     /* This is a call to a function that is always native. The value of the
        function is given as an index into the vm's readonly table. */
     o_native_call,
+    /* This is o_native_call when the result is returned right after. The frame
+       and registers of the current function are given over to the target. */
+    o_tail_call,
     /* Perform a general call: It could be either a native function or a foreign
        one. The source is a register. This checks which path to use, and follows
        either o_foreign_call or o_native call. */
     o_function_call,
+    /* This is o_function_call when the result is returned right after. A native
+       function is given over the current frame like o_tail_call. Foreign
+       functions and closures are called as usual, and the return after is
+       done. */
+    o_function_tail_call,
 
     /* Return to the caller and push a value back. */
     o_return_val,
     /* Return a Unit value to the caller. */
     o_return_unit,
 
-    /* Build a new List. This includes a count, and registers to use as source
-       values. */
+    /* Build a new List. This includes if the List can skip gc speculation, a
+       count, and registers to use as source values. */
     o_build_list,
-    /* Build a new Tuple. This includes a count, and registers to use as source
-       values. */
+    /* Build a new Tuple. This includes if the Tuple can skip gc speculation, a
+       count, and registers to use as source values. */
     o_build_tuple,
     /* Build a new Hash. This includes a count, which is the total number of
        values sent. The values are divided into key, value, key, value pairs. */
@@ -179,6 +224,10 @@ typedef enum {
        statement where there are no breaks. */
     o_optarg_dispatch,
 
+    /* Send a readonly ByteString through the render function. Templates are
+       compiled so that the text outside of the tags is written through this. */
+    o_render_content,
+
     /* Exit the vm. This is written at the end of __main__ to make it leave the
        vm exec function. It is also spoofed when entering foreign functions, so
        that they leave the vm exec function properly. */
@@ -103,8 +103,7 @@ lily_lex_state *lily_new_lex_state(lily_options *options,
         lily_raiser *raiser)
 {
     lily_lex_state *lexer = lily_malloc(sizeof(lily_lex_state));
-    lexer->data = lily_op_get_data(options);
-    lexer->render_func = lily_op_get_render_func(options);
+    lexer->content = lily_new_msgbuf(64);
 
     char *ch_class;
 
@@ -235,6 +234,7 @@ void lily_free_lex_state(lily_lex_state *lexer)
     lily_free(lexer->input_buffer);
     lily_free(lexer->ch_class);
     lily_free(lexer->label);
+    lily_free_msgbuf(lexer->content);
     lily_free(lexer);
 }
 
@@ -1758,73 +1758,52 @@ void lily_lexer(lily_lex_state *lexer)
     }
 }
 
-/* This handles what's outside of <?lily ... ?>. */
+/* This handles what's outside of <?lily ... ?>. The text is collected into
+   lexer->content, instead of being rendered here. The parser turns it into a
+   ByteString literal that is rendered when the template is run, so that the
+   template can be run again without being scanned again. */
 void lily_lexer_handle_content(lily_lex_state *lexer)
 {
-    char c;
-    int lbp, htmlp;
-    void *data = lexer->data;
+    lily_msgbuf *content = lexer->content;
+    char *input_buffer = lexer->input_buffer;
+    int lbp = lexer->input_pos;
 
-    /* htmlp and lbp are used so it's obvious they aren't globals. */
-    lbp = lexer->input_pos;
-    c = lexer->input_buffer[lbp];
-    htmlp = 0;
+    lily_mb_flush(content);
 
     /* For `?>\n`, don't render the newline (it's annoying). */
-    if (c == '\n' &&
+    if (input_buffer[lbp] == '\n' &&
         lbp > 2 &&
-        lexer->input_buffer[lbp - 1] == '>' &&
-        lexer->input_buffer[lbp - 2] == '?') {
-
-        goto next_line;
-    }
+        input_buffer[lbp - 1] == '>' &&
+        input_buffer[lbp - 2] == '?')
+        lbp++;
 
-    /* Send html to the server either when unable to hold more or the lily tag
-       is found. */
     while (1) {
-        lbp++;
-        if (c == '<') {
-            if (strncmp(lexer->input_buffer + lbp, "?lily", 5) == 0) {
-                if (htmlp != 0) {
-                    /* Don't include the '<', because it goes with <?lily. */
-                    lexer->label[htmlp] = '\0';
-                    lexer->render_func(lexer->label, data);
-                }
-                lbp += 5;
-                /* Yield control to the lexer. */
-                break;
-            }
-        }
-        lexer->label[htmlp] = c;
-        htmlp++;
-        if (htmlp == (lexer->input_size - 1)) {
-            lexer->label[htmlp] = '\0';
-            lexer->render_func(lexer->label, data);
-            /* This isn't done, so fix htmlp. */
-            htmlp = 0;
+        char *tag_start = strstr(input_buffer + lbp, "<?lily");
+
+        if (tag_start) {
+            int tag_pos = (int)(tag_start - input_buffer);
+
+            /* Don't include the '<', because it goes with <?lily. */
+            lily_mb_add_slice(content, input_buffer, lbp, tag_pos);
+            /* Yield control to the lexer. */
+            lbp = tag_pos + 6;
+            break;
         }
 
-        if (c == '\n') {
-next_line:
-            if (read_line(lexer))
-                lbp = 0;
-            else {
-                if (htmlp != 0) {
-                    lexer->label[htmlp] = '\0';
-                    /* Don't bother with sending just a newline. */
-                    if (htmlp != 1 && lexer->label[0] != '\n')
-                        lexer->render_func(lexer->label, data);
-                    else
-                        lexer->label[0] = '\0';
-                }
+        lily_mb_add(content, input_buffer + lbp);
 
-                lexer->token = lexer->entry->final_token;
-                lbp = 0;
-                break;
-            }
+        lbp = 0;
+        if (read_line(lexer) == 0) {
+            /* Don't bother with sending just a newline. */
+            if (strcmp(lily_mb_get(content), "\n") == 0)
+                lily_mb_flush(content);
+
+            lexer->token = lexer->entry->final_token;
+            break;
         }
 
-        c = lexer->input_buffer[lbp];
+        /* Reading a line may have grown the buffer. */
+        input_buffer = lexer->input_buffer;
     }
 
     lexer->input_pos = lbp;
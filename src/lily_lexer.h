@@ -132,8 +132,8 @@ typedef struct lily_lex_state_ {
     lily_literal *last_literal;
     lily_symtab *symtab;
     lily_raiser *raiser;
-    lily_render_func render_func;
-    void *data;
+    /* Template mode: This holds the text that was outside of the tags. */
+    lily_msgbuf *content;
 } lily_lex_state;
 
 void lily_free_lex_state(lily_lex_state *);
@@ -85,3 +85,37 @@ MOVE_FN  (string,         lily_string_val *,     string,    LILY_STRING_ID     |
 CAST_FN_F(tuple,          lily_tuple_val *,      list,      LILY_TUPLE_ID, lily_list_val *)
 MOVE_PRIM(unit,           int64_t,               integer,   LILY_UNIT_ID)
 CAST_FN_F(variant,        lily_variant_val *,    instance,  VAL_IS_ENUM, lily_instance_val *)
+
+/* Integer, Double, String, Byte, ByteString, and Boolean values can never hold
+   tagged data. A List or Tuple holding only those does not need to be swept
+   through by the gc, and can skip being speculative. Lists only hold one type,
+   so the first element speaks for the rest. A container whose elements have
+   not been set yet (flags of 0) stays speculative. */
+static uint32_t move_flags_for(lily_value *values, int count)
+{
+    if (count == 0)
+        return VAL_IS_DEREFABLE | VAL_IS_GC_SPECULATIVE;
+
+    int i;
+    for (i = 0;i < count;i++) {
+        uint32_t flags = values[i].flags;
+
+        if ((flags & (VAL_IS_GC_SWEEPABLE | VAL_IS_INSTANCE | VAL_IS_ENUM |
+                      VAL_IS_FOREIGN)) ||
+            values[i].class_id < LILY_INTEGER_ID ||
+            values[i].class_id > LILY_BOOLEAN_ID)
+            return VAL_IS_DEREFABLE | VAL_IS_GC_SPECULATIVE;
+    }
+
+    return VAL_IS_DEREFABLE;
+}
+
+uint32_t lily_list_move_flags(lily_list_val *lv)
+{
+    return move_flags_for(lv->elems, lv->num_values ? 1 : 0);
+}
+
+uint32_t lily_tuple_move_flags(lily_tuple_val *tv)
+{
+    return move_flags_for(tv->elems, tv->num_values);
+}
@@ -21,6 +21,11 @@ void lily_move_tuple_f(uint32_t, lily_value *, lily_tuple_val *);
 void lily_move_unit(lily_value *);
 void lily_move_variant_f(uint32_t, lily_value *, lily_variant_val *);
 
+/* These return the MOVE_DEREF_* flag to move a List or Tuple with, based on
+   what it currently holds. */
+uint32_t lily_list_move_flags(lily_list_val *);
+uint32_t lily_tuple_move_flags(lily_tuple_val *);
+
 /* This value can be ref'd/deref'd, but does not contain any tagged data inside
    of it. */
 #define MOVE_DEREF_NO_GC          VAL_IS_DEREFABLE
@@ -10,6 +10,7 @@
 
 #include "lily_api_alloc.h"
 #include "lily_api_msgbuf.h"
+#include "lily_api_value.h"
 
 extern lily_type *lily_unit_type;
 
@@ -139,7 +140,7 @@ void lily_mb_add(lily_msgbuf *msgbuf, const char *str)
     if ((msgbuf->pos + len + 1) > msgbuf->size)
         resize_msgbuf(msgbuf, msgbuf->pos + len + 1);
 
-    strcat(msgbuf->message, str);
+    memcpy(msgbuf->message + msgbuf->pos, str, len + 1);
     msgbuf->pos += len;
 }
 
@@ -387,7 +388,7 @@ static void add_list_like(lily_vm_state *vm, lily_msgbuf *msgbuf, tag *t,
         lily_value *v, const char *prefix, const char *suffix)
 {
     int count, i;
-    lily_value **values;
+    lily_value *values;
 
     if (v->class_id == LILY_LIST_ID ||
         v->class_id == LILY_TUPLE_ID) {
@@ -404,11 +405,11 @@ static void add_list_like(lily_vm_state *vm, lily_msgbuf *msgbuf, tag *t,
     /* This is necessary because num_values is unsigned. */
     if (count != 0) {
         for (i = 0;i < count - 1;i++) {
-            add_value_to_msgbuf(vm, msgbuf, t, values[i]);
+            add_value_to_msgbuf(vm, msgbuf, t, &values[i]);
             lily_mb_add(msgbuf, ", ");
         }
         if (i != count)
-            add_value_to_msgbuf(vm, msgbuf, t, values[i]);
+            add_value_to_msgbuf(vm, msgbuf, t, &values[i]);
     }
 
     lily_mb_add(msgbuf, suffix);
@@ -443,7 +444,7 @@ static void add_value_to_msgbuf(lily_vm_state *vm, lily_msgbuf *msgbuf,
     else if (v->class_id == LILY_DOUBLE_ID)
         add_double(msgbuf, v->value.doubleval);
     else if (v->class_id == LILY_STRING_ID)
-        lily_mb_escape_add_str(msgbuf, v->value.string->string);
+        lily_mb_escape_add_str(msgbuf, lily_string_raw(v->value.string));
     else if (v->class_id == LILY_BYTESTRING_ID)
         add_bytestring(msgbuf, v->value.string);
     else if (v->class_id == LILY_FUNCTION_ID) {
@@ -472,19 +473,17 @@ static void add_value_to_msgbuf(lily_vm_state *vm, lily_msgbuf *msgbuf,
     else if (v->class_id == LILY_HASH_ID) {
         lily_hash_val *hv = v->value.hash;
         lily_mb_add_char(msgbuf, '[');
-        int i, j;
-        for (i = 0, j = 0;i < hv->num_bins;i++) {
-            lily_hash_entry *entry = hv->bins[i];
-
-            if (entry) {
-                add_value_to_msgbuf(vm, msgbuf, t, entry->boxed_key);
-                lily_mb_add(msgbuf, " => ");
-                add_value_to_msgbuf(vm, msgbuf, t, entry->record);
-                if (j != hv->num_entries - 1)
-                    lily_mb_add(msgbuf, ", ");
-
-                j++;
-            }
+        lily_hash_entry *entry;
+        int pos = 0, j = 0;
+
+        while ((entry = lily_hash_next_entry(hv, &pos)) != NULL) {
+            add_value_to_msgbuf(vm, msgbuf, t, &entry->boxed_key);
+            lily_mb_add(msgbuf, " => ");
+            add_value_to_msgbuf(vm, msgbuf, t, &entry->record);
+            if (j != hv->num_entries - 1)
+                lily_mb_add(msgbuf, ", ");
+
+            j++;
         }
         lily_mb_add_char(msgbuf, ']');
     }
@@ -523,7 +522,8 @@ void lily_mb_add_value(lily_msgbuf *msgbuf, lily_vm_state *vm,
         lily_value *value)
 {
     if (value->class_id == LILY_STRING_ID)
-        lily_mb_add(msgbuf, value->value.string->string);
+        lily_mb_add_slice(msgbuf, value->value.string->string, 0,
+                value->value.string->size);
     else
         add_value_to_msgbuf(vm, msgbuf, NULL, value);
 }
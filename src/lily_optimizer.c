@@ -0,0 +1,1246 @@
+#include <string.h>
+
+#include "lily_api_alloc.h"
+#include "lily_api_code_iter.h"
+#include "lily_int_opcode.h"
+#include "lily_optimizer.h"
+
+/** The emitter writes code one expression at a time, and never looks back at
+    what it wrote. Literals are loaded into storages right before they're used,
+    conditions are stored into a Boolean before being tested, and branches leave
+    behind jumps that lead to other jumps.
+
+    This pass runs over the finished code of each function and cleans that up.
+    It does the following, in order:
+
+    * Constant folding. Integer and Boolean loads are tracked through storages
+      within a basic block. Arithmetic and comparisons on them are turned into
+      loads of the result, and a conditional jump (o_jump_if, or one of the
+      compare and jump opcodes) on known values becomes either an o_jump or
+      nothing.
+    * Jump threading. A jump to an o_jump goes straight to where that leads. A
+      conditional jump that only skips over an o_jump is flipped to go where
+      the o_jump was going instead.
+    * Unreachable code (such as what follows o_return_* or o_raise) is removed.
+    * Jumps to the instruction after them are removed.
+    * Dead stores. Liveness is computed for storages, and an instruction that
+      has no side effects and writes to a storage that is not read later is
+      removed.
+
+    Instructions never change places. They shrink or are removed where they
+    are, and only at the end is the code compacted and the jumps fixed. That
+    keeps the work simple, and it means that line numbers of what's left are
+    still correct. **/
+
+/* This instruction is where a jump goes to. */
+#define OPT_TARGET  0x1
+/* This instruction starts a basic block. */
+#define OPT_LEADER  0x2
+/* This instruction's block can be reached. Only set on leaders. */
+#define OPT_REACHED 0x4
+/* This instruction starts an exception handler. */
+#define OPT_HANDLER 0x8
+
+#define NO_TEMP UINT16_MAX
+#define NO_INDEX UINT16_MAX
+
+#define BIT_GET(set, i) (set[(i) >> 5] & (1u << ((i) & 31)))
+#define BIT_SET(set, i) set[(i) >> 5] |= (1u << ((i) & 31))
+#define BIT_CLEAR(set, i) set[(i) >> 5] &= ~(1u << ((i) & 31))
+
+lily_optimizer *lily_new_optimizer(void)
+{
+    lily_optimizer *opt = lily_malloc(sizeof(lily_optimizer));
+    uint32_t size = 64;
+
+    opt->starts = lily_malloc(size * sizeof(uint16_t));
+    opt->sizes = lily_malloc(size * sizeof(uint16_t));
+    opt->inst_flags = lily_malloc(size * sizeof(uint16_t));
+    opt->block_ids = lily_malloc(size * sizeof(uint16_t));
+    opt->block_starts = lily_malloc(size * sizeof(uint16_t));
+    opt->work = lily_malloc(size * sizeof(uint16_t));
+    opt->index_at = lily_malloc(size * sizeof(uint16_t));
+    opt->code_size = size;
+
+    opt->temp_ids = lily_malloc(size * sizeof(uint16_t));
+    opt->fact_values = lily_malloc(size * sizeof(int16_t));
+    opt->fact_ops = lily_malloc(size * sizeof(uint16_t));
+    opt->fact_blocks = lily_malloc(size * sizeof(uint16_t));
+    opt->reg_size = size;
+
+    opt->bits = lily_malloc(size * sizeof(uint32_t));
+    opt->bits_size = size;
+
+    opt->reads = lily_new_buffer_u16(8);
+    opt->writes = lily_new_buffer_u16(8);
+    opt->succs = lily_new_buffer_u16(8);
+
+    opt->inst_count = 0;
+    opt->block_count = 0;
+    opt->reg_count = 0;
+    opt->temp_count = 0;
+    opt->words = 0;
+    opt->has_try = 0;
+    opt->partial_write = 0;
+
+    return opt;
+}
+
+void lily_free_optimizer(lily_optimizer *opt)
+{
+    lily_free(opt->starts);
+    lily_free(opt->sizes);
+    lily_free(opt->inst_flags);
+    lily_free(opt->block_ids);
+    lily_free(opt->block_starts);
+    lily_free(opt->work);
+    lily_free(opt->index_at);
+    lily_free(opt->temp_ids);
+    lily_free(opt->fact_values);
+    lily_free(opt->fact_ops);
+    lily_free(opt->fact_blocks);
+    lily_free(opt->bits);
+    lily_free_buffer_u16(opt->reads);
+    lily_free_buffer_u16(opt->writes);
+    lily_free_buffer_u16(opt->succs);
+    lily_free(opt);
+}
+
+static void ensure_code_size(lily_optimizer *opt, uint32_t need)
+{
+    if (opt->code_size >= need)
+        return;
+
+    uint32_t size = opt->code_size;
+    while (size < need)
+        size *= 2;
+
+    opt->starts = lily_realloc(opt->starts, size * sizeof(uint16_t));
+    opt->sizes = lily_realloc(opt->sizes, size * sizeof(uint16_t));
+    opt->inst_flags = lily_realloc(opt->inst_flags, size * sizeof(uint16_t));
+    opt->block_ids = lily_realloc(opt->block_ids, size * sizeof(uint16_t));
+    opt->block_starts = lily_realloc(opt->block_starts,
+            size * sizeof(uint16_t));
+    opt->work = lily_realloc(opt->work, size * sizeof(uint16_t));
+    opt->index_at = lily_realloc(opt->index_at, size * sizeof(uint16_t));
+    opt->code_size = size;
+}
+
+void lily_opt_prepare(lily_optimizer *opt, uint16_t reg_count)
+{
+    if (opt->reg_size < reg_count) {
+        uint32_t size = opt->reg_size;
+        while (size < reg_count)
+            size *= 2;
+
+        opt->temp_ids = lily_realloc(opt->temp_ids, size * sizeof(uint16_t));
+        opt->fact_values = lily_realloc(opt->fact_values,
+                size * sizeof(int16_t));
+        opt->fact_ops = lily_realloc(opt->fact_ops, size * sizeof(uint16_t));
+        opt->fact_blocks = lily_realloc(opt->fact_blocks,
+                size * sizeof(uint16_t));
+        opt->reg_size = size;
+    }
+
+    memset(opt->temp_ids, 0xFF, reg_count * sizeof(uint16_t));
+    opt->reg_count = reg_count;
+    opt->temp_count = 0;
+}
+
+void lily_opt_mark_temp(lily_optimizer *opt, uint16_t reg)
+{
+    if (reg < opt->reg_count && opt->temp_ids[reg] == NO_TEMP) {
+        opt->temp_ids[reg] = opt->temp_count;
+        opt->temp_count++;
+    }
+}
+
+/***
+ *      _   _      _
+ *     | | | | ___| |_ __   ___ _ __ ___
+ *     | |_| |/ _ \ | '_ \ / _ \ '__/ __|
+ *     |  _  |  __/ | |_) |  __/ |  \__ \
+ *     |_| |_|\___|_| .__/ \___|_|  |___/
+ *                  |_|
+ */
+
+static void iter_at(lily_optimizer *opt, uint16_t *code, int i,
+        lily_code_iter *ci)
+{
+    lily_ci_init(ci, code, opt->starts[i], opt->starts[i] + opt->sizes[i]);
+    lily_ci_next(ci);
+}
+
+/* Return the absolute position of jump 'n' of the instruction, or -1 if that
+   jump isn't there (catch opcodes use a 0 to end the chain). */
+static int jump_target(lily_code_iter *ci, int n)
+{
+    int pos = ci->offset + ci->round_total - ci->jumps_7 + n;
+    int16_t distance = (int16_t)ci->buffer[pos];
+
+    if (distance == 0 &&
+        (ci->opcode == o_except_catch || ci->opcode == o_except_ignore))
+        return -1;
+
+    return ci->offset + distance;
+}
+
+static int set_jump_target(lily_code_iter *ci, int n, int target)
+{
+    int distance = target - ci->offset;
+
+    if (distance < INT16_MIN || distance > INT16_MAX)
+        return 0;
+
+    ci->buffer[ci->offset + ci->round_total - ci->jumps_7 + n] =
+            (uint16_t)(int16_t)distance;
+    return 1;
+}
+
+/* These opcodes jump if a condition holds, and otherwise go to the next
+   instruction. They all have the check value at [1], and their one jump last. */
+static int is_cond_jump(uint16_t opcode)
+{
+    switch (opcode) {
+        case o_jump_if:
+        case o_integer_eq_jump:
+        case o_integer_less_jump:
+        case o_integer_less_eq_jump:
+        case o_integer_eq_imm_jump:
+        case o_integer_less_imm_jump:
+        case o_integer_less_eq_imm_jump:
+        case o_double_eq_jump:
+        case o_double_less_jump:
+        case o_double_less_eq_jump:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+/* These opcodes only write to their output. If nothing reads that output, they
+   can be removed. */
+static int is_pure(uint16_t opcode)
+{
+    switch (opcode) {
+        case o_fast_assign:
+        case o_assign:
+        case o_integer_add:
+        case o_integer_minus:
+        case o_integer_add_imm:
+        case o_integer_mul:
+        case o_left_shift:
+        case o_right_shift:
+        case o_bitwise_and:
+        case o_bitwise_or:
+        case o_bitwise_xor:
+        case o_double_add:
+        case o_double_minus:
+        case o_double_mul:
+        case o_unary_not:
+        case o_unary_minus:
+        case o_get_global:
+        case o_get_readonly:
+        case o_get_integer:
+        case o_get_boolean:
+        case o_get_byte:
+        case o_get_empty_variant:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+static void add_reads(lily_optimizer *opt, uint16_t *c, int start, int count)
+{
+    int i;
+    for (i = start;i < start + count;i++)
+        lily_u16_write_1(opt->reads, c[i]);
+}
+
+static void add_writes(lily_optimizer *opt, uint16_t *c, int start, int count)
+{
+    int i;
+    for (i = start;i < start + count;i++)
+        lily_u16_write_1(opt->writes, c[i]);
+}
+
+/* This loads the registers that the instruction at 'c' reads and writes into
+   the optimizer. lily_code_iter isn't used here, because it describes the
+   layout of operands, not what the vm does with them. */
+static void load_operands(lily_optimizer *opt, uint16_t *c)
+{
+    lily_u16_set_pos(opt->reads, 0);
+    lily_u16_set_pos(opt->writes, 0);
+    opt->partial_write = 0;
+
+    switch ((lily_opcode)c[0]) {
+        case o_fast_assign:
+        case o_assign:
+        case o_unary_not:
+        case o_unary_minus:
+            add_reads(opt, c, 2, 1);
+            add_writes(opt, c, 3, 1);
+            break;
+        case o_integer_add_imm:
+            add_reads(opt, c, 2, 1);
+            add_writes(opt, c, 4, 1);
+            break;
+        case o_integer_eq_jump:
+        case o_integer_less_jump:
+        case o_integer_less_eq_jump:
+        case o_double_eq_jump:
+        case o_double_less_jump:
+        case o_double_less_eq_jump:
+            add_reads(opt, c, 2, 2);
+            break;
+        case o_integer_eq_imm_jump:
+        case o_integer_less_imm_jump:
+        case o_integer_less_eq_imm_jump:
+            add_reads(opt, c, 2, 1);
+            break;
+        case o_integer_add:
+        case o_integer_minus:
+        case o_modulo:
+        case o_integer_mul:
+        case o_integer_div:
+        case o_left_shift:
+        case o_right_shift:
+        case o_bitwise_and:
+        case o_bitwise_or:
+        case o_bitwise_xor:
+        case o_double_add:
+        case o_double_minus:
+        case o_double_mul:
+        case o_double_div:
+        case o_integer_eq:
+        case o_integer_not_eq:
+        case o_integer_less:
+        case o_integer_less_eq:
+        case o_double_eq:
+        case o_double_not_eq:
+        case o_double_less:
+        case o_double_less_eq:
+        case o_string_eq:
+        case o_string_not_eq:
+        case o_string_less:
+        case o_string_less_eq:
+        case o_generic_eq:
+        case o_generic_not_eq:
+        case o_get_item:
+            add_reads(opt, c, 2, 2);
+            add_writes(opt, c, 4, 1);
+            break;
+        case o_set_item:
+            add_reads(opt, c, 2, 3);
+            break;
+        case o_get_property:
+        case o_dynamic_cast:
+        case o_load_class_closure:
+            add_reads(opt, c, 3, 1);
+            add_writes(opt, c, 4, 1);
+            break;
+        case o_set_property:
+            add_reads(opt, c, 3, 2);
+            break;
+        case o_jump_if:
+        case o_return_val:
+        case o_raise:
+        case o_set_global:
+        case o_match_dispatch:
+            add_reads(opt, c, 2, 1);
+            break;
+        case o_set_upvalue:
+            add_reads(opt, c, 3, 1);
+            break;
+        case o_integer_for:
+            /* The internal counter is updated in place, and the user's var is
+               only written to if the loop continues. */
+            add_reads(opt, c, 2, 3);
+            add_writes(opt, c, 2, 1);
+            add_writes(opt, c, 5, 1);
+            opt->partial_write = 1;
+            break;
+        case o_for_setup:
+            add_reads(opt, c, 2, 3);
+            add_writes(opt, c, 2, 1);
+            add_writes(opt, c, 5, 1);
+            opt->partial_write = 1;
+            break;
+        case o_function_call:
+        case o_function_tail_call:
+            add_reads(opt, c, 2, 1);
+        case o_native_call:
+        case o_tail_call:
+        case o_foreign_call:
+            add_reads(opt, c, 5, c[3]);
+            add_writes(opt, c, 4, 1);
+            break;
+        case o_build_list:
+        case o_build_tuple:
+        case o_build_hash:
+        case o_build_enum:
+            add_reads(opt, c, 4, c[3]);
+            add_writes(opt, c, 4 + c[3], 1);
+            break;
+        case o_interpolation:
+            add_reads(opt, c, 3, c[2]);
+            add_writes(opt, c, 3 + c[2], 1);
+            break;
+        case o_get_global:
+        case o_get_readonly:
+        case o_get_integer:
+        case o_get_boolean:
+        case o_get_byte:
+        case o_get_empty_variant:
+        case o_get_upvalue:
+        case o_new_instance_basic:
+        case o_new_instance_speculative:
+        case o_new_instance_tagged:
+        case o_create_closure:
+            add_writes(opt, c, 3, 1);
+            break;
+        case o_create_function:
+            add_reads(opt, c, 1, 1);
+            add_writes(opt, c, 3, 1);
+            break;
+        case o_load_closure:
+            add_writes(opt, c, 3 + c[2], 1);
+            break;
+        case o_variant_decompose:
+            add_reads(opt, c, 2, 1);
+            add_writes(opt, c, 4, c[3]);
+            break;
+        case o_except_catch:
+            /* This is only written to if the exception is caught. */
+            add_writes(opt, c, 3, 1);
+            opt->partial_write = 1;
+            break;
+        case o_optarg_dispatch:
+        {
+            /* This scans down from the last parameter to see which ones were
+               given values. */
+            int i;
+            for (i = 0;i < c[2] && i <= c[1];i++)
+                lily_u16_write_1(opt->reads, c[1] - i);
+            break;
+        }
+        case o_jump:
+        case o_return_unit:
+        case o_push_try:
+        case o_pop_try:
+        case o_except_ignore:
+        case o_render_content:
+        case o_return_from_vm:
+            break;
+    }
+}
+
+static int temp_of(lily_optimizer *opt, uint16_t reg)
+{
+    if (reg >= opt->reg_count)
+        return NO_TEMP;
+
+    return opt->temp_ids[reg];
+}
+
+/* Return the first instruction at or after 'i' that hasn't been removed. */
+static int first_kept_from(lily_optimizer *opt, int i)
+{
+    while (i < opt->inst_count && opt->sizes[i] == 0)
+        i++;
+
+    return i;
+}
+
+/* Load the blocks that block 'b' can go to next into opt->succs. */
+static void load_successors(lily_optimizer *opt, uint16_t *code, int b)
+{
+    int first = opt->block_starts[b];
+    int i = opt->block_starts[b + 1] - 1;
+    int falls = 1;
+
+    lily_u16_set_pos(opt->succs, 0);
+
+    while (i >= first && opt->sizes[i] == 0)
+        i--;
+
+    if (i >= first) {
+        lily_code_iter ci;
+        int j;
+
+        iter_at(opt, code, i, &ci);
+
+        for (j = 0;j < ci.jumps_7;j++) {
+            int target = jump_target(&ci, j);
+
+            if (target != -1) {
+                int block = opt->block_ids[opt->index_at[target]];
+
+                if (block < opt->block_count)
+                    lily_u16_write_1(opt->succs, block);
+            }
+        }
+
+        falls = lily_ci_falls_through(ci.opcode);
+    }
+
+    if (falls && b + 1 < opt->block_count)
+        lily_u16_write_1(opt->succs, b + 1);
+}
+
+/***
+ *      ____  _             _
+ *     / ___|| |_ __ _ _ __| |_
+ *     \___ \| __/ _` | '__| __|
+ *      ___) | || (_| | |  | |_
+ *     |____/ \__\__,_|_|   \__|
+ *
+ */
+
+/* This walks over the code to find the instructions and split them into basic
+   blocks. If the code has something that this doesn't understand, 0 is
+   returned and the code is left as-is. */
+static int index_code(lily_optimizer *opt, uint16_t *code, uint16_t size)
+{
+    lily_code_iter ci;
+    int count = 0;
+    int i, j;
+
+    ensure_code_size(opt, (uint32_t)size + 1);
+    memset(opt->index_at, 0xFF, ((uint32_t)size + 1) * sizeof(uint16_t));
+    opt->has_try = 0;
+
+    lily_ci_init(&ci, code, 0, size);
+    while (lily_ci_next(&ci)) {
+        if (ci.offset + ci.round_total > size)
+            return 0;
+
+        opt->starts[count] = ci.offset;
+        opt->sizes[count] = ci.round_total;
+        opt->inst_flags[count] = 0;
+        opt->index_at[ci.offset] = count;
+
+        if (ci.opcode == o_push_try)
+            opt->has_try = 1;
+
+        count++;
+    }
+
+    /* An opcode that the iter doesn't know stops it early. */
+    if (ci.offset != size || count == 0)
+        return 0;
+
+    opt->starts[count] = size;
+    opt->sizes[count] = 0;
+    opt->index_at[size] = count;
+    opt->inst_count = count;
+    opt->inst_flags[0] = OPT_LEADER;
+
+    for (i = 0;i < count;i++) {
+        iter_at(opt, code, i, &ci);
+
+        for (j = 0;j < ci.jumps_7;j++) {
+            int target = jump_target(&ci, j);
+
+            if (target == -1)
+                continue;
+
+            if (target < 0 || target > size ||
+                opt->index_at[target] == NO_INDEX)
+                return 0;
+
+            uint16_t flags = OPT_TARGET | OPT_LEADER;
+
+            if (ci.opcode == o_push_try ||
+                ci.opcode == o_except_catch ||
+                ci.opcode == o_except_ignore)
+                flags |= OPT_HANDLER;
+
+            opt->inst_flags[opt->index_at[target]] |= flags;
+        }
+
+        if (ci.jumps_7 || lily_ci_falls_through(ci.opcode) == 0)
+            opt->inst_flags[i + 1] |= OPT_LEADER;
+    }
+
+    int block = -1;
+
+    for (i = 0;i < count;i++) {
+        if (opt->inst_flags[i] & OPT_LEADER) {
+            block++;
+            opt->block_starts[block] = i;
+        }
+
+        opt->block_ids[i] = block;
+    }
+
+    block++;
+    opt->block_ids[count] = block;
+    opt->block_starts[block] = count;
+    opt->block_count = block;
+
+    return 1;
+}
+
+/***
+ *      _____     _     _ _
+ *     |  ___|__ | | __| (_)_ __   __ _
+ *     | |_ / _ \| |/ _` | | '_ \ / _` |
+ *     |  _| (_) | | (_| | | | | | (_| |
+ *     |_|  \___/|_|\__,_|_|_| |_|\__, |
+ *                                |___/
+ */
+
+static int get_fact(lily_optimizer *opt, uint16_t reg, uint16_t epoch,
+        uint16_t *op, int64_t *value)
+{
+    int t = temp_of(opt, reg);
+
+    if (t == NO_TEMP || opt->fact_blocks[t] != epoch)
+        return 0;
+
+    *op = opt->fact_ops[t];
+    *value = opt->fact_values[t];
+    return 1;
+}
+
+static void set_fact(lily_optimizer *opt, uint16_t reg, uint16_t epoch,
+        uint16_t op, int16_t value)
+{
+    int t = temp_of(opt, reg);
+
+    if (t == NO_TEMP)
+        return;
+
+    opt->fact_blocks[t] = epoch;
+    opt->fact_ops[t] = op;
+    opt->fact_values[t] = value;
+}
+
+static void clear_fact(lily_optimizer *opt, uint16_t reg)
+{
+    int t = temp_of(opt, reg);
+
+    if (t != NO_TEMP)
+        opt->fact_blocks[t] = 0;
+}
+
+/* Try to fold 'op' over two values loaded by o_get_integer or o_get_boolean.
+   This must give the same result that the vm would. */
+static int fold_binary(uint16_t op, uint16_t left_op, int64_t left,
+        uint16_t right_op, int64_t right, uint16_t *out_op, int64_t *out)
+{
+    int64_t result;
+
+    if (left_op != right_op)
+        return 0;
+
+    *out_op = o_get_integer;
+
+    switch (op) {
+        case o_integer_add: result = left + right; break;
+        case o_integer_minus: result = left - right; break;
+        case o_integer_mul: result = left * right; break;
+        case o_integer_div:
+            /* Leave it alone, so the vm raises DivisionByZeroError. */
+            if (right == 0)
+                return 0;
+            result = left / right;
+            break;
+        case o_modulo:
+            if (right == 0)
+                return 0;
+            result = left % right;
+            break;
+        case o_left_shift:
+            if (left < 0 || right < 0 || right > 15)
+                return 0;
+            result = left << right;
+            break;
+        case o_right_shift:
+            if (right < 0 || right > 15)
+                return 0;
+            result = left >> right;
+            break;
+        case o_bitwise_and: result = left & right; break;
+        case o_bitwise_or: result = left | right; break;
+        case o_bitwise_xor: result = left ^ right; break;
+        /* Boolean values are compared like Integer values are. */
+        case o_integer_eq: result = (left == right); break;
+        case o_integer_not_eq: result = (left != right); break;
+        case o_integer_less: result = (left < right); break;
+        case o_integer_less_eq: result = (left <= right); break;
+        default:
+            return 0;
+    }
+
+    if (op >= o_integer_eq && op <= o_integer_less_eq)
+        *out_op = o_get_boolean;
+    else if (left_op == o_get_boolean)
+        return 0;
+    /* o_get_integer only holds 16 bits. */
+    else if (result < INT16_MIN || result > INT16_MAX)
+        return 0;
+
+    *out = result;
+    return 1;
+}
+
+/* The result of a fused Integer compare and jump, if both sides are known. */
+static int fold_compare(uint16_t op, int64_t left, int64_t right)
+{
+    switch (op) {
+        case o_integer_eq_jump:
+        case o_integer_eq_imm_jump:
+            return left == right;
+        case o_integer_less_jump:
+        case o_integer_less_imm_jump:
+            return left < right;
+        default:
+            return left <= right;
+    }
+}
+
+/* The conditional jump at 'c' is known to either always or never be taken. */
+static void settle_jump(lily_optimizer *opt, uint16_t *c, int i, int taken)
+{
+    if (taken) {
+        c[1] = c[opt->sizes[i] - 1];
+        c[0] = o_jump;
+        opt->sizes[i] = 2;
+    }
+    else
+        opt->sizes[i] = 0;
+}
+
+static void fold_constants(lily_optimizer *opt, uint16_t *code)
+{
+    uint16_t epoch = 0;
+    uint16_t left_op, right_op, out_op;
+    int64_t left, right, out;
+    int i, j;
+
+    memset(opt->fact_blocks, 0, opt->temp_count * sizeof(uint16_t));
+
+    for (i = 0;i < opt->inst_count;i++) {
+        uint16_t *c = code + opt->starts[i];
+
+        if (opt->inst_flags[i] & OPT_LEADER)
+            epoch = opt->block_ids[i] + 1;
+
+        switch (c[0]) {
+            case o_get_integer:
+            case o_get_boolean:
+                set_fact(opt, c[3], epoch, c[0], (int16_t)c[2]);
+                continue;
+            case o_integer_add:
+            case o_integer_minus:
+            case o_modulo:
+            case o_integer_mul:
+            case o_integer_div:
+            case o_left_shift:
+            case o_right_shift:
+            case o_bitwise_and:
+            case o_bitwise_or:
+            case o_bitwise_xor:
+            case o_integer_eq:
+            case o_integer_not_eq:
+            case o_integer_less:
+            case o_integer_less_eq:
+                if (get_fact(opt, c[2], epoch, &left_op, &left) &&
+                    get_fact(opt, c[3], epoch, &right_op, &right) &&
+                    fold_binary(c[0], left_op, left, right_op, right, &out_op,
+                            &out)) {
+                    /* The line stays where it is. */
+                    c[0] = out_op;
+                    c[2] = (uint16_t)(int16_t)out;
+                    c[3] = c[4];
+                    opt->sizes[i] = 4;
+                    set_fact(opt, c[3], epoch, out_op, (int16_t)out);
+                    continue;
+                }
+                break;
+            case o_unary_not:
+                if (get_fact(opt, c[2], epoch, &left_op, &left)) {
+                    /* The result has the class of the input. */
+                    c[0] = left_op;
+                    c[2] = !left;
+                    set_fact(opt, c[3], epoch, left_op, !left);
+                    continue;
+                }
+                break;
+            case o_unary_minus:
+                if (get_fact(opt, c[2], epoch, &left_op, &left) &&
+                    left_op == o_get_integer &&
+                    left != INT16_MIN) {
+                    c[0] = o_get_integer;
+                    c[2] = (uint16_t)(int16_t)-left;
+                    set_fact(opt, c[3], epoch, o_get_integer, (int16_t)-left);
+                    continue;
+                }
+                break;
+            case o_integer_add_imm:
+                if (get_fact(opt, c[2], epoch, &left_op, &left) &&
+                    left_op == o_get_integer &&
+                    fold_binary(o_integer_add, left_op, left, o_get_integer,
+                            (int16_t)c[3], &out_op, &out)) {
+                    c[0] = out_op;
+                    c[2] = (uint16_t)(int16_t)out;
+                    c[3] = c[4];
+                    opt->sizes[i] = 4;
+                    set_fact(opt, c[3], epoch, out_op, (int16_t)out);
+                    continue;
+                }
+                break;
+            case o_jump_if:
+                if (get_fact(opt, c[2], epoch, &left_op, &left)) {
+                    /* Keep this synced with the vm's o_jump_if. */
+                    settle_jump(opt, c, i, (left == 0) != c[1]);
+                    continue;
+                }
+                break;
+            case o_integer_eq_jump:
+            case o_integer_less_jump:
+            case o_integer_less_eq_jump:
+                if (get_fact(opt, c[2], epoch, &left_op, &left) &&
+                    get_fact(opt, c[3], epoch, &right_op, &right) &&
+                    left_op == o_get_integer &&
+                    right_op == o_get_integer) {
+                    settle_jump(opt, c, i,
+                            fold_compare(c[0], left, right) == c[1]);
+                    continue;
+                }
+                break;
+            case o_integer_eq_imm_jump:
+            case o_integer_less_imm_jump:
+            case o_integer_less_eq_imm_jump:
+                if (get_fact(opt, c[2], epoch, &left_op, &left) &&
+                    left_op == o_get_integer) {
+                    settle_jump(opt, c, i,
+                            fold_compare(c[0], left, (int16_t)c[3]) == c[1]);
+                    continue;
+                }
+                break;
+        }
+
+        load_operands(opt, c);
+
+        for (j = 0;j < lily_u16_pos(opt->writes);j++)
+            clear_fact(opt, lily_u16_get(opt->writes, j));
+    }
+}
+
+/***
+ *          _
+ *         | |_   _ _ __ ___  _ __  ___
+ *      _  | | | | | '_ ` _ \| '_ \/ __|
+ *     | |_| | |_| | | | | | | |_) \__ \
+ *      \___/ \__,_|_| |_| |_| .__/|___/
+ *                           |_|
+ */
+
+static void thread_jumps(lily_optimizer *opt, uint16_t *code)
+{
+    lily_code_iter ci, target_ci;
+    int i;
+
+    for (i = 0;i < opt->inst_count;i++) {
+        if (opt->sizes[i] == 0)
+            continue;
+
+        uint16_t op = code[opt->starts[i]];
+
+        if (op != o_jump && is_cond_jump(op) == 0)
+            continue;
+
+        iter_at(opt, code, i, &ci);
+
+        int target = jump_target(&ci, 0);
+        int hops;
+
+        /* The limit stops jumps that go in a circle. */
+        for (hops = 0;hops < 8;hops++) {
+            int next = first_kept_from(opt, opt->index_at[target]);
+
+            if (next == opt->inst_count || next == i ||
+                code[opt->starts[next]] != o_jump)
+                break;
+
+            iter_at(opt, code, next, &target_ci);
+            target = jump_target(&target_ci, 0);
+        }
+
+        set_jump_target(&ci, 0, target);
+    }
+}
+
+/* Threading changes where jumps go, so this finds where they go now. */
+static void mark_targets(lily_optimizer *opt, uint16_t *code)
+{
+    lily_code_iter ci;
+    int i, j;
+
+    for (i = 0;i < opt->inst_count;i++)
+        opt->inst_flags[i] &= ~OPT_TARGET;
+
+    for (i = 0;i < opt->inst_count;i++) {
+        if (opt->sizes[i] == 0)
+            continue;
+
+        iter_at(opt, code, i, &ci);
+
+        for (j = 0;j < ci.jumps_7;j++) {
+            int target = jump_target(&ci, j);
+
+            if (target != -1)
+                opt->inst_flags[opt->index_at[target]] |= OPT_TARGET;
+        }
+    }
+}
+
+/* This turns 'o_jump_if (x) A; o_jump B; A:' into 'o_jump_if (!x) B; A:'. */
+static void invert_jumps(lily_optimizer *opt, uint16_t *code)
+{
+    lily_code_iter ci, jump_ci;
+    int i;
+
+    for (i = 0;i < opt->inst_count;i++) {
+        if (opt->sizes[i] == 0 || is_cond_jump(code[opt->starts[i]]) == 0)
+            continue;
+
+        int jump = first_kept_from(opt, i + 1);
+
+        if (jump == opt->inst_count ||
+            code[opt->starts[jump]] != o_jump ||
+            opt->inst_flags[jump] & OPT_TARGET)
+            continue;
+
+        iter_at(opt, code, i, &ci);
+
+        int after = first_kept_from(opt, jump + 1);
+        int if_target = jump_target(&ci, 0);
+
+        if (first_kept_from(opt, opt->index_at[if_target]) != after)
+            continue;
+
+        iter_at(opt, code, jump, &jump_ci);
+
+        if (set_jump_target(&ci, 0, jump_target(&jump_ci, 0)) == 0)
+            continue;
+
+        code[opt->starts[i] + 1] = !code[opt->starts[i] + 1];
+        opt->sizes[jump] = 0;
+    }
+}
+
+static void remove_unreachable(lily_optimizer *opt, uint16_t *code)
+{
+    uint16_t *work = opt->work;
+    int work_pos = 0;
+    int i, j;
+
+    work[work_pos] = 0;
+    work_pos++;
+    opt->inst_flags[0] |= OPT_REACHED;
+
+    while (work_pos) {
+        work_pos--;
+        load_successors(opt, code, work[work_pos]);
+
+        for (j = 0;j < lily_u16_pos(opt->succs);j++) {
+            uint16_t first = opt->block_starts[lily_u16_get(opt->succs, j)];
+
+            if ((opt->inst_flags[first] & OPT_REACHED) == 0) {
+                opt->inst_flags[first] |= OPT_REACHED;
+                work[work_pos] = lily_u16_get(opt->succs, j);
+                work_pos++;
+            }
+        }
+    }
+
+    for (i = 0;i < opt->block_count;i++) {
+        int first = opt->block_starts[i];
+
+        if ((opt->inst_flags[first] & OPT_REACHED) == 0) {
+            for (j = first;j < opt->block_starts[i + 1];j++)
+                opt->sizes[j] = 0;
+        }
+    }
+}
+
+/* Remove jumps that go to the instruction right after them. This goes
+   backward, so that a series of those is removed too. */
+static void remove_useless_jumps(lily_optimizer *opt, uint16_t *code)
+{
+    lily_code_iter ci;
+    int i;
+
+    for (i = opt->inst_count - 1;i >= 0;i--) {
+        if (opt->sizes[i] == 0)
+            continue;
+
+        uint16_t op = code[opt->starts[i]];
+
+        if (op != o_jump && is_cond_jump(op) == 0)
+            continue;
+
+        iter_at(opt, code, i, &ci);
+
+        int target = first_kept_from(opt,
+                opt->index_at[jump_target(&ci, 0)]);
+
+        if (target == first_kept_from(opt, i + 1))
+            opt->sizes[i] = 0;
+    }
+}
+
+/***
+ *      ____                 _
+ *     |  _ \  ___  __ _  __| |
+ *     | | | |/ _ \/ _` |/ _` |
+ *     | |_| |  __/ (_| | (_| |
+ *     |____/ \___|\__,_|\__,_|
+ *
+ */
+
+/* Apply what instruction 'c' does to 'live', going backward. If 'def' is given,
+   the temps that are overwritten are added to it. */
+static void step_backward(lily_optimizer *opt, uint16_t *c, uint32_t *live,
+        uint32_t *def)
+{
+    int i;
+
+    load_operands(opt, c);
+
+    if (opt->partial_write == 0) {
+        for (i = 0;i < lily_u16_pos(opt->writes);i++) {
+            int t = temp_of(opt, lily_u16_get(opt->writes, i));
+
+            if (t != NO_TEMP) {
+                BIT_CLEAR(live, t);
+                if (def)
+                    BIT_SET(def, t);
+            }
+        }
+    }
+
+    for (i = 0;i < lily_u16_pos(opt->reads);i++) {
+        int t = temp_of(opt, lily_u16_get(opt->reads, i));
+
+        if (t != NO_TEMP)
+            BIT_SET(live, t);
+    }
+}
+
+/* This finds out which temps are live at the end of each block. Handlers can
+   be entered from anywhere in a try, so what they need is live everywhere. */
+static void compute_liveness(lily_optimizer *opt, uint16_t *code)
+{
+    int words = opt->words;
+    int block_count = opt->block_count;
+    uint32_t *handler = opt->bits + (4 * block_count + 1) * words;
+    int b, i, j, w;
+
+    memset(opt->bits, 0, (4 * block_count + 2) * words * sizeof(uint32_t));
+
+    for (b = 0;b < block_count;b++) {
+        uint32_t *use = opt->bits + (4 * b) * words;
+        uint32_t *def = use + words;
+
+        for (i = opt->block_starts[b + 1] - 1;
+             i >= opt->block_starts[b];
+             i--) {
+            if (opt->sizes[i])
+                step_backward(opt, code + opt->starts[i], use, def);
+        }
+    }
+
+    int changed;
+
+    do {
+        changed = 0;
+
+        if (opt->has_try) {
+            for (b = 0;b < block_count;b++) {
+                if (opt->inst_flags[opt->block_starts[b]] & OPT_HANDLER) {
+                    uint32_t *in = opt->bits + (4 * b + 2) * words;
+                    for (w = 0;w < words;w++)
+                        handler[w] |= in[w];
+                }
+            }
+        }
+
+        for (b = block_count - 1;b >= 0;b--) {
+            uint32_t *use = opt->bits + (4 * b) * words;
+            uint32_t *def = use + words;
+            uint32_t *in = def + words;
+            uint32_t *out = in + words;
+
+            load_successors(opt, code, b);
+
+            for (j = 0;j < lily_u16_pos(opt->succs);j++) {
+                int s = lily_u16_get(opt->succs, j);
+                uint32_t *succ_in = opt->bits + (4 * s + 2) * words;
+
+                for (w = 0;w < words;w++)
+                    out[w] |= succ_in[w];
+            }
+
+            for (w = 0;w < words;w++) {
+                uint32_t new_in;
+
+                out[w] |= handler[w];
+                new_in = use[w] | (out[w] & ~def[w]) | handler[w];
+
+                if (new_in != in[w]) {
+                    in[w] = new_in;
+                    changed = 1;
+                }
+            }
+        }
+    } while (changed);
+}
+
+static int remove_dead_stores(lily_optimizer *opt, uint16_t *code)
+{
+    int words = opt->words;
+    uint32_t *live = opt->bits + (4 * opt->block_count) * words;
+    uint32_t *handler = live + words;
+    int removed = 0;
+    int b, i, w;
+
+    for (b = 0;b < opt->block_count;b++) {
+        uint32_t *out = opt->bits + (4 * b + 3) * words;
+
+        memcpy(live, out, words * sizeof(uint32_t));
+
+        for (i = opt->block_starts[b + 1] - 1;
+             i >= opt->block_starts[b];
+             i--) {
+            if (opt->sizes[i] == 0)
+                continue;
+
+            uint16_t *c = code + opt->starts[i];
+
+            if (is_pure(c[0])) {
+                load_operands(opt, c);
+
+                int t = temp_of(opt, lily_u16_get(opt->writes, 0));
+
+                if (t != NO_TEMP && BIT_GET(live, t) == 0) {
+                    opt->sizes[i] = 0;
+                    removed = 1;
+                    continue;
+                }
+            }
+
+            step_backward(opt, c, live, NULL);
+
+            for (w = 0;w < words;w++)
+                live[w] |= handler[w];
+        }
+    }
+
+    return removed;
+}
+
+static void remove_dead_code(lily_optimizer *opt, uint16_t *code)
+{
+    int words = (opt->temp_count + 31) / 32;
+    uint32_t need = (4 * opt->block_count + 2) * words;
+    int rounds;
+
+    if (opt->bits_size < need) {
+        uint32_t size = opt->bits_size;
+        while (size < need)
+            size *= 2;
+
+        opt->bits = lily_realloc(opt->bits, size * sizeof(uint32_t));
+        opt->bits_size = size;
+    }
+
+    opt->words = words;
+
+    /* Removing a store can make what it read from dead too. */
+    for (rounds = 0;rounds < 8;rounds++) {
+        compute_liveness(opt, code);
+
+        if (remove_dead_stores(opt, code) == 0)
+            break;
+    }
+}
+
+/***
+ *       ____                                _
+ *      / ___|___  _ __ ___  _ __   __ _  ___| |_
+ *     | |   / _ \| '_ ` _ \| '_ \ / _` |/ __| __|
+ *     | |__| (_) | | | | | | |_) | (_| | (__| |_
+ *      \____\___/|_| |_| |_| .__/ \__,_|\___|\__|
+ *                          |_|
+ */
+
+static uint16_t compact(lily_optimizer *opt, uint16_t *code, uint16_t size)
+{
+    lily_code_iter ci;
+    uint16_t pos = 0;
+    int i, j;
+
+    /* Instructions only move back, so copying in order is safe. A removed
+       instruction maps to where the next one ends up. */
+    for (i = 0;i < opt->inst_count;i++) {
+        uint16_t start = opt->starts[i];
+
+        opt->index_at[start] = pos;
+
+        if (opt->sizes[i]) {
+            memmove(code + pos, code + start, opt->sizes[i] * sizeof(uint16_t));
+            pos += opt->sizes[i];
+        }
+    }
+
+    opt->index_at[size] = pos;
+
+    /* Jumps are still relative to where their opcode started. */
+    for (i = 0;i < opt->inst_count;i++) {
+        if (opt->sizes[i] == 0)
+            continue;
+
+        uint16_t start = opt->starts[i];
+        uint16_t new_start = opt->index_at[start];
+
+        lily_ci_init(&ci, code, new_start, new_start + opt->sizes[i]);
+        lily_ci_next(&ci);
+
+        for (j = 0;j < ci.jumps_7;j++) {
+            int target = jump_target(&ci, j);
+
+            if (target == -1)
+                continue;
+
+            target = opt->index_at[start + (target - new_start)];
+            set_jump_target(&ci, j, target);
+        }
+    }
+
+    return pos;
+}
+
+uint32_t lily_opt_run(lily_optimizer *opt, uint16_t *code, uint32_t size)
+{
+    /* Offsets and indexes are kept in 16 bits, with UINT16_MAX for none. */
+    if (size >= UINT16_MAX || index_code(opt, code, (uint16_t)size) == 0)
+        return size;
+
+    fold_constants(opt, code);
+    thread_jumps(opt, code);
+    mark_targets(opt, code);
+    invert_jumps(opt, code);
+    remove_unreachable(opt, code);
+    remove_useless_jumps(opt, code);
+
+    if (opt->temp_count)
+        remove_dead_code(opt, code);
+
+    return compact(opt, code, (uint16_t)size);
+}
@@ -0,0 +1,83 @@
+#ifndef LILY_OPTIMIZER_H
+# define LILY_OPTIMIZER_H
+
+# include <stdint.h>
+
+# include "lily_buffer_u16.h"
+
+/* The optimizer takes the code of a function after the emitter is done with it,
+   and rewrites it to do less work. The emitter owns one of these, and uses it
+   for each function that it finishes.
+   Registers that the emitter marks as temporary (storages) are assumed to hold
+   intermediate values only. Writes to them can be folded or dropped. Other
+   registers (vars) are always left alone. */
+typedef struct lily_optimizer_ {
+    /* Where each instruction started in the original code, and how many words
+       it has now. A size of 0 means that the instruction was removed. */
+    uint16_t *starts;
+    uint16_t *sizes;
+    /* OPT_* flags for each instruction. */
+    uint16_t *inst_flags;
+    /* The basic block that each instruction belongs to. */
+    uint16_t *block_ids;
+    /* The first instruction of each block. */
+    uint16_t *block_starts;
+    /* A stack of blocks, used when looking for unreachable code. */
+    uint16_t *work;
+
+    /* Indexed by the offset of an instruction in the original code. This is the
+       index of that instruction, until compaction turns it into where that
+       instruction ends up. */
+    uint16_t *index_at;
+
+    /* Every array above has this many elements. */
+    uint32_t code_size;
+
+    /* For each register, an index into the bitsets if it is a temporary, or
+       UINT16_MAX if it isn't. */
+    uint16_t *temp_ids;
+    /* For each temporary, the value that it's known to have, the opcode that it
+       was loaded with, and the block (+ 1) that it was loaded in. */
+    int16_t *fact_values;
+    uint16_t *fact_ops;
+    uint16_t *fact_blocks;
+    uint32_t reg_size;
+
+    /* Liveness bitsets. Each block gets four (use, def, in, out). After those
+       come two more: one for scratch, and one for what exception handlers
+       need. */
+    uint32_t *bits;
+    uint32_t bits_size;
+
+    /* The registers that the instruction being looked at reads and writes. */
+    lily_buffer_u16 *reads;
+    lily_buffer_u16 *writes;
+    /* The blocks that a block can go to next. */
+    lily_buffer_u16 *succs;
+
+    uint16_t inst_count;
+    uint16_t block_count;
+    uint16_t reg_count;
+    uint16_t temp_count;
+    uint16_t words;
+    uint16_t has_try;
+    /* Set if the writes of the current instruction are conditional, or only
+       update part of a value. They don't make the value before dead. */
+    uint16_t partial_write;
+    uint16_t pad;
+} lily_optimizer;
+
+lily_optimizer *lily_new_optimizer(void);
+void lily_free_optimizer(lily_optimizer *);
+
+/* Start work on a function that has the given number of registers. None of the
+   registers are temporary until they are marked. */
+void lily_opt_prepare(lily_optimizer *, uint16_t);
+void lily_opt_mark_temp(lily_optimizer *, uint16_t);
+
+/* Optimize the code given in place, and return the new size. If the code has
+   anything that the optimizer doesn't understand, or is too long for the 16 bit
+   offsets above (UINT16_MAX words or more), it's left untouched. */
+uint32_t lily_opt_run(lily_optimizer *, uint16_t *, uint32_t);
+
+#endif
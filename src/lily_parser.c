@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "lily_cache.h"
 #include "lily_config.h"
 #include "lily_library.h"
 #include "lily_parser.h"
@@ -18,6 +19,7 @@
 #include "lily_pkg_time.h"
 
 #include "lily_api_alloc.h"
+#include "lily_api_embed.h"
 /* Ids for Exception + children are in here, and dynaload needs them. */
 #include "lily_api_value.h"
 #include "lily_api_options.h"
@@ -81,6 +83,16 @@ typedef struct lily_rewind_state_
     uint32_t pending;
 } lily_rewind_state;
 
+/* A template that has been compiled. The size and hash of the source are kept
+   so that a template is only compiled again if the source changes. */
+typedef struct lily_template_ {
+    lily_function_val *func;
+    char *name;
+    uint64_t source_size;
+    uint64_t source_hash;
+    struct lily_template_ *next;
+} lily_template;
+
 /* This sets up the core of the interpreter. It's pretty rough around the edges,
    especially with how the parser is assigning into all sorts of various structs
    when it shouldn't. */
@@ -101,6 +113,11 @@ lily_state *lily_new_state(lily_options *options)
     lily_raiser *raiser = lily_new_raiser();
 
     parser->first_pass = 1;
+    parser->write_cache = 0;
+    parser->frozen = 0;
+    parser->cache = NULL;
+    parser->templates = NULL;
+    parser->clone_source = NULL;
     parser->class_self_type = NULL;
     parser->raiser = raiser;
     parser->first_expr = lily_new_expr_state();
@@ -136,6 +153,7 @@ lily_state *lily_new_state(lily_options *options)
     parser->expr->lex_linenum = &parser->lex->line_num;
 
     parser->emit->lex_linenum = &parser->lex->line_num;
+    parser->emit->optimize = lily_op_get_optimize(options);
     parser->emit->symtab = parser->symtab;
     parser->emit->parser = parser;
 
@@ -184,10 +202,28 @@ static void free_links_until(lily_module_link *link_iter,
 
 #define free_links(iter) free_links_until(iter, NULL)
 
+/* A clone only frees what it doesn't share with the snapshot it came from. */
+static void free_clone(lily_parse_state *parser)
+{
+    lily_free_raiser(parser->raiser);
+    lily_free_vm(parser->vm);
+    lily_free_value_stack(parser->foreign_values);
+    lily_free_msgbuf(parser->msgbuf);
+    lily_free(parser->rs);
+    lily_free(parser->symtab->main_function);
+    lily_free(parser->symtab);
+    lily_free(parser);
+}
+
 void lily_free_state(lily_state *vm)
 {
     lily_parse_state *parser = vm->parser;
 
+    if (parser->clone_source) {
+        free_clone(parser);
+        return;
+    }
+
     lily_free_raiser(parser->raiser);
 
     /* The root expression is the only one that is allocated (the rest are on
@@ -234,10 +270,55 @@ void lily_free_state(lily_state *vm)
     lily_free_type_maker(parser->tm);
     lily_free(parser->rs);
     lily_free_options(parser->options);
+    lily_free_cache(parser->cache);
+
+    lily_template *template_iter = parser->templates;
+    while (template_iter) {
+        lily_template *template_next = template_iter->next;
+
+        lily_free(template_iter->func->code);
+        lily_free(template_iter->func);
+        lily_free(template_iter->name);
+        lily_free(template_iter);
+        template_iter = template_next;
+    }
 
     lily_free(parser);
 }
 
+/* This rewinds the raiser and the vm. A frozen state only needs this part,
+   because the rest of its parser is not used. */
+static void rewind_interpreter(lily_parse_state *parser)
+{
+    /* Rewind raiser */
+    lily_raiser *raiser = parser->raiser;
+    lily_mb_flush(raiser->msgbuf);
+    lily_mb_flush(raiser->aux_msgbuf);
+    raiser->line_adjust = 0;
+    raiser->exception_cls = NULL;
+
+    /* Rewind the parts of the vm that can be rewound. */
+    lily_vm_state *vm = parser->vm;
+
+    lily_vm_catch_entry *catch_iter = vm->catch_chain;
+    while (catch_iter->prev)
+        catch_iter = catch_iter->prev;
+
+    vm->catch_chain = catch_iter;
+    vm->exception_value = NULL;
+    vm->pending_line = 0;
+    vm->vm_regs = vm->regs_from_main;
+    vm->include_last_frame_in_trace = 1;
+
+    lily_call_frame *call_iter = vm->call_frames;
+
+    vm->call_chain = call_iter;
+    vm->num_registers = call_iter->regs_used; /* todo: verify */
+    vm->call_depth = 0;
+    vm->reentry_depth = 0;
+    vm->exec_depth = 0;
+}
+
 static void rewind_parser(lily_parse_state *parser, lily_rewind_state *rs)
 {
     lily_u16_set_pos(parser->data_stack, 0);
@@ -303,33 +384,7 @@ static void rewind_parser(lily_parse_state *parser, lily_rewind_state *rs)
     lily_rewind_lex_state(parser->lex);
     parser->lex->line_num = rs->line_num;
 
-    /* Rewind raiser */
-    lily_raiser *raiser = parser->raiser;
-    lily_mb_flush(raiser->msgbuf);
-    lily_mb_flush(raiser->aux_msgbuf);
-    raiser->line_adjust = 0;
-    raiser->exception_cls = NULL;
-
-    /* Rewind the parts of the vm that can be rewound. */
-    lily_vm_state *vm = parser->vm;
-
-    lily_vm_catch_entry *catch_iter = vm->catch_chain;
-    while (catch_iter->prev)
-        catch_iter = catch_iter->prev;
-
-    vm->catch_chain = catch_iter;
-    vm->exception_value = NULL;
-    vm->pending_line = 0;
-    vm->vm_regs = vm->regs_from_main;
-    vm->include_last_frame_in_trace = 1;
-
-    lily_call_frame *call_iter = vm->call_chain;
-    while (call_iter->prev)
-        call_iter = call_iter->prev;
-
-    vm->call_chain = call_iter;
-    vm->num_registers = call_iter->regs_used; /* todo: verify */
-    vm->call_depth = 0;
+    rewind_interpreter(parser);
 
     /* Symtab will choose to hide new classes (if executing) or destroy them (if
        not executing). New vars are destroyed, and the main module is made
@@ -343,7 +398,13 @@ static void handle_rewind(lily_parse_state *parser)
     lily_rewind_state *rs = parser->rs;
 
     if (parser->rs->pending) {
-        rewind_parser(parser, rs);
+        /* The parsing parts of a frozen state are shared, and were already
+           rewound when it was frozen. */
+        if (parser->frozen)
+            rewind_interpreter(parser);
+        else
+            rewind_parser(parser, rs);
+
         parser->rs->pending = 0;
     }
 
@@ -1682,6 +1743,22 @@ lily_class *lily_dynaload_exception(lily_parse_state *parser, const char *name)
     return (lily_class *)try_toplevel_dynaload(parser, m, name);
 }
 
+/* Find 'name' within the builtin module, dynaloading it if it hasn't been
+   loaded yet. This is used to rebuild builtin items when loading a cache. */
+lily_item *lily_find_or_dl_builtin(lily_parse_state *parser, const char *name)
+{
+    lily_module_entry *m = parser->module_start;
+    lily_item *result = (lily_item *)lily_find_var(parser->symtab, m, name);
+
+    if (result == NULL)
+        result = (lily_item *)lily_find_class(parser->symtab, m, name);
+
+    if (result == NULL)
+        result = try_toplevel_dynaload(parser, m, name);
+
+    return result;
+}
+
 /* Like find_run_dynaload, but only do the dynaload if the entity to be loaded
    is a class-like entity. */
 static lily_class *find_run_class_dynaload(lily_parse_state *parser,
@@ -4389,6 +4466,67 @@ static void setup_and_exec_vm(lily_parse_state *parser)
     lily_reset_main(parser->emit);
 }
 
+/* Template mode: This writes the text that the lexer collected between two
+   tags as a readonly ByteString, and emits code to render it. */
+static void emit_template_content(lily_parse_state *parser)
+{
+    const char *text = lily_mb_get(parser->lex->content);
+    int size = strlen(text);
+
+    if (size == 0)
+        return;
+
+    lily_literal *lit = lily_get_bytestring_literal(parser->symtab, text, size);
+    lily_emit_render_content(parser->emit, lit->reg_spot);
+}
+
+/* Template mode: The template has been parsed, and __main__ holds the code for
+   all of it. This makes a function holding a copy of that code, so that it can
+   be run again later without going through the parser again. */
+static lily_function_val *finish_template(lily_parse_state *parser)
+{
+    lily_emit_state *emit = parser->emit;
+    lily_function_val *main_function = parser->symtab->main_function;
+
+    lily_register_classes(parser->symtab, parser->vm);
+    lily_prepare_main(emit);
+    update_all_cid_tables(parser);
+
+    lily_function_val *f = lily_malloc(sizeof(lily_function_val));
+    /* Don't trust code_len, since it's only 16 bits wide. */
+    uint32_t code_size = lily_u16_pos(emit->code) * sizeof(uint16_t);
+
+    *f = *main_function;
+    f->refcount = 1;
+    f->code = lily_malloc(code_size);
+    memcpy(f->code, main_function->code, code_size);
+
+    lily_reset_main(emit);
+    return f;
+}
+
+/* This runs a template made by finish_template. Templates run as __main__,
+   because their vars are globals that the functions they declare rely on. */
+static void exec_template(lily_parse_state *parser, lily_function_val *f)
+{
+    lily_function_val *main_function = parser->symtab->main_function;
+
+    main_function->code = f->code;
+    main_function->code_len = f->code_len;
+    /* Use all of __main__'s registers, instead of what the template had when
+       it was compiled. Templates compiled since then may have added globals,
+       and those need to stay visible to the gc. */
+    main_function->reg_count = parser->emit->main_block->next_reg_spot;
+
+    lily_vm_prep(parser->vm, parser->symtab, parser->symtab->literals->data,
+            parser->foreign_values);
+
+    parser->executing = 1;
+    parser->vm->rendering = 1;
+    lily_vm_execute(parser->vm);
+    parser->executing = 0;
+}
+
 /* This is the entry point of the parser. It parses the thing that it was given
    and then runs the code. This shouldn't be called directly, but instead by
    one of the lily_parse_* functions that will set it up right. */
@@ -4410,17 +4548,22 @@ static void parser_loop(lily_parse_state *parser, const char *filename)
                            "Unterminated block(s) at end of parsing.");
             }
 
-            setup_and_exec_vm(parser);
-
             if (lex->token == tk_end_tag) {
                 lily_lexer_handle_content(parser->lex);
-                if (lex->token == tk_eof)
-                    break;
-                else
+                emit_template_content(parser);
+                if (lex->token != tk_eof) {
                     lily_lexer(lex);
+                    continue;
+                }
             }
-            else
-                break;
+
+            /* Templates are run by the caller, once they're compiled. */
+            if (parser->write_cache)
+                lily_write_cache(parser, filename);
+            else if (lex->in_template == 0)
+                setup_and_exec_vm(parser);
+
+            break;
         }
         else if (lex->token == tk_docstring) {
             process_docstring(parser);
@@ -4524,8 +4667,27 @@ static void build_error(lily_parse_state *parser)
     }
 }
 
+/* Snapshots and their clones share the parts of the parser that they were
+   frozen with, so this is used to refuse parsing with them. */
+static int reject_frozen(lily_parse_state *parser)
+{
+    handle_rewind(parser);
+
+    if (setjmp(parser->raiser->all_jumps->jump) == 0)
+        lily_raise_err(parser->raiser,
+                "Cannot parse with a snapshot or a clone of one.");
+
+    parser->rs->pending = 1;
+    return 0;
+}
+
 static int parse_file(lily_parse_state *parser, const char *filename)
 {
+    if (parser->frozen)
+        return reject_frozen(parser);
+
+    int first_pass = parser->first_pass;
+
     if (parser->first_pass)
         fix_first_file_name(parser, filename);
 
@@ -4538,6 +4700,21 @@ static int parse_file(lily_parse_state *parser, const char *filename)
         if (suffix == NULL || strcmp(suffix, ".lly") != 0)
             lily_raise_err(parser->raiser, "File name must end with '.lly'.");
 
+        if (parser->write_cache && first_pass == 0)
+            lily_raise_err(parser->raiser,
+                    "Only the first file of an interpreter can be cached.");
+
+        /* A cache assumes that nothing has been loaded before it. Templates
+           are not cached, because a cache does not record the mode that it
+           was made in. */
+        if (first_pass && parser->write_cache == 0 &&
+            parser->lex->in_template == 0 &&
+            lily_load_cache(parser, filename)) {
+            setup_and_exec_vm(parser);
+            lily_mb_flush(parser->msgbuf);
+            return 1;
+        }
+
         lily_load_source(parser->lex, et_file, filename);
         parser_loop(parser, filename);
         lily_pop_lex_entry(parser->lex);
@@ -4553,6 +4730,9 @@ static int parse_file(lily_parse_state *parser, const char *filename)
 
 static int parse_string(lily_parse_state *parser, const char *name, char *str)
 {
+    if (parser->frozen)
+        return reject_frozen(parser);
+
     if (parser->first_pass)
         fix_first_file_name(parser, name);
 
@@ -4577,6 +4757,20 @@ int lily_parse_file(lily_state *s, const char *name)
     return parse_file(s->parser, name);
 }
 
+/* This parses a file without running it, and writes a cache of it instead.
+   Later calls to lily_parse_file for that file will load the cache. */
+int lily_cache_file(lily_state *s, const char *name)
+{
+    lily_parse_state *parser = s->parser;
+
+    lily_set_in_template(parser->lex, 0);
+    parser->write_cache = 1;
+    int result = parse_file(parser, name);
+    parser->write_cache = 0;
+
+    return result;
+}
+
 int lily_parse_string(lily_state *s, const char *name,
         char *str)
 {
@@ -4590,9 +4784,12 @@ int lily_parse_expr(lily_state *s, const char *name, char *str,
     if (text)
         *text = NULL;
 
-    lily_set_in_template(s->parser->lex, 0);
-
     lily_parse_state *parser = s->parser;
+    if (parser->frozen)
+        return reject_frozen(parser);
+
+    lily_set_in_template(parser->lex, 0);
+
     if (parser->first_pass)
         fix_first_file_name(parser, name);
 
@@ -4613,16 +4810,22 @@ int lily_parse_expr(lily_state *s, const char *name, char *str,
         lily_pop_lex_entry(parser->lex);
 
         if (sym && text) {
-            lily_value *reg = s->regs_from_main[sym->reg_spot];
+            lily_value *reg = &s->regs_from_main[sym->reg_spot];
             lily_msgbuf *msgbuf = parser->msgbuf;
 
             lily_mb_flush(msgbuf);
             lily_mb_add_fmt(msgbuf, "(^T): ", sym->type);
 
             /* Add value doesn't quote String values, because most callers do
-               not want that. This one does, so bypass that. */
-            if (reg->class_id == LILY_STRING_ID)
-                lily_mb_add_fmt(msgbuf, "\"%s\"", reg->value.string->string);
+               not want that. This one does, so bypass that. The String may be
+               a view, so the bytes are added by size. */
+            if (reg->class_id == LILY_STRING_ID) {
+                lily_string_val *sv = reg->value.string;
+
+                lily_mb_add_char(msgbuf, '"');
+                lily_mb_add_slice(msgbuf, sv->string, 0, sv->size);
+                lily_mb_add_char(msgbuf, '"');
+            }
             else
                 lily_mb_add_value(msgbuf, s, reg);
 
@@ -4637,17 +4840,245 @@ int lily_parse_expr(lily_state *s, const char *name, char *str,
     return 0;
 }
 
+/* This reads the template file 'name' into a \0 terminated buffer, so that it
+   can be hashed and then parsed without reading the file twice. If the file
+   can't be read, or isn't a .lly file, then NULL is returned. The caller uses
+   parse_file instead, so that the error is the same as for any other file. */
+static char *read_template_file(const char *name)
+{
+    const char *suffix = strrchr(name, '.');
+    if (suffix == NULL || strcmp(suffix, ".lly") != 0)
+        return NULL;
+
+    FILE *f = fopen(name, "r");
+    if (f == NULL)
+        return NULL;
+
+    size_t size = 4096, pos = 0, count;
+    char *buffer = lily_malloc(size);
+
+    while ((count = fread(buffer + pos, 1, size - pos - 1, f)) != 0) {
+        pos += count;
+
+        if (pos + 1 == size) {
+            size *= 2;
+            buffer = lily_realloc(buffer, size);
+        }
+    }
+
+    fclose(f);
+    buffer[pos] = '\0';
+
+    /* String sources end at the first \0, so leave a file with one inside to
+       parse_file. */
+    if (strlen(buffer) != pos) {
+        lily_free(buffer);
+        buffer = NULL;
+    }
+
+    return buffer;
+}
+
+/* This compiles the template 'name', unless it has already been compiled from
+   the same source. If 'str' is NULL, then 'name' is a file to read.
+   There is one template for each name. If the source of a name changes, the
+   new function replaces the old one, which is freed. A host that reloads
+   templates then holds onto one function for each, instead of every version
+   it has seen. */
+static lily_function_val *compile_template(lily_parse_state *parser,
+        const char *name, char *str)
+{
+    uint64_t source_size = 0, source_hash = 0;
+    char *text = NULL;
+
+    if (str == NULL)
+        str = text = read_template_file(name);
+
+    if (str)
+        lily_cache_identify_string(str, &source_size, &source_hash);
+
+    lily_template *t = parser->templates;
+    while (t) {
+        if (strcmp(t->name, name) == 0)
+            break;
+
+        t = t->next;
+    }
+
+    if (t && str &&
+        t->source_size == source_size &&
+        t->source_hash == source_hash) {
+        lily_free(text);
+        return t->func;
+    }
+
+    int result;
+
+    if (parser->frozen) {
+        lily_free(text);
+        reject_frozen(parser);
+        return NULL;
+    }
+
+    lily_set_in_template(parser->lex, 1);
+
+    if (str)
+        result = parse_string(parser, name, str);
+    else
+        result = parse_file(parser, name);
+
+    /* Only the source of the template is in template mode. Anything that is
+       dynaloaded later (like an exception that the vm raises) is plain code. */
+    lily_set_in_template(parser->lex, 0);
+    lily_free(text);
+
+    /* The function from before (if any) is still good. */
+    if (result == 0)
+        return NULL;
+
+    if (t == NULL) {
+        t = lily_malloc(sizeof(lily_template));
+        t->name = lily_malloc(strlen(name) + 1);
+        strcpy(t->name, name);
+        t->next = parser->templates;
+        parser->templates = t;
+    }
+    else {
+        lily_free(t->func->code);
+        lily_free(t->func);
+    }
+
+    t->func = finish_template(parser);
+    t->source_size = source_size;
+    t->source_hash = source_hash;
+
+    return t->func;
+}
+
+lily_function_val *lily_compile_template_string(lily_state *s,
+        const char *name, char *str)
+{
+    return compile_template(s->parser, name, str);
+}
+
+lily_function_val *lily_compile_template_file(lily_state *s,
+        const char *filename)
+{
+    return compile_template(s->parser, filename, NULL);
+}
+
+int lily_render_template(lily_state *s, lily_function_val *f)
+{
+    lily_parse_state *parser = s->parser;
+    int result;
+
+    handle_rewind(parser);
+
+    if (setjmp(parser->raiser->all_jumps->jump) == 0) {
+        exec_template(parser, f);
+        result = 1;
+    }
+    else {
+        parser->rs->pending = 1;
+        result = 0;
+    }
+
+    /* Send what was rendered, even if there was an error. */
+    s->rendering = 0;
+    lily_render_flush(s);
+    return result;
+}
+
 int lily_render_string(lily_state *s, const char *name,
         char *str)
 {
-    lily_set_in_template(s->parser->lex, 1);
-    return parse_string(s->parser, name, str);
+    lily_function_val *f = compile_template(s->parser, name, str);
+    if (f == NULL)
+        return 0;
+
+    return lily_render_template(s, f);
 }
 
 int lily_render_file(lily_state *s, const char *filename)
 {
-    lily_set_in_template(s->parser->lex, 1);
-    return parse_file(s->parser, filename);
+    lily_function_val *f = compile_template(s->parser, filename, NULL);
+    if (f == NULL)
+        return 0;
+
+    return lily_render_template(s, f);
+}
+
+/* A snapshot owns the state that it was made from. */
+struct lily_snapshot_ {
+    lily_parse_state *parser;
+};
+
+lily_snapshot *lily_state_snapshot(lily_state *s)
+{
+    lily_parse_state *parser = s->parser;
+
+    handle_rewind(parser);
+
+    /* Clones can't dynaload, so load what the vm might need now. The vm is
+       prepped (without running) so that values waiting to be dynaloaded are in
+       registers to be copied. */
+    lily_vm_load_exceptions(parser->vm);
+    lily_register_classes(parser->symtab, parser->vm);
+    lily_prepare_main(parser->emit);
+    lily_vm_prep(parser->vm, parser->symtab, parser->symtab->literals->data,
+            parser->foreign_values);
+    update_all_cid_tables(parser);
+    lily_reset_main(parser->emit);
+
+    parser->frozen = 1;
+
+    lily_snapshot *snapshot = lily_malloc(sizeof(lily_snapshot));
+    snapshot->parser = parser;
+    return snapshot;
+}
+
+lily_state *lily_state_clone(lily_snapshot *snapshot, void *data)
+{
+    lily_parse_state *source = snapshot->parser;
+    lily_parse_state *parser = lily_malloc(sizeof(lily_parse_state));
+
+    if (data == NULL)
+        data = source->vm->data;
+
+    *parser = *source;
+    parser->clone_source = source;
+    parser->data = data;
+    parser->raiser = lily_new_raiser();
+    parser->msgbuf = lily_new_msgbuf(64);
+    parser->foreign_values = lily_new_value_stack();
+
+    parser->rs = lily_malloc(sizeof(lily_rewind_state));
+    *parser->rs = *source->rs;
+    parser->rs->pending = 0;
+
+    /* Templates run by swapping the code of __main__, so each clone needs its
+       own. */
+    parser->symtab = lily_malloc(sizeof(lily_symtab));
+    *parser->symtab = *source->symtab;
+    parser->symtab->main_function = lily_malloc(sizeof(lily_function_val));
+    *parser->symtab->main_function = *source->symtab->main_function;
+
+    lily_vm_state *vm = lily_vm_clone(source->vm, parser->raiser,
+            source->emit->main_block->next_reg_spot);
+
+    vm->data = data;
+    vm->parser = parser;
+    vm->symtab = parser->symtab;
+    vm->vm_buffer = parser->raiser->msgbuf;
+    parser->vm = vm;
+
+    return vm;
+}
+
+void lily_free_snapshot(lily_snapshot *snapshot)
+{
+    lily_free_state(snapshot->parser->vm);
+    lily_free(snapshot);
 }
 
 lily_function_val *lily_get_func(lily_vm_state *vm, const char *name)
@@ -4660,6 +5091,8 @@ lily_function_val *lily_get_func(lily_vm_state *vm, const char *name)
 
     if (v)
         result = vm->readonly_table[v->reg_spot]->value.function;
+    else if (vm->parser->cache)
+        result = lily_cache_find_func(vm->parser->cache, vm, name);
     else
         result = NULL;
 
@@ -15,6 +15,8 @@
 # include "lily_api_msgbuf.h"
 
 struct lily_rewind_state_;
+struct lily_cache_;
+struct lily_template_;
 
 typedef struct lily_parse_state_ {
     lily_module_entry *module_start;
@@ -26,7 +28,11 @@ typedef struct lily_parse_state_ {
 
     uint16_t executing;
     uint16_t first_pass;
-    uint32_t pad;
+    /* If 1, the first file is written to a cache instead of being run. */
+    uint16_t write_cache;
+    /* If 1, this is a snapshot or a clone of one. These can run templates that
+       were compiled before the snapshot, but can't parse anything else. */
+    uint16_t frozen;
 
     /* The current expression state. */
     lily_expr_state *expr;
@@ -57,6 +63,14 @@ typedef struct lily_parse_state_ {
     lily_raiser *raiser;
     struct lily_options_ *options;
     struct lily_rewind_state_ *rs;
+    /* This is set if the first file was loaded from a cache. */
+    struct lily_cache_ *cache;
+    /* Templates that have been compiled, newest first. */
+    struct lily_template_ *templates;
+    /* Clones only: The snapshot parser that this was cloned from. A clone
+       shares everything but its raiser, msgbuf, rs, vm, foreign values, and
+       symtab (which is a shallow copy with its own __main__). */
+    struct lily_parse_state_ *clone_source;
     void *data;
 } lily_parse_state;
 
@@ -66,5 +80,6 @@ lily_sym *lily_parser_interp_eval(lily_parse_state *, int, const char *);
 lily_item *lily_find_or_dl_member(lily_parse_state *, lily_class *,
         const char *);
 lily_class *lily_dynaload_exception(lily_parse_state *, const char *);
+lily_item *lily_find_or_dl_builtin(lily_parse_state *, const char *);
 
 #endif
@@ -2,10 +2,12 @@
 #include <errno.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/stat.h>
 
 #include "lily_parser.h"
 #include "lily_symtab.h"
 #include "lily_utf8.h"
+#include "lily_search.h"
 #include "lily_move.h"
 #include "lily_value_flags.h"
 #include "lily_value_structs.h"
@@ -286,14 +288,7 @@ static const char follower_table[256] =
 
 static lily_string_val *make_sv(lily_state *s, int size)
 {
-    lily_string_val *new_sv = lily_malloc(sizeof(lily_string_val));
-    char *new_string = lily_malloc(sizeof(char) * size);
-
-    new_sv->string = new_string;
-    new_sv->size = size - 1;
-    new_sv->refcount = 0;
-
-    return new_sv;
+    return lily_new_string_blank(size - 1);
 }
 
 void do_str_slice(lily_state *s, int is_bytestring)
@@ -323,13 +318,21 @@ void do_str_slice(lily_state *s, int is_bytestring)
         return;
     }
 
-    char *raw = lily_string_raw(sv);
+    /* This reads the bytes directly, because a view of the result can be made
+       without making 'sv' have a terminator. The end of 'sv' is always a valid
+       place to start or stop. */
+    char *raw = sv->string;
     if (is_bytestring == 0) {
-        if (follower_table[(unsigned char)raw[start]] == -1 ||
-            follower_table[(unsigned char)raw[stop]] == -1) {
+        if ((start != sv->size &&
+             follower_table[(unsigned char)raw[start]] == -1) ||
+            (stop != sv->size &&
+             follower_table[(unsigned char)raw[stop]] == -1)) {
             lily_return_string(s, lily_new_string(""));
             return;
         }
+
+        lily_return_string(s, lily_new_string_view(sv, start, stop - start));
+        return;
     }
 
     int new_size = (stop - start) + 1;
@@ -543,6 +546,58 @@ void lily_builtin_File_close(lily_state *s)
     lily_return_unit(s);
 }
 
+/* This reads the next line of 'filev' into the line buffer of 'filev'. The
+   newline at the end (if there is one) is included. The size of the line is
+   returned, or 0 if there is nothing left to read. Lines may have \0 inside of
+   them, so callers should use the size instead of strlen.
+   Where getline is available, the line is found by scanning the C library's
+   buffer for the newline, instead of one libc call per byte. */
+static size_t read_file_line(lily_file_val *filev)
+{
+    FILE *f = filev->inner_file;
+
+#ifndef _WIN32
+    ssize_t result = getline(&filev->line_buffer, &filev->line_capacity, f);
+
+    if (result == -1)
+        result = 0;
+
+    return (size_t)result;
+#else
+    size_t pos = 0;
+    int ch;
+
+    /* fgets isn't used because it may read in \0's without saying how much
+       was written. */
+    while ((ch = fgetc(f)) != EOF) {
+        if (pos + 1 >= filev->line_capacity) {
+            size_t new_capacity = filev->line_capacity ?
+                    filev->line_capacity * 2 : 128;
+
+            /* This buffer is given to free when the File is destroyed, since
+               getline allocates it with malloc on other platforms. Use the
+               plain allocator here so both sides match. */
+            char *new_buffer = realloc(filev->line_buffer, new_capacity);
+            if (new_buffer == NULL)
+                abort();
+
+            filev->line_buffer = new_buffer;
+            filev->line_capacity = new_capacity;
+        }
+
+        filev->line_buffer[pos] = (char)ch;
+        pos++;
+
+        /* \r is intentionally not checked for, because it's been a very, very
+           long time since any os used \r alone for newlines. */
+        if (ch == '\n')
+            break;
+    }
+
+    return pos;
+#endif
+}
+
 /**
 method File.each_line(self: File, fn: Function(ByteString))
 
@@ -555,46 +610,19 @@ Read each line of text from `self`, passing it down to `fn` for processing.
 void lily_builtin_File_each_line(lily_state *s)
 {
     lily_file_val *filev = lily_arg_file(s, 0);
-    lily_msgbuf *vm_buffer = lily_get_msgbuf(s);
-    char read_buffer[128];
-    int ch = 0, pos = 0;
+    size_t size;
 
     lily_file_ensure_readable(s, filev);
-    FILE *f = filev->inner_file;
-
     lily_call_prepare(s, lily_arg_function(s, 1));
 
-    /* This uses fgetc in a loop because fgets may read in \0's, but doesn't
-       tell how much was written. */
-    while (1) {
-        ch = fgetc(f);
+    while ((size = read_file_line(filev)) != 0) {
+        lily_push_bytestring(s,
+                lily_new_bytestring_sized(filev->line_buffer, size));
+        lily_call_exec_prepared(s, 1);
 
-        if (ch == EOF)
+        /* The callback may have closed the File. */
+        if (filev->inner_file == NULL)
             break;
-
-        if (pos == sizeof(read_buffer)) {
-            lily_mb_add_slice(vm_buffer, read_buffer, 0, sizeof(read_buffer));
-            pos = 0;
-        }
-
-        read_buffer[pos] = (char)ch;
-
-        /* \r is intentionally not checked for, because it's been a very, very
-           long time since any os used \r alone for newlines. */
-        if (ch == '\n') {
-            if (pos != 0) {
-                lily_mb_add_slice(vm_buffer, read_buffer, 0, pos);
-                pos = 0;
-            }
-
-            const char *text = lily_mb_get(vm_buffer);
-
-            lily_push_bytestring(s, lily_new_bytestring(text));
-            lily_call_exec_prepared(s, 1);
-            lily_mb_flush(vm_buffer);
-        }
-        else
-            pos++;
     }
 
     lily_return_unit(s);
@@ -676,10 +704,26 @@ with a newline at the end.
 void lily_builtin_File_print(lily_state *s)
 {
     lily_builtin_File_write(s);
-    fputc('\n', lily_arg_file_raw(s, 0));
+    lily_vm_write_file(s, lily_arg_file_raw(s, 0), "\n", 1);
     lily_return_unit(s);
 }
 
+/* This returns how many bytes are left in 'f', if 'f' is a regular file. If the
+   size can't be known, then 0 is returned instead. */
+static size_t file_size_hint(FILE *f)
+{
+#ifndef _WIN32
+    struct stat st;
+
+    if (fstat(fileno(f), &st) == 0 && S_ISREG(st.st_mode)) {
+        long at = ftell(f);
+        if (at >= 0 && st.st_size > at)
+            return (size_t)(st.st_size - at);
+    }
+#endif
+    return 0;
+}
+
 /**
 method File.read(self: File, size: *Integer=-1): ByteString
 
@@ -695,7 +739,7 @@ void lily_builtin_File_read(lily_state *s)
 {
     lily_file_val *filev = lily_arg_file(s,0);
     lily_file_ensure_readable(s, filev);
-    int need = -1;
+    int64_t need = -1;
     if (lily_arg_count(s) == 2)
         need = lily_arg_integer(s, 1);
 
@@ -704,38 +748,38 @@ void lily_builtin_File_read(lily_state *s)
         need = -1;
 
     FILE *raw_file = lily_file_raw(filev);
-    size_t bufsize = 64;
+    size_t hint = file_size_hint(raw_file);
+    /* The +2 leaves room for the terminator, and one more byte so that a read
+       of the whole file finds EOF without having to grow the buffer. */
+    size_t bufsize = hint ? hint + 2 : 64;
+    size_t pos = 0;
+
+    if (need != -1 && (size_t)need + 1 < bufsize)
+        bufsize = (size_t)need + 1;
+
     char *buffer = lily_malloc(bufsize);
-    int pos = 0, nread;
-    int nbuf = bufsize/2;
 
     while (1) {
-        int to_read;
         /* Read either the max possible, or the rest that's needed. */
-        if (need == -1 || need > nbuf)
-            to_read = nbuf;
-        else
-            to_read = need;
+        size_t to_read = bufsize - pos - 1;
+        if (need != -1 && to_read > (size_t)need - pos)
+            to_read = (size_t)need - pos;
 
-        nread = fread(buffer+pos, 1, to_read, raw_file);
+        size_t nread = fread(buffer + pos, 1, to_read, raw_file);
         pos += nread;
 
-        if (pos >= bufsize) {
-            nbuf = bufsize;
-            bufsize *= 2;
-            buffer = lily_realloc(buffer, bufsize);
-        }
-
         /* Done if EOF hit (first), or got what was wanted (second). */
-        if (nread < to_read || (pos >= need && need != -1)) {
-            buffer[pos] = '\0';
+        if (nread < to_read || (need != -1 && pos == (size_t)need))
             break;
+
+        if (pos + 1 == bufsize) {
+            bufsize *= 2;
+            buffer = lily_realloc(buffer, bufsize);
         }
-        else if (to_read != -1)
-            to_read -= nread;
     }
 
-    lily_return_bytestring(s, lily_new_bytestring_take(buffer));
+    buffer[pos] = '\0';
+    lily_return_bytestring(s, lily_new_bytestring_take_sized(buffer, pos));
 }
 
 /**
@@ -752,43 +796,13 @@ should check the result against `B""`. This will be fixed in a future release.
 void lily_builtin_File_read_line(lily_state *s)
 {
     lily_file_val *filev = lily_arg_file(s, 0);
-    lily_msgbuf *vm_buffer = lily_get_msgbuf(s);
-    char read_buffer[128];
-    int ch = 0, pos = 0, total_pos = 0;
 
     lily_file_ensure_readable(s, filev);
-    FILE *f = filev->inner_file;
 
-    /* This uses fgetc in a loop because fgets may read in \0's, but doesn't
-       tell how much was written. */
-    while (1) {
-        ch = fgetc(f);
-
-        if (ch == EOF)
-            break;
-
-        if (pos == sizeof(read_buffer)) {
-            lily_mb_add_slice(vm_buffer, read_buffer, 0, sizeof(read_buffer));
-            total_pos += pos;
-            pos = 0;
-        }
+    size_t size = read_file_line(filev);
+    const char *line = size ? filev->line_buffer : "";
 
-        read_buffer[pos] = (char)ch;
-        pos++;
-
-        /* \r is intentionally not checked for, because it's been a very, very
-           long time since any os used \r alone for newlines. */
-        if (ch == '\n')
-            break;
-    }
-
-    if (pos != 0) {
-        lily_mb_add_slice(vm_buffer, read_buffer, 0, pos);
-        total_pos += pos;
-    }
-
-    const char *text = lily_mb_get(vm_buffer);
-    lily_return_bytestring(s, lily_new_bytestring_sized(text, total_pos));
+    lily_return_bytestring(s, lily_new_bytestring_sized(line, size));
 }
 
 /**
@@ -808,12 +822,15 @@ void lily_builtin_File_write(lily_state *s)
     lily_file_ensure_writeable(s, filev);
 
     if (to_write->class_id == LILY_STRING_ID)
-        fputs(to_write->value.string->string, filev->inner_file);
+        lily_vm_write_file(s, filev->inner_file,
+                to_write->value.string->string, to_write->value.string->size);
     else {
         lily_msgbuf *msgbuf = s->vm_buffer;
         lily_mb_flush(msgbuf);
         lily_mb_add_value(msgbuf, s, to_write);
-        fputs(lily_mb_get(msgbuf), filev->inner_file);
+
+        const char *text = lily_mb_get(msgbuf);
+        lily_vm_write_file(s, filev->inner_file, text, strlen(text));
     }
 
     lily_return_unit(s);
@@ -870,31 +887,14 @@ static inline void remove_key_check(lily_state *s, lily_hash_val *hash_val)
         lily_RuntimeError(s, "Cannot remove key from hash during iteration.");
 }
 
-static void destroy_hash_elems(lily_hash_val *hash_val)
-{
-    int i;
-    for (i = 0;i < hash_val->num_bins;i++) {
-        lily_hash_entry *entry = hash_val->bins[i];
-        if (entry) {
-            lily_deref(entry->boxed_key);
-            lily_free(entry->boxed_key);
-
-            lily_deref(entry->record);
-            lily_free(entry->record);
-
-            lily_free(entry);
-            hash_val->bins[i] = NULL;
-        }
-    }
-}
-
 void lily_destroy_hash(lily_value *v)
 {
     lily_hash_val *hv = v->value.hash;
 
-    destroy_hash_elems(hv);
+    lily_hash_clear(hv);
 
-    lily_free(hv->bins);
+    lily_free(hv->ctrl);
+    lily_free(hv->entries);
     lily_free(hv);
 }
 
@@ -914,9 +914,7 @@ void lily_builtin_Hash_clear(lily_state *s)
     if (hash_val->iter_count != 0)
         lily_RuntimeError(s, "Cannot remove key from hash during iteration.");
 
-    destroy_hash_elems(hash_val);
-
-    hash_val->num_entries = 0;
+    lily_hash_clear(hash_val);
 
     lily_return_unit(s);
 }
@@ -938,18 +936,11 @@ void lily_builtin_Hash_delete(lily_state *s)
     remove_key_check(s, hash_val);
 
     lily_value *key = lily_arg_value(s, 1);
-    lily_value *v;
-
-    if (lily_hash_delete(hash_val, &key, &v)) {
-        if (key->flags & VAL_IS_DEREFABLE)
-            lily_deref(key);
-
-        lily_free(key);
+    lily_value old_key, old_record;
 
-        if (v->flags & VAL_IS_DEREFABLE)
-            lily_deref(v);
-
-        lily_free(v);
+    if (lily_hash_delete(hash_val, key, &old_key, &old_record)) {
+        lily_deref(&old_key);
+        lily_deref(&old_record);
     }
 
     lily_return_unit(s);
@@ -970,14 +961,13 @@ void lily_builtin_Hash_each_pair(lily_state *s)
     hash_val->iter_count++;
     lily_jump_link *link = lily_jump_setup(s->raiser);
     if (setjmp(link->jump) == 0) {
-        int i;
-        for (i = 0;i < hash_val->num_bins;i++) {
-            lily_hash_entry *entry = hash_val->bins[i];
-            if (entry) {
-                lily_push_value(s, entry->boxed_key);
-                lily_push_value(s, entry->record);
-                lily_call_exec_prepared(s, 2);
-            }
+        lily_hash_entry *entry;
+        int pos = 0;
+
+        while ((entry = lily_hash_next_entry(hash_val, &pos)) != NULL) {
+            lily_push_value(s, &entry->boxed_key);
+            lily_push_value(s, &entry->record);
+            lily_call_exec_prepared(s, 2);
         }
 
         hash_val->iter_count--;
@@ -1034,14 +1024,12 @@ void lily_builtin_Hash_keys(lily_state *s)
 {
     lily_hash_val *hash_val = lily_arg_hash(s, 0);
     lily_list_val *result_lv = lily_new_list(hash_val->num_entries);
-    int i, list_i;
+    lily_hash_entry *entry;
+    int pos = 0, list_i = 0;
 
-    for (i = 0, list_i = 0;i < hash_val->num_bins;i++) {
-        lily_hash_entry *entry = hash_val->bins[i];
-        if (entry) {
-            lily_value_assign(result_lv->elems[list_i], entry->boxed_key);
-            list_i++;
-        }
+    while ((entry = lily_hash_next_entry(hash_val, &pos)) != NULL) {
+        lily_value_assign(&result_lv->elems[list_i], &entry->boxed_key);
+        list_i++;
     }
 
     lily_return_list(s, result_lv);
@@ -1079,18 +1067,17 @@ void lily_builtin_Hash_map_values(lily_state *s)
     lily_jump_link *link = lily_jump_setup(s->raiser);
 
     if (setjmp(link->jump) == 0) {
-        int i;
-        for (i = 0;i < hash_val->num_bins;i++) {
-            lily_hash_entry *entry = hash_val->bins[i];
-            if (entry) {
-                lily_push_value(s, entry->boxed_key);
-                lily_push_value(s, entry->record);
+        lily_hash_entry *entry;
+        int pos = 0;
 
-                lily_call_exec_prepared(s, 1);
+        while ((entry = lily_hash_next_entry(hash_val, &pos)) != NULL) {
+            lily_push_value(s, &entry->boxed_key);
+            lily_push_value(s, &entry->record);
 
-                lily_push_value(s, lily_result_value(s));
-                count++;
-            }
+            lily_call_exec_prepared(s, 1);
+
+            lily_push_value(s, lily_result_value(s));
+            count++;
         }
 
         lily_hash_val *result_hash = lily_new_hash_like_sized(hash_val, count);
@@ -1120,24 +1107,20 @@ void lily_builtin_Hash_merge(lily_state *s)
     lily_hash_val *result_hash = lily_new_hash_like_sized(hash_val,
             hash_val->num_entries);
 
-    int i, j;
+    lily_hash_entry *entry;
+    int i, pos = 0;
 
-    for (i = 0;i < hash_val->num_bins;i++) {
-        lily_hash_entry *entry = hash_val->bins[i];
-        if (entry)
-            lily_hash_insert_value(result_hash, entry->boxed_key,
-                    entry->record);
-    }
+    while ((entry = lily_hash_next_entry(hash_val, &pos)) != NULL)
+        lily_hash_insert_value(result_hash, &entry->boxed_key, &entry->record);
 
     lily_list_val *to_merge = lily_arg_list(s, 1);
     for (i = 0;i < to_merge->num_values;i++) {
-        lily_hash_val *merging_hash = to_merge->elems[i]->value.hash;
-        for (j = 0;j < merging_hash->num_bins;j++) {
-            lily_hash_entry *entry = merging_hash->bins[j];
-            if (entry)
-                lily_hash_insert_value(result_hash, entry->boxed_key,
-                        entry->record);
-        }
+        lily_hash_val *merging_hash = to_merge->elems[i].value.hash;
+
+        pos = 0;
+        while ((entry = lily_hash_next_entry(merging_hash, &pos)) != NULL)
+            lily_hash_insert_value(result_hash, &entry->boxed_key,
+                    &entry->record);
     }
 
     lily_return_hash(s, result_hash);
@@ -1153,24 +1136,23 @@ static void hash_select_reject_common(lily_state *s, int expect)
     lily_jump_link *link = lily_jump_setup(s->raiser);
 
     if (setjmp(link->jump) == 0) {
-        int i;
-        for (i = 0;i < hash_val->num_bins;i++) {
-            lily_hash_entry *entry = hash_val->bins[i];
-            if (entry) {
-                lily_push_value(s, entry->boxed_key);
-                lily_push_value(s, entry->record);
-
-                lily_push_value(s, entry->boxed_key);
-                lily_push_value(s, entry->record);
-
-                lily_call_exec_prepared(s, 2);
-                if (lily_result_boolean(s) != expect) {
-                    lily_result_drop(s);
-                    lily_result_drop(s);
-                }
-                else
-                    count++;
+        lily_hash_entry *entry;
+        int pos = 0;
+
+        while ((entry = lily_hash_next_entry(hash_val, &pos)) != NULL) {
+            lily_push_value(s, &entry->boxed_key);
+            lily_push_value(s, &entry->record);
+
+            lily_push_value(s, &entry->boxed_key);
+            lily_push_value(s, &entry->record);
+
+            lily_call_exec_prepared(s, 2);
+            if (lily_result_boolean(s) != expect) {
+                lily_result_drop(s);
+                lily_result_drop(s);
             }
+            else
+                count++;
         }
 
         lily_hash_val *result_hash = lily_new_hash_like_sized(hash_val, count);
@@ -1342,10 +1324,8 @@ void lily_builtin_List_clear(lily_state *s)
     lily_list_val *list_val = lily_arg_list(s, 0);
     int i;
 
-    for (i = 0;i < list_val->num_values;i++) {
-        lily_deref(list_val->elems[i]);
-        lily_free(list_val->elems[i]);
-    }
+    for (i = 0;i < list_val->num_values;i++)
+        lily_deref(&list_val->elems[i]);
 
     list_val->extra_space += list_val->num_values;
     list_val->num_values = 0;
@@ -1367,7 +1347,7 @@ void lily_builtin_List_count(lily_state *s)
 
     int i;
     for (i = 0;i < list_val->num_values;i++) {
-        lily_push_value(s, list_val->elems[i]);
+        lily_push_value(s, &list_val->elems[i]);
         lily_call_exec_prepared(s, 1);
 
         if (lily_result_boolean(s) == 1)
@@ -1377,6 +1357,17 @@ void lily_builtin_List_count(lily_state *s)
     lily_return_integer(s, count);
 }
 
+/* Put a copy of 'v' (with a ref) into 'slot', which is spare space in a list
+   and may hold a stale value that was moved out. */
+static void copy_into_free_slot(lily_value *slot, lily_value *v)
+{
+    if (v->flags & VAL_IS_DEREFABLE)
+        v->value.generic->refcount++;
+
+    slot->flags = v->flags;
+    slot->value = v->value;
+}
+
 /* This expands the list value so there's more extra space. Growth is done
    relative to the current size of the list, because why not? */
 static void make_extra_space_in_list(lily_list_val *lv)
@@ -1384,7 +1375,7 @@ static void make_extra_space_in_list(lily_list_val *lv)
     /* There's probably room for improvement here, later on. */
     int extra = (lv->num_values + 8) >> 2;
     lv->elems = lily_realloc(lv->elems,
-            (lv->num_values + extra) * sizeof(lily_value *));
+            (lv->num_values + extra) * sizeof(lily_value));
     lv->extra_space = extra;
 }
 
@@ -1429,14 +1420,12 @@ void lily_builtin_List_delete_at(lily_state *s)
     if (list_val->extra_space == 0)
         make_extra_space_in_list(list_val);
 
-    lily_value *to_delete = list_val->elems[pos];
-    lily_deref(to_delete);
-    lily_free(to_delete);
+    lily_deref(&list_val->elems[pos]);
 
     /* Shove everything leftward hide the hole from erasing the value. */
     if (pos != list_val->num_values)
         memmove(list_val->elems + pos, list_val->elems + pos + 1,
-                (list_val->num_values - pos) * sizeof(lily_value *));
+                (list_val->num_values - pos) * sizeof(lily_value));
 
     list_val->num_values--;
     list_val->extra_space++;
@@ -1455,7 +1444,7 @@ void lily_builtin_List_each(lily_state *s)
     int i;
 
     for (i = 0;i < list_val->num_values;i++) {
-        lily_push_value(s, list_val->elems[i]);
+        lily_push_value(s, &list_val->elems[i]);
         lily_call_exec_prepared(s, 1);
     }
 
@@ -1502,7 +1491,7 @@ void lily_builtin_List_fill(lily_state *s)
 
     int i;
     for (i = 0;i < n;i++)
-        lily_value_assign(lv->elems[i], to_repeat);
+        lily_value_assign(&lv->elems[i], to_repeat);
 
     lily_return_list(s, lv);
 }
@@ -1531,7 +1520,7 @@ void lily_builtin_List_fold(lily_state *s)
         lily_push_value(s, start);
         int i = 0;
         while (1) {
-            lily_push_value(s, list_val->elems[i]);
+            lily_push_value(s, &list_val->elems[i]);
             lily_call_exec_prepared(s, 2);
             v = lily_result_value(s);
 
@@ -1571,9 +1560,9 @@ void lily_builtin_List_insert(lily_state *s)
     /* Shove everything rightward to make space for the new value. */
     if (insert_pos != list_val->num_values)
         memmove(list_val->elems + insert_pos + 1, list_val->elems + insert_pos,
-                (list_val->num_values - insert_pos) * sizeof(lily_value *));
+                (list_val->num_values - insert_pos) * sizeof(lily_value));
 
-    list_val->elems[insert_pos] = lily_value_copy(insert_value);
+    copy_into_free_slot(&list_val->elems[insert_pos], insert_value);
     list_val->num_values++;
     list_val->extra_space--;
 
@@ -1599,13 +1588,13 @@ void lily_builtin_List_join(lily_state *s)
 
     if (lv->num_values) {
         int i, stop = lv->num_values - 1;
-        lily_value **values = lv->elems;
+        lily_value *values = lv->elems;
         for (i = 0;i < stop;i++) {
-            lily_mb_add_value(vm_buffer, s, values[i]);
+            lily_mb_add_value(vm_buffer, s, &values[i]);
             lily_mb_add(vm_buffer, delim);
         }
         if (stop != -1)
-            lily_mb_add_value(vm_buffer, s, values[i]);
+            lily_mb_add_value(vm_buffer, s, &values[i]);
     }
 
     lily_return_string(s, lily_new_string(lily_mb_get(vm_buffer)));
@@ -1620,27 +1609,32 @@ newly-made `List` containing the results of `fn`.
 void lily_builtin_List_map(lily_state *s)
 {
     lily_list_val *list_val = lily_arg_list(s, 0);
+    lily_list_val *result_list = lily_new_list(list_val->num_values);
+
+    /* Results go straight into the new List, which starts out empty. It's put
+       on the stack so that the gc can find what's in it while `fn` runs. */
+    result_list->extra_space = result_list->num_values;
+    result_list->num_values = 0;
+    lily_push_list(s, result_list);
 
     lily_call_prepare(s, lily_arg_function(s, 1));
 
     int i;
     for (i = 0;i < list_val->num_values;i++) {
-        lily_value *e = list_val->elems[i];
+        lily_value *e = &list_val->elems[i];
         lily_push_value(s, e);
         lily_call_exec_prepared(s, 1);
-        lily_push_value(s, lily_result_value(s));
-    }
 
-    lily_list_val *result_list = lily_new_list(i);
+        /* `fn` may have made `self` bigger. */
+        if (result_list->extra_space == 0)
+            make_extra_space_in_list(result_list);
 
-    i--;
-    for (;i >= 0;i--) {
-        s->num_registers--;
-        lily_value_assign(result_list->elems[i],
-                s->regs_from_main[s->num_registers]);
+        copy_into_free_slot(&result_list->elems[i], lily_result_value(s));
+        result_list->num_values++;
+        result_list->extra_space--;
     }
 
-    lily_return_list(s, result_list);
+    lily_result_return(s);
 }
 
 /**
@@ -1659,15 +1653,12 @@ void lily_builtin_List_pop(lily_state *s)
     if (list_val->num_values == 0)
         lily_IndexError(s, "Pop from an empty list.");
 
-    lily_value *source = list_val->elems[list_val->num_values - 1];
+    lily_value *source = &list_val->elems[list_val->num_values - 1];
 
     /* This is a special case because the value is moving out of the list, so
        don't let it get a ref increase. */
     lily_return_value_noref(s, source);
 
-    /* For now, free extra values instead of trying to keep reserves around.
-       Not the best course of action, perhaps, but certainly the simplest. */
-    lily_free(list_val->elems[list_val->num_values - 1]);
     list_val->num_values--;
     list_val->extra_space++;
 }
@@ -1687,7 +1678,7 @@ void lily_builtin_List_push(lily_state *s)
 
     int value_count = list_val->num_values;
 
-    list_val->elems[value_count] = lily_value_copy(insert_value);
+    copy_into_free_slot(&list_val->elems[value_count], insert_value);
     list_val->num_values++;
     list_val->extra_space--;
 
@@ -1702,13 +1693,13 @@ static void list_select_reject_common(lily_state *s, int expect)
     int n = 0;
     int i;
     for (i = 0;i < list_val->num_values;i++) {
-        lily_push_value(s, list_val->elems[i]);
+        lily_push_value(s, &list_val->elems[i]);
         lily_call_exec_prepared(s, 1);
 
         int ok = lily_result_boolean(s) == expect;
 
         if (ok) {
-            lily_push_value(s, list_val->elems[i]);
+            lily_push_value(s, &list_val->elems[i]);
             n++;
         }
     }
@@ -1718,8 +1709,8 @@ static void list_select_reject_common(lily_state *s, int expect)
     n--;
     for (;n >= 0;n--) {
         s->num_registers--;
-        lily_value_assign(result_list->elems[n],
-                s->regs_from_main[s->num_registers]);
+        lily_value_assign(&result_list->elems[n],
+                &s->regs_from_main[s->num_registers]);
     }
 
     lily_return_list(s, result_list);
@@ -1775,20 +1766,16 @@ void lily_builtin_List_shift(lily_state *s)
     if (list_val->num_values == 0)
         lily_IndexError(s, "Shift on an empty list.");
 
-    lily_value *source = list_val->elems[0];
+    lily_value *source = &list_val->elems[0];
 
     /* Similar to List.pop, the value is being taken out so use this custom
        assign to keep the refcount the same. */
     lily_return_value_noref(s, source);
 
-    /* For now, free extra values instead of trying to keep reserves around.
-       Not the best course of action, perhaps, but certainly the simplest. */
-    lily_free(list_val->elems[0]);
-
     if (list_val->num_values != 1)
         memmove(list_val->elems, list_val->elems + 1,
                 (list_val->num_values - 1) *
-                sizeof(lily_value *));
+                sizeof(lily_value));
 
     list_val->num_values--;
     list_val->extra_space++;
@@ -1857,9 +1844,9 @@ void lily_builtin_List_unshift(lily_state *s)
 
     if (list_val->num_values != 0)
         memmove(list_val->elems + 1, list_val->elems,
-                list_val->num_values * sizeof(lily_value *));
+                list_val->num_values * sizeof(lily_value));
 
-    list_val->elems[0] = lily_value_copy(input_reg);
+    copy_into_free_slot(&list_val->elems[0], input_reg);
 
     list_val->num_values++;
     list_val->extra_space--;
@@ -2234,41 +2221,18 @@ void lily_builtin_String_find(lily_state *s)
     if (find_length > input_length ||
         find_length == 0 ||
         start > input_length ||
-        follower_table[(unsigned char)input_str[start]] == -1) {
+        (start != input_length &&
+         follower_table[(unsigned char)input_str[start]] == -1)) {
         lily_return_empty_variant(s, LILY_NONE_ID);
         return;
     }
 
-    char find_ch;
-    int i, j, k, length_diff, match;
-
-    length_diff = input_length - find_length;
-    find_ch = find_str[0];
-    match = 0;
-
-    /* This stops at length_diff for two reasons:
-       * The inner loop won't have to do a boundary check.
-       * Search will stop if there isn't enough length left for a match
-         (ex: "abcdef".find("defg")) */
-    for (i = start;i <= length_diff;i++) {
-        if (input_str[i] == find_ch) {
-            match = 1;
-            /* j starts at i + 1 to skip the first match.
-               k starts at 1 for the same reason. */
-            for (j = i + 1, k = 1;k < find_length;j++, k++) {
-                if (input_str[j] != find_str[k]) {
-                    match = 0;
-                    break;
-                }
-            }
-            if (match == 1)
-                break;
-        }
-    }
+    const char *match = lily_search(input_str + start, input_length - start,
+            find_str, find_length);
 
     if (match) {
         lily_variant_val *variant = lily_new_variant(1);
-        lily_variant_set_integer(variant, 0, i);
+        lily_variant_set_integer(variant, 0, match - input_str);
         lily_return_variant(s, LILY_SOME_ID, variant);
     }
     else
@@ -2287,7 +2251,7 @@ int lily_maybe_html_encode_to_buffer(lily_state *s, lily_value *input)
 {
     lily_msgbuf *vm_buffer = lily_get_msgbuf(s);
     int start = 0, stop = 0;
-    char *input_str = input->value.string->string;
+    char *input_str = lily_string_raw(input->value.string);
     char *ch = &input_str[0];
 
     while (1) {
@@ -2577,7 +2541,7 @@ void lily_builtin_String_lstrip(lily_state *s)
 
     strip_sv = strip_arg->value.string;
     strip_str = strip_sv->string;
-    strip_str_len = strlen(strip_str);
+    strip_str_len = strip_sv->size;
     has_multibyte_char = 0;
 
     for (i = 0;i < strip_str_len;i++) {
@@ -2593,12 +2557,10 @@ void lily_builtin_String_lstrip(lily_state *s)
     else
         copy_from = lstrip_utf8_start(input_arg, strip_sv);
 
-    int new_size = (input_arg->value.string->size - copy_from) + 1;
-    lily_string_val *new_sv = make_sv(s, new_size);
-
-    strcpy(new_sv->string, input_arg->value.string->string + copy_from);
+    lily_string_val *input_sv = input_arg->value.string;
 
-    lily_return_string(s, new_sv);
+    lily_return_string(s, lily_new_string_view(input_sv, copy_from,
+            input_sv->size - copy_from));
 }
 
 /**
@@ -2675,44 +2637,36 @@ void lily_builtin_String_replace(lily_state *s)
     int source_len = lily_string_length(source_sv);
     int needle_len = lily_string_length(needle_sv);
 
-    if (needle_len > source_len) {
+    /* Getting the raw replacement may give a view new bytes, so it's done
+       before pointers to the bytes of the others are taken. The search only
+       needs the bytes of the others. */
+    char *replace_with = lily_arg_string_raw(s, 2);
+    char *source = source_sv->string;
+    char *needle = needle_sv->string;
+    const char *match = lily_search(source, source_len, needle, needle_len);
+
+    if (match == NULL) {
         lily_return_string(s, source_sv);
         return;
     }
 
     lily_msgbuf *msgbuf = lily_get_msgbuf(s);
-    char *source = lily_string_raw(source_sv);
-    char *needle = lily_string_raw(needle_sv);
-    char *replace_with = lily_arg_string_raw(s, 2);
-    char needle_first = *needle;
-    char ch;
     int start = 0;
-    int i;
 
-    for (i = 0;i < source_len;i++) {
-        ch = source[i];
-        if (ch == needle_first &&
-            (i + needle_len) <= source_len) {
-            int match = 1;
-            int j;
-            for (j = 1;j < needle_len;j++) {
-                if (needle[j] != source[i + j])
-                    match = 0;
-            }
+    do {
+        int at = match - source;
 
-            if (match) {
-                if (i != start)
-                    lily_mb_add_slice(msgbuf, source, start, i);
+        if (at != start)
+            lily_mb_add_slice(msgbuf, source, start, at);
 
-                lily_mb_add(msgbuf, replace_with);
-                i += needle_len - 1;
-                start = i + 1;
-            }
-        }
-    }
+        lily_mb_add(msgbuf, replace_with);
+        start = at + needle_len;
+        match = lily_search(source + start, source_len - start, needle,
+                needle_len);
+    } while (match);
 
-    if (i != start)
-        lily_mb_add_slice(msgbuf, source, start, i);
+    if (start != source_len)
+        lily_mb_add_slice(msgbuf, source, start, source_len);
 
     lily_return_string(s, lily_new_string(lily_mb_get(msgbuf)));
 }
@@ -2833,7 +2787,7 @@ void lily_builtin_String_rstrip(lily_state *s)
 
     strip_sv = strip_arg->value.string;
     strip_str = strip_sv->string;
-    strip_str_len = strlen(strip_str);
+    strip_str_len = strip_sv->size;
     has_multibyte_char = 0;
 
     for (i = 0;i < strip_str_len;i++) {
@@ -2849,112 +2803,45 @@ void lily_builtin_String_rstrip(lily_state *s)
     else
         copy_to = rstrip_utf8_stop(input_arg, strip_sv);
 
-    int new_size = copy_to + 1;
-    lily_string_val *new_sv = make_sv(s, new_size);
-
-    strncpy(new_sv->string, input_arg->value.string->string, copy_to);
-    /* This will always copy a partial string, so make sure to add a terminator. */
-    new_sv->string[copy_to] = '\0';
-
-    lily_return_string(s, new_sv);
+    lily_return_string(s, lily_new_string_view(input_arg->value.string, 0,
+            copy_to));
 }
 
-static const char move_table[256] =
+/* This splits 'input' by 'splitby' in one pass, adding each piece to the
+   result as it's found. Matches don't overlap, and searching resumes right
+   after each one. */
+static lily_list_val *string_split_by_val(lily_state *s,
+        lily_string_val *input_sv, char *splitby, int splitby_size)
 {
-     /* 0  1  2  3  4  5  6  7  8  9  A  B  C  D  E  F */
-/* 0 */ 0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
-/* 1 */ 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
-/* 2 */ 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
-/* 3 */ 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
-/* 4 */ 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
-/* 5 */ 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
-/* 6 */ 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
-/* 7 */ 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
-/* 8 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-/* 9 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-/* A */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-/* B */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-/* C */ 0, 0, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
-/* D */ 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
-/* E */ 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3,
-/* F */ 4, 4, 4, 4, 4, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
-};
-
-static lily_list_val *string_split_by_val(lily_state *s, char *input,
-        char *splitby)
-{
-    char *input_ch = &input[0];
-    char *splitby_ch = &splitby[0];
-    int values_needed = 0;
-
-    while (move_table[(unsigned char)*input_ch] != 0) {
-        if (*input_ch == *splitby_ch) {
-            char *restore_ch = input_ch;
-            int is_match = 1;
-            while (*input_ch == *splitby_ch) {
-                splitby_ch++;
-                input_ch++;
-                if (*splitby_ch == '\0')
-                    break;
-
-                if (*input_ch != *splitby_ch) {
-                    is_match = 0;
-                    input_ch = restore_ch;
-                    break;
-                }
-            }
-
-            splitby_ch = &splitby[0];
-            values_needed += is_match;
-        }
-        else
-            input_ch += move_table[(unsigned char)*input_ch];
-    }
-
-    values_needed++;
-    input_ch = &input[0];
-    lily_list_val *list_val = lily_new_list(values_needed);
-    int i = 0;
-    char *last_start = input_ch;
+    const char *input = input_sv->string;
+    int input_size = input_sv->size;
+    lily_list_val *list_val = lily_new_list(0);
+    const char *end = input + input_size;
+    const char *piece = input;
 
     while (1) {
-        char *match_start = input_ch;
-        int is_match = 0;
-        if (*input_ch == *splitby_ch) {
-            is_match = 1;
-            while (*input_ch == *splitby_ch) {
-                splitby_ch++;
-                if (*splitby_ch == '\0')
-                    break;
-
-                input_ch++;
-                if (*input_ch != *splitby_ch) {
-                    is_match = 0;
-                    input_ch = match_start;
-                    break;
-                }
-            }
-            splitby_ch = &splitby[0];
-        }
-
-        /* The second check is so that if the last bit of the input string
-           matches the split string, an empty string will be made.
+        const char *match = lily_search(piece, end - piece, splitby,
+                splitby_size);
+        const char *piece_end = (match ? match : end);
+
+        if (list_val->extra_space == 0)
+            make_extra_space_in_list(list_val);
+
+        /* The new slot is spare space that hasn't been set yet. */
+        lily_value *slot = &list_val->elems[list_val->num_values];
+        slot->flags = 0;
+        lily_list_set_string(list_val, list_val->num_values,
+                lily_new_string_view(input_sv, piece - input,
+                        piece_end - piece));
+        list_val->num_values++;
+        list_val->extra_space--;
+
+        /* If the last bit of the input matches, then an empty String is made.
            Ex: "1 2 3 ".split(" ") # ["1", "2", "3", ""] */
-        if (is_match || *input_ch == '\0') {
-            int size = match_start - last_start;
-            lily_string_val *sv = lily_new_string_sized(last_start, size);
-            lily_list_set_string(list_val, i, sv);
-
-            i++;
-            if (*input_ch == '\0')
-                break;
-
-            last_start = input_ch + 1;
-        }
-        else if (*input_ch == '\0')
+        if (match == NULL)
             break;
 
-        input_ch++;
+        piece = match + splitby_size;
     }
 
     return list_val;
@@ -2986,6 +2873,10 @@ method String.split(self: String, split_by: *String=" "):List[String]
 This attempts to split `self` using `split_by`, with a default value of a single
 space.
 
+Pieces share the bytes of `self` instead of copying them. Once `self` is only
+kept alive by pieces that use less than half of it, those pieces are given
+their own copies so that `self` can be freed.
+
 # Errors
 
 * `ValueError` if `split_by` is empty.
@@ -3007,8 +2898,8 @@ void lily_builtin_String_split(lily_state *s)
         split_strval = &fake_sv;
     }
 
-    lily_list_val *lv = string_split_by_val(s, input_strval->string,
-            split_strval->string);
+    lily_list_val *lv = string_split_by_val(s, input_strval,
+            split_strval->string, split_strval->size);
 
     lily_return_list(s, lv);
 }
@@ -3065,7 +2956,7 @@ void lily_builtin_String_strip(lily_state *s)
     char ch;
     lily_string_val *strip_sv = strip_arg->value.string;
     char *strip_str = strip_sv->string;
-    int strip_str_len = strlen(strip_str);
+    int strip_str_len = strip_sv->size;
     int has_multibyte_char = 0;
     int copy_from, copy_to, i;
 
@@ -3093,14 +2984,8 @@ void lily_builtin_String_strip(lily_state *s)
            result is an empty string. */
         copy_to = copy_from;
 
-    int new_size = (copy_to - copy_from) + 1;
-    lily_string_val *new_sv = make_sv(s, new_size);
-
-    char *new_str = new_sv->string;
-    strncpy(new_str, input_arg->value.string->string + copy_from, new_size - 1);
-    new_str[new_size - 1] = '\0';
-
-    lily_return_string(s, new_sv);
+    lily_return_string(s, lily_new_string_view(input_arg->value.string,
+            copy_from, copy_to - copy_from));
 }
 
 /**
@@ -3112,8 +2997,12 @@ to be performed.
 void lily_builtin_String_to_bytestring(lily_state *s)
 {
     /* They currently have the same internal representation. This method is
-       provided for the type system. */
-    lily_return_bytestring(s, (lily_bytestring_val *)lily_arg_string(s, 0));
+       provided for the type system. A ByteString can be written to, so make
+       sure that a view has its own bytes first. */
+    lily_string_val *sv = lily_arg_string(s, 0);
+
+    lily_string_raw(sv);
+    lily_return_bytestring(s, (lily_bytestring_val *)sv);
 }
 
 /**
@@ -3133,24 +3022,14 @@ void lily_builtin_String_trim(lily_state *s)
     fake_sv.size = strlen(fake_buffer);
 
     int copy_from = lstrip_ascii_start(input_arg, &fake_sv);
-    lily_string_val *new_sv;
+    int copy_to = copy_from;
 
-    if (copy_from != input_arg->value.string->size) {
-        int copy_to = rstrip_ascii_stop(input_arg, &fake_sv);
-        int new_size = (copy_to - copy_from) + 1;
-        new_sv = make_sv(s, new_size);
-        char *new_str = new_sv->string;
+    /* If it's all space, this makes an empty string. */
+    if (copy_from != input_arg->value.string->size)
+        copy_to = rstrip_ascii_stop(input_arg, &fake_sv);
 
-        strncpy(new_str, input_arg->value.string->string + copy_from, new_size - 1);
-        new_str[new_size - 1] = '\0';
-    }
-    else {
-        /* It's all space, so make a new empty string. */
-        new_sv = make_sv(s, 1);
-        new_sv->string[0] = '\0';
-    }
-
-    lily_return_string(s, new_sv);
+    lily_return_string(s, lily_new_string_view(input_arg->value.string,
+            copy_from, copy_to - copy_from));
 }
 
 /**
@@ -3183,6 +3062,284 @@ void lily_builtin_String_upper(lily_state *s)
     lily_return_string(s, new_sv);
 }
 
+typedef struct {
+    LILY_FOREIGN_HEADER
+    char *buffer;
+    uint32_t size;
+    uint32_t capacity;
+    /* Set when bytes were added that may not be valid utf-8. */
+    uint32_t has_raw_bytes;
+    uint32_t pad;
+} lily_builtin_StringBuilder;
+
+static void destroy_StringBuilder(lily_builtin_StringBuilder *sb)
+{
+    lily_free(sb->buffer);
+    lily_free(sb);
+}
+
+/* Make sure that 'sb' has room for 'need' more bytes, and a terminator. */
+static void sb_reserve(lily_builtin_StringBuilder *sb, uint32_t need)
+{
+    uint64_t want = (uint64_t)sb->size + need + 1;
+
+    if (want <= sb->capacity)
+        return;
+
+    uint64_t new_capacity = sb->capacity ? sb->capacity : 64;
+
+    while (new_capacity < want)
+        new_capacity *= 2;
+
+    if (new_capacity > UINT32_MAX)
+        new_capacity = want;
+
+    sb->buffer = lily_realloc(sb->buffer, new_capacity);
+    sb->capacity = (uint32_t)new_capacity;
+}
+
+static void sb_add(lily_builtin_StringBuilder *sb, const char *text,
+        uint32_t size)
+{
+    sb_reserve(sb, size);
+    memcpy(sb->buffer + sb->size, text, size);
+    sb->size += size;
+}
+
+/* Give the bytes of 'sb' to the caller, which takes ownership of them. The
+   builder is left empty. */
+static char *sb_take(lily_builtin_StringBuilder *sb)
+{
+    char *result;
+
+    sb_reserve(sb, 0);
+    result = sb->buffer;
+    result[sb->size] = '\0';
+
+    /* Don't hand over a buffer that's mostly unused space. */
+    if (sb->capacity - sb->size > (sb->size >> 2) + 64)
+        result = lily_realloc(result, sb->size + 1);
+
+    sb->buffer = NULL;
+    sb->size = 0;
+    sb->capacity = 0;
+    sb->has_raw_bytes = 0;
+    return result;
+}
+
+/* The copy gets a buffer of its own, sized like a new builder would be. */
+lily_generic_val *lily_copy_stringbuilder(lily_generic_val *source)
+{
+    lily_builtin_StringBuilder *from = (lily_builtin_StringBuilder *)source;
+    lily_builtin_StringBuilder *sb = lily_malloc(
+            sizeof(lily_builtin_StringBuilder));
+
+    *sb = *from;
+    sb->refcount = 1;
+    sb->buffer = NULL;
+    sb->capacity = 0;
+
+    if (from->size) {
+        sb->size = 0;
+        sb_add(sb, from->buffer, from->size);
+    }
+
+    return (lily_generic_val *)sb;
+}
+
+#define ARG_StringBuilder(state, index) \
+(lily_builtin_StringBuilder *)lily_arg_generic(state, index)
+
+/**
+class StringBuilder
+
+The `StringBuilder` class holds a buffer that grows as text is added to it. Use
+it to build a large `String` or `ByteString` out of many small parts, since
+doing that through interpolation copies everything built so far each time.
+
+Finishing with `StringBuilder.to_s` or `StringBuilder.to_bytestring` gives the
+buffer to the result without copying it, and leaves the builder empty.
+*/
+
+/**
+constructor StringBuilder(size: *Integer=0): StringBuilder
+
+Create a new, empty `StringBuilder`. If `size` is given, the builder starts with
+room for that many bytes.
+
+# Errors
+
+* `ValueError` if `size` is negative.
+*/
+void lily_builtin_StringBuilder_new(lily_state *s)
+{
+    int64_t size = 0;
+
+    if (lily_arg_count(s) == 1)
+        size = lily_arg_integer(s, 0);
+
+    if (size < 0)
+        lily_ValueError(s, "Size must be >= 0 (%d given).", (int)size);
+    else if (size >= UINT32_MAX)
+        lily_ValueError(s, "StringBuilder cannot be that large.");
+
+    lily_builtin_StringBuilder *sb = lily_malloc(
+            sizeof(lily_builtin_StringBuilder));
+
+    sb->refcount = 0;
+    sb->destroy_func = (lily_destroy_func)destroy_StringBuilder;
+    sb->buffer = NULL;
+    sb->size = 0;
+    sb->capacity = 0;
+    sb->has_raw_bytes = 0;
+
+    if (size)
+        sb_reserve(sb, (uint32_t)size);
+
+    lily_return_foreign(s, LILY_STRINGBUILDER_ID, (lily_foreign_val *)sb);
+}
+
+/* Make sure that 'sb' can hold 'need' more bytes, raising ValueError if it
+   would be too large. */
+static void sb_check_room(lily_state *s, lily_builtin_StringBuilder *sb,
+        uint64_t need)
+{
+    if ((uint64_t)sb->size + need >= UINT32_MAX)
+        lily_ValueError(s, "StringBuilder cannot be that large.");
+}
+
+/**
+method StringBuilder.append(self: StringBuilder, text: String)
+
+Add `text` to the end of `self`.
+*/
+void lily_builtin_StringBuilder_append(lily_state *s)
+{
+    lily_builtin_StringBuilder *sb = ARG_StringBuilder(s, 0);
+    lily_string_val *text_sv = lily_arg_string(s, 1);
+
+    sb_check_room(s, sb, text_sv->size);
+    sb_add(sb, text_sv->string, text_sv->size);
+}
+
+/**
+method StringBuilder.append_byte(self: StringBuilder, byte: Byte)
+
+Add `byte` to the end of `self`.
+*/
+void lily_builtin_StringBuilder_append_byte(lily_state *s)
+{
+    lily_builtin_StringBuilder *sb = ARG_StringBuilder(s, 0);
+    char ch = (char)lily_arg_byte(s, 1);
+
+    sb_check_room(s, sb, 1);
+    sb_add(sb, &ch, 1);
+    sb->has_raw_bytes = 1;
+}
+
+/**
+method StringBuilder.append_bytes(self: StringBuilder, bytes: ByteString)
+
+Add the contents of `bytes` to the end of `self`.
+*/
+void lily_builtin_StringBuilder_append_bytes(lily_state *s)
+{
+    lily_builtin_StringBuilder *sb = ARG_StringBuilder(s, 0);
+    lily_bytestring_val *bytes = lily_arg_bytestring(s, 1);
+    int size = lily_bytestring_length(bytes);
+
+    sb_check_room(s, sb, size);
+    sb_add(sb, lily_bytestring_raw(bytes), size);
+    sb->has_raw_bytes = 1;
+}
+
+/**
+method StringBuilder.clear(self: StringBuilder)
+
+Remove the contents of `self`. The space that `self` has is kept for later use.
+*/
+void lily_builtin_StringBuilder_clear(lily_state *s)
+{
+    lily_builtin_StringBuilder *sb = ARG_StringBuilder(s, 0);
+
+    sb->size = 0;
+    sb->has_raw_bytes = 0;
+}
+
+/**
+method StringBuilder.reserve(self: StringBuilder, size: Integer)
+
+Make sure that `self` has room for `size` more bytes, so that adding them does
+not need to grow `self`.
+
+# Errors
+
+* `ValueError` if `size` is negative, or `self` would be too large.
+*/
+void lily_builtin_StringBuilder_reserve(lily_state *s)
+{
+    lily_builtin_StringBuilder *sb = ARG_StringBuilder(s, 0);
+    int64_t size = lily_arg_integer(s, 1);
+
+    if (size < 0)
+        lily_ValueError(s, "Size must be >= 0 (%d given).", (int)size);
+
+    sb_check_room(s, sb, (uint64_t)size);
+    sb_reserve(sb, (uint32_t)size);
+}
+
+/**
+method StringBuilder.size(self: StringBuilder): Integer
+
+Return the number of bytes that are in `self`.
+*/
+void lily_builtin_StringBuilder_size(lily_state *s)
+{
+    lily_builtin_StringBuilder *sb = ARG_StringBuilder(s, 0);
+
+    lily_return_integer(s, sb->size);
+}
+
+/**
+method StringBuilder.to_bytestring(self: StringBuilder): ByteString
+
+Return the contents of `self` as a `ByteString`, and leave `self` empty.
+*/
+void lily_builtin_StringBuilder_to_bytestring(lily_state *s)
+{
+    lily_builtin_StringBuilder *sb = ARG_StringBuilder(s, 0);
+    int size = sb->size;
+    char *buffer = sb_take(sb);
+
+    lily_return_bytestring(s, lily_new_bytestring_take_sized(buffer, size));
+}
+
+/**
+method StringBuilder.to_s(self: StringBuilder): String
+
+Return the contents of `self` as a `String`, and leave `self` empty.
+
+# Errors
+
+* `ValueError` if bytes added through `StringBuilder.append_byte` or
+  `StringBuilder.append_bytes` did not make valid utf-8. In that case, `self` is
+  left unchanged.
+*/
+void lily_builtin_StringBuilder_to_s(lily_state *s)
+{
+    lily_builtin_StringBuilder *sb = ARG_StringBuilder(s, 0);
+
+    /* Strings are always valid utf-8, so only raw bytes need to be checked. */
+    if (sb->has_raw_bytes &&
+        lily_is_valid_sized_utf8(sb->buffer, sb->size) == 0)
+        lily_ValueError(s, "StringBuilder does not hold valid utf-8.");
+
+    int size = sb->size;
+    char *buffer = sb_take(sb);
+
+    lily_return_string(s, lily_new_string_take_sized(buffer, size));
+}
+
 /**
 class Tuple
 
@@ -3217,10 +3374,10 @@ void lily_builtin_Tuple_merge(lily_state *s)
 
     int i, j;
     for (i = 0, j = 0;i < left_tuple->num_values;i++, j++)
-        lily_value_assign(lv->elems[j], left_tuple->elems[i]);
+        lily_value_assign(&lv->elems[j], &left_tuple->elems[i]);
 
     for (i = 0;i < right_tuple->num_values;i++, j++)
-        lily_value_assign(lv->elems[j], right_tuple->elems[i]);
+        lily_value_assign(&lv->elems[j], &right_tuple->elems[i]);
 
     lily_return_tuple(s, lv);
 }
@@ -3238,9 +3395,9 @@ void lily_builtin_Tuple_push(lily_state *s)
 
     int i, j;
     for (i = 0, j = 0;i < left_tuple->num_values;i++, j++)
-        lily_value_assign(lv->elems[j], left_tuple->elems[i]);
+        lily_value_assign(&lv->elems[j], &left_tuple->elems[i]);
 
-    lily_value_assign(lv->elems[j], right);
+    lily_value_assign(&lv->elems[j], right);
 
     lily_return_tuple(s, lv);
 }
@@ -3371,6 +3528,8 @@ void lily_init_pkg_builtin(lily_symtab *symtab)
     symtab->function_class->flags |= CLS_GC_TAGGED;
     symtab->dynamic_class->flags |= CLS_GC_SPECULATIVE;
     /* HACK: This ensures that there is space to dynaload builtin classes and
-       enums into. */
-    symtab->next_class_id = START_CLASS_ID;
+       enums into. StringBuilder comes after that space, and building it leaves
+       the next id at START_CLASS_ID. */
+    symtab->next_class_id = LILY_STRINGBUILDER_ID;
+    build_class(symtab, "StringBuilder", 0, STRINGBUILDER_OFFSET);
 }
@@ -4,4 +4,7 @@
 void lily_register_pkg_builtin(struct lily_vm_state_ *);
 void lily_init_pkg_builtin(struct lily_symtab_ *symtab);
 
+/* Clones of a snapshot use this to get their own copy of a StringBuilder. */
+struct lily_generic_val_ *lily_copy_stringbuilder(struct lily_generic_val_ *);
+
 #endif
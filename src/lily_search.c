@@ -0,0 +1,231 @@
+/* This is the substring search used by String methods like find, replace, and
+   split. There are three ways that a search is done:
+
+   * A needle of one byte is handed to memchr.
+   * Short needles are found by checking where both the first and last bytes of
+     the needle line up with the haystack. This is done for 16 (or 32, with
+     AVX2) positions at once. Only positions where both match are compared in
+     full. On text, that's almost never a false match.
+   * Longer needles use the Two-Way algorithm (Crochemore and Perrin). It looks
+     at each byte of the haystack a constant number of times, so a needle that
+     nearly matches everywhere can't make the search quadratic. */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "lily_simd.h"
+#include "lily_search.h"
+
+/* Needles longer than this use Two-Way. */
+#define SHORT_NEEDLE_MAX 32
+
+/* This is for needles of at least two bytes. The first and last bytes of the
+   needle are checked first, since that rules out most positions cheaply. */
+static const char *short_search(const char *haystack, size_t haystack_size,
+        const char *needle, size_t needle_size)
+{
+    size_t last = needle_size - 1;
+    size_t stop = haystack_size - last;
+    size_t i = 0;
+
+#if defined(LILY_SIMD_AVX2)
+    __m256i first_v = _mm256_set1_epi8(needle[0]);
+    __m256i last_v = _mm256_set1_epi8(needle[last]);
+
+    for (;i + 32 <= stop;i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(haystack + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(haystack + i + last));
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_and_si256(
+                _mm256_cmpeq_epi8(a, first_v), _mm256_cmpeq_epi8(b, last_v)));
+
+        while (mask) {
+            size_t at = i + lily_lowest_bit(mask);
+
+            if (memcmp(haystack + at + 1, needle + 1, last - 1) == 0)
+                return haystack + at;
+
+            mask &= mask - 1;
+        }
+    }
+#elif defined(LILY_SIMD_SSE2)
+    __m128i first_v = _mm_set1_epi8(needle[0]);
+    __m128i last_v = _mm_set1_epi8(needle[last]);
+
+    for (;i + 16 <= stop;i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(haystack + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(haystack + i + last));
+        uint32_t mask = (uint32_t)_mm_movemask_epi8(_mm_and_si128(
+                _mm_cmpeq_epi8(a, first_v), _mm_cmpeq_epi8(b, last_v)));
+
+        while (mask) {
+            size_t at = i + lily_lowest_bit(mask);
+
+            if (memcmp(haystack + at + 1, needle + 1, last - 1) == 0)
+                return haystack + at;
+
+            mask &= mask - 1;
+        }
+    }
+#endif
+
+    /* Whatever is left (or everything, without simd). memchr finds the first
+       byte quickly, and the last byte is checked before the rest. */
+    while (i < stop) {
+        const char *at = memchr(haystack + i, needle[0], stop - i);
+
+        if (at == NULL)
+            break;
+
+        i = at - haystack;
+
+        if (haystack[i + last] == needle[last] &&
+            memcmp(haystack + i + 1, needle + 1, last - 1) == 0)
+            return at;
+
+        i++;
+    }
+
+    return NULL;
+}
+
+/* Two-Way splits the needle at a critical position, found from the maximal
+   suffixes of the needle under both orderings of bytes. This returns the start
+   of the maximal suffix, and gives the period of it through 'period'. */
+static size_t max_suffix(const unsigned char *needle, size_t size,
+        size_t *period, int reverse)
+{
+    /* 'start' is one before where the suffix starts. It begins as SIZE_MAX,
+       which wraps to 0 when 1 is added. */
+    size_t start = (size_t)-1;
+    size_t j = 0, k = 1;
+
+    *period = 1;
+
+    while (j + k < size) {
+        unsigned char a = needle[j + k];
+        unsigned char b = needle[start + k];
+
+        if (reverse ? a > b : a < b) {
+            j += k;
+            k = 1;
+            *period = j - start;
+        }
+        else if (a == b) {
+            if (k != *period)
+                k++;
+            else {
+                j += *period;
+                k = 1;
+            }
+        }
+        else {
+            start = j;
+            j = start + 1;
+            k = *period = 1;
+        }
+    }
+
+    return start;
+}
+
+static const char *two_way_search(const char *haystack, size_t haystack_size,
+        const char *needle, size_t needle_size)
+{
+    const unsigned char *y = (const unsigned char *)haystack;
+    const unsigned char *x = (const unsigned char *)needle;
+    size_t m = needle_size, n = haystack_size;
+    size_t p, q, ell, per, i, j;
+
+    size_t s1 = max_suffix(x, m, &p, 0);
+    size_t s2 = max_suffix(x, m, &q, 1);
+
+    /* The larger start wins. Since both start at SIZE_MAX, compare them with
+       1 added so that SIZE_MAX is the smallest. */
+    if (s1 + 1 > s2 + 1) {
+        ell = s1;
+        per = p;
+    }
+    else {
+        ell = s2;
+        per = q;
+    }
+
+    /* 'ell' is one before the right half. Adding 1 to it again gives the
+       length of the left half. */
+    if (memcmp(x, x + per, ell + 1) == 0) {
+        /* The needle is periodic. After a match of the right half, the part
+           that overlaps the next period is already known to match, and
+           'memory' remembers how much of it that is. */
+        size_t memory = 0;
+
+        j = 0;
+        while (j <= n - m) {
+            i = (ell + 1 > memory ? ell + 1 : memory);
+
+            while (i < m && x[i] == y[i + j])
+                i++;
+
+            if (i >= m) {
+                i = ell + 1;
+
+                while (i > memory && x[i - 1] == y[i - 1 + j])
+                    i--;
+
+                if (i <= memory)
+                    return haystack + j;
+
+                j += per;
+                memory = m - per;
+            }
+            else {
+                j += i - ell;
+                memory = 0;
+            }
+        }
+    }
+    else {
+        size_t left = ell + 1;
+        size_t right = m - left;
+
+        per = (left > right ? left : right) + 1;
+
+        j = 0;
+        while (j <= n - m) {
+            i = ell + 1;
+
+            while (i < m && x[i] == y[i + j])
+                i++;
+
+            if (i >= m) {
+                i = ell + 1;
+
+                while (i > 0 && x[i - 1] == y[i - 1 + j])
+                    i--;
+
+                if (i == 0)
+                    return haystack + j;
+
+                j += per;
+            }
+            else
+                j += i - ell;
+        }
+    }
+
+    return NULL;
+}
+
+const char *lily_search(const char *haystack, size_t haystack_size,
+        const char *needle, size_t needle_size)
+{
+    if (needle_size == 0 || needle_size > haystack_size)
+        return NULL;
+
+    if (needle_size == 1)
+        return memchr(haystack, needle[0], haystack_size);
+
+    if (needle_size <= SHORT_NEEDLE_MAX)
+        return short_search(haystack, haystack_size, needle, needle_size);
+
+    return two_way_search(haystack, haystack_size, needle, needle_size);
+}
@@ -0,0 +1,13 @@
+#ifndef LILY_SEARCH_H
+# define LILY_SEARCH_H
+
+# include <stddef.h>
+
+/* Find the first place that 'needle' (of 'needle_size' bytes) appears within
+   'haystack' (of 'haystack_size' bytes). The result is where it starts, or NULL
+   if it isn't there (or if the needle is empty). Neither side needs to be
+   terminated. */
+const char *lily_search(const char *haystack, size_t haystack_size,
+        const char *needle, size_t needle_size);
+
+#endif
@@ -0,0 +1,35 @@
+#ifndef LILY_SIMD_H
+# define LILY_SIMD_H
+
+# include <stdint.h>
+
+/* Hashing, searching, and utf-8 checks work on 16 (or 32) bytes at once when
+   the compiler targets vector instructions. LILY_SIMD_SSE2 is defined whenever
+   LILY_SIMD_AVX2 is, so code that only needs 16 bytes can check for just that.
+   Without either, each file falls back to plain C. */
+# if defined(__AVX2__)
+#  include <immintrin.h>
+#  define LILY_SIMD_AVX2
+#  define LILY_SIMD_SSE2
+# elif defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#  include <emmintrin.h>
+#  define LILY_SIMD_SSE2
+# endif
+
+/* The index of the lowest set bit in a (nonzero) movemask result. */
+static inline int lily_lowest_bit(uint32_t mask)
+{
+# if defined(__GNUC__)
+    return __builtin_ctz(mask);
+# else
+    int i = 0;
+    while ((mask & 1) == 0) {
+        mask >>= 1;
+        i++;
+    }
+    return i;
+# endif
+}
+
+#endif
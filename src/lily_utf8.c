@@ -1,5 +1,13 @@
+/* Validation first skips over ascii as quickly as it can. 16 (or 32, with
+   AVX2) bytes are checked at once for either a high bit or \0, and 8 at a time
+   when simd isn't available. Only the bytes of a multi-byte sequence go through
+   the dfa below. Neither function allows \0 within the input, because strings
+   made from it are \0 terminated. */
+
 #include <stdint.h>
+#include <string.h>
 
+#include "lily_simd.h"
 #include "lily_utf8.h"
 
 // Copyright (c) 2008-2009 Bjoern Hoehrmann <bjoern@hoehrmann.de>
@@ -25,7 +33,7 @@ static const uint8_t utf8d[] = {
     1,3,1,1,1,1,1,3,1,3,1,1,1,1,1,1,1,3,1,1,1,1,1,1,1,1,1,1,1,1,1,1, // s7..s8
 };
 
-uint32_t
+static inline uint32_t
 decode(uint32_t* state, uint32_t* codep, uint32_t byte) {
     uint32_t type = utf8d[byte];
 
@@ -37,31 +45,103 @@ decode(uint32_t* state, uint32_t* codep, uint32_t byte) {
     return *state;
 }
 
-/* Only check if 'input' is valid utf-8 (\0 termination is assumed). */
-int lily_is_valid_utf8(const char *input)
+#define WORD_ONES  0x0101010101010101ull
+#define WORD_HIGHS 0x8080808080808080ull
+
+/* Return where the first byte that is either \0 or above 127 is, or 'end' if
+   there isn't one. */
+static const uint8_t *skip_ascii(const uint8_t *s, const uint8_t *end)
 {
-    uint8_t *s = (uint8_t *)input;
-    uint32_t codepoint;
-    uint32_t state = 0;
+#if defined(LILY_SIMD_AVX2)
+    __m256i zero = _mm256_setzero_si256();
 
-    for (;*s; ++s)
-        if (decode(&state, &codepoint, *s) == UTF8_REJECT)
+    while (end - s >= 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)s);
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(
+                _mm256_or_si256(v, _mm256_cmpeq_epi8(v, zero)));
+
+        if (mask)
+            return s + lily_lowest_bit(mask);
+
+        s += 32;
+    }
+#elif defined(LILY_SIMD_SSE2)
+    __m128i zero = _mm_setzero_si128();
+
+    while (end - s >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)s);
+        uint32_t mask = (uint32_t)_mm_movemask_epi8(
+                _mm_or_si128(v, _mm_cmpeq_epi8(v, zero)));
+
+        if (mask)
+            return s + lily_lowest_bit(mask);
+
+        s += 16;
+    }
+#endif
+
+    /* Whatever is left (or everything, without simd). A word is all ascii if
+       no byte has the high bit set, and has no \0 if subtracting 1 from each
+       byte doesn't borrow into a high bit. */
+    while (end - s >= 8) {
+        uint64_t w;
+
+        memcpy(&w, s, sizeof(w));
+
+        if (((w | ((w - WORD_ONES) & ~w)) & WORD_HIGHS) != 0)
             break;
 
-    return state == UTF8_ACCEPT;
+        s += 8;
+    }
+
+    while (s != end && *s != '\0' && *s < 0x80)
+        s++;
+
+    return s;
 }
 
-/* Check if 'input' is valid utf-8 and \0 terminated. */
-int lily_is_valid_sized_utf8(const char *input, int size)
+static int is_valid_range(const uint8_t *s, const uint8_t *end)
 {
-    uint8_t *s = (uint8_t *)input;
-    uint8_t *end = s + size;
     uint32_t codepoint;
-    uint32_t state = 0;
+    uint32_t state = UTF8_ACCEPT;
 
-    for (;*s; ++s)
-        if (decode(&state, &codepoint, *s) == UTF8_REJECT)
+    while (1) {
+        if (state == UTF8_ACCEPT) {
+            s = skip_ascii(s, end);
+
+            if (s == end)
+                break;
+
+            /* \0 is only accepted by the dfa between sequences, so this is
+               the only place it needs to be checked for. */
+            if (*s == '\0')
+                return 0;
+        }
+        else if (s == end)
             break;
 
-    return (state == UTF8_ACCEPT) && (s == end);
+        if (decode(&state, &codepoint, *s) == UTF8_REJECT)
+            return 0;
+
+        s++;
+    }
+
+    return state == UTF8_ACCEPT;
+}
+
+/* Only check if 'input' is valid utf-8 (\0 termination is assumed). */
+int lily_is_valid_utf8(const char *input)
+{
+    const uint8_t *s = (const uint8_t *)input;
+
+    return is_valid_range(s, s + strlen(input));
+}
+
+/* Check if the 'size' bytes of 'input' are valid utf-8 with no \0 inside. Bytes
+   past 'size' are never read, so 'input' doesn't need to be terminated. */
+int lily_is_valid_sized_utf8(const char *input, int size)
+{
+    const uint8_t *s = (const uint8_t *)input;
+
+    return is_valid_range(s, s + size);
 }
@@ -69,6 +69,12 @@ typedef struct lily_gc_entry_ {
        to NULL to keep the gc from looking at an invalid data. */
     lily_raw_value value;
     struct lily_gc_entry_ *next;
+    /* Minor collections use this to count how many refs to the value come from
+       outside of the young generation. */
+    int32_t gc_refs;
+    /* 0 for entries in the young generation, 1 for entries that have survived
+       a collection and moved to the old generation. */
+    uint32_t generation;
 } lily_gc_entry;
 
 /* A proper Lily value. The flags field holds markers for gc and other info in
@@ -89,16 +95,32 @@ typedef struct lily_value_ {
 typedef struct lily_string_val_ {
     uint32_t refcount;
     uint32_t size;
+    /* Strings that are copies are one block, and this points just past the
+       header. Strings that took their buffer point to that buffer instead. */
     char *string;
+    /* If this isn't NULL, this string is a view. The bytes belong to the
+       string here (which this holds a ref to), and aren't \0 terminated. */
+    struct lily_string_val_ *parent;
+    /* The hash of this string, or 0 if it has not been hashed yet. Strings can
+       be shared (literals, clones of a snapshot), so they must never change
+       once they're built. Filling this in is the one exception: every table
+       within a vm shares the same seed, so whoever hashes first writes the
+       same value that anyone else would. */
+    uint64_t hash;
+    /* If views point into the bytes of this string, this keeps track of them
+       (see lily_new_string_view). Otherwise, this is NULL. */
+    struct lily_view_set_ *views;
 } lily_string_val;
 
 /* Internally, ByteString values are represented by strings. This exists apart
    from lily_string_val so that API can't assume they're the same (in case they
-   diverge). */
+   diverge). The fields here must stay a prefix of lily_string_val. ByteStrings
+   are never hashed, so they leave out the hash. */
 typedef struct lily_bytestring_val_ {
     uint32_t refcount;
     uint32_t size;
     char *string;
+    struct lily_string_val_ *parent;
 } lily_bytestring_val;
 
 /* Instances of the Dynamic class act as a wrapper around some singular value.
@@ -119,7 +141,7 @@ typedef struct lily_variant_val_ {
     uint16_t pad2;
     uint32_t num_values;
     uint32_t pad3;
-    struct lily_value_ **values;
+    struct lily_value_ *values;
     struct lily_gc_entry_ *gc_entry;
 } lily_variant_val;
 
@@ -128,25 +150,33 @@ typedef struct lily_list_val_ {
     uint32_t extra_space;
     uint32_t num_values;
     uint32_t pad;
-    struct lily_value_ **elems;
+    /* Elements are stored inline, so growing the list can move them. */
+    struct lily_value_ *elems;
 } lily_list_val;
 
+/* Hash entries live inline within the table's slots, and hold their own copy
+   of the key and record. */
 typedef struct lily_hash_entry_ {
-    unsigned int hash;
-    char *raw_key;
-    lily_value *boxed_key;
-    lily_value *record;
-    struct lily_hash_entry_ *next;
+    uint64_t hash;
+    lily_value boxed_key;
+    lily_value record;
 } lily_hash_entry;
 
+/* Hashes use open addressing (see st.c). Each slot has a control byte in ctrl
+   that says if the entry at that same spot in entries is in use. */
 typedef struct lily_hash_val_ {
     uint32_t refcount;
     uint32_t iter_count;
-    int (*compare_fn)();
-    int (*hash_fn)();
-    int num_bins;
-    int num_entries;
-    lily_hash_entry **bins;
+    uint32_t num_entries;
+    /* Always a power of two (or 0 for an empty table). */
+    uint32_t num_slots;
+    /* How many empty slots can be taken before the table must grow. */
+    uint32_t growth_left;
+    uint32_t pad;
+    /* Keys are hashed with this. Copied from the vm that made the table. */
+    uint64_t seed[2];
+    uint8_t *ctrl;
+    lily_hash_entry *entries;
 } lily_hash_val;
 
 /* Either an instance or an enum. This structure has extra padding so that it
@@ -159,7 +189,7 @@ typedef struct lily_instance_val_ {
     uint16_t ctor_need;
     uint32_t num_values;
     uint32_t pad2;
-    struct lily_value_ **values;
+    struct lily_value_ *values;
     struct lily_gc_entry_ *gc_entry;
 } lily_instance_val;
 
@@ -171,6 +201,10 @@ typedef struct lily_file_val_ {
     uint8_t pad1;
     uint32_t pad2;
     FILE *inner_file;
+    /* Lines are read into this buffer, which is kept and reused for the next
+       line. This is allocated by the C library (not lily_malloc). */
+    char *line_buffer;
+    size_t line_capacity;
 } lily_file_val;
 
 /* Finally, functions. Functions come in two flavors: Native and foreign.
@@ -232,7 +266,7 @@ typedef struct lily_tuple_val_ {
     uint32_t extra_space;
     uint32_t num_values;
     uint32_t pad;
-    struct lily_value_ **elems;
+    struct lily_value_ *elems;
 } lily_tuple_val;
 
 /* Every value that is refcounted is a superset of this. */
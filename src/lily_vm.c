@@ -1,93 +1,68 @@
 #include <stddef.h>
 #include <string.h>
+#include <time.h>
 
 #include "lily_vm.h"
 #include "lily_parser.h"
 #include "lily_value_stack.h"
 #include "lily_value_flags.h"
 #include "lily_move.h"
+#include "lily_pkg_builtin.h"
 
 #include "lily_int_opcode.h"
 
 #include "lily_api_alloc.h"
+#include "lily_api_embed.h"
 #include "lily_api_options.h"
 #include "lily_api_value.h"
 
 extern lily_gc_entry *lily_gc_stopper;
+
 /* This isn't included in a header file because only vm should use this. */
 void lily_value_destroy(lily_value *);
 /* Same here: Safely escape string values for `KeyError`. */
 void lily_mb_escape_add_str(lily_msgbuf *, const char *);
 
 #define INTEGER_OP(OP) \
-lhs_reg = vm_regs[code[2]]; \
-rhs_reg = vm_regs[code[3]]; \
-vm_regs[code[4]]->value.integer = \
+lhs_reg = &vm_regs[code[2]]; \
+rhs_reg = &vm_regs[code[3]]; \
+vm_regs[code[4]].value.integer = \
 lhs_reg->value.integer OP rhs_reg->value.integer; \
-vm_regs[code[4]]->flags = LILY_INTEGER_ID; \
+vm_regs[code[4]].flags = LILY_INTEGER_ID; \
 code += 5;
 
 #define DOUBLE_OP(OP) \
-lhs_reg = vm_regs[code[2]]; \
-rhs_reg = vm_regs[code[3]]; \
-vm_regs[code[4]]->value.doubleval = \
+lhs_reg = &vm_regs[code[2]]; \
+rhs_reg = &vm_regs[code[3]]; \
+vm_regs[code[4]].value.doubleval = \
 lhs_reg->value.doubleval OP rhs_reg->value.doubleval; \
-vm_regs[code[4]]->flags = LILY_DOUBLE_ID; \
+vm_regs[code[4]].flags = LILY_DOUBLE_ID; \
 code += 5;
 
-/* EQUALITY_COMPARE_OP is used for == and !=, instead of a normal COMPARE_OP.
-   The difference is that this will allow op on any type, so long as the lhs
-   and rhs agree on the full type. This allows comparing functions, hashes
-   lists, and more.
-
-   Arguments are:
-   * op:       The operation to perform relative to the values given. This will
-               be substituted like: lhs->value OP rhs->value
-               This is done for everything BUT string.
-   * stringop: The operation to perform relative to the result of strcmp. ==
-               does == 0, as an example. */
-#define EQUALITY_COMPARE_OP(OP, STRINGOP) \
-lhs_reg = vm_regs[code[2]]; \
-rhs_reg = vm_regs[code[3]]; \
-if (lhs_reg->class_id == LILY_DOUBLE_ID) { \
-    vm_regs[code[4]]->value.integer = \
-    (lhs_reg->value.doubleval OP rhs_reg->value.doubleval); \
-} \
-else if (lhs_reg->class_id == LILY_INTEGER_ID) { \
-    vm_regs[code[4]]->value.integer =  \
-    (lhs_reg->value.integer OP rhs_reg->value.integer); \
-} \
-else if (lhs_reg->class_id == LILY_STRING_ID) { \
-    vm_regs[code[4]]->value.integer = \
-    strcmp(lhs_reg->value.string->string, \
-           rhs_reg->value.string->string) STRINGOP; \
-} \
-else { \
-    vm->pending_line = code[1]; \
-    vm_regs[code[4]]->value.integer = \
-    lily_value_compare(vm, lhs_reg, rhs_reg) OP 1; \
-} \
-vm_regs[code[4]]->flags = LILY_BOOLEAN_ID; \
+/* This is used by the comparison opcodes. Each one knows what kind of values
+   it's given, so the test (written in terms of lhs_reg and rhs_reg) is done
+   without checking them first. */
+#define COMPARE_OP(TEST) \
+lhs_reg = &vm_regs[code[2]]; \
+rhs_reg = &vm_regs[code[3]]; \
+vm_regs[code[4]].value.integer = (TEST); \
+vm_regs[code[4]].flags = LILY_BOOLEAN_ID; \
 code += 5;
 
-#define COMPARE_OP(OP, STRINGOP) \
-lhs_reg = vm_regs[code[2]]; \
-rhs_reg = vm_regs[code[3]]; \
-if (lhs_reg->class_id == LILY_DOUBLE_ID) { \
-    vm_regs[code[4]]->value.integer = \
-    (lhs_reg->value.doubleval OP rhs_reg->value.doubleval); \
-} \
-else if (lhs_reg->class_id == LILY_INTEGER_ID) { \
-    vm_regs[code[4]]->value.integer = \
-    (lhs_reg->value.integer OP rhs_reg->value.integer); \
-} \
-else if (lhs_reg->class_id == LILY_STRING_ID) { \
-    vm_regs[code[4]]->value.integer = \
-    strcmp(lhs_reg->value.string->string, \
-           rhs_reg->value.string->string) STRINGOP; \
-} \
-vm_regs[code[4]]->flags = LILY_BOOLEAN_ID; \
-code += 5;
+#define INTEGER_COMPARE(OP) \
+(lhs_reg->value.integer OP rhs_reg->value.integer)
+
+#define DOUBLE_COMPARE(OP) \
+(lhs_reg->value.doubleval OP rhs_reg->value.doubleval)
+
+/* This is for opcodes that compare and jump. The comparison is checked against
+   code[1] to see if the jump should be taken, like with o_jump_if. */
+#define COMPARE_JUMP_OP(FIELD, OP, RHS) \
+lhs_reg = &vm_regs[code[2]]; \
+if ((lhs_reg->value.FIELD OP RHS) == code[1]) \
+    code += (int16_t)code[4]; \
+else \
+    code += 5;
 
 /** If you're interested in working on the vm, or having trouble with it, here's
     some advice that might make things easier.
@@ -116,32 +91,87 @@ static uint16_t foreign_code[1] = {o_return_from_vm};
  *                          |_|
  */
 
-static void add_call_frame(lily_vm_state *);
-static void invoke_gc(lily_vm_state *);
+static void grow_call_frames(lily_vm_state *);
+static void vm_error(lily_vm_state *, uint8_t, const char *);
+static void invoke_major_gc(lily_vm_state *);
 
-lily_vm_state *lily_new_vm_state(lily_options *options,
-        lily_raiser *raiser)
+/* This is splitmix64's step, used to spread a seed over more bits. */
+static uint64_t seed_step(uint64_t *state)
 {
-    lily_vm_state *vm = lily_malloc(sizeof(lily_vm_state));
-    vm->data = lily_op_get_data(options);
-    vm->gc_threshold = lily_op_get_gc_start(options);
-    vm->gc_multiplier = lily_op_get_gc_multiplier(options);
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+/* Hash tables are seeded so that keys that collide can't be computed ahead of
+   time. If the embedder gave a seed, use it (useful for reproducible runs).
+   Otherwise, try the system's random source before falling back to whatever
+   varies from run to run. */
+static void init_hash_seed(lily_vm_state *vm, uint64_t given)
+{
+    uint64_t state = given;
+
+    if (state == 0) {
+        int ok = 0;
+#ifndef _WIN32
+        FILE *f = fopen("/dev/urandom", "rb");
+        if (f) {
+            ok = (fread(vm->hash_seed, sizeof(uint64_t), 2, f) == 2);
+            fclose(f);
+        }
+#endif
+        if (ok)
+            return;
+
+        state = (uint64_t)time(NULL) ^ ((uint64_t)clock() << 32) ^
+                (uint64_t)(uintptr_t)vm;
+    }
+
+    vm->hash_seed[0] = seed_step(&state);
+    vm->hash_seed[1] = seed_step(&state);
+}
 
+/* This makes a vm with nothing in it. The caller sets the fields that come
+   from options (data, rendering, gc tuning, and the hash seed). */
+static lily_vm_state *new_vm_state(lily_raiser *raiser,
+        uint32_t max_call_depth)
+{
+    lily_vm_state *vm = lily_malloc(sizeof(lily_vm_state));
+    vm->render_pos = 0;
+    vm->rendering = 0;
     vm->call_depth = 0;
     vm->raiser = raiser;
     vm->vm_regs = NULL;
     vm->regs_from_main = NULL;
     vm->num_registers = 0;
     vm->max_registers = 0;
-    vm->gc_live_entries = NULL;
+    vm->gc_young_entries = NULL;
+    vm->gc_old_entries = NULL;
     vm->gc_spare_entries = NULL;
-    vm->gc_live_entry_count = 0;
+    vm->gc_entry_blocks = NULL;
+    vm->gc_young_count = 0;
+    vm->gc_old_count = 0;
     vm->gc_pass = 0;
+    vm->gc_minor = 0;
+    vm->gc_minor_passes = 0;
+    vm->gc_major_passes = 0;
+    vm->gc_spare_count = 0;
+    vm->gc_last_freed = 0;
+    vm->gc_total_freed = 0;
+    vm->gc_total_pause = 0;
+    vm->gc_max_pause = 0;
     vm->catch_chain = NULL;
     vm->symtab = NULL;
     vm->readonly_table = NULL;
     vm->readonly_count = 0;
     vm->call_chain = NULL;
+    vm->call_frames = NULL;
+    vm->call_frame_count = 0;
+    vm->max_call_depth = max_call_depth;
+    vm->reentry_depth = 0;
+    vm->max_reentry = 0;
+    vm->exec_depth = 0;
     vm->class_count = 0;
     vm->class_table = NULL;
     vm->stdout_reg = NULL;
@@ -149,7 +179,7 @@ lily_vm_state *lily_new_vm_state(lily_options *options,
     vm->pending_line = 0;
     vm->include_last_frame_in_trace = 1;
 
-    add_call_frame(vm);
+    grow_call_frames(vm);
 
     lily_vm_catch_entry *catch_entry = lily_malloc(sizeof(lily_vm_catch_entry));
     catch_entry->prev = NULL;
@@ -160,32 +190,49 @@ lily_vm_state *lily_new_vm_state(lily_options *options,
     return vm;
 }
 
-static void destroy_gc_entries(lily_vm_state *vm)
+lily_vm_state *lily_new_vm_state(lily_options *options,
+        lily_raiser *raiser)
 {
-    lily_gc_entry *gc_iter, *gc_temp;
-    gc_iter = vm->gc_live_entries;
+    lily_vm_state *vm = new_vm_state(raiser,
+            lily_op_get_max_call_depth(options));
+    vm->max_reentry = lily_op_get_max_reentry(options);
+    vm->data = lily_op_get_data(options);
+    vm->render_sink = lily_op_get_render_sink(options);
+    vm->render_func = lily_op_get_render_func(options);
+    vm->render_threshold = lily_op_get_render_threshold(options);
+    vm->render_buffer = lily_malloc(vm->render_threshold + 1);
+    vm->gc_threshold = lily_op_get_gc_start(options);
+    vm->gc_multiplier = lily_op_get_gc_multiplier(options);
+    vm->gc_major_threshold = vm->gc_threshold * vm->gc_multiplier;
 
-    while (gc_iter != NULL) {
-        gc_temp = gc_iter->next;
+    init_hash_seed(vm, lily_op_get_hash_seed(options));
 
-        lily_free(gc_iter);
+    return vm;
+}
 
-        gc_iter = gc_temp;
-    }
+/* Entries are made this many at a time, and are never freed one at a time. */
+#define GC_ENTRY_BLOCK_SIZE 128
 
-    gc_iter = vm->gc_spare_entries;
-    while (gc_iter != NULL) {
-        gc_temp = gc_iter->next;
+typedef struct lily_gc_entry_block_ {
+    struct lily_gc_entry_block_ *next;
+    lily_gc_entry entries[GC_ENTRY_BLOCK_SIZE];
+} lily_gc_entry_block;
 
-        lily_free(gc_iter);
+static void destroy_gc_entries(lily_vm_state *vm)
+{
+    lily_gc_entry_block *block_iter = vm->gc_entry_blocks;
+    lily_gc_entry_block *block_next;
 
-        gc_iter = gc_temp;
+    while (block_iter) {
+        block_next = block_iter->next;
+        lily_free(block_iter);
+        block_iter = block_next;
     }
 }
 
 void lily_free_vm(lily_vm_state *vm)
 {
-    lily_value **regs_from_main = vm->regs_from_main;
+    lily_value *regs_from_main = vm->regs_from_main;
     lily_value *reg;
     int i;
     if (vm->catch_chain != NULL) {
@@ -202,11 +249,9 @@ void lily_free_vm(lily_vm_state *vm)
     }
 
     for (i = vm->max_registers-1;i >= 0;i--) {
-        reg = regs_from_main[i];
+        reg = &regs_from_main[i];
 
         lily_deref(reg);
-
-        lily_free(reg);
     }
 
     /* This keeps the final gc invoke from touching the now-deleted registers.
@@ -216,26 +261,17 @@ void lily_free_vm(lily_vm_state *vm)
 
     lily_free(regs_from_main);
 
-    lily_call_frame *frame_iter = vm->call_chain;
-    lily_call_frame *frame_next;
-
-    while (frame_iter->prev)
-        frame_iter = frame_iter->prev;
-
-    while (frame_iter) {
-        frame_next = frame_iter->next;
-        lily_free(frame_iter);
-        frame_iter = frame_next;
-    }
+    lily_free(vm->call_frames);
 
     /* If there are any entries left over, then do a final gc pass that will
        destroy the tagged values. */
-    if (vm->gc_live_entry_count)
-        invoke_gc(vm);
+    if (vm->gc_young_count || vm->gc_old_count)
+        invoke_major_gc(vm);
 
     destroy_gc_entries(vm);
 
     lily_free(vm->class_table);
+    lily_free(vm->render_buffer);
     lily_free(vm);
 }
 
@@ -248,9 +284,37 @@ void lily_free_vm(lily_vm_state *vm)
  *
  */
 
-static void gc_mark(int, lily_value *);
-
-/* This is Lily's garbage collector. It runs in multiple stages:
+static void gc_mark(lily_vm_state *, lily_value *);
+
+/* Lily's garbage collector is only needed to find cycles, since refcounting
+   takes care of everything else. Tagged values are split into two generations.
+   New entries start out young, and entries that survive a collection are moved
+   into the old generation.
+
+   Most collections are minor collections, which only look at young entries.
+   Instead of marking from registers, a minor collection uses refcounts to find
+   the young values that something outside of the young generation (registers,
+   old values, untagged containers, and so on) has a ref to:
+   1: Each young entry starts with gc_refs set to the refcount of its value.
+   2: Go through the values inside of each young value. Every ref to a young
+      value that is found subtracts 1 from that entry's gc_refs. Untagged
+      containers are only looked into if their refcount is 1, because then the
+      value being scanned is the only owner. Otherwise, the refs inside of them
+      are left alone, which keeps what they hold alive.
+   3: Young entries with gc_refs left over are referenced from the outside, so
+      they're marked, along with every young value they can reach. Old entries
+      are treated as already marked, so marking stays within the young
+      generation.
+   4: Anything not marked is only held by other unmarked young values. Those
+      are destroyed the same way that a major collection destroys them.
+   5: Survivors are moved into the old generation.
+   A value cannot be put inside of an old value without giving it a ref, so
+   there's no need for a write barrier to find old values pointing to young
+   ones. The cost of a minor collection depends on how many values are young,
+   instead of how many values are alive.
+
+   A major collection looks at everything, and runs when the old generation has
+   grown past the major threshold. It runs in multiple stages:
    1: Go to each _in-use_ register that is not nil and use the appropriate
       gc_marker call to mark all values inside that value which are visible.
       Visible items are set to the vm's ->gc_pass.
@@ -274,33 +338,31 @@ static void gc_mark(int, lily_value *);
       by the gc.
    4: Finally, destroy any values that stage 2 didn't clear.
       Absolutely nothing is using these now, so it's safe to destroy them. */
-static void invoke_gc(lily_vm_state *vm)
+
+static uint64_t gc_clock(void)
 {
-    /* This is (sort of) a mark-and-sweep garbage collector. This is called when
-       a certain number of allocations have been done. Take note that values
-       can be destroyed by deref. However, those values will have the gc_entry's
-       value set to NULL as an indicator. */
-    vm->gc_pass++;
+#if defined(CLOCK_MONOTONIC) && !defined(_WIN32)
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+#else
+    return (uint64_t)clock() * (1000000000 / CLOCKS_PER_SEC);
+#endif
+}
 
-    lily_value **regs_from_main = vm->regs_from_main;
-    int pass = vm->gc_pass;
-    int i;
-    lily_gc_entry *gc_iter;
+static void gc_record_pause(lily_vm_state *vm, uint64_t start)
+{
+    uint64_t pause = gc_clock() - start;
 
-    /* Stage 1: Go through all registers and use the appropriate gc_marker call
-                that will mark every inner value that's visible. */
-    for (i = 0;i < vm->num_registers;i++) {
-        lily_value *reg = regs_from_main[i];
-        if (reg->flags & VAL_IS_GC_SWEEPABLE)
-            gc_mark(pass, reg);
-    }
+    vm->gc_total_pause += pause;
+    if (vm->gc_max_pause < pause)
+        vm->gc_max_pause = pause;
+}
 
-    /* Stage 2: Start destroying everything that wasn't marked as visible.
-                Don't forget to check ->value for NULL in case the value was
-                destroyed through normal ref/deref means. */
-    for (gc_iter = vm->gc_live_entries;
-         gc_iter;
-         gc_iter = gc_iter->next) {
+/* Destroy the values that the current pass did not mark. */
+static void gc_destroy_unmarked(lily_gc_entry *gc_iter, int pass)
+{
+    for (;gc_iter;gc_iter = gc_iter->next) {
         if (gc_iter->last_pass != pass &&
             gc_iter->value.generic != NULL) {
             /* This tells value destroy to just hollow the value since it may be
@@ -309,114 +371,287 @@ static void invoke_gc(lily_vm_state *vm)
             lily_value_destroy((lily_value *)gc_iter);
         }
     }
+}
+
+/* Registers that are not in use may hold a value that was just destroyed.
+   Those registers are set to nil so that prep_registers won't deref them. */
+static void gc_clear_unused_registers(lily_vm_state *vm)
+{
+    lily_value *regs_from_main = vm->regs_from_main;
+    int i;
 
-    /* Stage 3: Check registers not currently in use to see if they hold a
-                value that's going to be collected. If so, then mark the
-                register as nil so that the value will be cleared later. */
     for (i = vm->num_registers;i < vm->max_registers;i++) {
-        lily_value *reg = regs_from_main[i];
+        lily_value *reg = &regs_from_main[i];
         if (reg->flags & VAL_IS_GC_TAGGED &&
             reg->value.gc_generic->gc_entry == lily_gc_stopper) {
             reg->flags = 0;
         }
     }
+}
 
-    /* Stage 4: Delete the values that stage 2 didn't delete.
-                Nothing is using them anymore. Also, sort entries into those
-                that are living and those that are no longer used. */
-    i = 0;
-    lily_gc_entry *new_live_entries = NULL;
-    lily_gc_entry *new_spare_entries = vm->gc_spare_entries;
-    lily_gc_entry *iter_next = NULL;
-    gc_iter = vm->gc_live_entries;
+/* Free the values that were hollowed, and move their entries (along with those
+   whose values were destroyed by deref) to the spare list. Everything else is
+   moved into the old generation. Returns how many entries were moved. */
+static uint32_t gc_sweep_into_old(lily_vm_state *vm, lily_gc_entry *gc_iter)
+{
+    lily_gc_entry *iter_next;
+    uint32_t count = 0;
 
     while (gc_iter) {
         iter_next = gc_iter->next;
 
-        if (gc_iter->last_pass == -1) {
-            lily_free(gc_iter->value.generic);
+        if (gc_iter->last_pass == -1 ||
+            gc_iter->value.generic == NULL) {
+            if (gc_iter->value.generic) {
+                lily_free(gc_iter->value.generic);
+                vm->gc_last_freed++;
+            }
 
-            gc_iter->next = new_spare_entries;
-            new_spare_entries = gc_iter;
+            gc_iter->next = vm->gc_spare_entries;
+            vm->gc_spare_entries = gc_iter;
+            vm->gc_spare_count++;
         }
         else {
-            i++;
-            gc_iter->next = new_live_entries;
-            new_live_entries = gc_iter;
+            count++;
+            gc_iter->generation = 1;
+            gc_iter->next = vm->gc_old_entries;
+            vm->gc_old_entries = gc_iter;
         }
 
         gc_iter = iter_next;
     }
 
-    /* Did the sweep reclaim enough objects? If not, then increase the threshold
-       to prevent spamming sweeps when everything is alive. */
-    if (vm->gc_threshold <= i)
-        vm->gc_threshold *= vm->gc_multiplier;
+    return count;
+}
 
-    vm->gc_live_entry_count = i;
-    vm->gc_live_entries = new_live_entries;
-    vm->gc_spare_entries = new_spare_entries;
+static void gc_subtract_inner(lily_value *);
+
+/* Stage 2 of a minor collection: Subtract the refs that 'v' holds to young
+   values. */
+static void gc_subtract_children(lily_value *v)
+{
+    int class_id = v->class_id;
+
+    if (class_id == LILY_LIST_ID ||
+        class_id == LILY_TUPLE_ID ||
+        v->flags & (VAL_IS_ENUM | VAL_IS_INSTANCE)) {
+        lily_list_val *list_val = v->value.list;
+        int i;
+
+        for (i = 0;i < list_val->num_values;i++)
+            gc_subtract_inner(&list_val->elems[i]);
+    }
+    else if (class_id == LILY_HASH_ID) {
+        lily_hash_val *hv = v->value.hash;
+        lily_hash_entry *entry;
+        int pos = 0;
+
+        while ((entry = lily_hash_next_entry(hv, &pos)) != NULL)
+            gc_subtract_inner(&entry->record);
+    }
+    else if (class_id == LILY_DYNAMIC_ID)
+        gc_subtract_inner(v->value.dynamic->inner_value);
+    else if (class_id == LILY_FUNCTION_ID) {
+        lily_function_val *function_val = v->value.function;
+        lily_value **upvalues = function_val->upvalues;
+        int count = function_val->num_upvalues;
+        int i;
+
+        /* A cell shared with another closure is owned by both. */
+        for (i = 0;i < count;i++) {
+            lily_value *up = upvalues[i];
+            if (up && up->cell_refcount == 1)
+                gc_subtract_inner(up);
+        }
+    }
 }
 
-static void dynamic_marker(int pass, lily_value *v)
+static void gc_subtract_inner(lily_value *v)
 {
+    if ((v->flags & VAL_IS_GC_SWEEPABLE) == 0)
+        return;
+
     if (v->flags & VAL_IS_GC_TAGGED) {
-        lily_gc_entry *e = v->value.dynamic->gc_entry;
-        if (e->last_pass == pass)
-            return;
+        lily_gc_entry *e = v->value.gc_generic->gc_entry;
+        if (e->generation == 0)
+            e->gc_refs--;
+    }
+    else if (v->flags & VAL_IS_DEREFABLE &&
+             v->value.generic->refcount == 1)
+        gc_subtract_children(v);
+}
+
+static void invoke_minor_gc(lily_vm_state *vm)
+{
+    uint64_t start = gc_clock();
+    lily_gc_entry *young = vm->gc_young_entries;
+    lily_gc_entry *gc_iter;
+
+    vm->gc_pass++;
+    vm->gc_minor = 1;
+    vm->gc_last_freed = 0;
+
+    int pass = vm->gc_pass;
 
-        e->last_pass = pass;
+    /* Stages 1 and 2: Figure out which young values are referenced from outside
+                       of the young generation. */
+    for (gc_iter = young;gc_iter;gc_iter = gc_iter->next) {
+        if (gc_iter->value.generic != NULL)
+            gc_iter->gc_refs = gc_iter->value.generic->refcount;
     }
 
-    lily_value *inner_value = v->value.dynamic->inner_value;
+    for (gc_iter = young;gc_iter;gc_iter = gc_iter->next) {
+        if (gc_iter->value.generic != NULL)
+            gc_subtract_children((lily_value *)gc_iter);
+    }
 
-    if (inner_value->flags & VAL_IS_GC_SWEEPABLE)
-        gc_mark(pass, inner_value);
+    /* Stage 3: Mark from those values. */
+    for (gc_iter = young;gc_iter;gc_iter = gc_iter->next) {
+        if (gc_iter->value.generic != NULL &&
+            gc_iter->gc_refs > 0)
+            gc_mark(vm, (lily_value *)gc_iter);
+    }
+
+    vm->gc_minor = 0;
+
+    /* Stage 4: Destroy what's left, and make sure no unused register still
+                holds a destroyed value. */
+    gc_destroy_unmarked(young, pass);
+    gc_clear_unused_registers(vm);
+
+    /* Stage 5: The survivors are now old. */
+    vm->gc_old_count += gc_sweep_into_old(vm, young);
+    vm->gc_young_entries = NULL;
+    vm->gc_young_count = 0;
+    vm->gc_minor_passes++;
+    vm->gc_total_freed += vm->gc_last_freed;
+
+    gc_record_pause(vm, start);
 }
 
-static void list_marker(int pass, lily_value *v)
+static void invoke_major_gc(lily_vm_state *vm)
 {
-    if (v->flags & VAL_IS_GC_TAGGED) {
-        /* Only instances/enums that pass through here are tagged. */
-        lily_gc_entry *e = v->value.instance->gc_entry;
-        if (e->last_pass == pass)
-            return;
+    /* This is (sort of) a mark-and-sweep garbage collector. This is called when
+       a certain number of allocations have been done. Take note that values
+       can be destroyed by deref. However, those values will have the gc_entry's
+       value set to NULL as an indicator. */
+    uint64_t start = gc_clock();
+    vm->gc_pass++;
+    vm->gc_last_freed = 0;
+
+    lily_value *regs_from_main = vm->regs_from_main;
+    int pass = vm->gc_pass;
+    int i;
+
+    /* Put both generations together, since they're both being swept. */
+    lily_gc_entry *all_entries = vm->gc_young_entries;
+    if (all_entries) {
+        lily_gc_entry *tail = all_entries;
+        while (tail->next)
+            tail = tail->next;
+
+        tail->next = vm->gc_old_entries;
+    }
+    else
+        all_entries = vm->gc_old_entries;
 
-        e->last_pass = pass;
+    vm->gc_young_entries = NULL;
+    vm->gc_old_entries = NULL;
+
+    /* Stage 1: Go through all registers and use the appropriate gc_marker call
+                that will mark every inner value that's visible. */
+    for (i = 0;i < vm->num_registers;i++) {
+        lily_value *reg = &regs_from_main[i];
+        if (reg->flags & VAL_IS_GC_SWEEPABLE)
+            gc_mark(vm, reg);
     }
 
+    /* Stage 2: Start destroying everything that wasn't marked as visible.
+                Don't forget to check ->value for NULL in case the value was
+                destroyed through normal ref/deref means. */
+    gc_destroy_unmarked(all_entries, pass);
+
+    /* Stage 3: Check registers not currently in use to see if they hold a
+                value that's going to be collected. If so, then mark the
+                register as nil so that the value will be cleared later. */
+    gc_clear_unused_registers(vm);
+
+    /* Stage 4: Delete the values that stage 2 didn't delete.
+                Nothing is using them anymore. Everything else is old now. */
+    uint32_t count = gc_sweep_into_old(vm, all_entries);
+
+    /* Did the sweep reclaim enough objects? If not, then increase the threshold
+       to prevent spamming sweeps when everything is alive. */
+    if (vm->gc_major_threshold <= count)
+        vm->gc_major_threshold *= vm->gc_multiplier;
+
+    vm->gc_old_count = count;
+    vm->gc_young_count = 0;
+    vm->gc_major_passes++;
+    vm->gc_total_freed += vm->gc_last_freed;
+
+    gc_record_pause(vm, start);
+}
+
+/* Returns 1 if 'e' has not been seen by this pass yet, and marks it as seen.
+   During a minor collection, old entries count as already seen. */
+static int gc_mark_entry(lily_vm_state *vm, lily_gc_entry *e)
+{
+    if (e->last_pass == (int32_t)vm->gc_pass ||
+        (e->generation && vm->gc_minor))
+        return 0;
+
+    e->last_pass = vm->gc_pass;
+    return 1;
+}
+
+static void dynamic_marker(lily_vm_state *vm, lily_value *v)
+{
+    if (v->flags & VAL_IS_GC_TAGGED &&
+        gc_mark_entry(vm, v->value.dynamic->gc_entry) == 0)
+        return;
+
+    lily_value *inner_value = v->value.dynamic->inner_value;
+
+    if (inner_value->flags & VAL_IS_GC_SWEEPABLE)
+        gc_mark(vm, inner_value);
+}
+
+static void list_marker(lily_vm_state *vm, lily_value *v)
+{
+    /* Only instances/enums that pass through here are tagged. */
+    if (v->flags & VAL_IS_GC_TAGGED &&
+        gc_mark_entry(vm, v->value.instance->gc_entry) == 0)
+        return;
+
     lily_list_val *list_val = v->value.list;
     int i;
 
     for (i = 0;i < list_val->num_values;i++) {
-        lily_value *elem = list_val->elems[i];
+        lily_value *elem = &list_val->elems[i];
 
         if (elem->flags & VAL_IS_GC_SWEEPABLE)
-            gc_mark(pass, elem);
+            gc_mark(vm, elem);
     }
 }
 
-static void hash_marker(int pass, lily_value *v)
+static void hash_marker(lily_vm_state *vm, lily_value *v)
 {
     lily_hash_val *hv = v->value.hash;
-    int i;
+    lily_hash_entry *entry;
+    int pos = 0;
 
-    for (i = 0;i < hv->num_bins;i++) {
-        lily_hash_entry *entry = hv->bins[i];
-        if (entry)
-            gc_mark(pass, entry->record);
+    while ((entry = lily_hash_next_entry(hv, &pos)) != NULL) {
+        if (entry->record.flags & VAL_IS_GC_SWEEPABLE)
+            gc_mark(vm, &entry->record);
     }
 }
 
-static void function_marker(int pass, lily_value *v)
+static void function_marker(lily_vm_state *vm, lily_value *v)
 {
-    if (v->flags & VAL_IS_GC_TAGGED) {
-        lily_gc_entry *e = v->value.function->gc_entry;
-        if (e->last_pass == pass)
-            return;
-
-        e->last_pass = pass;
-    }
+    if (v->flags & VAL_IS_GC_TAGGED &&
+        gc_mark_entry(vm, v->value.function->gc_entry) == 0)
+        return;
 
     lily_function_val *function_val = v->value.function;
 
@@ -427,59 +662,120 @@ static void function_marker(int pass, lily_value *v)
     for (i = 0;i < count;i++) {
         lily_value *up = upvalues[i];
         if (up && (up->flags & VAL_IS_GC_SWEEPABLE))
-            gc_mark(pass, up);
+            gc_mark(vm, up);
     }
 }
 
-static void gc_mark(int pass, lily_value *v)
+static void gc_mark(lily_vm_state *vm, lily_value *v)
 {
     if (v->flags & (VAL_IS_GC_TAGGED | VAL_IS_GC_SPECULATIVE)) {
         int class_id = v->class_id;
         if (class_id == LILY_LIST_ID ||
             class_id == LILY_TUPLE_ID ||
             v->flags & (VAL_IS_ENUM | VAL_IS_INSTANCE))
-            list_marker(pass, v);
+            list_marker(vm, v);
         else if (class_id == LILY_HASH_ID)
-            hash_marker(pass, v);
+            hash_marker(vm, v);
         else if (class_id == LILY_DYNAMIC_ID)
-            dynamic_marker(pass, v);
+            dynamic_marker(vm, v);
         else if (class_id == LILY_FUNCTION_ID)
-            function_marker(pass, v);
+            function_marker(vm, v);
+    }
+}
+
+void lily_gc_get_stats(lily_vm_state *vm, lily_gc_stats *stats)
+{
+    stats->minor_passes = vm->gc_minor_passes;
+    stats->major_passes = vm->gc_major_passes;
+    stats->young_entries = vm->gc_young_count;
+    stats->old_entries = vm->gc_old_count;
+    stats->spare_entries = vm->gc_spare_count;
+    stats->threshold = vm->gc_threshold;
+    stats->major_threshold = vm->gc_major_threshold;
+    stats->multiplier = vm->gc_multiplier;
+    stats->last_freed = vm->gc_last_freed;
+    stats->total_freed = vm->gc_total_freed;
+    stats->total_pause_ns = vm->gc_total_pause;
+    stats->max_pause_ns = vm->gc_max_pause;
+}
+
+/* Do a major collection right now. Values that are only reachable through
+   cycles are destroyed, even if the thresholds haven't been reached. */
+void lily_gc_collect(lily_vm_state *vm)
+{
+    invoke_major_gc(vm);
+}
+
+void lily_gc_set_threshold(lily_vm_state *vm, uint32_t threshold)
+{
+    vm->gc_threshold = threshold;
+}
+
+void lily_gc_set_major_threshold(lily_vm_state *vm, uint32_t threshold)
+{
+    vm->gc_major_threshold = threshold;
+}
+
+void lily_gc_set_multiplier(lily_vm_state *vm, uint32_t multiplier)
+{
+    vm->gc_multiplier = multiplier;
+}
+
+/* Make a new block of entries, and put all of them into the spare list. */
+static void add_gc_entry_block(lily_vm_state *vm)
+{
+    lily_gc_entry_block *block = lily_malloc(sizeof(lily_gc_entry_block));
+    int i;
+
+    block->next = vm->gc_entry_blocks;
+    vm->gc_entry_blocks = block;
+
+    for (i = 0;i < GC_ENTRY_BLOCK_SIZE;i++) {
+        block->entries[i].next = vm->gc_spare_entries;
+        vm->gc_spare_entries = &block->entries[i];
     }
+
+    vm->gc_spare_count += GC_ENTRY_BLOCK_SIZE;
 }
 
 /* This will attempt to grab a spare entry and associate it with the value
-   given. If there are no spare entries, then a new entry is made. These entries
-   are how the gc is able to locate values later.
+   given. If there are no spare entries, then a new block of entries is made.
+   These entries are how the gc is able to locate values later.
 
-   If the number of living gc objects is at or past the threshold, then the
-   collector will run BEFORE the association. This is intentional, as 'value' is
-   not guaranteed to be in a register. */
+   If the number of young gc objects is at or past the threshold, then a minor
+   collection (and possibly a major one) will run BEFORE the association. This
+   is intentional, as 'value' is not guaranteed to be in a register. */
 void lily_tag_value(lily_vm_state *vm, lily_value *v)
 {
-    if (vm->gc_live_entry_count >= vm->gc_threshold)
-        invoke_gc(vm);
+    if (vm->gc_young_count >= vm->gc_threshold) {
+        invoke_minor_gc(vm);
 
-    lily_gc_entry *new_entry;
-    if (vm->gc_spare_entries != NULL) {
-        new_entry = vm->gc_spare_entries;
-        vm->gc_spare_entries = vm->gc_spare_entries->next;
+        if (vm->gc_old_count >= vm->gc_major_threshold)
+            invoke_major_gc(vm);
     }
-    else
-        new_entry = lily_malloc(sizeof(lily_gc_entry));
 
+    if (vm->gc_spare_entries == NULL)
+        add_gc_entry_block(vm);
+
+    lily_gc_entry *new_entry = vm->gc_spare_entries;
+    vm->gc_spare_entries = new_entry->next;
+    vm->gc_spare_count--;
+
+    v->flags |= VAL_IS_GC_TAGGED;
+
+    /* The entry is marked as tagged too, so that collections can mark from an
+       entry as if it were the value. */
     new_entry->value.gc_generic = v->value.gc_generic;
     new_entry->last_pass = 0;
     new_entry->flags = v->flags;
+    new_entry->generation = 0;
 
-    new_entry->next = vm->gc_live_entries;
-    vm->gc_live_entries = new_entry;
+    new_entry->next = vm->gc_young_entries;
+    vm->gc_young_entries = new_entry;
 
     /* Attach the gc_entry to the value so the caller doesn't have to. */
     v->value.gc_generic->gc_entry = new_entry;
-    vm->gc_live_entry_count++;
-
-    v->flags |= VAL_IS_GC_TAGGED;
+    vm->gc_young_count++;
 }
 
 /***
@@ -503,14 +799,24 @@ void lily_tag_value(lily_vm_state *vm, lily_value *v)
     a register with a seed type of, say, A, into whatever it should be for the
     given invocation. **/
 
+/* Registers live in a single block, so growing them may move every register.
+   Call frames and a few other places hold pointers to registers. This moves
+   those pointers over to the new block. */
+#define REBASE_REGISTER(ptr, old_start, old_end, new_start) \
+if ((uintptr_t)(ptr) >= old_start && (uintptr_t)(ptr) < old_end) \
+    ptr = new_start + (((uintptr_t)(ptr) - old_start) / sizeof(lily_value));
+
 /* This function ensures that 'register_need' more registers will be available.
-   This may resize (and thus invalidate) vm->regs_from_main and vm->vm_regs. */
+   This may resize (and thus invalidate) vm->regs_from_main and vm->vm_regs, as
+   well as any pointer to a register held outside of the vm. */
 static void grow_vm_registers(lily_vm_state *vm, int register_need)
 {
-    lily_value **new_regs;
+    lily_value *new_regs;
     int i = vm->max_registers;
 
     ptrdiff_t reg_offset = vm->vm_regs - vm->regs_from_main;
+    uintptr_t old_start = (uintptr_t)vm->regs_from_main;
+    uintptr_t old_end = (uintptr_t)(vm->regs_from_main + i);
 
     /* Size is zero only when this is called the first time and no registers
        have been made available. */
@@ -523,23 +829,33 @@ static void grow_vm_registers(lily_vm_state *vm, int register_need)
     while (size < register_need);
 
     /* Remember, use regs_from_main, NOT vm_regs, which is likely adjusted. */
-    new_regs = lily_realloc(vm->regs_from_main, size *
-            sizeof(lily_value *));
+    new_regs = lily_realloc(vm->regs_from_main, size * sizeof(lily_value));
 
     /* Realloc can move the pointer, so always recalculate vm_regs again using
        regs_from_main and the offset. */
     vm->regs_from_main = new_regs;
     vm->vm_regs = new_regs + reg_offset;
 
-    /* Now create the registers as a bunch of empty values, to be filled in
-       whenever they are needed. */
-    for (;i < size;i++) {
-        lily_value *v = lily_malloc(sizeof(lily_value));
-        v->flags = 0;
+    if (old_start != (uintptr_t)new_regs) {
+        lily_call_frame *frame_iter = vm->call_chain;
+
+        while (frame_iter->prev)
+            frame_iter = frame_iter->prev;
 
-        new_regs[i] = v;
+        for (;frame_iter;frame_iter = frame_iter->next) {
+            REBASE_REGISTER(frame_iter->return_target, old_start, old_end,
+                    new_regs)
+        }
+
+        REBASE_REGISTER(vm->stdout_reg, old_start, old_end, new_regs)
+        REBASE_REGISTER(vm->exception_value, old_start, old_end, new_regs)
     }
 
+    /* The new registers start off empty, to be filled in whenever they are
+       needed. */
+    for (;i < size;i++)
+        new_regs[i].flags = 0;
+
     vm->max_registers = size;
 }
 
@@ -549,9 +865,9 @@ static void grow_vm_registers(lily_vm_state *vm, int register_need)
 static inline void scrub_registers(lily_vm_state *vm,
         lily_function_val *fval, int args_collected)
 {
-    lily_value **target_regs = vm->regs_from_main + vm->num_registers;
+    lily_value *target_regs = vm->regs_from_main + vm->num_registers;
     for (;args_collected < fval->reg_count;args_collected++) {
-        lily_value *reg = target_regs[args_collected];
+        lily_value *reg = &target_regs[args_collected];
         lily_deref(reg);
 
         reg->flags = 0;
@@ -566,14 +882,14 @@ static void prep_registers(lily_vm_state *vm, lily_function_val *fval,
 {
     int register_need = vm->num_registers + fval->reg_count;
     int i;
-    lily_value **input_regs = vm->vm_regs;
-    lily_value **target_regs = vm->regs_from_main + vm->num_registers;
+    lily_value *input_regs = vm->vm_regs;
+    lily_value *target_regs = vm->regs_from_main + vm->num_registers;
 
     /* A function's args always come first, so copy arguments over while clearing
        old values. */
     for (i = 0;i < code[3];i++) {
-        lily_value *get_reg = input_regs[code[5+i]];
-        lily_value *set_reg = target_regs[i];
+        lily_value *get_reg = &input_regs[code[5+i]];
+        lily_value *set_reg = &target_regs[i];
 
         if (get_reg->flags & VAL_IS_DEREFABLE)
             get_reg->value.generic->refcount++;
@@ -595,7 +911,7 @@ void lily_push_byte(lily_vm_state *vm, uint8_t b)
     if (vm->num_registers == vm->max_registers)
         grow_vm_registers(vm, vm->num_registers + 1);
 
-    lily_move_byte(vm->regs_from_main[vm->num_registers], b);
+    lily_move_byte(&vm->regs_from_main[vm->num_registers], b);
     vm->num_registers++;
 }
 
@@ -604,7 +920,7 @@ void lily_push_bytestring(lily_vm_state *vm, lily_bytestring_val *sv)
     if (vm->num_registers == vm->max_registers)
         grow_vm_registers(vm, vm->num_registers + 1);
 
-    lily_move_bytestring(vm->regs_from_main[vm->num_registers], sv);
+    lily_move_bytestring(&vm->regs_from_main[vm->num_registers], sv);
     vm->num_registers++;
 }
 
@@ -613,7 +929,7 @@ void lily_push_integer(lily_vm_state *vm, int64_t i)
     if (vm->num_registers == vm->max_registers)
         grow_vm_registers(vm, vm->num_registers + 1);
 
-    lily_move_integer(vm->regs_from_main[vm->num_registers], i);
+    lily_move_integer(&vm->regs_from_main[vm->num_registers], i);
     vm->num_registers++;
 }
 
@@ -623,16 +939,23 @@ void lily_push_list(lily_vm_state *vm, lily_list_val *l)
         grow_vm_registers(vm, vm->num_registers + 1);
 
     lily_move_list_f(MOVE_DEREF_SPECULATIVE,
-            vm->regs_from_main[vm->num_registers], l);
+            &vm->regs_from_main[vm->num_registers], l);
     vm->num_registers++;
 }
 
 void lily_push_value(lily_vm_state *vm, lily_value *v)
 {
-    if (vm->num_registers == vm->max_registers)
+    if (vm->num_registers == vm->max_registers) {
+        /* 'v' may be one of the registers about to move. */
+        uintptr_t old_start = (uintptr_t)vm->regs_from_main;
+        uintptr_t old_end = (uintptr_t)(vm->regs_from_main +
+                vm->max_registers);
+
         grow_vm_registers(vm, vm->num_registers + 1);
+        REBASE_REGISTER(v, old_start, old_end, vm->regs_from_main)
+    }
 
-    lily_value_assign(vm->regs_from_main[vm->num_registers], v);
+    lily_value_assign(&vm->regs_from_main[vm->num_registers], v);
     vm->num_registers++;
 }
 
@@ -646,20 +969,45 @@ void lily_push_value(lily_vm_state *vm, lily_value *v)
  *                  |_|
  */
 
-static void add_call_frame(lily_vm_state *vm)
+/* This makes room for more frames after the last one, or raises RuntimeError if
+   there are already max_call_depth frames. The frames may move, so this fixes
+   vm->call_chain. Callers holding a frame need to get it again from there. */
+static void grow_call_frames(lily_vm_state *vm)
 {
-    lily_call_frame *new_frame = lily_malloc(sizeof(lily_call_frame));
+    uint32_t count = vm->call_frame_count;
+    uint32_t new_count = count * 2;
+    uint32_t current = 0;
+    uint32_t i;
+
+    if (count == vm->max_call_depth)
+        vm_error(vm, LILY_RUNTIMEERROR_ID,
+                "Function call recursion limit reached.");
 
-    /* This intentionally doesn't set anything but prev and next because the
-       caller will have proper values for those. */
-    new_frame->prev = vm->call_chain;
-    new_frame->next = NULL;
-    new_frame->return_target = NULL;
+    if (new_count == 0)
+        new_count = 16;
 
-    if (vm->call_chain != NULL)
-        vm->call_chain->next = new_frame;
+    if (new_count > vm->max_call_depth)
+        new_count = vm->max_call_depth;
 
-    vm->call_chain = new_frame;
+    if (vm->call_chain)
+        current = (uint32_t)(vm->call_chain - vm->call_frames);
+
+    lily_call_frame *frames = lily_realloc(vm->call_frames,
+            new_count * sizeof(lily_call_frame));
+
+    /* Only prev, next, and return_target are set because the caller will have
+       proper values for the rest. */
+    for (i = count;i < new_count;i++)
+        frames[i].return_target = NULL;
+
+    for (i = 0;i < new_count;i++) {
+        frames[i].prev = (i == 0 ? NULL : &frames[i - 1]);
+        frames[i].next = (i + 1 == new_count ? NULL : &frames[i + 1]);
+    }
+
+    vm->call_frames = frames;
+    vm->call_frame_count = new_count;
+    vm->call_chain = &frames[current];
 }
 
 static void add_catch_entry(lily_vm_state *vm)
@@ -739,7 +1087,7 @@ static void key_error(lily_vm_state *vm, lily_value *key, uint16_t line_num)
     lily_msgbuf *msgbuf = vm->raiser->aux_msgbuf;
 
     if (key->class_id == LILY_STRING_ID)
-        lily_mb_escape_add_str(msgbuf, key->value.string->string);
+        lily_mb_escape_add_str(msgbuf, lily_string_raw(key->value.string));
     else
         lily_mb_add_fmt(msgbuf, "%d", key->value.integer);
 
@@ -757,6 +1105,83 @@ static void boundary_error(lily_vm_state *vm, int bad_index)
     vm_error(vm, LILY_INDEXERROR_ID, lily_mb_get(msgbuf));
 }
 
+/***
+ *      ____                _
+ *     |  _ \ ___ _ __   __| | ___ _ __
+ *     | |_) / _ \ '_ \ / _` |/ _ \ '__|
+ *     |  _ <  __/ | | | (_| |  __/ |
+ *     |_| \_\___|_| |_|\__,_|\___|_|
+ *
+ */
+
+/** Templates send their output through a render sink that the embedder gives.
+    Instead of calling the sink for every piece of content and every print,
+    output is collected into a buffer that is sent once it fills up, and when a
+    template finishes. A piece larger than the buffer is sent as-is. Sinks are
+    given a size, but an older render_func needs a \0 terminator that a String
+    view doesn't have, so large pieces are copied for it. **/
+
+static void send_render(lily_vm_state *vm, const char *text, size_t size)
+{
+    if (vm->render_sink)
+        vm->render_sink(text, size, vm->data);
+    else
+        vm->render_func((char *)text, vm->data);
+}
+
+static void send_render_unterminated(lily_vm_state *vm, const char *text,
+        size_t size)
+{
+    if (vm->render_sink) {
+        vm->render_sink(text, size, vm->data);
+        return;
+    }
+
+    char *copy = lily_malloc(size + 1);
+
+    memcpy(copy, text, size);
+    copy[size] = '\0';
+    vm->render_func(copy, vm->data);
+    lily_free(copy);
+}
+
+void lily_render_flush(lily_vm_state *vm)
+{
+    if (vm->render_pos == 0)
+        return;
+
+    vm->render_buffer[vm->render_pos] = '\0';
+    send_render(vm, vm->render_buffer, vm->render_pos);
+    vm->render_pos = 0;
+}
+
+void lily_vm_render(lily_vm_state *vm, const char *text, size_t size)
+{
+    if (vm->render_pos + size > vm->render_threshold) {
+        lily_render_flush(vm);
+
+        if (size > vm->render_threshold) {
+            send_render_unterminated(vm, text, size);
+            return;
+        }
+    }
+
+    memcpy(vm->render_buffer + vm->render_pos, text, size);
+    vm->render_pos += size;
+}
+
+/* This writes 'text' to 'target'. While a template is running, writes to stdout
+   go to the render buffer instead, so that they stay in order with the content
+   of the template. */
+void lily_vm_write_file(lily_vm_state *vm, FILE *target, const char *text,
+        size_t size)
+{
+    if (vm->rendering && target == stdout)
+        lily_vm_render(vm, text, size);
+    else
+        fwrite(text, 1, size, target);
+}
+
 /***
  *      ____        _ _ _   _
  *     | __ ) _   _(_) | |_(_)_ __  ___
@@ -779,15 +1204,18 @@ void lily_builtin_calltrace(lily_vm_state *vm)
 static void do_print(lily_vm_state *vm, FILE *target, lily_value *source)
 {
     if (source->class_id == LILY_STRING_ID)
-        fputs(source->value.string->string, target);
+        lily_vm_write_file(vm, target, source->value.string->string,
+                source->value.string->size);
     else {
         lily_msgbuf *msgbuf = vm->vm_buffer;
         lily_mb_flush(msgbuf);
         lily_mb_add_value(msgbuf, vm, source);
-        fputs(lily_mb_get(msgbuf), target);
+
+        const char *text = lily_mb_get(msgbuf);
+        lily_vm_write_file(vm, target, text, strlen(text));
     }
 
-    fputc('\n', target);
+    lily_vm_write_file(vm, target, "\n", 1);
     lily_return_unit(vm);
 }
 
@@ -852,42 +1280,42 @@ void lily_builtin_Dynamic_new(lily_vm_state *vm)
    be loaded from a register. */
 static void do_o_set_property(lily_vm_state *vm, uint16_t *code)
 {
-    lily_value **vm_regs = vm->vm_regs;
+    lily_value *vm_regs = vm->vm_regs;
     lily_value *rhs_reg;
     int index;
     lily_instance_val *ival;
 
     index = code[2];
-    ival = vm_regs[code[3]]->value.instance;
-    rhs_reg = vm_regs[code[4]];
+    ival = vm_regs[code[3]].value.instance;
+    rhs_reg = &vm_regs[code[4]];
 
-    lily_value_assign(ival->values[index], rhs_reg);
+    lily_value_assign(&ival->values[index], rhs_reg);
 }
 
 static void do_o_get_property(lily_vm_state *vm, uint16_t *code)
 {
-    lily_value **vm_regs = vm->vm_regs;
+    lily_value *vm_regs = vm->vm_regs;
     lily_value *result_reg;
     int index;
     lily_instance_val *ival;
 
     index = code[2];
-    ival = vm_regs[code[3]]->value.instance;
-    result_reg = vm_regs[code[4]];
+    ival = vm_regs[code[3]].value.instance;
+    result_reg = &vm_regs[code[4]];
 
-    lily_value_assign(result_reg, ival->values[index]);
+    lily_value_assign(result_reg, &ival->values[index]);
 }
 
 /* This handles subscript assignment. The index is a register, and needs to be
    validated. */
 static void do_o_set_item(lily_vm_state *vm, uint16_t *code)
 {
-    lily_value **vm_regs = vm->vm_regs;
+    lily_value *vm_regs = vm->vm_regs;
     lily_value *lhs_reg, *index_reg, *rhs_reg;
 
-    lhs_reg = vm_regs[code[2]];
-    index_reg = vm_regs[code[3]];
-    rhs_reg = vm_regs[code[4]];
+    lhs_reg = &vm_regs[code[2]];
+    index_reg = &vm_regs[code[3]];
+    rhs_reg = &vm_regs[code[4]];
 
     if (lhs_reg->class_id != LILY_HASH_ID) {
         int index_int = index_reg->value.integer;
@@ -920,7 +1348,7 @@ static void do_o_set_item(lily_vm_state *vm, uint16_t *code)
             else if (index_int >= list_val->num_values)
                 boundary_error(vm, index_int);
 
-            lily_value_assign(list_val->elems[index_int], rhs_reg);
+            lily_value_assign(&list_val->elems[index_int], rhs_reg);
         }
     }
     else
@@ -931,12 +1359,12 @@ static void do_o_set_item(lily_vm_state *vm, uint16_t *code)
    validated. */
 static void do_o_get_item(lily_vm_state *vm, uint16_t *code)
 {
-    lily_value **vm_regs = vm->vm_regs;
+    lily_value *vm_regs = vm->vm_regs;
     lily_value *lhs_reg, *index_reg, *result_reg;
 
-    lhs_reg = vm_regs[code[2]];
-    index_reg = vm_regs[code[3]];
-    result_reg = vm_regs[code[4]];
+    lhs_reg = &vm_regs[code[2]];
+    index_reg = &vm_regs[code[3]];
+    result_reg = &vm_regs[code[4]];
 
     if (lhs_reg->class_id != LILY_HASH_ID) {
         int index_int = index_reg->value.integer;
@@ -969,7 +1397,7 @@ static void do_o_get_item(lily_vm_state *vm, uint16_t *code)
             else if (index_int >= list_val->num_values)
                 boundary_error(vm, index_int);
 
-            lily_value_assign(result_reg, list_val->elems[index_int]);
+            lily_value_assign(result_reg, &list_val->elems[index_int]);
         }
     }
     else {
@@ -985,27 +1413,27 @@ static void do_o_get_item(lily_vm_state *vm, uint16_t *code)
 
 static void do_o_build_hash(lily_vm_state *vm, uint16_t *code)
 {
-    lily_value **vm_regs = vm->vm_regs;
+    lily_value *vm_regs = vm->vm_regs;
     int i, num_values;
     lily_value *result, *key_reg, *value_reg;
 
     int id = code[2];
     num_values = code[3];
-    result = vm_regs[code[4 + num_values]];
+    result = &vm_regs[code[4 + num_values]];
 
     lily_hash_val *hash_val;
     if (id == LILY_STRING_ID)
-        hash_val = lily_new_hash_strtable_sized(num_values / 2);
+        hash_val = lily_new_hash_strtable_sized(vm, num_values / 2);
     else
-        hash_val = lily_new_hash_numtable_sized(num_values / 2);
+        hash_val = lily_new_hash_numtable_sized(vm, num_values / 2);
 
     lily_move_hash_f(MOVE_DEREF_SPECULATIVE, result, hash_val);
 
     for (i = 0;
          i < num_values;
          i += 2) {
-        key_reg = vm_regs[code[4 + i]];
-        value_reg = vm_regs[code[4 + i + 1]];
+        key_reg = &vm_regs[code[4 + i]];
+        value_reg = &vm_regs[code[4 + i + 1]];
 
         lily_hash_insert_value(hash_val, key_reg, value_reg);
     }
@@ -1016,41 +1444,43 @@ static void do_o_build_hash(lily_vm_state *vm, uint16_t *code)
    However, variant types are also tuples (but with a different name). */
 static void do_o_build_list_tuple(lily_vm_state *vm, uint16_t *code)
 {
-    lily_value **vm_regs = vm->vm_regs;
-    int num_elems = code[2];
-    lily_value *result = vm_regs[code[3+num_elems]];
+    lily_value *vm_regs = vm->vm_regs;
+    int num_elems = code[3];
+    lily_value *result = &vm_regs[code[4+num_elems]];
+    /* The emitter sets this if the type can't have tagged data inside. */
+    uint32_t move_flags = code[2] ? MOVE_DEREF_NO_GC : MOVE_DEREF_SPECULATIVE;
 
     lily_list_val *lv = lily_new_list(num_elems);
-    lily_value **elems = lv->elems;
+    lily_value *elems = lv->elems;
 
     if (code[0] == o_build_list)
-        lily_move_list_f(MOVE_DEREF_SPECULATIVE, result, lv);
+        lily_move_list_f(move_flags, result, lv);
     else
-        lily_move_tuple_f(MOVE_DEREF_SPECULATIVE, result, (lily_tuple_val *)lv);
+        lily_move_tuple_f(move_flags, result, (lily_tuple_val *)lv);
 
     int i;
     for (i = 0;i < num_elems;i++) {
-        lily_value *rhs_reg = vm_regs[code[3+i]];
-        lily_value_assign(elems[i], rhs_reg);
+        lily_value *rhs_reg = &vm_regs[code[4+i]];
+        lily_value_assign(&elems[i], rhs_reg);
     }
 }
 
 static void do_o_build_enum(lily_vm_state *vm, uint16_t *code)
 {
-    lily_value **vm_regs = vm->vm_regs;
+    lily_value *vm_regs = vm->vm_regs;
     int variant_id = code[2];
     int count = code[3];
-    lily_value *result = vm_regs[code[code[3] + 4]];
+    lily_value *result = &vm_regs[code[code[3] + 4]];
 
     lily_variant_val *ival = lily_new_variant(count);
-    lily_value **slots = ival->values;
+    lily_value *slots = ival->values;
 
     lily_move_variant_f(variant_id | MOVE_DEREF_SPECULATIVE, result, ival);
 
     int i;
     for (i = 0;i < count;i++) {
-        lily_value *rhs_reg = vm_regs[code[4+i]];
-        lily_value_assign(slots[i], rhs_reg);
+        lily_value *rhs_reg = &vm_regs[code[4+i]];
+        lily_value_assign(&slots[i], rhs_reg);
     }
 }
 
@@ -1062,7 +1492,7 @@ static void do_o_raise(lily_vm_state *vm, lily_value *exception_val)
        container for traceback. */
 
     lily_instance_val *ival = exception_val->value.instance;
-    char *message = ival->values[0]->value.string->string;
+    char *message = lily_string_raw(ival->values[0].value.string);
     lily_class *raise_cls = vm->class_table[exception_val->class_id];
 
     /* There's no need for a ref/deref here, because the gc cannot trigger
@@ -1078,13 +1508,13 @@ static void do_o_raise(lily_vm_state *vm, lily_value *exception_val)
    This is done outside of the vm's main loop because it's not common. */
 static int do_o_optarg_dispatch(lily_vm_state *vm, uint16_t *code)
 {
-    lily_value **vm_regs = vm->vm_regs;
+    lily_value *vm_regs = vm->vm_regs;
     uint16_t first_spot = code[1];
     int count = code[2] - 1;
     unsigned int i;
 
     for (i = 0;i < count;i++) {
-        lily_value *reg = vm_regs[first_spot - i];
+        lily_value *reg = &vm_regs[first_spot - i];
         if (reg->flags)
             break;
     }
@@ -1101,8 +1531,8 @@ static void do_o_new_instance(lily_vm_state *vm, uint16_t *code)
 {
     int total_entries;
     int cls_id = code[2];
-    lily_value **vm_regs = vm->vm_regs;
-    lily_value *result = vm_regs[code[3]];
+    lily_value *vm_regs = vm->vm_regs;
+    lily_value *result = &vm_regs[code[3]];
     lily_class *instance_class = vm->class_table[cls_id];
 
     total_entries = instance_class->prop_count;
@@ -1133,28 +1563,28 @@ static void do_o_new_instance(lily_vm_state *vm, uint16_t *code)
 
 static void do_o_interpolation(lily_vm_state *vm, uint16_t *code)
 {
-    lily_value **vm_regs = vm->vm_regs;
+    lily_value *vm_regs = vm->vm_regs;
     int count = code[2];
     lily_msgbuf *vm_buffer = vm->vm_buffer;
     lily_mb_flush(vm_buffer);
 
     int i;
     for (i = 0;i < count;i++) {
-        lily_value *v = vm_regs[code[3 + i]];
+        lily_value *v = &vm_regs[code[3 + i]];
         lily_mb_add_value(vm_buffer, vm, v);
     }
 
-    lily_value *result_reg = vm_regs[code[3 + i]];
+    lily_value *result_reg = &vm_regs[code[3 + i]];
 
     lily_move_string(result_reg, lily_new_string(lily_mb_get(vm_buffer)));
 }
 
 static void do_o_dynamic_cast(lily_vm_state *vm, uint16_t *code)
 {
-    lily_value **vm_regs = vm->vm_regs;
+    lily_value *vm_regs = vm->vm_regs;
     lily_class *cast_class = vm->class_table[code[2]];
-    lily_value *rhs_reg = vm_regs[code[3]];
-    lily_value *lhs_reg = vm_regs[code[4]];
+    lily_value *rhs_reg = &vm_regs[code[3]];
+    lily_value *lhs_reg = &vm_regs[code[4]];
 
     lily_value *inner = rhs_reg->value.dynamic->inner_value;
 
@@ -1196,6 +1626,9 @@ static void do_o_dynamic_cast(lily_vm_state *vm, uint16_t *code)
 
 /* This takes a value and makes a closure cell that is a copy of that value. The
    value is given a ref increase. */
+/* Cells are always separate from registers. Registers live in one block that
+   moves when it grows, so a closure can't point into it. Instead, the value is
+   copied into a cell that closures share through cell_refcount. */
 static lily_value *make_cell_from(lily_value *value)
 {
     lily_value *result = lily_malloc(sizeof(lily_value));
@@ -1223,7 +1656,7 @@ static lily_function_val *new_function_copy(lily_function_val *to_copy)
 static lily_value **do_o_create_closure(lily_vm_state *vm, uint16_t *code)
 {
     int count = code[2];
-    lily_value *result = vm->vm_regs[code[3]];
+    lily_value *result = &vm->vm_regs[code[3]];
 
     lily_function_val *last_call = vm->call_chain->function;
 
@@ -1273,13 +1706,13 @@ static void copy_upvalues(lily_function_val *target, lily_function_val *source)
    the specified closure. */
 static void do_o_create_function(lily_vm_state *vm, uint16_t *code)
 {
-    lily_value **vm_regs = vm->vm_regs;
-    lily_value *input_closure_reg = vm_regs[code[1]];
+    lily_value *vm_regs = vm->vm_regs;
+    lily_value *input_closure_reg = &vm_regs[code[1]];
 
     lily_value *target = vm->readonly_table[code[2]];
     lily_function_val *target_func = target->value.function;
 
-    lily_value *result_reg = vm_regs[code[3]];
+    lily_value *result_reg = &vm_regs[code[3]];
     lily_function_val *new_closure = new_function_copy(target_func);
 
     copy_upvalues(new_closure, input_closure_reg->value.function);
@@ -1324,7 +1757,7 @@ static lily_value **do_o_load_closure(lily_vm_state *vm, uint16_t *code)
         }
     }
 
-    lily_value *result_reg = vm->vm_regs[code[i]];
+    lily_value *result_reg = &vm->vm_regs[code[i]];
 
     input_closure->refcount++;
 
@@ -1343,7 +1776,7 @@ static lily_value **do_o_load_closure(lily_vm_state *vm, uint16_t *code)
 static lily_value **do_o_load_class_closure(lily_vm_state *vm, uint16_t *code)
 {
     do_o_get_property(vm, code);
-    lily_value *result_reg = vm->vm_regs[code[4]];
+    lily_value *result_reg = &vm->vm_regs[code[4]];
     lily_function_val *input_closure = result_reg->value.function;
 
     lily_function_val *new_closure = new_function_copy(input_closure);
@@ -1423,7 +1856,7 @@ static lily_list_val *build_traceback_raw(lily_vm_state *vm)
         sprintf(str, "%s:%s from %s%s%s", path, line, class_name, separator,
                 name);
 
-        lily_move_string(lv->elems[i - 1], lily_new_string_take(str));
+        lily_move_string(&lv->elems[i - 1], lily_new_string_take(str));
     }
 
     return lv;
@@ -1456,7 +1889,7 @@ static void fixup_exception_val(lily_vm_state *vm, lily_value *result)
     lily_list_val *raw_trace = build_traceback_raw(vm);
     lily_instance_val *iv = result->value.instance;
 
-    lily_move_list_f(MOVE_DEREF_SPECULATIVE, iv->values[1], raw_trace);
+    lily_move_list_f(MOVE_DEREF_SPECULATIVE, &iv->values[1], raw_trace);
 }
 
 /* This attempts to catch the exception that the raiser currently holds. If it
@@ -1481,7 +1914,7 @@ static int maybe_catch_exception(lily_vm_state *vm)
 
     lily_vm_catch_entry *catch_iter = vm->catch_chain->prev;
     lily_value *catch_reg = NULL;
-    lily_value **stack_regs;
+    lily_value *stack_regs;
     int do_unbox, jump_location, match;
 
     match = 0;
@@ -1495,7 +1928,8 @@ static int maybe_catch_exception(lily_vm_state *vm)
             break;
         }
 
-        lily_call_frame *call_frame = catch_iter->call_frame;
+        lily_call_frame *call_frame =
+                &vm->call_frames[catch_iter->call_frame_depth - 1];
         uint16_t *code = call_frame->function->code;
         /* A try block is done when the next jump is at 0 (because 0 would
            always be going back, which is illogical otherwise). */
@@ -1514,7 +1948,7 @@ static int maybe_catch_exception(lily_vm_state *vm)
                    stack_regs[0] is always safe. */
                 do_unbox = code[jump_location] == o_except_catch;
 
-                catch_reg = stack_regs[code[jump_location + 3]];
+                catch_reg = &stack_regs[code[jump_location + 3]];
 
                 /* ...So that execution resumes from within the except block. */
                 jump_location += 5;
@@ -1551,7 +1985,7 @@ static int maybe_catch_exception(lily_vm_state *vm)
         /* Make sure any exception value that was held is gone. No ref/deref is
            necessary, because the value was saved somewhere in a register. */
         vm->exception_value = NULL;
-        vm->call_chain = catch_iter->call_frame;
+        vm->call_chain = &vm->call_frames[catch_iter->call_frame_depth - 1];
         vm->call_depth = catch_iter->call_frame_depth;
         vm->vm_regs = stack_regs;
         vm->call_chain->code = vm->call_chain->function->code + jump_location;
@@ -1595,18 +2029,12 @@ uint16_t lily_cid_at(lily_vm_state *vm, int n)
 
 void lily_call_prepare(lily_vm_state *vm, lily_function_val *func)
 {
+    if (vm->call_chain->next == NULL)
+        grow_call_frames(vm);
+
     lily_call_frame *caller_frame = vm->call_chain;
     caller_frame->code = foreign_code;
-    caller_frame->return_target = vm->vm_regs[caller_frame->regs_used];
-
-    if (caller_frame->next == NULL) {
-        add_call_frame(vm);
-        /* The vm's call chain automatically advances when add_call_frame is
-            used. That's useful for the vm, but not here. Rewind the frame
-            back so that every invocation of this call will have the same
-            call_chain. */
-        vm->call_chain = caller_frame;
-    }
+    caller_frame->return_target = &vm->vm_regs[caller_frame->regs_used];
 
     lily_call_frame *target_frame = caller_frame->next;
     target_frame->code = func->code;
@@ -1620,6 +2048,11 @@ void lily_call_exec_prepared(lily_vm_state *vm, int count)
     lily_call_frame *target_frame = vm->call_chain->next;
     lily_function_val *target_fn = target_frame->function;
 
+    /* Calls within the vm don't use native stack, but each time a foreign
+       function enters the vm again, it does. */
+    if (target_fn->code != NULL && vm->reentry_depth == vm->max_reentry)
+        lily_RuntimeError(vm, "Function call recursion limit reached.");
+
     vm->call_depth++;
 
     if (target_fn->code == NULL) {
@@ -1630,7 +2063,9 @@ void lily_call_exec_prepared(lily_vm_state *vm, int count)
 
         target_fn->foreign_func(vm);
 
-        vm->call_chain = target_frame->prev;
+        /* The function may have moved the frames by calling further, so don't
+           use target_frame here. */
+        vm->call_chain = vm->call_chain->prev;
         vm->num_registers -= count;
 
         vm->call_depth--;
@@ -1658,15 +2093,26 @@ void lily_call_exec_prepared(lily_vm_state *vm, int count)
         /* Increase the register count to include the intermediates that will be
            needed by the native function. */
         vm->num_registers += distance;
+        vm->reentry_depth++;
 
         lily_vm_execute(vm);
 
+        vm->reentry_depth--;
+
         /* The frame is dropped when returning from native execute.
-           Leave the call chain and the depth alone. */
+           Leave the call chain and the depth alone. The frames may have moved,
+           so the caller is found through the chain. */
+
+        /* A tail call may have given the frame to another function. Put this
+           one back, since prepared calls can be run more than once. */
+        target_frame = vm->call_chain->next;
+        target_frame->function = target_fn;
+        target_frame->code = target_fn->code;
+        target_frame->regs_used = target_fn->reg_count;
 
         /* Drop the registers back to what they were before the call. */
         vm->num_registers = save - count;
-        vm->vm_regs = vm->regs_from_main + target_frame->prev->offset_to_main;
+        vm->vm_regs = vm->regs_from_main + vm->call_chain->offset_to_main;
     }
 }
 
@@ -1743,7 +2189,7 @@ static void load_foreign_values(lily_vm_state *vm, lily_value_stack *values)
         /* The value already has a ref from being made, so don't use regular
            assign or it will have two refs. Since this is a transfer of
            ownership, use noref and drop the old container. */
-        lily_value_assign_noref(vm->regs_from_main[reg_spot], (lily_value *)l);
+        lily_value_assign_noref(&vm->regs_from_main[reg_spot], (lily_value *)l);
         lily_free(l);
     }
 }
@@ -1765,7 +2211,7 @@ static void maybe_fix_print(lily_vm_state *vm)
                for print to the safe one. */
             lily_value *print_value = vm->readonly_table[print_var->reg_spot];
             print_value->value.function->foreign_func = builtin_stdout_print;
-            lily_value *stdout_reg = vm->regs_from_main[stdout_var->reg_spot];
+            lily_value *stdout_reg = &vm->regs_from_main[stdout_var->reg_spot];
             vm->stdout_reg = stdout_reg;
         }
     }
@@ -1798,6 +2244,17 @@ void lily_vm_prep(lily_vm_state *vm, lily_symtab *symtab,
         vm->vm_regs = vm->regs_from_main;
     }
 
+    /* If __main__ has new globals, their registers may still hold values that
+       calls from the last run left behind. Globals are written to as if their
+       registers are empty, so clear those out first. */
+    int i;
+    for (i = vm->num_registers;i < main_function->reg_count;i++) {
+        lily_value *reg = &vm->regs_from_main[i];
+
+        lily_deref(reg);
+        reg->flags = 0;
+    }
+
     load_foreign_values(vm, foreign_values);
 
     if (vm->stdout_reg == NULL)
@@ -1813,6 +2270,316 @@ void lily_vm_prep(lily_vm_state *vm, lily_symtab *symtab,
     vm->call_depth = 1;
 }
 
+/***
+ *       ____ _
+ *      / ___| | ___  _ __   ___
+ *     | |   | |/ _ \| '_ \ / _ \
+ *     | |___| | (_) | | | |  __/
+ *      \____|_|\___/|_| |_|\___|
+ *
+ */
+
+/** A snapshot is a state that has finished loading, and won't parse anything
+    else. Clones of it share everything that can't change after parsing:
+    classes, types, function code, and the readonly table. Each clone gets its
+    own registers, with a copy of the globals that the snapshot had.
+
+    Strings, ByteStrings, Files, foreign values, and functions that aren't
+    closures are shared with a ref bump instead of being copied. A clone can't
+    change them, except for Files (a clone that closes a File closes it for
+    every other clone) and foreign values from outside of the builtin package
+    (which the vm knows nothing about). StringBuilder is the one foreign value
+    that's copied, because it changes in place. Everything else is copied, and
+    this keeps a table of what has been copied so far so that shared values
+    stay shared within the clone, and cycles don't loop forever. **/
+
+typedef struct {
+    /* Both are 'size' long. A slot is empty if 'from' is NULL. */
+    void **from;
+    void **to;
+    uint32_t size;
+    uint32_t used;
+    lily_vm_state *vm;
+} lily_clone_table;
+
+static uint32_t clone_slot(lily_clone_table *table, void *from)
+{
+    uint64_t hash = (uint64_t)((uintptr_t)from >> 3) * 0x9e3779b97f4a7c15ULL;
+    uint32_t mask = table->size - 1;
+    uint32_t i = (uint32_t)(hash >> 32) & mask;
+
+    while (table->from[i] != NULL && table->from[i] != from)
+        i = (i + 1) & mask;
+
+    return i;
+}
+
+static void *clone_find(lily_clone_table *table, void *from)
+{
+    return table->to[clone_slot(table, from)];
+}
+
+static void clone_table_init(lily_clone_table *table, uint32_t size)
+{
+    table->from = lily_malloc(size * sizeof(void *));
+    table->to = lily_malloc(size * sizeof(void *));
+    table->size = size;
+    table->used = 0;
+
+    uint32_t i;
+    for (i = 0;i < size;i++) {
+        table->from[i] = NULL;
+        table->to[i] = NULL;
+    }
+}
+
+static void clone_remember(lily_clone_table *table, void *from, void *to)
+{
+    if ((table->used + 1) * 2 > table->size) {
+        void **old_from = table->from;
+        void **old_to = table->to;
+        uint32_t old_size = table->size;
+        uint32_t i;
+
+        clone_table_init(table, old_size * 2);
+
+        for (i = 0;i < old_size;i++) {
+            if (old_from[i])
+                clone_remember(table, old_from[i], old_to[i]);
+        }
+
+        lily_free(old_from);
+        lily_free(old_to);
+    }
+
+    uint32_t slot = clone_slot(table, from);
+
+    table->from[slot] = from;
+    table->to[slot] = to;
+    table->used++;
+}
+
+static void clone_value(lily_clone_table *, lily_value *, lily_value *);
+
+static lily_list_val *clone_list(lily_clone_table *table,
+        lily_list_val *source)
+{
+    lily_list_val *lv = lily_new_list(source->num_values);
+    uint32_t i;
+
+    lv->refcount = 1;
+    clone_remember(table, source, lv);
+
+    for (i = 0;i < source->num_values;i++)
+        clone_value(table, &lv->elems[i], &source->elems[i]);
+
+    return lv;
+}
+
+/* Variants have the same layout as instances, so this does both. */
+static lily_instance_val *clone_instance(lily_clone_table *table,
+        lily_instance_val *source)
+{
+    lily_instance_val *iv = lily_new_instance(source->num_values);
+    uint32_t i;
+
+    iv->refcount = 1;
+    iv->ctor_need = source->ctor_need;
+    clone_remember(table, source, iv);
+
+    for (i = 0;i < source->num_values;i++)
+        clone_value(table, &iv->values[i], &source->values[i]);
+
+    return iv;
+}
+
+static lily_hash_val *clone_hash(lily_clone_table *table,
+        lily_hash_val *source)
+{
+    lily_hash_val *hv = lily_new_hash_like_sized(source, source->num_entries);
+    lily_hash_entry *entry;
+    lily_value record;
+    int pos = 0;
+
+    hv->refcount = 1;
+    clone_remember(table, source, hv);
+
+    /* Keys are never copied, since they can't hold anything mutable. */
+    while ((entry = lily_hash_next_entry(source, &pos)) != NULL) {
+        clone_value(table, &record, &entry->record);
+        lily_hash_insert_value(hv, &entry->boxed_key, &record);
+        lily_deref(&record);
+    }
+
+    return hv;
+}
+
+static lily_dynamic_val *clone_dynamic(lily_clone_table *table,
+        lily_dynamic_val *source)
+{
+    lily_dynamic_val *dv = lily_new_dynamic();
+
+    dv->refcount = 1;
+    clone_remember(table, source, dv);
+    clone_value(table, dv->inner_value, source->inner_value);
+
+    return dv;
+}
+
+/* Closures share cells with other closures, so cells go through the table
+   too. */
+static lily_function_val *clone_closure(lily_clone_table *table,
+        lily_function_val *source)
+{
+    lily_function_val *f = lily_malloc(sizeof(lily_function_val));
+    int count = source->num_upvalues;
+    int i;
+
+    *f = *source;
+    f->refcount = 1;
+    f->gc_entry = NULL;
+    f->upvalues = lily_malloc(sizeof(lily_value *) * count);
+    clone_remember(table, source, f);
+
+    for (i = 0;i < count;i++) {
+        lily_value *up = source->upvalues[i];
+        lily_value *cell = NULL;
+
+        if (up) {
+            cell = clone_find(table, up);
+
+            if (cell)
+                cell->cell_refcount++;
+            else {
+                cell = lily_malloc(sizeof(lily_value));
+                cell->cell_refcount = 1;
+                clone_remember(table, up, cell);
+                clone_value(table, cell, up);
+            }
+        }
+
+        f->upvalues[i] = cell;
+    }
+
+    return f;
+}
+
+/* This copies 'source' into 'target', which is assumed to be empty. The
+   cell_refcount of 'target' is left alone. */
+static void clone_value(lily_clone_table *table, lily_value *target,
+        lily_value *source)
+{
+    target->flags = source->flags;
+    target->value = source->value;
+
+    if ((source->flags & VAL_IS_DEREFABLE) == 0)
+        return;
+
+    lily_raw_value raw = source->value;
+    lily_generic_val *copy = clone_find(table, raw.generic);
+
+    if (copy) {
+        copy->refcount++;
+        target->value.generic = copy;
+        return;
+    }
+
+    int class_id = source->class_id;
+
+    if (source->flags & VAL_IS_FOREIGN) {
+        /* A StringBuilder changes in place, so each clone needs its own. */
+        if (class_id == LILY_STRINGBUILDER_ID) {
+            target->value.generic = lily_copy_stringbuilder(raw.generic);
+            clone_remember(table, raw.generic, target->value.generic);
+        }
+        else
+            raw.generic->refcount++;
+
+        return;
+    }
+    else if (class_id == LILY_LIST_ID || class_id == LILY_TUPLE_ID)
+        target->value.list = clone_list(table, raw.list);
+    else if (source->flags & (VAL_IS_INSTANCE | VAL_IS_ENUM))
+        target->value.instance = clone_instance(table, raw.instance);
+    else if (class_id == LILY_HASH_ID)
+        target->value.hash = clone_hash(table, raw.hash);
+    else if (class_id == LILY_DYNAMIC_ID)
+        target->value.dynamic = clone_dynamic(table, raw.dynamic);
+    else if (class_id == LILY_FUNCTION_ID &&
+             raw.function->num_upvalues != (uint16_t)-1)
+        target->value.function = clone_closure(table, raw.function);
+    else {
+        raw.generic->refcount++;
+        return;
+    }
+
+    if (source->flags & VAL_IS_GC_TAGGED)
+        lily_tag_value(table->vm, target);
+}
+
+/* Clones run without a parser, so any exception that vm_error may need is
+   loaded into the snapshot ahead of time. */
+void lily_vm_load_exceptions(lily_vm_state *vm)
+{
+    int i;
+
+    for (i = LILY_EXCEPTION_ID;i <= LILY_ASSERTIONERROR_ID;i++) {
+        if (vm->class_table[i] == NULL)
+            vm->class_table[i] = lily_dynaload_exception(vm->parser,
+                    names[i - LILY_EXCEPTION_ID]);
+    }
+}
+
+/* This makes a new vm from 'source', copying the first 'reg_count' registers
+   (the globals). The class table, gc tuning, render settings, and hash seed
+   are the same as the source's. The hash seed must match, because Strings
+   cache their hash and are shared. The caller links the new vm to a parser and
+   symtab, and must free it before 'source'. */
+lily_vm_state *lily_vm_clone(lily_vm_state *source, lily_raiser *raiser,
+        uint16_t reg_count)
+{
+    lily_vm_state *vm = new_vm_state(raiser, source->max_call_depth);
+    int i;
+
+    vm->max_reentry = source->max_reentry;
+    vm->data = source->data;
+    vm->render_sink = source->render_sink;
+    vm->render_func = source->render_func;
+    vm->render_threshold = source->render_threshold;
+    vm->render_buffer = lily_malloc(vm->render_threshold + 1);
+    vm->gc_multiplier = source->gc_multiplier;
+    vm->gc_major_threshold = source->gc_major_threshold;
+    vm->hash_seed[0] = source->hash_seed[0];
+    vm->hash_seed[1] = source->hash_seed[1];
+
+    vm->class_count = source->class_count;
+    vm->class_table = lily_malloc(vm->class_count * sizeof(lily_class *));
+    memcpy(vm->class_table, source->class_table,
+            vm->class_count * sizeof(lily_class *));
+
+    grow_vm_registers(vm, reg_count);
+    vm->vm_regs = vm->regs_from_main;
+    vm->num_registers = reg_count;
+
+    /* Values aren't reachable from a register until they're done, so the gc
+       must not run while copying. */
+    vm->gc_threshold = UINT32_MAX;
+
+    lily_clone_table table;
+    clone_table_init(&table, 64);
+    table.vm = vm;
+
+    for (i = 0;i < reg_count;i++)
+        clone_value(&table, &vm->regs_from_main[i], &source->regs_from_main[i]);
+
+    lily_free(table.from);
+    lily_free(table.to);
+
+    vm->gc_threshold = source->gc_threshold;
+
+    return vm;
+}
+
 /***
  *      _____                     _
  *     | ____|_  _____  ___ _   _| |_ ___
@@ -1822,184 +2589,364 @@ void lily_vm_prep(lily_vm_state *vm, lily_symtab *symtab,
  *
  */
 
+/* By default, the vm's main loop is a switch over the current opcode. That
+   funnels every instruction through a single indirect jump, which is hard for
+   the cpu to predict. Compilers that can take the address of a label (gcc and
+   clang) instead use a table of labels, and each opcode jumps directly to the
+   body of the next one. Define LILY_NO_COMPUTED_GOTO to use the switch anyway.
+   Both forms are written through these macros so there's only one copy of the
+   opcode bodies. */
+#if defined(__GNUC__) && !defined(LILY_NO_COMPUTED_GOTO)
+# define LILY_COMPUTED_GOTO
+#endif
+
+#ifdef LILY_COMPUTED_GOTO
+# define vm_dispatch goto *dispatch_table[code[0]];
+# define vm_case(op) lbl_##op
+# define vm_default lbl_default
+# define vm_next goto *dispatch_table[code[0]]
+#else
+# define vm_dispatch switch(code[0])
+# define vm_case(op) case op
+# define vm_default default
+# define vm_next break
+#endif
+
 void lily_vm_execute(lily_vm_state *vm)
 {
     uint16_t *code;
-    lily_value **regs_from_main;
-    lily_value **vm_regs;
+    lily_value *regs_from_main;
+    lily_value *vm_regs;
     int i, num_registers, max_registers;
     register int64_t for_temp;
     register lily_value *lhs_reg, *rhs_reg, *loop_reg, *step_reg;
     lily_function_val *fval;
     lily_value **upvalues = NULL;
 
+#ifdef LILY_COMPUTED_GOTO
+    /* This must have an entry for every opcode. The except opcodes are only
+       markers for the exception catching code, and never executed. */
+    static const void *dispatch_table[] = {
+        [o_fast_assign] = &&lbl_o_fast_assign,
+        [o_assign] = &&lbl_o_assign,
+        [o_integer_add] = &&lbl_o_integer_add,
+        [o_integer_minus] = &&lbl_o_integer_minus,
+        [o_modulo] = &&lbl_o_modulo,
+        [o_integer_mul] = &&lbl_o_integer_mul,
+        [o_integer_div] = &&lbl_o_integer_div,
+        [o_left_shift] = &&lbl_o_left_shift,
+        [o_right_shift] = &&lbl_o_right_shift,
+        [o_bitwise_and] = &&lbl_o_bitwise_and,
+        [o_bitwise_or] = &&lbl_o_bitwise_or,
+        [o_bitwise_xor] = &&lbl_o_bitwise_xor,
+        [o_integer_add_imm] = &&lbl_o_integer_add_imm,
+        [o_double_add] = &&lbl_o_double_add,
+        [o_double_minus] = &&lbl_o_double_minus,
+        [o_double_mul] = &&lbl_o_double_mul,
+        [o_double_div] = &&lbl_o_double_div,
+        [o_integer_eq] = &&lbl_o_integer_eq,
+        [o_integer_not_eq] = &&lbl_o_integer_not_eq,
+        [o_integer_less] = &&lbl_o_integer_less,
+        [o_integer_less_eq] = &&lbl_o_integer_less_eq,
+        [o_double_eq] = &&lbl_o_double_eq,
+        [o_double_not_eq] = &&lbl_o_double_not_eq,
+        [o_double_less] = &&lbl_o_double_less,
+        [o_double_less_eq] = &&lbl_o_double_less_eq,
+        [o_string_eq] = &&lbl_o_string_eq,
+        [o_string_not_eq] = &&lbl_o_string_not_eq,
+        [o_string_less] = &&lbl_o_string_less,
+        [o_string_less_eq] = &&lbl_o_string_less_eq,
+        [o_generic_eq] = &&lbl_o_generic_eq,
+        [o_generic_not_eq] = &&lbl_o_generic_not_eq,
+        [o_unary_not] = &&lbl_o_unary_not,
+        [o_unary_minus] = &&lbl_o_unary_minus,
+        [o_jump] = &&lbl_o_jump,
+        [o_jump_if] = &&lbl_o_jump_if,
+        [o_integer_eq_jump] = &&lbl_o_integer_eq_jump,
+        [o_integer_less_jump] = &&lbl_o_integer_less_jump,
+        [o_integer_less_eq_jump] = &&lbl_o_integer_less_eq_jump,
+        [o_integer_eq_imm_jump] = &&lbl_o_integer_eq_imm_jump,
+        [o_integer_less_imm_jump] = &&lbl_o_integer_less_imm_jump,
+        [o_integer_less_eq_imm_jump] = &&lbl_o_integer_less_eq_imm_jump,
+        [o_double_eq_jump] = &&lbl_o_double_eq_jump,
+        [o_double_less_jump] = &&lbl_o_double_less_jump,
+        [o_double_less_eq_jump] = &&lbl_o_double_less_eq_jump,
+        [o_integer_for] = &&lbl_o_integer_for,
+        [o_for_setup] = &&lbl_o_for_setup,
+        [o_foreign_call] = &&lbl_o_foreign_call,
+        [o_native_call] = &&lbl_o_native_call,
+        [o_tail_call] = &&lbl_o_tail_call,
+        [o_function_call] = &&lbl_o_function_call,
+        [o_function_tail_call] = &&lbl_o_function_tail_call,
+        [o_return_val] = &&lbl_o_return_val,
+        [o_return_unit] = &&lbl_o_return_unit,
+        [o_build_list] = &&lbl_o_build_list,
+        [o_build_tuple] = &&lbl_o_build_tuple,
+        [o_build_hash] = &&lbl_o_build_hash,
+        [o_build_enum] = &&lbl_o_build_enum,
+        [o_get_item] = &&lbl_o_get_item,
+        [o_set_item] = &&lbl_o_set_item,
+        [o_get_global] = &&lbl_o_get_global,
+        [o_set_global] = &&lbl_o_set_global,
+        [o_get_readonly] = &&lbl_o_get_readonly,
+        [o_get_integer] = &&lbl_o_get_integer,
+        [o_get_boolean] = &&lbl_o_get_boolean,
+        [o_get_byte] = &&lbl_o_get_byte,
+        [o_get_empty_variant] = &&lbl_o_get_empty_variant,
+        [o_new_instance_basic] = &&lbl_o_new_instance_basic,
+        [o_new_instance_speculative] = &&lbl_o_new_instance_speculative,
+        [o_new_instance_tagged] = &&lbl_o_new_instance_tagged,
+        [o_get_property] = &&lbl_o_get_property,
+        [o_set_property] = &&lbl_o_set_property,
+        [o_push_try] = &&lbl_o_push_try,
+        [o_pop_try] = &&lbl_o_pop_try,
+        [o_except_ignore] = &&lbl_default,
+        [o_except_catch] = &&lbl_default,
+        [o_raise] = &&lbl_o_raise,
+        [o_match_dispatch] = &&lbl_o_match_dispatch,
+        [o_variant_decompose] = &&lbl_o_variant_decompose,
+        [o_get_upvalue] = &&lbl_o_get_upvalue,
+        [o_set_upvalue] = &&lbl_o_set_upvalue,
+        [o_create_closure] = &&lbl_o_create_closure,
+        [o_create_function] = &&lbl_o_create_function,
+        [o_load_class_closure] = &&lbl_o_load_class_closure,
+        [o_load_closure] = &&lbl_o_load_closure,
+        [o_dynamic_cast] = &&lbl_o_dynamic_cast,
+        [o_interpolation] = &&lbl_o_interpolation,
+        [o_optarg_dispatch] = &&lbl_o_optarg_dispatch,
+        [o_render_content] = &&lbl_o_render_content,
+        [o_return_from_vm] = &&lbl_o_return_from_vm,
+    };
+#endif
+
     lily_call_frame *current_frame = vm->call_chain;
     code = current_frame->function->code;
 
+    /* If an exception is caught here, it may have come from deeper entries
+       into the vm that are now gone. */
+    uint32_t reentry_depth = vm->reentry_depth;
+    uint32_t exec_depth = vm->exec_depth;
+    lily_jump_link *link = NULL;
+
+    vm->exec_depth++;
+
     /* Initialize local vars from the vm state's vars. */
     vm_regs = vm->vm_regs;
     regs_from_main = vm->regs_from_main;
     max_registers = vm->max_registers;
 
-    lily_jump_link *link = lily_jump_setup(vm->raiser);
-    if (setjmp(link->jump) != 0) {
-        /* If the current function is a native one, then fix the line
-           number of it. Otherwise, leave the line number alone. */
-        if (vm->call_chain->function->code != NULL) {
-            if (vm->pending_line) {
-                current_frame->line_num = vm->pending_line;
-                vm->pending_line = 0;
+    /* Foreign functions like List.map enter here once per element. Setting up
+       a jump each time adds up, so those entries skip it. An exception raised
+       by one goes to the jump of the entry below, which fixes the line of the
+       frame that raised it and unwinds the foreign function as well.
+       A try block needs exceptions to come back here, so o_push_try sets up the
+       jump if it hasn't been done yet. */
+    if (exec_depth == 0) {
+        setup_jump: ;
+
+        link = lily_jump_setup(vm->raiser);
+        if (setjmp(link->jump) != 0) {
+            /* If the current function is a native one, then fix the line
+               number of it. Otherwise, leave the line number alone. */
+            if (vm->call_chain->function->code != NULL) {
+                if (vm->pending_line) {
+                    vm->call_chain->line_num = vm->pending_line;
+                    vm->pending_line = 0;
+                }
+                else
+                    vm->call_chain->line_num = vm->call_chain->code[1];
             }
-            else
-                vm->call_chain->line_num = vm->call_chain->code[1];
-        }
 
-        if (maybe_catch_exception(vm) == 0)
-            /* Couldn't catch it. Jump back into parser, which will jump
-               back to the caller to give them the bad news. */
-            lily_jump_back(vm->raiser);
-        else {
-            /* The exception was caught, so resync local data. */
-            current_frame = vm->call_chain;
-            code = current_frame->code;
-            upvalues = current_frame->upvalues;
-            regs_from_main = vm->regs_from_main;
-            vm_regs = vm->vm_regs;
-            vm->num_registers = (vm_regs - regs_from_main) + current_frame->regs_used;
+            if (maybe_catch_exception(vm) == 0) {
+                /* Couldn't catch it. Jump back into parser, which will jump
+                   back to the caller to give them the bad news. */
+                vm->exec_depth = exec_depth;
+                lily_jump_back(vm->raiser);
+            }
+            else {
+                /* The exception was caught, so resync local data. */
+                vm->reentry_depth = reentry_depth;
+                vm->exec_depth = exec_depth + 1;
+                current_frame = vm->call_chain;
+                code = current_frame->code;
+                upvalues = current_frame->upvalues;
+                regs_from_main = vm->regs_from_main;
+                vm_regs = vm->vm_regs;
+                max_registers = vm->max_registers;
+                vm->num_registers = (vm_regs - regs_from_main) +
+                        current_frame->regs_used;
+            }
         }
     }
 
     num_registers = vm->num_registers;
 
     while (1) {
-        switch(code[0]) {
-            case o_fast_assign:
-                rhs_reg = vm_regs[code[2]];
-                lhs_reg = vm_regs[code[3]];
+        vm_dispatch {
+            vm_case(o_fast_assign):
+                rhs_reg = &vm_regs[code[2]];
+                lhs_reg = &vm_regs[code[3]];
                 lhs_reg->flags = rhs_reg->flags;
                 lhs_reg->value = rhs_reg->value;
                 code += 4;
-                break;
-            case o_get_readonly:
+                vm_next;
+            vm_case(o_get_readonly):
                 rhs_reg = vm->readonly_table[code[2]];
-                lhs_reg = vm_regs[code[3]];
+                lhs_reg = &vm_regs[code[3]];
 
                 lily_deref(lhs_reg);
 
                 lhs_reg->value = rhs_reg->value;
                 lhs_reg->flags = rhs_reg->flags;
                 code += 4;
-                break;
-            case o_get_empty_variant:
-                lhs_reg = vm_regs[code[3]];
+                vm_next;
+            vm_case(o_get_empty_variant):
+                lhs_reg = &vm_regs[code[3]];
 
                 lily_deref(lhs_reg);
 
                 lhs_reg->value.instance = NULL;
                 lhs_reg->flags = VAL_IS_ENUM | code[2];
                 code += 4;
-                break;
-            case o_get_integer:
-                lhs_reg = vm_regs[code[3]];
+                vm_next;
+            vm_case(o_get_integer):
+                lhs_reg = &vm_regs[code[3]];
                 lhs_reg->value.integer = (int16_t)code[2];
                 lhs_reg->flags = LILY_INTEGER_ID;
                 code += 4;
-                break;
-            case o_get_boolean:
-                lhs_reg = vm_regs[code[3]];
+                vm_next;
+            vm_case(o_get_boolean):
+                lhs_reg = &vm_regs[code[3]];
                 lhs_reg->value.integer = code[2];
                 lhs_reg->flags = LILY_BOOLEAN_ID;
                 code += 4;
-                break;
-            case o_get_byte:
-                lhs_reg = vm_regs[code[3]];
+                vm_next;
+            vm_case(o_get_byte):
+                lhs_reg = &vm_regs[code[3]];
                 lhs_reg->value.integer = (uint8_t)code[2];
                 lhs_reg->flags = LILY_BYTE_ID;
                 code += 4;
-                break;
-            case o_integer_add:
+                vm_next;
+            vm_case(o_integer_add):
                 INTEGER_OP(+)
-                break;
-            case o_integer_minus:
+                vm_next;
+            vm_case(o_integer_minus):
                 INTEGER_OP(-)
-                break;
-            case o_double_add:
+                vm_next;
+            vm_case(o_integer_add_imm):
+                lhs_reg = &vm_regs[code[2]];
+                vm_regs[code[4]].value.integer =
+                        lhs_reg->value.integer + (int16_t)code[3];
+                vm_regs[code[4]].flags = LILY_INTEGER_ID;
+                code += 5;
+                vm_next;
+            vm_case(o_double_add):
                 DOUBLE_OP(+)
-                break;
-            case o_double_minus:
+                vm_next;
+            vm_case(o_double_minus):
                 DOUBLE_OP(-)
-                break;
-            case o_less:
-                COMPARE_OP(<, == -1)
-                break;
-            case o_less_eq:
-                COMPARE_OP(<=, <= 0)
-                break;
-            case o_is_equal:
-                EQUALITY_COMPARE_OP(==, == 0)
-                break;
-            case o_greater:
-                COMPARE_OP(>, == 1)
-                break;
-            case o_greater_eq:
-                COMPARE_OP(>=, >= 0)
-                break;
-            case o_not_eq:
-                EQUALITY_COMPARE_OP(!=, != 0)
-                break;
-            case o_jump:
+                vm_next;
+            vm_case(o_integer_eq):
+                COMPARE_OP(INTEGER_COMPARE(==))
+                vm_next;
+            vm_case(o_integer_not_eq):
+                COMPARE_OP(INTEGER_COMPARE(!=))
+                vm_next;
+            vm_case(o_integer_less):
+                COMPARE_OP(INTEGER_COMPARE(<))
+                vm_next;
+            vm_case(o_integer_less_eq):
+                COMPARE_OP(INTEGER_COMPARE(<=))
+                vm_next;
+            vm_case(o_double_eq):
+                COMPARE_OP(DOUBLE_COMPARE(==))
+                vm_next;
+            vm_case(o_double_not_eq):
+                COMPARE_OP(DOUBLE_COMPARE(!=))
+                vm_next;
+            vm_case(o_double_less):
+                COMPARE_OP(DOUBLE_COMPARE(<))
+                vm_next;
+            vm_case(o_double_less_eq):
+                COMPARE_OP(DOUBLE_COMPARE(<=))
+                vm_next;
+            vm_case(o_string_eq):
+                COMPARE_OP(lily_string_eq(lhs_reg->value.string,
+                        rhs_reg->value.string))
+                vm_next;
+            vm_case(o_string_not_eq):
+                COMPARE_OP(lily_string_eq(lhs_reg->value.string,
+                        rhs_reg->value.string) == 0)
+                vm_next;
+            vm_case(o_string_less):
+                COMPARE_OP(lily_string_cmp(lhs_reg->value.string,
+                        rhs_reg->value.string) < 0)
+                vm_next;
+            vm_case(o_string_less_eq):
+                COMPARE_OP(lily_string_cmp(lhs_reg->value.string,
+                        rhs_reg->value.string) <= 0)
+                vm_next;
+            vm_case(o_generic_eq):
+                vm->pending_line = code[1];
+                COMPARE_OP(lily_value_compare(vm, lhs_reg, rhs_reg))
+                vm_next;
+            vm_case(o_generic_not_eq):
+                vm->pending_line = code[1];
+                COMPARE_OP(lily_value_compare(vm, lhs_reg, rhs_reg) == 0)
+                vm_next;
+            vm_case(o_jump):
                 code += (int16_t)code[1];
-                break;
-            case o_integer_mul:
+                vm_next;
+            vm_case(o_integer_mul):
                 INTEGER_OP(*)
-                break;
-            case o_double_mul:
+                vm_next;
+            vm_case(o_double_mul):
                 DOUBLE_OP(*)
-                break;
-            case o_integer_div:
+                vm_next;
+            vm_case(o_integer_div):
                 /* Before doing INTEGER_OP, check for a division by zero. This
                    will involve some redundant checking of the rhs, but better
                    than dumping INTEGER_OP's contents here or rewriting
                    INTEGER_OP for the special case of division. */
-                rhs_reg = vm_regs[code[3]];
+                rhs_reg = &vm_regs[code[3]];
                 if (rhs_reg->value.integer == 0)
                     vm_error(vm, LILY_DBZERROR_ID,
                             "Attempt to divide by zero.");
                 INTEGER_OP(/)
-                break;
-            case o_modulo:
+                vm_next;
+            vm_case(o_modulo):
                 /* x % 0 will do the same thing as x / 0... */
-                rhs_reg = vm_regs[code[3]];
+                rhs_reg = &vm_regs[code[3]];
                 if (rhs_reg->value.integer == 0)
                     vm_error(vm, LILY_DBZERROR_ID,
                             "Attempt to divide by zero.");
                 INTEGER_OP(%)
-                break;
-            case o_left_shift:
+                vm_next;
+            vm_case(o_left_shift):
                 INTEGER_OP(<<)
-                break;
-            case o_right_shift:
+                vm_next;
+            vm_case(o_right_shift):
                 INTEGER_OP(>>)
-                break;
-            case o_bitwise_and:
+                vm_next;
+            vm_case(o_bitwise_and):
                 INTEGER_OP(&)
-                break;
-            case o_bitwise_or:
+                vm_next;
+            vm_case(o_bitwise_or):
                 INTEGER_OP(|)
-                break;
-            case o_bitwise_xor:
+                vm_next;
+            vm_case(o_bitwise_xor):
                 INTEGER_OP(^)
-                break;
-            case o_double_div:
-                rhs_reg = vm_regs[code[3]];
+                vm_next;
+            vm_case(o_double_div):
+                rhs_reg = &vm_regs[code[3]];
                 if (rhs_reg->value.doubleval == 0)
                     vm_error(vm, LILY_DBZERROR_ID,
                             "Attempt to divide by zero.");
 
                 DOUBLE_OP(/)
-                break;
-            case o_jump_if:
-                lhs_reg = vm_regs[code[2]];
+                vm_next;
+            vm_case(o_jump_if):
+                lhs_reg = &vm_regs[code[2]];
                 {
                     int id = lhs_reg->class_id;
                     int result;
@@ -2018,17 +2965,44 @@ void lily_vm_execute(lily_vm_state *vm)
                     else
                         code += 4;
                 }
-                break;
-            case o_foreign_call:
+                vm_next;
+            vm_case(o_integer_eq_jump):
+                COMPARE_JUMP_OP(integer, ==, vm_regs[code[3]].value.integer)
+                vm_next;
+            vm_case(o_integer_less_jump):
+                COMPARE_JUMP_OP(integer, <, vm_regs[code[3]].value.integer)
+                vm_next;
+            vm_case(o_integer_less_eq_jump):
+                COMPARE_JUMP_OP(integer, <=, vm_regs[code[3]].value.integer)
+                vm_next;
+            vm_case(o_integer_eq_imm_jump):
+                COMPARE_JUMP_OP(integer, ==, (int16_t)code[3])
+                vm_next;
+            vm_case(o_integer_less_imm_jump):
+                COMPARE_JUMP_OP(integer, <, (int16_t)code[3])
+                vm_next;
+            vm_case(o_integer_less_eq_imm_jump):
+                COMPARE_JUMP_OP(integer, <=, (int16_t)code[3])
+                vm_next;
+            vm_case(o_double_eq_jump):
+                COMPARE_JUMP_OP(doubleval, ==, vm_regs[code[3]].value.doubleval)
+                vm_next;
+            vm_case(o_double_less_jump):
+                COMPARE_JUMP_OP(doubleval, <, vm_regs[code[3]].value.doubleval)
+                vm_next;
+            vm_case(o_double_less_eq_jump):
+                COMPARE_JUMP_OP(doubleval, <=, vm_regs[code[3]].value.doubleval)
+                vm_next;
+            vm_case(o_foreign_call):
                 fval = vm->readonly_table[code[2]]->value.function;
 
                 foreign_func_body: ;
 
                 if (current_frame->next == NULL) {
-                    if (vm->call_depth > 100)
-                        vm_error(vm, LILY_RUNTIMEERROR_ID,
-                                "Function call recursion limit reached.");
-                    add_call_frame(vm);
+                    vm->pending_line = code[1];
+                    grow_call_frames(vm);
+                    vm->pending_line = 0;
+                    current_frame = vm->call_chain;
                 }
 
                 i = code[3];
@@ -2050,7 +3024,7 @@ void lily_vm_execute(lily_vm_state *vm)
                 /* Prepare the registers for what the function wants. Afterward,
                    update num_registers since prep_registers changes it. */
                 prep_registers(vm, fval, code);
-                current_frame->return_target = vm_regs[code[4]];
+                current_frame->return_target = &vm_regs[code[4]];
                 vm_regs = vm_regs + current_frame->regs_used;
                 vm->vm_regs = vm_regs;
 
@@ -2070,13 +3044,14 @@ void lily_vm_execute(lily_vm_state *vm)
                 func(vm);
 
                 /* This function may have called the vm, thus growing the number
-                   of registers. Copy over important data if that's happened. */
+                   of registers. Copy over important data if that's happened.
+                   The frames may have moved too, so get them again. */
                 if (vm->max_registers != max_registers) {
                     regs_from_main = vm->regs_from_main;
                     max_registers  = vm->max_registers;
                 }
 
-                current_frame = current_frame->prev;
+                current_frame = vm->call_chain->prev;
 
                 vm_regs = vm->regs_from_main + num_registers - current_frame->regs_used;
                 vm->vm_regs = vm_regs;
@@ -2087,17 +3062,17 @@ void lily_vm_execute(lily_vm_state *vm)
                 vm->call_depth--;
                 vm->num_registers = num_registers;
 
-                break;
-            case o_native_call: {
+                vm_next;
+            vm_case(o_native_call): {
                 fval = vm->readonly_table[code[2]]->value.function;
 
                 native_func_body: ;
 
                 if (current_frame->next == NULL) {
-                    if (vm->call_depth > 100)
-                        vm_error(vm, LILY_RUNTIMEERROR_ID,
-                                "Function call recursion limit reached.");
-                    add_call_frame(vm);
+                    vm->pending_line = code[1];
+                    grow_call_frames(vm);
+                    vm->pending_line = 0;
+                    current_frame = vm->call_chain;
                 }
 
                 i = code[3];
@@ -2120,7 +3095,7 @@ void lily_vm_execute(lily_vm_state *vm)
                 prep_registers(vm, fval, code);
                 num_registers = vm->num_registers;
 
-                current_frame->return_target = vm_regs[code[4]];
+                current_frame->return_target = &vm_regs[code[4]];
                 vm_regs = vm_regs + current_frame->regs_used;
                 vm->vm_regs = vm_regs;
 
@@ -2137,44 +3112,114 @@ void lily_vm_execute(lily_vm_state *vm)
                 code = fval->code;
                 upvalues = NULL;
 
-                break;
+                vm_next;
             }
-            case o_function_call:
-                fval = vm_regs[code[2]]->value.function;
+            vm_case(o_tail_call): {
+                fval = vm->readonly_table[code[2]]->value.function;
+
+                tail_call_body: ;
+
+                int register_need = num_registers + fval->reg_count;
+
+                if (register_need > max_registers) {
+                    grow_vm_registers(vm, register_need);
+                    regs_from_main = vm->regs_from_main;
+                    vm_regs        = vm->vm_regs;
+                    max_registers  = vm->max_registers;
+                }
+
+                /* The arguments may come from registers that are about to be
+                   written over. Put them past this function's registers first,
+                   then move them down. */
+                lhs_reg = vm_regs + current_frame->regs_used;
+                int count = code[3];
+
+                for (i = 0;i < count;i++) {
+                    rhs_reg = &vm_regs[code[5 + i]];
+
+                    if (rhs_reg->flags & VAL_IS_DEREFABLE)
+                        rhs_reg->value.generic->refcount++;
+
+                    if (lhs_reg[i].flags & VAL_IS_DEREFABLE)
+                        lily_deref(&lhs_reg[i]);
+
+                    lhs_reg[i] = *rhs_reg;
+                }
+
+                for (i = 0;i < count;i++) {
+                    lily_deref(&vm_regs[i]);
+                    vm_regs[i] = lhs_reg[i];
+                    lhs_reg[i].flags = 0;
+                }
+
+                for (;i < fval->reg_count;i++) {
+                    lily_deref(&vm_regs[i]);
+                    vm_regs[i].flags = 0;
+                }
+
+                /* The caller still has the return target, so this frame only
+                   needs to say what it's running now. */
+                num_registers += fval->reg_count - current_frame->regs_used;
+                vm->num_registers = num_registers;
+
+                current_frame->function = fval;
+                current_frame->regs_used = fval->reg_count;
+                current_frame->code = fval->code;
+                current_frame->upvalues = NULL;
+                code = fval->code;
+                upvalues = NULL;
+
+                vm_next;
+            }
+            vm_case(o_function_call):
+                fval = vm_regs[code[2]].value.function;
 
                 if (fval->code != NULL)
                     goto native_func_body;
                 else
                     goto foreign_func_body;
 
-                break;
-            case o_interpolation:
+                vm_next;
+            vm_case(o_function_tail_call):
+                fval = vm_regs[code[2]].value.function;
+
+                /* A closure may only be held by registers that a tail call
+                   would write over, so those take the usual path. */
+                if (fval->code == NULL)
+                    goto foreign_func_body;
+                else if (fval->upvalues != NULL)
+                    goto native_func_body;
+                else
+                    goto tail_call_body;
+
+                vm_next;
+            vm_case(o_interpolation):
                 do_o_interpolation(vm, code);
                 code += code[2] + 4;
-                break;
-            case o_unary_not:
-                lhs_reg = vm_regs[code[2]];
+                vm_next;
+            vm_case(o_unary_not):
+                lhs_reg = &vm_regs[code[2]];
 
-                rhs_reg = vm_regs[code[3]];
+                rhs_reg = &vm_regs[code[3]];
                 rhs_reg->flags = lhs_reg->flags;
                 rhs_reg->value.integer = !(lhs_reg->value.integer);
                 code += 4;
-                break;
-            case o_unary_minus:
-                lhs_reg = vm_regs[code[2]];
+                vm_next;
+            vm_case(o_unary_minus):
+                lhs_reg = &vm_regs[code[2]];
 
-                rhs_reg = vm_regs[code[3]];
+                rhs_reg = &vm_regs[code[3]];
                 rhs_reg->flags = LILY_INTEGER_ID;
                 rhs_reg->value.integer = -(lhs_reg->value.integer);
                 code += 4;
-                break;
-            case o_return_unit:
+                vm_next;
+            vm_case(o_return_unit):
                 lily_move_unit(current_frame->prev->return_target);
                 goto return_common;
 
-            case o_return_val:
+            vm_case(o_return_val):
                 lhs_reg = current_frame->prev->return_target;
-                rhs_reg = vm_regs[code[2]];
+                rhs_reg = &vm_regs[code[2]];
                 lily_value_assign(lhs_reg, rhs_reg);
 
                 return_common: ;
@@ -2193,90 +3238,96 @@ void lily_vm_execute(lily_vm_state *vm)
                 vm->vm_regs = vm_regs;
                 upvalues = current_frame->upvalues;
                 code = current_frame->code;
-                break;
-            case o_get_global:
-                rhs_reg = regs_from_main[code[2]];
-                lhs_reg = vm_regs[code[3]];
+                vm_next;
+            vm_case(o_get_global):
+                rhs_reg = &regs_from_main[code[2]];
+                lhs_reg = &vm_regs[code[3]];
 
                 lily_value_assign(lhs_reg, rhs_reg);
                 code += 4;
-                break;
-            case o_set_global:
-                rhs_reg = vm_regs[code[2]];
-                lhs_reg = regs_from_main[code[3]];
+                vm_next;
+            vm_case(o_set_global):
+                rhs_reg = &vm_regs[code[2]];
+                lhs_reg = &regs_from_main[code[3]];
 
                 lily_value_assign(lhs_reg, rhs_reg);
                 code += 4;
-                break;
-            case o_assign:
-                rhs_reg = vm_regs[code[2]];
-                lhs_reg = vm_regs[code[3]];
+                vm_next;
+            vm_case(o_assign):
+                rhs_reg = &vm_regs[code[2]];
+                lhs_reg = &vm_regs[code[3]];
 
                 lily_value_assign(lhs_reg, rhs_reg);
                 code += 4;
-                break;
-            case o_get_item:
+                vm_next;
+            vm_case(o_get_item):
                 do_o_get_item(vm, code);
                 code += 5;
-                break;
-            case o_get_property:
+                vm_next;
+            vm_case(o_get_property):
                 do_o_get_property(vm, code);
                 code += 5;
-                break;
-            case o_set_item:
+                vm_next;
+            vm_case(o_set_item):
                 do_o_set_item(vm, code);
                 code += 5;
-                break;
-            case o_set_property:
+                vm_next;
+            vm_case(o_set_property):
                 do_o_set_property(vm, code);
                 code += 5;
-                break;
-            case o_build_hash:
+                vm_next;
+            vm_case(o_build_hash):
                 do_o_build_hash(vm, code);
                 code += code[3] + 5;
-                break;
-            case o_build_list:
-            case o_build_tuple:
+                vm_next;
+            vm_case(o_build_list):
+            vm_case(o_build_tuple):
                 do_o_build_list_tuple(vm, code);
-                code += code[2] + 4;
-                break;
-            case o_build_enum:
+                code += code[3] + 5;
+                vm_next;
+            vm_case(o_build_enum):
                 do_o_build_enum(vm, code);
                 code += code[3] + 5;
-                break;
-            case o_dynamic_cast:
+                vm_next;
+            vm_case(o_dynamic_cast):
                 do_o_dynamic_cast(vm, code);
                 code += 5;
-                break;
-            case o_create_function:
+                vm_next;
+            vm_case(o_create_function):
                 do_o_create_function(vm, code);
                 code += 4;
-                break;
-            case o_set_upvalue:
+                vm_next;
+            vm_case(o_set_upvalue):
                 lhs_reg = upvalues[code[2]];
-                rhs_reg = vm_regs[code[3]];
+                rhs_reg = &vm_regs[code[3]];
                 if (lhs_reg == NULL)
                     upvalues[code[2]] = make_cell_from(rhs_reg);
                 else
                     lily_value_assign(lhs_reg, rhs_reg);
 
                 code += 4;
-                break;
-            case o_get_upvalue:
-                lhs_reg = vm_regs[code[3]];
+                vm_next;
+            vm_case(o_get_upvalue):
+                lhs_reg = &vm_regs[code[3]];
                 rhs_reg = upvalues[code[2]];
                 lily_value_assign(lhs_reg, rhs_reg);
                 code += 4;
-                break;
-            case o_optarg_dispatch:
+                vm_next;
+            vm_case(o_optarg_dispatch):
                 code += do_o_optarg_dispatch(vm, code);
-                break;
-            case o_integer_for:
+                vm_next;
+            vm_case(o_render_content):
+                rhs_reg = vm->readonly_table[code[1]];
+                lily_vm_render(vm, rhs_reg->value.string->string,
+                        rhs_reg->value.string->size);
+                code += 2;
+                vm_next;
+            vm_case(o_integer_for):
                 /* loop_reg is an internal counter, while lhs_reg is an external
                    counter. rhs_reg is the stopping point. */
-                loop_reg = vm_regs[code[2]];
-                rhs_reg  = vm_regs[code[3]];
-                step_reg = vm_regs[code[4]];
+                loop_reg = &vm_regs[code[2]];
+                rhs_reg  = &vm_regs[code[3]];
+                step_reg = &vm_regs[code[4]];
 
                 /* Note the use of the loop_reg. This makes it use the internal
                    counter, and thus prevent user assignments from damaging the loop. */
@@ -2291,7 +3342,7 @@ void lily_vm_execute(lily_vm_state *vm)
 
                     /* Haven't reached the end yet, so bump the internal and
                        external values.*/
-                    lhs_reg = vm_regs[code[5]];
+                    lhs_reg = &vm_regs[code[5]];
                     lhs_reg->value.integer = for_temp;
                     loop_reg->value.integer = for_temp;
                     code += 7;
@@ -2299,14 +3350,19 @@ void lily_vm_execute(lily_vm_state *vm)
                 else
                     code += code[6];
 
-                break;
-            case o_push_try:
+                vm_next;
+            vm_case(o_push_try):
             {
+                if (link == NULL) {
+                    /* This comes back here once the jump is ready. */
+                    vm->num_registers = num_registers;
+                    goto setup_jump;
+                }
+
                 if (vm->catch_chain->next == NULL)
                     add_catch_entry(vm);
 
                 lily_vm_catch_entry *catch_entry = vm->catch_chain;
-                catch_entry->call_frame = current_frame;
                 catch_entry->call_frame_depth = vm->call_depth;
                 catch_entry->code_pos = 2 + (code - current_frame->function->code);
                 catch_entry->jump_entry = vm->raiser->all_jumps;
@@ -2314,73 +3370,73 @@ void lily_vm_execute(lily_vm_state *vm)
 
                 vm->catch_chain = vm->catch_chain->next;
                 code += 3;
-                break;
+                vm_next;
             }
-            case o_pop_try:
+            vm_case(o_pop_try):
                 vm->catch_chain = vm->catch_chain->prev;
 
                 code++;
-                break;
-            case o_raise:
-                lhs_reg = vm_regs[code[2]];
+                vm_next;
+            vm_case(o_raise):
+                lhs_reg = &vm_regs[code[2]];
                 do_o_raise(vm, lhs_reg);
                 code += 3;
-                break;
-            case o_new_instance_basic:
-            case o_new_instance_speculative:
-            case o_new_instance_tagged:
+                vm_next;
+            vm_case(o_new_instance_basic):
+            vm_case(o_new_instance_speculative):
+            vm_case(o_new_instance_tagged):
             {
                 do_o_new_instance(vm, code);
                 code += 4;
-                break;
+                vm_next;
             }
-            case o_match_dispatch:
+            vm_case(o_match_dispatch):
             {
                 /* This opcode is easy because emitter ensures that the match is
                    exhaustive. It also writes down the jumps in order (even if
                    they came out of order). What this does is take the class id
                    of the variant, and drop it so that the first variant is 0,
                    the second is 1, etc. */
-                lhs_reg = vm_regs[code[2]];
+                lhs_reg = &vm_regs[code[2]];
                 /* code[3] is the base enum id + 1. */
                 i = lhs_reg->class_id - code[3];
 
                 code += code[5 + i];
-                break;
+                vm_next;
             }
-            case o_variant_decompose:
+            vm_case(o_variant_decompose):
             {
-                rhs_reg = vm_regs[code[2]];
-                lily_value **decompose_values = rhs_reg->value.instance->values;
+                rhs_reg = &vm_regs[code[2]];
+                lily_value *decompose_values = rhs_reg->value.instance->values;
 
                 /* Each variant value gets mapped away to a register. The
                    emitter ensures that the decomposition won't go too far. */
                 for (i = 0;i < code[3];i++) {
-                    lhs_reg = vm_regs[code[4 + i]];
-                    lily_value_assign(lhs_reg, decompose_values[i]);
+                    lhs_reg = &vm_regs[code[4 + i]];
+                    lily_value_assign(lhs_reg, &decompose_values[i]);
                 }
 
                 code += 4 + i;
-                break;
+                vm_next;
             }
-            case o_create_closure:
+            vm_case(o_create_closure):
                 upvalues = do_o_create_closure(vm, code);
                 code += 4;
-                break;
-            case o_load_class_closure:
+                vm_next;
+            vm_case(o_load_class_closure):
                 upvalues = do_o_load_class_closure(vm, code);
                 code += 5;
-                break;
-            case o_load_closure:
+                vm_next;
+            vm_case(o_load_closure):
                 upvalues = do_o_load_closure(vm, code);
                 code += (code[2] + 4);
-                break;
-            case o_for_setup:
+                vm_next;
+            vm_case(o_for_setup):
                 /* lhs_reg is the start, rhs_reg is the stop. */
-                lhs_reg = vm_regs[code[2]];
-                rhs_reg = vm_regs[code[3]];
-                step_reg = vm_regs[code[4]];
-                loop_reg = vm_regs[code[5]];
+                lhs_reg = &vm_regs[code[2]];
+                rhs_reg = &vm_regs[code[3]];
+                step_reg = &vm_regs[code[4]];
+                loop_reg = &vm_regs[code[5]];
 
                 if (step_reg->value.integer == 0)
                     vm_error(vm, LILY_VALUEERROR_ID,
@@ -2393,11 +3449,14 @@ void lily_vm_execute(lily_vm_state *vm)
                 loop_reg->flags = LILY_INTEGER_ID;
 
                 code += 6;
-                break;
-            case o_return_from_vm:
-                lily_release_jump(vm->raiser);
+                vm_next;
+            vm_case(o_return_from_vm):
+                if (link)
+                    lily_release_jump(vm->raiser);
+
+                vm->exec_depth--;
                 return;
-            default:
+            vm_default:
                 return;
         }
     }
@@ -4,6 +4,8 @@
 # include "lily_raiser.h"
 # include "lily_symtab.h"
 
+# include "lily_api_options.h"
+
 typedef struct lily_call_frame_ {
     lily_function_val *function;
     lily_value *return_target;
@@ -23,12 +25,13 @@ typedef struct lily_call_frame_ {
        subclass uses the value of the higher-up class. */
     lily_value *build_value;
 
+    /* Frames are kept together in vm->call_frames. These link each frame to
+       those beside it, and are fixed whenever the frames are moved. */
     struct lily_call_frame_ *prev;
     struct lily_call_frame_ *next;
 } lily_call_frame;
 
 typedef struct lily_vm_catch_entry_ {
-    lily_call_frame *call_frame;
     /* How far away vm->vm_regs (where the locals start) is from
        vm->regs_from_main in the current frame. When catching exceptions, it's
        simpler, safer, and faster to fix vm->vm_regs with this instead of
@@ -36,6 +39,8 @@ typedef struct lily_vm_catch_entry_ {
        vm->vm_regs will end up. */
     int offset_from_main;
     int code_pos;
+    /* The depth of the frame that pushed this entry. Frames can move, so the
+       frame is found through this instead of being held. */
     uint32_t call_frame_depth;
     uint32_t pad;
     lily_jump_link *jump_entry;
@@ -45,8 +50,10 @@ typedef struct lily_vm_catch_entry_ {
 } lily_vm_catch_entry;
 
 typedef struct lily_vm_state_ {
-    lily_value **vm_regs;
-    lily_value **regs_from_main;
+    /* Registers are a single block of values. vm_regs points to where the
+       current function's registers start within that block. */
+    lily_value *vm_regs;
+    lily_value *regs_from_main;
 
     /* The total number or registers allocated. */
     uint32_t max_registers;
@@ -66,32 +73,82 @@ typedef struct lily_vm_state_ {
 
     lily_call_frame *call_chain;
 
+    /* Frames are held in a single block that grows as calls get deeper. The
+       frame at a given depth is call_frames[depth - 1]. The block never grows
+       past max_call_depth frames. */
+    lily_call_frame *call_frames;
+    uint32_t call_frame_count;
+    uint32_t max_call_depth;
+
+    /* How many times foreign functions have entered the vm again. Each entry
+       uses native stack, so this stops at max_reentry (lily_op_max_reentry).
+       That's kept well below max_call_depth, since a native stack overflow
+       can't be caught. */
+    uint32_t reentry_depth;
+    uint32_t max_reentry;
+
+    /* How many calls to lily_vm_execute are running. Only the first of those
+       sets up a jump right away. The others are entered by foreign functions,
+       and what they raise can go to the one below (see o_push_try). */
+    uint32_t exec_depth;
+
     lily_value **readonly_table;
     lily_class **class_table;
     uint32_t class_count;
     uint32_t readonly_count;
 
-    /* A linked list of entries that should be findable from a register. */
-    lily_gc_entry *gc_live_entries;
+    /* Entries tagged since the last collection. Minor collections only look
+       through these. */
+    lily_gc_entry *gc_young_entries;
+
+    /* Entries that have survived at least one collection. These are only
+       collected by a major collection. */
+    lily_gc_entry *gc_old_entries;
 
     /* A linked list of entries not currently in use. */
     lily_gc_entry *gc_spare_entries;
 
-    /* How many entries are in ->gc_live_entries. If this is >= ->gc_threshold,
-       then the gc is triggered when there is an attempt to attach a gc_entry
-       to a value. */
-    uint32_t gc_live_entry_count;
-    /* How many entries to allow in ->gc_live_entries before doing a sweep. */
+    /* Entries are allocated in blocks, which are freed with the vm. */
+    struct lily_gc_entry_block_ *gc_entry_blocks;
+
+    /* How many entries are in ->gc_young_entries. If this is >= ->gc_threshold,
+       then a minor collection is triggered when there is an attempt to attach
+       a gc_entry to a value. */
+    uint32_t gc_young_count;
+    /* How many young entries to allow before doing a minor collection. */
     uint32_t gc_threshold;
+    /* How many entries are in ->gc_old_entries. */
+    uint32_t gc_old_count;
+    /* A major collection is done after a minor one if the old generation has
+       at least this many entries. */
+    uint32_t gc_major_threshold;
     /* An always-increasing value indicating the current pass, used to determine
        if an entry has been seen. An entry is visible if
        'entry->last_pass == gc_pass' */
     uint32_t gc_pass;
 
-    /* If the current gc sweep does not free anything, this is how much that
-       the threshold is multiplied by to increase it. */
+    /* If a major collection does not free enough, this is how much that the
+       major threshold is multiplied by to increase it. */
     uint32_t gc_multiplier;
 
+    /* 1 while a minor collection is marking, 0 otherwise. */
+    uint32_t gc_minor;
+
+    /* How many entries are in ->gc_spare_entries. */
+    uint32_t gc_spare_count;
+
+    /* How many of each kind of collection have been done. */
+    uint32_t gc_minor_passes;
+    uint32_t gc_major_passes;
+
+    /* How many values the last collection destroyed, and the running total. */
+    uint32_t gc_last_freed;
+    uint64_t gc_total_freed;
+
+    /* Time spent collecting, in nanoseconds. */
+    uint64_t gc_total_pause;
+    uint64_t gc_max_pause;
+
     lily_vm_catch_entry *catch_chain;
 
     /* If a proper value is being raised (currently only the `raise` keyword),
@@ -112,14 +169,31 @@ typedef struct lily_vm_state_ {
        functions can fetch it back out. */
     void *data;
 
+    /* Template output is collected here, and sent to render_sink (or
+       render_func, if there's no sink) along with the above data. The buffer
+       has space for render_threshold bytes, plus a \0 for render_func. */
+    char *render_buffer;
+    uint32_t render_pos;
+    uint32_t render_threshold;
+    lily_render_sink render_sink;
+    lily_render_func render_func;
+    /* This is 1 while a template is running. During that time, print and
+       writes to stdout go into the render buffer. */
+    uint32_t rendering;
+    uint32_t pad;
+
     /* If stdout has been dynaloaded, then this is the register that holds
        Lily's stdout. Otherwise, this is NULL. */
     lily_value *stdout_reg;
+
+    /* Hash tables made by this vm hash their keys using this seed. */
+    uint64_t hash_seed[2];
 } lily_vm_state;
 
 struct lily_value_stack_;
 
 lily_vm_state *lily_new_vm_state(struct lily_options_ *, lily_raiser *);
+lily_vm_state *lily_vm_clone(lily_vm_state *, lily_raiser *, uint16_t);
 void lily_free_vm(lily_vm_state *);
 void lily_vm_prep(lily_vm_state *, lily_symtab *, lily_value **,
         struct lily_value_stack_ *);
@@ -128,6 +202,11 @@ uint64_t lily_siphash(lily_vm_state *, lily_value *);
 
 void lily_tag_value(lily_vm_state *, lily_value *);
 
+void lily_vm_render(lily_vm_state *, const char *, size_t);
+void lily_vm_write_file(lily_vm_state *, FILE *, const char *, size_t);
+
+void lily_vm_load_exceptions(lily_vm_state *);
+
 void lily_vm_ensure_class_table(lily_vm_state *, int);
 void lily_vm_add_class_unchecked(lily_vm_state *, lily_class *);
 void lily_vm_add_class(lily_vm_state *, lily_class *);
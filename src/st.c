@@ -1,274 +1,456 @@
-/* This is based on the public domain general purpose hash table package written
-   by Peter Moore @ UCB. */
+/* This is Lily's hash table, used by the Hash class. It uses open addressing
+   with a separate array of control bytes, one per slot:
+
+   * 0x80 (high bit set): The slot is empty, and ends any probe through it.
+   * 0xFE (high bit set): The slot held an entry that was deleted. Probes keep
+     going past these.
+   * 0x00-0x7F: The slot holds an entry. The low 7 bits are the top 7 bits of
+     the entry's hash.
+
+   Slots are grouped into groups of 16. A lookup starts at the group picked by
+   the hash, and compares the 7 hash bits against all 16 control bytes of that
+   group at once (with SSE2 when available). Only slots that match are compared
+   against the key. The search ends at the first group that has an empty slot.
+   Groups are probed in triangular order, which visits every group since the
+   number of groups is a power of two.
+
+   Entries hold the key and record inline, so adding a pair to a table does not
+   allocate unless the table needs to grow.
+
+   Keys are hashed with a seed that each table copies from the vm that made it.
+   The seed is random unless the embedder fixes it through options. Strings are
+   hashed with SipHash-1-3, so that a flood of keys crafted to collide (say,
+   through query parameters) can't turn lookups linear. */
 
-#include <stdio.h>
 #include <string.h>
 
 #include "lily_core_types.h"
 #include "lily_value_structs.h"
+#include "lily_value_flags.h"
+
+#include "lily_vm.h"
 
 #include "lily_api_alloc.h"
 #include "lily_api_value.h"
+#include "lily_simd.h"
+
+#define GROUP_WIDTH 16
+#define CTRL_EMPTY ((uint8_t)0x80)
+#define CTRL_DELETED ((uint8_t)0xFE)
+#define CTRL_IS_FULL(c) (((c) & 0x80) == 0)
+
+/* The top 7 bits go into the control byte, and the rest picks the group. */
+#define HASH_H1(h) ((h) >> 7)
+#define HASH_H2(h) ((uint8_t)((h) >> 57))
+
+/* Tables are resized before they are more than 7/8ths full. */
+#define MAX_LOAD(slots) ((slots) - ((slots) >> 3))
+
+/* These return a mask with bit N set if byte N of the group matches. */
+#ifdef LILY_SIMD_SSE2
+
+static inline uint32_t group_match(const uint8_t *group, uint8_t h2)
+{
+    __m128i ctrl = _mm_loadu_si128((const __m128i *)group);
+    __m128i match = _mm_set1_epi8((char)h2);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, match));
+}
 
-static long primes[] =
+static inline uint32_t group_match_empty(const uint8_t *group)
 {
-    8 + 3,
-    16 + 3,
-    32 + 5,
-    64 + 3,
-    128 + 3,
-    256 + 27,
-    512 + 9,
-    1024 + 9,
-    2048 + 5,
-    4096 + 3,
-    8192 + 27,
-    16384 + 43,
-    32768 + 3,
-    65536 + 45,
-    131072 + 29,
-    262144 + 3,
-    524288 + 21,
-    1048576 + 7,
-    2097152 + 17,
-    4194304 + 15,
-    8388608 + 9,
-    16777216 + 43,
-    33554432 + 35,
-    67108864 + 15,
-    134217728 + 29,
-    268435456 + 3,
-    536870912 + 11,
-    1073741824 + 85,
-    0
-};
-
-#define MINSIZE 8
-#define ST_DEFAULT_MAX_DENSITY 5
-#define ST_DEFAULT_INIT_TABLE_SIZE 11
-#define do_hash(key,table) (unsigned int)(*(table)->hash_fn)((key))
-#define do_hash_bin(key,table) (do_hash(key, table)%(table)->num_bins)
-
-#define EQUAL(table,x,y) ((x)==(y) || (*table->compare_fn)((x),(y)) == 0)
-#define PTR_NOT_EQUAL(table, ptr, hash_val, key) \
-((ptr) != 0 && (ptr->hash != (hash_val) || !EQUAL((table), (key), (ptr)->raw_key)))
-
-#define ADD_DIRECT(table, key_box, key_raw, value, hash_val, bin_pos)\
-{\
-    lily_hash_entry *entry;\
-    if (table->num_entries/(table->num_bins) > ST_DEFAULT_MAX_DENSITY) {\
-        rehash(table);\
-        bin_pos = hash_val % table->num_bins;\
-    }\
-    \
-    entry = lily_malloc(sizeof(lily_hash_entry));\
-    \
-    entry->boxed_key = lily_value_copy(key_box); \
-    entry->raw_key = key_raw; \
-    entry->hash = hash_val;\
-    entry->record = lily_value_copy(value);\
-    entry->next = table->bins[bin_pos];\
-    table->bins[bin_pos] = entry;\
-    table->num_entries++;\
+    return group_match(group, CTRL_EMPTY);
 }
 
-#define FIND_ENTRY(table, ptr, hash_val, bin_pos) \
-bin_pos = hash_val%(table)->num_bins;\
-ptr = (table)->bins[bin_pos];\
-if (PTR_NOT_EQUAL(table, ptr, hash_val, key)) {\
-    while (PTR_NOT_EQUAL(table, ptr->next, hash_val, key)) {\
-        ptr = ptr->next;\
-    }\
-    ptr = ptr->next;\
+static inline uint32_t group_match_empty_or_deleted(const uint8_t *group)
+{
+    /* Both have the high bit set, which is exactly what movemask gathers. */
+    __m128i ctrl = _mm_loadu_si128((const __m128i *)group);
+    return (uint32_t)_mm_movemask_epi8(ctrl);
 }
 
-static int new_size(int size)
+#else
+
+static inline uint32_t group_match(const uint8_t *group, uint8_t h2)
 {
-    int i, newsize;
-
-    for (i = 0, newsize = MINSIZE;
-         i < sizeof(primes)/sizeof(primes[0]);
-         i++, newsize <<= 1)
-    {
-        if (newsize > size)
-            return primes[i];
+    uint32_t result = 0;
+    int i;
+
+    for (i = 0;i < GROUP_WIDTH;i++) {
+        if (group[i] == h2)
+            result |= (1 << i);
     }
 
-    /* Out of primes. You'll probably hit out of memory before this. */
-    return -1;
+    return result;
 }
 
-static lily_hash_val *new_table_sized(int size, int (*compare_fn)(),
-        int (*hash_fn)())
+static inline uint32_t group_match_empty(const uint8_t *group)
 {
-    lily_hash_val *tbl;
+    return group_match(group, CTRL_EMPTY);
+}
 
-    size = new_size(size); /* round up to prime number */
+static inline uint32_t group_match_empty_or_deleted(const uint8_t *group)
+{
+    uint32_t result = 0;
+    int i;
 
-    tbl = lily_malloc(sizeof(lily_hash_val));
-    tbl->refcount = 0;
-    tbl->iter_count = 0;
-    tbl->compare_fn = compare_fn;
-    tbl->hash_fn = hash_fn;
-    tbl->num_entries = 0;
-    tbl->num_bins = size;
-    tbl->bins =
-            (lily_hash_entry **)lily_malloc(size * sizeof(lily_hash_entry *));
-    memset(tbl->bins, 0, size * sizeof(lily_hash_entry *));
+    for (i = 0;i < GROUP_WIDTH;i++) {
+        if (group[i] & 0x80)
+            result |= (1 << i);
+    }
 
-    return tbl;
+    return result;
+}
+
+#endif
+
+/* A 64-bit finalizer (from MurmurHash3). This makes sure that every bit of the
+   input affects both the group picked and the control byte. */
+static inline uint64_t mix64(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
 }
 
-static lily_hash_val *new_table(int (*compare_fn)(), int (*hash_fn)())
+#define ROTL64(x, b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIPROUND \
+v0 += v1; v1 = ROTL64(v1, 13); v1 ^= v0; v0 = ROTL64(v0, 32); \
+v2 += v3; v3 = ROTL64(v3, 16); v3 ^= v2; \
+v0 += v3; v3 = ROTL64(v3, 21); v3 ^= v0; \
+v2 += v1; v1 = ROTL64(v1, 17); v1 ^= v2; v2 = ROTL64(v2, 32);
+
+static inline uint64_t read_u64_le(const unsigned char *p)
 {
-    return new_table_sized(0, compare_fn, hash_fn);
+    return ((uint64_t)p[0])       | ((uint64_t)p[1] << 8)  |
+           ((uint64_t)p[2] << 16) | ((uint64_t)p[3] << 24) |
+           ((uint64_t)p[4] << 32) | ((uint64_t)p[5] << 40) |
+           ((uint64_t)p[6] << 48) | ((uint64_t)p[7] << 56);
 }
 
-static int strhash(char *string)
+/* SipHash-1-3: One compression round per 8 bytes of input, and three rounds
+   of finalization. */
+static uint64_t siphash13(const uint64_t *seed, const char *data, uint32_t len)
 {
-    register int c;
-    register int val = 0;
+    const unsigned char *in = (const unsigned char *)data;
+    const unsigned char *end = in + (len & ~7);
+    uint64_t k0 = seed[0], k1 = seed[1];
+    uint64_t v0 = 0x736f6d6570736575ULL ^ k0;
+    uint64_t v1 = 0x646f72616e646f6dULL ^ k1;
+    uint64_t v2 = 0x6c7967656e657261ULL ^ k0;
+    uint64_t v3 = 0x7465646279746573ULL ^ k1;
+    uint64_t b = ((uint64_t)len) << 56;
+    uint64_t m;
+
+    for (;in != end;in += 8) {
+        m = read_u64_le(in);
+        v3 ^= m;
+        SIPROUND
+        v0 ^= m;
+    }
+
+    switch (len & 7) {
+        case 7: b |= ((uint64_t)in[6]) << 48;
+        case 6: b |= ((uint64_t)in[5]) << 40;
+        case 5: b |= ((uint64_t)in[4]) << 32;
+        case 4: b |= ((uint64_t)in[3]) << 24;
+        case 3: b |= ((uint64_t)in[2]) << 16;
+        case 2: b |= ((uint64_t)in[1]) << 8;
+        case 1: b |= ((uint64_t)in[0]);
+        case 0: break;
+    }
+
+    v3 ^= b;
+    SIPROUND
+    v0 ^= b;
 
-    while ((c = *string++) != '\0')
-        val = val * 997 + c;
+    v2 ^= 0xff;
+    SIPROUND
+    SIPROUND
+    SIPROUND
 
-    return val + (val >> 5);
+    return v0 ^ v1 ^ v2 ^ v3;
 }
 
-static int numcmp(int x, int y)
+static inline uint64_t hash_with_seed(const uint64_t *seed, lily_value *key)
 {
-    return x != y;
+    if (key->class_id == LILY_STRING_ID) {
+        lily_string_val *sv = key->value.string;
+        uint64_t hash = sv->hash;
+
+        if (hash == 0) {
+            hash = siphash13(seed, sv->string, sv->size);
+            /* 0 means not hashed yet, so no real hash can be 0. */
+            hash += (hash == 0);
+            sv->hash = hash;
+        }
+
+        return hash;
+    }
+    else
+        /* The seed keeps the mapping from Integer to hash unpredictable. */
+        return mix64((uint64_t)key->value.integer ^ seed[0]);
+}
+
+#define hash_key(table, key) hash_with_seed((table)->seed, key)
+
+/* Hash 'key' (a String or Integer) the same way that tables made by 'vm' do. */
+uint64_t lily_siphash(lily_vm_state *vm, lily_value *key)
+{
+    return hash_with_seed(vm->hash_seed, key);
 }
 
-static int numhash(int n)
+static inline int key_eq(lily_value *key, lily_value *other)
 {
-    return n;
+    if (key->class_id == LILY_STRING_ID) {
+        lily_string_val *left = key->value.string;
+        lily_string_val *right = other->value.string;
+
+        return left == right ||
+               (left->size == right->size &&
+                memcmp(left->string, right->string, left->size) == 0);
+    }
+    else
+        return key->value.integer == other->value.integer;
 }
 
-lily_hash_val *lily_new_hash_numtable(void)
+/* Slots always come in whole groups. The smallest table that has slots has a
+   single group. */
+static uint32_t slots_for(uint32_t count)
 {
-    return new_table(numcmp, numhash);
+    uint32_t slots = GROUP_WIDTH;
+
+    while (MAX_LOAD(slots) < count)
+        slots <<= 1;
+
+    return slots;
+}
+
+static void alloc_slots(lily_hash_val *table, uint32_t num_slots)
+{
+    table->ctrl = lily_malloc(num_slots * sizeof(uint8_t));
+    memset(table->ctrl, CTRL_EMPTY, num_slots);
+    table->entries = lily_malloc(num_slots * sizeof(lily_hash_entry));
+    table->num_slots = num_slots;
+    table->growth_left = MAX_LOAD(num_slots) - table->num_entries;
+}
+
+static lily_hash_val *new_table_sized(const uint64_t *seed, int size)
+{
+    lily_hash_val *tbl = lily_malloc(sizeof(lily_hash_val));
+
+    tbl->seed[0] = seed[0];
+    tbl->seed[1] = seed[1];
+
+    tbl->refcount = 0;
+    tbl->iter_count = 0;
+    tbl->num_entries = 0;
+    tbl->num_slots = 0;
+    tbl->growth_left = 0;
+    tbl->ctrl = NULL;
+    tbl->entries = NULL;
+
+    /* Empty tables wait until the first insert to allocate slots. */
+    if (size > 0)
+        alloc_slots(tbl, slots_for(size));
+
+    return tbl;
 }
 
-lily_hash_val *lily_new_hash_numtable_sized(int size)
+lily_hash_val *lily_new_hash_numtable(lily_state *s)
 {
-    return new_table_sized(size, numcmp, numhash);
+    return new_table_sized(s->hash_seed, 0);
 }
 
-lily_hash_val *lily_new_hash_strtable(void)
+lily_hash_val *lily_new_hash_numtable_sized(lily_state *s, int size)
 {
-    return new_table(strcmp, strhash);
+    return new_table_sized(s->hash_seed, size);
 }
 
-lily_hash_val *lily_new_hash_strtable_sized(int size)
+lily_hash_val *lily_new_hash_strtable(lily_state *s)
 {
-    return new_table_sized(size, strcmp, strhash);
+    return new_table_sized(s->hash_seed, 0);
+}
+
+lily_hash_val *lily_new_hash_strtable_sized(lily_state *s, int size)
+{
+    return new_table_sized(s->hash_seed, size);
 }
 
 lily_hash_val *lily_new_hash_like_sized(lily_hash_val *other, int size)
 {
-    return new_table_sized(size, other->compare_fn, other->hash_fn);
+    return new_table_sized(other->seed, size);
 }
 
-static void rehash(lily_hash_val *table)
+/* Find the slot holding 'key', or -1 if there isn't one. */
+static int find_slot(lily_hash_val *table, lily_value *key, uint64_t hash)
 {
-    lily_hash_entry *ptr, *next, **new_bins;
-    int i, old_num_bins = table->num_bins, new_num_bins;
-    unsigned int hash_val;
-
-    new_num_bins = new_size(old_num_bins+1);
-    new_bins = (lily_hash_entry **)lily_malloc(
-            new_num_bins * sizeof(lily_hash_entry *));
-    memset(new_bins, 0, new_num_bins * sizeof(lily_hash_entry *));
-
-    for(i = 0; i < old_num_bins; i++) {
-        ptr = table->bins[i];
-        while (ptr != 0) {
-            next = ptr->next;
-            hash_val = ptr->hash % new_num_bins;
-            ptr->next = new_bins[hash_val];
-            new_bins[hash_val] = ptr;
-            ptr = next;
+    if (table->num_entries == 0)
+        return -1;
+
+    uint32_t group_mask = (table->num_slots / GROUP_WIDTH) - 1;
+    uint32_t group = (uint32_t)HASH_H1(hash) & group_mask;
+    uint32_t stride = 0;
+    uint8_t h2 = HASH_H2(hash);
+
+    while (1) {
+        uint32_t base = group * GROUP_WIDTH;
+        const uint8_t *ctrl = table->ctrl + base;
+        uint32_t match = group_match(ctrl, h2);
+
+        while (match) {
+            int i = base + lily_lowest_bit(match);
+            lily_hash_entry *entry = &table->entries[i];
+
+            if (entry->hash == hash && key_eq(key, &entry->boxed_key))
+                return i;
+
+            match &= match - 1;
         }
+
+        if (group_match_empty(ctrl))
+            return -1;
+
+        stride++;
+        group = (group + stride) & group_mask;
     }
-    lily_free(table->bins);
-    table->num_bins = new_num_bins;
-    table->bins = new_bins;
 }
 
-int lily_hash_delete(lily_hash_val *table, lily_value **boxed_key,
-        lily_value **record)
+/* Find the first slot that a new entry with 'hash' can be put into. The table
+   must have at least one empty or deleted slot. */
+static int find_insert_slot(lily_hash_val *table, uint64_t hash)
 {
-    unsigned int hash_val;
-    lily_hash_entry *tmp, *ptr;
-    char *raw_key;
+    uint32_t group_mask = (table->num_slots / GROUP_WIDTH) - 1;
+    uint32_t group = (uint32_t)HASH_H1(hash) & group_mask;
+    uint32_t stride = 0;
 
-    if (table->compare_fn == numcmp)
-        raw_key = (char *)(*boxed_key)->value.integer;
-    else
-        raw_key = (*boxed_key)->value.string->string;
+    while (1) {
+        uint32_t base = group * GROUP_WIDTH;
+        uint32_t match = group_match_empty_or_deleted(table->ctrl + base);
 
-    hash_val = do_hash_bin(raw_key, table);
-    ptr = table->bins[hash_val];
+        if (match)
+            return base + lily_lowest_bit(match);
 
-    if (ptr == 0) {
-        if (record != 0)
-            *record = 0;
-        return 0;
+        stride++;
+        group = (group + stride) & group_mask;
     }
+}
 
-    if (EQUAL(table, raw_key, ptr->raw_key)) {
-        table->bins[hash_val] = ptr->next;
-        table->num_entries--;
-        if (record != 0)
-            *record = ptr->record;
+/* Move every entry into a fresh set of slots, dropping deleted markers along
+   the way. If there are a lot of deleted markers, this keeps the same size
+   instead of growing. */
+static void rehash(lily_hash_val *table)
+{
+    uint8_t *old_ctrl = table->ctrl;
+    lily_hash_entry *old_entries = table->entries;
+    uint32_t old_slots = table->num_slots;
+    uint32_t new_slots;
+    uint32_t i;
+
+    if (old_slots == 0)
+        new_slots = GROUP_WIDTH;
+    else if (table->num_entries < MAX_LOAD(old_slots) / 2)
+        new_slots = old_slots;
+    else
+        new_slots = old_slots * 2;
 
-        *boxed_key = ptr->boxed_key;
-        lily_free(ptr);
-        return 1;
-    }
+    alloc_slots(table, new_slots);
 
-    for(; ptr->next != 0; ptr = ptr->next) {
-        if (EQUAL(table, ptr->next->raw_key, raw_key)) {
-            tmp = ptr->next;
-            ptr->next = ptr->next->next;
-            table->num_entries--;
-            if (record != 0)
-                *record = tmp->record;
-
-            *boxed_key = tmp->boxed_key;
-            lily_free(tmp);
-            return 1;
+    for (i = 0;i < old_slots;i++) {
+        if (CTRL_IS_FULL(old_ctrl[i])) {
+            lily_hash_entry *old_entry = &old_entries[i];
+            int slot = find_insert_slot(table, old_entry->hash);
+
+            table->ctrl[slot] = HASH_H2(old_entry->hash);
+            table->entries[slot] = *old_entry;
         }
     }
 
-    return 0;
+    lily_free(old_ctrl);
+    lily_free(old_entries);
 }
 
-void lily_hash_insert_value(register lily_hash_val *table,
-        lily_value *boxed_key, lily_value *record)
+int lily_hash_delete(lily_hash_val *table, lily_value *key,
+        lily_value *out_key, lily_value *out_record)
 {
-    unsigned int hash_val, bin_pos;
-    register lily_hash_entry *ptr;
-    register char *key;
+    uint64_t hash = hash_key(table, key);
+    int slot = find_slot(table, key, hash);
+
+    if (slot == -1)
+        return 0;
+
+    lily_hash_entry *entry = &table->entries[slot];
+    uint32_t base = slot & ~(GROUP_WIDTH - 1);
+
+    /* If this group has an empty slot, then no probe ever went past it. That
+       means this slot can become empty again, instead of a deleted marker. */
+    if (group_match_empty(table->ctrl + base)) {
+        table->ctrl[slot] = CTRL_EMPTY;
+        table->growth_left++;
+    }
+    else
+        table->ctrl[slot] = CTRL_DELETED;
+
+    table->num_entries--;
+
+    /* The caller now owns the key and the record. */
+    if (out_key)
+        *out_key = entry->boxed_key;
+    else
+        lily_deref(&entry->boxed_key);
 
-    if (table->compare_fn == numcmp)
-        key = (char *)boxed_key->value.integer;
+    if (out_record)
+        *out_record = entry->record;
     else
-        key = boxed_key->value.string->string;
+        lily_deref(&entry->record);
+
+    return 1;
+}
 
-    hash_val = do_hash(key, table);
-    FIND_ENTRY(table, ptr, hash_val, bin_pos);
-    if (ptr == 0) {
-        ADD_DIRECT(table, boxed_key, key, record, hash_val, bin_pos);
+void lily_hash_insert_value(lily_hash_val *table, lily_value *boxed_key,
+        lily_value *record)
+{
+    uint64_t hash = hash_key(table, boxed_key);
+    int slot = find_slot(table, boxed_key, hash);
+
+    if (slot != -1) {
+        lily_hash_entry *entry = &table->entries[slot];
+        lily_value_assign(&entry->record, record);
+        lily_value_assign(&entry->boxed_key, boxed_key);
+        return;
     }
-    else {
-        lily_value_assign(ptr->record, record);
-        lily_value_assign(ptr->boxed_key, boxed_key);
+
+    if (table->num_slots == 0)
+        rehash(table);
+
+    slot = find_insert_slot(table, hash);
+
+    /* Reusing a deleted slot is free, but taking an empty one eats into the
+       space left before a resize. */
+    if (table->ctrl[slot] == CTRL_EMPTY) {
+        if (table->growth_left == 0) {
+            rehash(table);
+            slot = find_insert_slot(table, hash);
+        }
+
+        table->growth_left--;
     }
+
+    lily_hash_entry *entry = &table->entries[slot];
+
+    table->ctrl[slot] = HASH_H2(hash);
+    entry->hash = hash;
+    entry->boxed_key.flags = 0;
+    entry->record.flags = 0;
+    lily_value_assign(&entry->boxed_key, boxed_key);
+    lily_value_assign(&entry->record, record);
+    table->num_entries++;
 }
 
-void lily_hash_insert_str(register lily_hash_val *table, lily_string_val *key,
+void lily_hash_insert_str(lily_hash_val *table, lily_string_val *key,
         lily_value *record)
 {
     lily_value boxed_key;
@@ -280,20 +462,42 @@ void lily_hash_insert_str(register lily_hash_val *table, lily_string_val *key,
 
 lily_value *lily_hash_find_value(lily_hash_val *table, lily_value *boxed_key)
 {
-    unsigned int hash_val, bin_pos;
-    register lily_hash_entry *ptr;
-    char *key;
+    int slot = find_slot(table, boxed_key, hash_key(table, boxed_key));
 
-    if (table->compare_fn == numcmp)
-        key = (char *)boxed_key->value.integer;
+    if (slot != -1)
+        return &table->entries[slot].record;
     else
-        key = boxed_key->value.string->string;
+        return NULL;
+}
 
-    hash_val = do_hash(key, table);
-    FIND_ENTRY(table, ptr, hash_val, bin_pos);
+lily_hash_entry *lily_hash_next_entry(lily_hash_val *table, int *pos)
+{
+    uint32_t i;
 
-    if (ptr)
-        return ptr->record;
-    else
-        return NULL;
+    for (i = *pos;i < table->num_slots;i++) {
+        if (CTRL_IS_FULL(table->ctrl[i])) {
+            *pos = i + 1;
+            return &table->entries[i];
+        }
+    }
+
+    *pos = i;
+    return NULL;
+}
+
+void lily_hash_clear(lily_hash_val *table)
+{
+    lily_hash_entry *entry;
+    int pos = 0;
+
+    while ((entry = lily_hash_next_entry(table, &pos)) != NULL) {
+        lily_deref(&entry->boxed_key);
+        lily_deref(&entry->record);
+    }
+
+    if (table->num_slots)
+        memset(table->ctrl, CTRL_EMPTY, table->num_slots);
+
+    table->num_entries = 0;
+    table->growth_left = MAX_LOAD(table->num_slots);
 }
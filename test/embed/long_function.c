@@ -0,0 +1,84 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lily_api_embed.h"
+#include "lily_api_options.h"
+
+/*  long_function.c
+    The optimizer keeps offsets in 16 bits, so it has to leave functions with
+    more code than that alone. This builds a function that's just over that
+    limit, and one that's just under it, and checks that both give the same
+    answer with the optimizer on and off. */
+
+#define LINE "    x = x + (3 + 4)\n"
+
+/* Each line is about 14 words of code. */
+static char *make_source(int lines)
+{
+    const char *head = "define f: Integer {\n    var x = 0\n";
+    const char *tail = "    return x\n}\n";
+    size_t size = strlen(head) + strlen(LINE) * lines + strlen(tail) + 1;
+    char *source = malloc(size);
+    char *pos = source;
+    int i;
+
+    strcpy(pos, head);
+    pos += strlen(head);
+
+    for (i = 0;i < lines;i++) {
+        strcpy(pos, LINE);
+        pos += strlen(LINE);
+    }
+
+    strcpy(pos, tail);
+    return source;
+}
+
+static int fail_count = 0;
+
+static void check_lines(int lines, int optimize)
+{
+    lily_options *options = lily_new_options();
+    lily_op_optimize(options, optimize);
+
+    lily_state *s = lily_new_state(options);
+    char *source = make_source(lines);
+    char expect[32];
+    const char *text;
+
+    sprintf(expect, "(Integer): %d", lines * 7);
+
+    if (lily_parse_string(s, "[long]", source) == 0 ||
+        lily_parse_expr(s, "[expr]", "f()", &text) == 0) {
+        fprintf(stderr, "long_function: %s", lily_get_error(s));
+        fail_count++;
+    }
+    else if (text == NULL || strcmp(text, expect) != 0) {
+        fprintf(stderr,
+                "long_function: %d lines (optimize %d) gave %s, not %s.\n",
+                lines, optimize, text ? text : "nothing", expect);
+        fail_count++;
+    }
+
+    free(source);
+    lily_free_state(s);
+}
+
+int main(void)
+{
+    int lines[] = {4600, 4683, 9000};
+    int i;
+
+    for (i = 0;i < 3;i++) {
+        check_lines(lines[i], 1);
+        check_lines(lines[i], 0);
+    }
+
+    if (fail_count) {
+        fprintf(stderr, "long_function: %d checks failed.\n", fail_count);
+        exit(EXIT_FAILURE);
+    }
+
+    exit(EXIT_SUCCESS);
+}
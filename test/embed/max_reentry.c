@@ -0,0 +1,117 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lily_api_embed.h"
+#include "lily_api_options.h"
+
+/*  max_reentry.c
+    This checks that lily_op_max_reentry sets how deep foreign functions can
+    call back into the vm, and that a clone keeps the limit of its snapshot. */
+
+static char *source =
+"define map_down(n: Integer): Integer {\n"
+"    if n == 0: { return 0 }\n"
+"    return [n].map(|x| map_down(x - 1))[0] + 1\n"
+"}\n"
+"define depth_ok(n: Integer): Boolean {\n"
+"    var ok = true\n"
+"    try: map_down(n) except RuntimeError: ok = false\n"
+"    return ok\n"
+"}\n";
+
+static int fail_count = 0;
+
+static void check(lily_state *s, char *expr, const char *expect,
+        const char *what)
+{
+    const char *text;
+
+    if (lily_parse_expr(s, "[expr]", expr, &text) == 0) {
+        fprintf(stderr, "max_reentry: %s", lily_get_error(s));
+        fail_count++;
+    }
+    else if (text == NULL || strcmp(text, expect) != 0) {
+        fprintf(stderr, "max_reentry: %s (%s gave %s).\n", what, expr,
+                text ? text : "nothing");
+        fail_count++;
+    }
+}
+
+static void sink(const char *text, size_t size, void *data)
+{
+    char *out = data;
+    size_t pos = strlen(out);
+
+    if (pos + size < 16) {
+        memcpy(out + pos, text, size);
+        out[pos + size] = '\0';
+    }
+}
+
+/* Only clones render, but states need somewhere to send output to. */
+static char base_out[16];
+
+static lily_state *new_state(uint32_t reentry)
+{
+    lily_options *options = lily_new_options();
+    lily_op_max_reentry(options, reentry);
+    lily_op_render_sink(options, sink);
+    lily_op_data(options, base_out);
+
+    lily_state *s = lily_new_state(options);
+
+    if (lily_parse_string(s, "[source]", source) == 0) {
+        fprintf(stderr, "max_reentry: %s", lily_get_error(s));
+        exit(EXIT_FAILURE);
+    }
+
+    return s;
+}
+
+int main(void)
+{
+    lily_state *s = new_state(20);
+
+    check(s, "depth_ok(15)", "(Boolean): true", "Under the limit");
+    check(s, "depth_ok(25)", "(Boolean): false", "Over the limit");
+    lily_free_state(s);
+
+    /* The lowest limit allowed is 16. */
+    s = new_state(1);
+    check(s, "depth_ok(15)", "(Boolean): true", "Raised to the lowest limit");
+    check(s, "depth_ok(17)", "(Boolean): false", "Over the lowest limit");
+    lily_free_state(s);
+
+    s = new_state(2000);
+    check(s, "depth_ok(1500)", "(Boolean): true", "Raised limit");
+
+    struct lily_function_val_ *f = lily_compile_template_string(s, "[page]",
+            "<?lily print(depth_ok(1500)) ?>");
+    lily_snapshot *snapshot = lily_state_snapshot(s);
+    char out[16] = "";
+    lily_state *clone = lily_state_clone(snapshot, out);
+
+    if (f == NULL || lily_render_template(clone, f) == 0) {
+        fprintf(stderr, "max_reentry: Clone can't render.\n");
+        fail_count++;
+    }
+    else {
+        lily_render_flush(clone);
+
+        if (strcmp(out, "true\n") != 0) {
+            fprintf(stderr, "max_reentry: Clone lost the raised limit.\n");
+            fail_count++;
+        }
+    }
+
+    lily_free_state(clone);
+    lily_free_snapshot(snapshot);
+
+    if (fail_count) {
+        fprintf(stderr, "max_reentry: %d checks failed.\n", fail_count);
+        exit(EXIT_FAILURE);
+    }
+
+    exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,150 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lily_api_embed.h"
+#include "lily_api_options.h"
+
+/*  snapshot.c
+    This drives the embed api through a snapshot and a pair of clones. Each
+    clone changes every kind of mutable global that the prelude makes, and then
+    checks that the other clone and a fresh clone still see the values that the
+    snapshot had. Everything is freed at the end, so that leaks show up when
+    this is built with a leak checker.
+
+    pre-commit-hook.py runs this when it has been built (it is built with the
+    rest of the tree). */
+
+static const char *prelude =
+"class Box(v: Integer) {\n"
+"    var @value = v\n"
+"}\n"
+"var items = [1, 2, 3]\n"
+"var counts = [\"a\" => 1]\n"
+"var box = Box(10)\n"
+"var pair = <[items, box]>\n"
+"var sb = StringBuilder()\n"
+"sb.append(\"start\")\n"
+"var hits = 0\n";
+
+/* Every global is changed, and the values from before the change are printed.
+   Each clone runs this once, so it must always print the snapshot's values. */
+static char *change =
+"<?lily\n"
+"print(\"{0} {1} {2} {3} {4} {5}\".format(items, counts, box.value, \n"
+"      pair[0].size(), sb.to_s(), hits))\n"
+"items.push(4)\n"
+"counts[\"a\"] = 100\n"
+"counts[\"b\"] = 2\n"
+"box.value = 20\n"
+"sb.append(\"!\")\n"
+"hits += 1\n"
+"?>";
+
+static const char *expect =
+"[1, 2, 3] [\"a\" => 1] 10 3 start 0\n";
+
+typedef struct {
+    char buffer[256];
+    size_t size;
+} output;
+
+static void sink(const char *text, size_t size, void *data)
+{
+    output *o = data;
+
+    if (o->size + size < sizeof(o->buffer)) {
+        memcpy(o->buffer + o->size, text, size);
+        o->size += size;
+        o->buffer[o->size] = '\0';
+    }
+}
+
+static int fail_count = 0;
+
+static void check(int ok, const char *what)
+{
+    if (ok == 0) {
+        fprintf(stderr, "snapshot: %s\n", what);
+        fail_count++;
+    }
+}
+
+static int render(lily_state *s, struct lily_function_val_ *f, output *o)
+{
+    int result;
+
+    o->size = 0;
+    o->buffer[0] = '\0';
+    result = lily_render_template(s, f);
+
+    if (result == 0)
+        fprintf(stderr, "%s", lily_get_error(s));
+    else
+        lily_render_flush(s);
+
+    return result;
+}
+
+int main(void)
+{
+    output base_out, one_out, two_out;
+    lily_options *options = lily_new_options();
+
+    lily_op_render_sink(options, sink);
+    lily_op_data(options, &base_out);
+
+    lily_state *base = lily_new_state(options);
+
+    if (lily_parse_string(base, "[prelude]", (char *)prelude) == 0) {
+        fprintf(stderr, "%s", lily_get_error(base));
+        exit(EXIT_FAILURE);
+    }
+
+    struct lily_function_val_ *f = lily_compile_template_string(base,
+            "[change]", change);
+
+    if (f == NULL) {
+        fprintf(stderr, "%s", lily_get_error(base));
+        exit(EXIT_FAILURE);
+    }
+
+    lily_snapshot *snapshot = lily_state_snapshot(base);
+    lily_state *one = lily_state_clone(snapshot, &one_out);
+    lily_state *two = lily_state_clone(snapshot, &two_out);
+
+    check(render(one, f, &one_out), "first clone can render.");
+    check(strcmp(one_out.buffer, expect) == 0,
+            "first clone starts with the snapshot's globals.");
+
+    check(render(one, f, &one_out), "first clone can render again.");
+    check(strcmp(one_out.buffer, expect) != 0,
+            "first clone keeps its own changes.");
+
+    check(render(two, f, &two_out), "second clone can render.");
+    check(strcmp(two_out.buffer, expect) == 0,
+            "second clone is not changed by the first.");
+
+    check(lily_compile_template_string(one, "[new]", "<?lily ?>") == NULL,
+            "clones can't compile.");
+
+    lily_free_state(one);
+    lily_free_state(two);
+
+    /* A clone made after others were freed still starts from the snapshot. */
+    lily_state *three = lily_state_clone(snapshot, NULL);
+
+    check(render(three, f, &base_out), "third clone can render.");
+    check(strcmp(base_out.buffer, expect) == 0,
+            "third clone starts with the snapshot's globals.");
+
+    lily_free_state(three);
+    lily_free_snapshot(snapshot);
+
+    if (fail_count) {
+        fprintf(stderr, "snapshot: %d checks failed.\n", fail_count);
+        exit(EXIT_FAILURE);
+    }
+
+    exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,147 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lily_api_embed.h"
+#include "lily_api_options.h"
+#include "lily_api_value.h"
+#include "lily_core_types.h"
+#include "lily_value_flags.h"
+#include "lily_value_structs.h"
+
+/*  string_view.c
+    Strings made by slice and split can be views, which have no \0 terminator.
+    This checks that the parts of the embed api that give text back (expression
+    results, and a render_func) give the text of the view, not what comes after
+    it in the source.
+
+    It also checks when views are given their own bytes. That should only
+    happen once the views are all that holds their source, and they use less
+    than half of it. */
+
+/* The pieces are long enough to be views instead of copies. */
+static char *source =
+"var line = \"" "0123456789012345678901234567890123456789"
+                "0123456789012345678901234567890123456789\"\n"
+"var pieces = $\"^(line)|^(line)|^(line)\".split(\"|\")\n";
+
+static const char *line =
+"0123456789012345678901234567890123456789"
+"0123456789012345678901234567890123456789";
+
+static char rendered[1024];
+
+static void render_func(char *text, void *data)
+{
+    if (strlen(rendered) + strlen(text) < sizeof(rendered))
+        strcat(rendered, text);
+}
+
+static int fail_count = 0;
+
+static void fail(const char *what)
+{
+    fprintf(stderr, "string_view: %s\n", what);
+    fail_count++;
+}
+
+static void hold(lily_value *v, lily_string_val *sv)
+{
+    v->flags = LILY_STRING_ID | VAL_IS_DEREFABLE;
+    v->value.string = sv;
+    sv->refcount++;
+}
+
+static void check_release(void)
+{
+    char text[1000];
+    lily_value source_v, a_v, b_v, c_v;
+    int i;
+
+    for (i = 0;i < 1000;i++)
+        text[i] = 'a' + (i % 26);
+
+    lily_string_val *source = lily_new_string_sized(text, 1000);
+    hold(&source_v, source);
+
+    lily_string_val *a = lily_new_string_view(source, 0, 100);
+    lily_string_val *b = lily_new_string_view(source, 100, 800);
+    lily_string_val *c = lily_new_string_view(source, 900, 100);
+    hold(&a_v, a);
+    hold(&b_v, b);
+    hold(&c_v, c);
+
+    if (a->parent != source || b->parent != source || c->parent != source)
+        fail("Large parts of a String are not views.");
+
+    /* The source is still held, so the views keep using it. */
+    lily_deref(&b_v);
+
+    if (a->parent != source || c->parent != source)
+        fail("Views were released while the source is held.");
+
+    hold(&b_v, lily_new_string_view(source, 100, 800));
+
+    /* Now the views are all that holds it, but they use all of it. */
+    lily_deref(&source_v);
+
+    if (a->parent != source || c->parent != source)
+        fail("Views that use all of their source were released.");
+
+    /* This leaves 200 of 1000 bytes in use, so the rest get copies. */
+    lily_deref(&b_v);
+
+    if (a->parent != NULL || c->parent != NULL)
+        fail("Views that use little of their source were not released.");
+    else if (memcmp(lily_string_raw(a), text, 100) != 0 ||
+             memcmp(lily_string_raw(c), text + 900, 100) != 0)
+        fail("Released views have the wrong bytes.");
+
+    lily_deref(&a_v);
+    lily_deref(&c_v);
+}
+
+int main(void)
+{
+    lily_options *options = lily_new_options();
+    char expect[256];
+    const char *text;
+
+    /* Anything past 16 bytes goes to render_func without being buffered. */
+    lily_op_render_func(options, render_func);
+    lily_op_render_threshold(options, 16);
+
+    lily_state *s = lily_new_state(options);
+
+    if (lily_parse_string(s, "[source]", source) == 0) {
+        fprintf(stderr, "%s", lily_get_error(s));
+        exit(EXIT_FAILURE);
+    }
+
+    sprintf(expect, "(String): \"%s\"", line);
+
+    if (lily_parse_expr(s, "[expr]", "pieces[1]", &text) == 0)
+        fail(lily_get_error(s));
+    else if (text == NULL || strcmp(text, expect) != 0)
+        fail("Expression result has more than the view.");
+
+    if (lily_render_string(s, "[page]",
+            "<?lily stdout.write(pieces[0]) ?>") == 0)
+        fail(lily_get_error(s));
+    else {
+        lily_render_flush(s);
+
+        if (strcmp(rendered, line) != 0)
+            fail("render_func was given more than the view.");
+    }
+
+    lily_free_state(s);
+    check_release();
+
+    if (fail_count) {
+        fprintf(stderr, "string_view: %d checks failed.\n", fail_count);
+        exit(EXIT_FAILURE);
+    }
+
+    exit(EXIT_SUCCESS);
+}